@@ -0,0 +1,98 @@
+// Counts heap allocations made while parsing a request and building its response.
+// Built and run by: python build.py test
+// Everything but the response body should come from the request arena.
+#include "request.h"
+#include "response.h"
+#include "util.h"
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+using namespace std;
+
+static long allocations = 0;
+
+void* operator new(size_t n)
+{
+	allocations++;
+	void* p = malloc(n);
+	if (!p) throw bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+// util.cpp builds file paths under SERVER_ROOT. The test never touches files.
+const string& _get_server_root()
+{
+	static const string root = ".";
+	return root;
+}
+
+static const char raw[] =
+	"GET /search/index.lua?q=hello%20world&page=2&lang=en&sort=desc HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: session=abcdef0123456789; theme=dark\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"X-Forwarded-For: 10.0.0.1\r\n"
+	"\r\n";
+
+// The response body is a std::string of its own: one allocation for the content, one for the copy kept by setContent.
+static const double ALLOCATIONS_LIMIT = 2.0;
+
+int main()
+{
+	const int N = 10000;
+	size_t sink = 0;
+	// The first round fills the arena pool.
+	for (int round = 0; round < 2; round++)
+	{
+		allocations = 0;
+		for (int i = 0; i < N; i++)
+		{
+			ArenaLease arena;
+			Request req(arena.get());
+			if (parse_header(raw, sizeof(raw) - 1, req) < 0)
+			{
+				printf("FAIL: parse_header\n");
+				return 1;
+			}
+			ArenaString path(ArenaAllocator<char>(req.arena()));
+			ParamList param(ArenaAllocator<ParamList::value_type>(req.arena()));
+			if (urldecode(req.path.data(), req.path.size(), path, param) < 0 || param.size() != 4)
+			{
+				printf("FAIL: urldecode\n");
+				return 1;
+			}
+			Response res(arena.get());
+			res.set_code(200);
+			res.set_raw("Content-Type", "text/html");
+			res.setContent("<html>hello</html>");
+			ArenaString out = res.toString();
+			sink += out.size() + path.size();
+		}
+	}
+
+	double per_request = (double)allocations / N;
+	printf("%.2f allocations per request (%zu)\n", per_request, sink);
+	if (per_request > ALLOCATIONS_LIMIT)
+	{
+		printf("FAIL: more than %.0f allocations per request\n", ALLOCATIONS_LIMIT);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,208 @@
+// Sends HTTP/2 requests whose header lists are small on the wire but large once decoded.
+// Built and run by: python build.py test
+// One-byte indexed fields may all stand for the same large dynamic table entry. Their decoded size is what is limited.
+#include "h2.h"
+#include "hpack.h"
+#include "black_magic.h"
+#include "config.h"
+#include "metrics.h"
+#include <sys/resource.h>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+using namespace std;
+
+static int handled = 0;
+static string cookie_seen;
+
+int request_handler(const Request& req, Response& res)
+{
+	handled++;
+	const char* cookie = req.header.get(HeaderId::Cookie);
+	cookie_seen = cookie ? cookie : "";
+	res.set_code(200);
+	return 0;
+}
+
+void request_handler_finished(const Request&, const Response&, chrono::steady_clock::time_point)
+{
+}
+
+void metrics_on_timing(const Request&, const Response&, const RequestTiming&)
+{
+}
+
+const int& _get_h2_max_streams()
+{
+	static const int streams = 128;
+	return streams;
+}
+
+ConfigSnapshot ConfigCurrent()
+{
+	return nullptr;
+}
+
+static void put_frame(string& out, const string& payload, uint8_t type, uint8_t flags, uint32_t stream_id)
+{
+	size_t len = payload.size();
+	char b[9] = { (char)(len >> 16), (char)(len >> 8), (char)len, (char)type, (char)flags,
+		(char)(stream_id >> 24), (char)(stream_id >> 16), (char)(stream_id >> 8), (char)stream_id };
+	out.append(b, 9);
+	out.append(payload);
+}
+
+// Literal field with incremental indexing and a new name. Lengths stay below 127 or use the two-byte form.
+static void put_literal(string& block, const string& name, const string& value)
+{
+	block.push_back(0x40);
+	block.push_back((char)name.size());
+	block.append(name);
+	if (value.size() < 127)
+	{
+		block.push_back((char)value.size());
+	}
+	else
+	{
+		// 7-bit prefix integer: 127, then the rest in 7-bit groups.
+		size_t rest = value.size() - 127;
+		block.push_back(0x7F);
+		while (rest >= 128)
+		{
+			block.push_back((char)(0x80 | (rest & 0x7F)));
+			rest >>= 7;
+		}
+		block.push_back((char)rest);
+	}
+	block.append(value);
+}
+
+// Connection preface, empty SETTINGS, and one request on stream 1 with the extra fields in extra.
+static string make_request(const string& extra)
+{
+	string block;
+	block.push_back((char)0x82); // :method GET
+	block.push_back((char)0x84); // :path /
+	block.push_back((char)0x86); // :scheme http
+	block.append(extra);
+	string in(H2_PREFACE, H2_PREFACE_LEN);
+	put_frame(in, "", 4, 0, 0);
+	// Split into frames of at most 16384 bytes.
+	for (size_t off = 0; off < block.size(); off += 16384)
+	{
+		bool last = off + 16384 >= block.size();
+		put_frame(in, block.substr(off, 16384), off == 0 ? 1 : 9, (last ? 0x4 : 0) | (off == 0 ? 0x1 : 0), 1);
+	}
+	return in;
+}
+
+struct Output
+{
+	int ret = 0;
+	int status = 0;
+	uint32_t goaway_code = 0xFFFFFFFF;
+	uint32_t max_header_list = 0;
+};
+
+static Output run(const string& in)
+{
+	Output o;
+	H2Session s([]() {});
+	s.start();
+	o.ret = s.feed(in.data(), in.size());
+	string out;
+	const char* data;
+	size_t n;
+	while ((n = s.output(data)) > 0)
+	{
+		out.append(data, n);
+		s.consume(n);
+	}
+	HpackDecoder dec;
+	for (size_t off = 0; off + 9 <= out.size();)
+	{
+		const unsigned char* p = (const unsigned char*)out.data() + off;
+		size_t len = ((size_t)p[0] << 16) | ((size_t)p[1] << 8) | p[2];
+		const unsigned char* payload = p + 9;
+		if (p[3] == 4 && !(p[4] & 1))
+		{
+			for (size_t i = 0; i + 6 <= len; i += 6)
+			{
+				if (((payload[i] << 8) | payload[i + 1]) == 6)
+				{
+					o.max_header_list = ((uint32_t)payload[i + 2] << 24) | ((uint32_t)payload[i + 3] << 16) | ((uint32_t)payload[i + 4] << 8) | payload[i + 5];
+				}
+			}
+		}
+		else if (p[3] == 1)
+		{
+			dec.decode(payload, len, [&](const string& name, const string& value) {
+				if (name == ":status") o.status = atoi(value.c_str());
+			});
+		}
+		else if (p[3] == 7 && len >= 8)
+		{
+			o.goaway_code = ((uint32_t)payload[4] << 24) | ((uint32_t)payload[5] << 16) | ((uint32_t)payload[6] << 8) | payload[7];
+		}
+		off += 9 + len;
+	}
+	return o;
+}
+
+static long max_rss_kb()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+int main()
+{
+	int failed = 0;
+
+	// Cookie crumbs are joined, and the limit is advertised.
+	string crumbs;
+	put_literal(crumbs, "cookie", "a=1");
+	put_literal(crumbs, "cookie", "b=2");
+	put_literal(crumbs, "cookie", "c=3");
+	Output o = run(make_request(crumbs));
+	if (o.ret != 0 || handled != 1 || o.status != 200 || cookie_seen != "a=1; b=2; c=3" || o.max_header_list == 0)
+	{
+		printf("FAIL: split cookies: ret %d handled %d status %d cookie [%s] max_header_list %u\n",
+			o.ret, handled, o.status, cookie_seen.c_str(), o.max_header_list);
+		failed++;
+	}
+
+	// A 3000-byte cookie, then one-byte references to it. 100 of them decode to about 300 KB:
+	// the request is answered with 431 without being handled.
+	long rss_before = max_rss_kb();
+	string refs;
+	put_literal(refs, "cookie", string(3000, 'x'));
+	refs.append(100, (char)0xBE);
+	o = run(make_request(refs));
+	long grown_mb = (max_rss_kb() - rss_before) / 1024;
+	if (o.ret != 0 || handled != 1 || o.status != 431 || grown_mb > 16)
+	{
+		printf("FAIL: 100 references: ret %d handled %d status %d grown %ld MB\n", o.ret, handled, o.status, grown_mb);
+		failed++;
+	}
+
+	// 1000 and 10000 references (3 MB and 30 MB from a few KB): the connection is closed with ENHANCE_YOUR_CALM.
+	for (size_t count : { 1000, 10000 })
+	{
+		refs.clear();
+		put_literal(refs, "cookie", string(3000, 'x'));
+		refs.append(count, (char)0xBE);
+		o = run(make_request(refs));
+		grown_mb = (max_rss_kb() - rss_before) / 1024;
+		if (o.ret != -1 || handled != 1 || o.goaway_code != 11 || grown_mb > 16)
+		{
+			printf("FAIL: %zu references: ret %d handled %d goaway %u grown %ld MB\n", count, o.ret, handled, o.goaway_code, grown_mb);
+			failed++;
+		}
+	}
+
+	if (failed) return 1;
+	printf("Header lists are limited (SETTINGS_MAX_HEADER_LIST_SIZE %u)\n", o.max_header_list);
+	return 0;
+}
@@ -0,0 +1,168 @@
+// HPACK decoder against the examples of RFC 7541 Appendix C, and the encoder against the decoder.
+// Built and run by: python build.py test
+// C.4 (requests, Huffman coded) is also compared byte for byte with what the encoder sends.
+#include "hpack.h"
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+typedef vector<pair<string, string>> FieldList;
+
+struct Example
+{
+	const char* hex;
+	FieldList fields;
+};
+
+static string from_hex(const char* hex)
+{
+	string out;
+	for (size_t i = 0; hex[i] && hex[i + 1]; i += 2)
+	{
+		out.push_back((char)strtol(string(hex + i, 2).c_str(), nullptr, 16));
+	}
+	return out;
+}
+
+static int decode(HpackDecoder& dec, const string& block, FieldList& out)
+{
+	out.clear();
+	return dec.decode((const unsigned char*)block.data(), block.size(), [&](const string& name, const string& value) {
+		out.emplace_back(name, value);
+	});
+}
+
+static int check_examples(const char* title, const vector<Example>& examples, size_t table_size)
+{
+	int failed = 0;
+	HpackDecoder dec(table_size);
+	for (size_t i = 0; i < examples.size(); i++)
+	{
+		FieldList got;
+		int ret = decode(dec, from_hex(examples[i].hex), got);
+		if (ret != 0 || got != examples[i].fields)
+		{
+			printf("FAIL: %s.%d: ret %d, %d fields\n", title, (int)i + 1, ret, (int)got.size());
+			failed++;
+		}
+	}
+	return failed;
+}
+
+static const char DATE1[] = "Mon, 21 Oct 2013 20:13:21 GMT";
+static const char DATE2[] = "Mon, 21 Oct 2013 20:13:22 GMT";
+
+static const vector<Example> c4 = {
+	{ "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+		{ { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" } } },
+	{ "828684be5886a8eb10649cbf",
+		{ { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" },
+		{ "cache-control", "no-cache" } } },
+	{ "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+		{ { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" },
+		{ "custom-key", "custom-value" } } },
+};
+
+// The dynamic table is 256 bytes, so entries are evicted on the way.
+static const vector<Example> c6 = {
+	{ "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+		{ { ":status", "302" }, { "cache-control", "private" }, { "date", DATE1 }, { "location", "https://www.example.com" } } },
+	{ "4883640effc1c0bf",
+		{ { ":status", "307" }, { "cache-control", "private" }, { "date", DATE1 }, { "location", "https://www.example.com" } } },
+	{ "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af2708"
+		"7f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007",
+		{ { ":status", "200" }, { "cache-control", "private" }, { "date", DATE2 }, { "location", "https://www.example.com" },
+		{ "content-encoding", "gzip" }, { "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" } } },
+};
+
+static int check_encoder_c4()
+{
+	int failed = 0;
+	HpackEncoder enc;
+	for (size_t i = 0; i < c4.size(); i++)
+	{
+		string out;
+		enc.begin(out);
+		for (const auto& f : c4[i].fields)
+		{
+			enc.encode(f.first.data(), f.first.size(), f.second.data(), f.second.size(), out);
+		}
+		if (out != from_hex(c4[i].hex))
+		{
+			printf("FAIL: encoding C.4.%d: %d bytes\n", (int)i + 1, (int)out.size());
+			failed++;
+		}
+	}
+	return failed;
+}
+
+static string random_string(size_t max_len, bool name)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_";
+	size_t len = rand() % (max_len + 1);
+	if (name && len == 0) len = 1;
+	string s;
+	for (size_t i = 0; i < len; i++)
+	{
+		// Names come from the table above. Values may hold any byte, so Huffman codes of every length are used.
+		s.push_back(name ? chars[rand() % (sizeof(chars) - 1)] : (char)(rand() % 256));
+	}
+	return s;
+}
+
+// Random fields, repeated often enough to be found in the dynamic table, through encoder and decoder.
+static int check_round_trip()
+{
+	srand(7541);
+	HpackEncoder enc;
+	HpackDecoder dec;
+	vector<pair<string, string>> pool;
+	for (int i = 0; i < 64; i++)
+	{
+		// Some names are longer than the encoder's stack buffer.
+		size_t max_name = i % 8 == 0 ? 1000 : 20;
+		pool.emplace_back(random_string(max_name, true), random_string(i % 5 == 0 ? 3000 : 40, false));
+	}
+	for (int block = 0; block < 2000; block++)
+	{
+		if (block % 500 == 250)
+		{
+			// As if the peer sent a new SETTINGS_HEADER_TABLE_SIZE.
+			enc.set_max_table_size(block % 1000 == 250 ? 256 : 4096);
+		}
+		FieldList sent, expect, got;
+		int count = rand() % 12;
+		for (int i = 0; i < count; i++)
+		{
+			sent.push_back(rand() % 4 ? pool[rand() % pool.size()] : make_pair(random_string(30, true), random_string(50, false)));
+		}
+		string out;
+		enc.begin(out);
+		for (size_t i = 0; i < sent.size(); i++)
+		{
+			const auto& f = sent[i];
+			enc.encode(f.first.data(), f.first.size(), f.second.data(), f.second.size(), out, i % 3 != 0);
+			string lower = f.first;
+			for (auto& c : lower) c = (char)tolower((unsigned char)c);
+			expect.emplace_back(lower, f.second);
+		}
+		if (decode(dec, out, got) != 0 || got != expect)
+		{
+			printf("FAIL: round trip of block %d: %d fields sent, %d decoded\n", block, (int)expect.size(), (int)got.size());
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main()
+{
+	int failed = check_examples("C.4", c4, 4096) + check_examples("C.6", c6, 256) + check_encoder_c4() + check_round_trip();
+	if (failed) return 1;
+	printf("HPACK examples and round trips match\n");
+	return 0;
+}
@@ -0,0 +1,114 @@
+// Parses query strings and forms with many fields and repeated names.
+// Built and run by: python build.py test
+// The first value of a name wins. Finding repeats must not cost a pass over the fields parsed so far.
+#include "util.h"
+#include "form.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+using namespace std;
+
+// util.cpp builds file paths under SERVER_ROOT. The test never touches files.
+const string& _get_server_root()
+{
+	static const string root = ".";
+	return root;
+}
+
+static const char* find(const ParamList& list, const char* name)
+{
+	for (const auto& pr : list)
+	{
+		if (pr.first == name) return pr.second.c_str();
+	}
+	return nullptr;
+}
+
+static string multipart(const string& boundary, size_t count, const string& name_prefix)
+{
+	string body;
+	for (size_t i = 0; i < count; i++)
+	{
+		body += "--" + boundary + "\r\nContent-Disposition: form-data; name=\"" + name_prefix + to_string(i) + "\"\r\n\r\n"
+			+ to_string(i) + "\r\n";
+	}
+	body += "--" + boundary + "--\r\n";
+	return body;
+}
+
+int main()
+{
+	int failed = 0;
+	ArenaLease arena;
+
+	// Repeated names keep their first value, in a query string and in both kinds of form.
+	{
+		ArenaString path(ArenaAllocator<char>(arena.get()));
+		ParamList param(ArenaAllocator<ParamList::value_type>(arena.get()));
+		const char url[] = "/a.lua?x=1&y=2&x=3&z&y=4&w%3D=5";
+		urldecode(url, sizeof(url) - 1, path, param);
+		const char* x = find(param, "x");
+		const char* y = find(param, "y");
+		const char* w = find(param, "w=");
+		if (path != "/a.lua" || param.size() != 3 || !x || string(x) != "1" || !y || string(y) != "2" || !w || string(w) != "5")
+		{
+			printf("FAIL: query string: %zu parameters\n", param.size());
+			failed++;
+		}
+
+		FormData urlencoded;
+		const char body[] = "a=1&b=x+y&a=2";
+		urlencoded.parse("application/x-www-form-urlencoded", body, sizeof(body) - 1);
+		const char* b = find(urlencoded.fields, "b");
+		if (urlencoded.fields.size() != 2 || string(find(urlencoded.fields, "a")) != "1" || !b || string(b) != "x y")
+		{
+			printf("FAIL: urlencoded form: %zu fields\n", urlencoded.fields.size());
+			failed++;
+		}
+
+		FormData form;
+		string mp = multipart("B", 3, "f") + multipart("B", 3, "f");
+		int ret = form.parse("multipart/form-data; boundary=B", mp.data(), mp.size());
+		const char* f2 = find(form.fields, "f2");
+		if (ret != 0 || form.fields.size() != 3 || !f2 || string(f2) != "2")
+		{
+			printf("FAIL: multipart form: ret %d %zu fields\n", ret, form.fields.size());
+			failed++;
+		}
+	}
+
+	// Many fields: only PARAM_LIMIT are kept, and the repeats among them are found by hash.
+	auto start = chrono::steady_clock::now();
+	for (int round = 0; round < 20; round++)
+	{
+		string body;
+		for (size_t i = 0; i < 50000; i++)
+		{
+			body += "name" + to_string(i % (PARAM_LIMIT - 1)) + "=" + to_string(i) + "&";
+		}
+		body += "last=1";
+		ParamList param(ArenaAllocator<ParamList::value_type>(arena.get()));
+		parse_urlencoded(body.data(), body.size(), param);
+		if (param.size() != PARAM_LIMIT || string(find(param, "name7")) != "7" || string(find(param, "last")) != "1")
+		{
+			printf("FAIL: many parameters: %zu kept\n", param.size());
+			failed++;
+			break;
+		}
+
+		FormData form;
+		string mp = multipart("B", PARAM_LIMIT + 10, "f");
+		int ret = form.parse("multipart/form-data; boundary=B", mp.data(), mp.size());
+		if (ret != -1 || form.fields.size() != PARAM_LIMIT)
+		{
+			printf("FAIL: many form fields: ret %d %zu kept\n", ret, form.fields.size());
+			failed++;
+			break;
+		}
+	}
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	if (failed) return 1;
+	printf("Parameters parsed (%.0f ms for 20 rounds of %d fields)\n", ms, (int)PARAM_LIMIT);
+	return 0;
+}
@@ -0,0 +1,49 @@
+# Request mix used to train PGO builds. Covers static files, range requests,
+# directory listing, Lua GET/POST, errors and the status page.
+import http.client
+import threading
+
+_requests=[
+    ('GET','/',None,{}),
+    ('GET','/post_test.html',None,{}),
+    ('GET','/post_test.html',None,{'Range':'bytes=0-99'}),
+    ('GET','/post_test.html',None,{'Range':'bytes=-64'}),
+    ('GET','/list_all.lua?hello=world&name=%E4%BD%A0%E5%A5%BD&empty=',None,{}),
+    ('GET','/list_all?x=1',None,{'Accept':'text/html','User-Agent':'NaiveWorkload'}),
+    ('POST','/list_all.lua','data=hello&message=world',{'Content-Type':'application/x-www-form-urlencoded'}),
+    ('POST','/post_test.html','data=1',{'Content-Type':'application/x-www-form-urlencoded'}),
+    ('GET','/not_found.html',None,{}),
+    ('GET','/__status',None,{}),
+    ('DELETE','/',None,{}),
+]
+
+def _worker(host,port,rounds,errors,done):
+    count=0
+    for i in range(rounds):
+        for method,path,body,headers in _requests:
+            try:
+                conn=http.client.HTTPConnection(host,port,timeout=10)
+                conn.request(method,path,body,headers)
+                conn.getresponse().read()
+                conn.close()
+                count+=1
+            except Exception as e:
+                errors.append(e)
+    done.append(count)
+
+# Returns the number of requests that got a response.
+def run(host,port,rounds=100,concurrency=4):
+    errors=[]
+    done=[]
+    threads=[threading.Thread(target=_worker,args=(host,port,rounds,errors,done)) for i in range(concurrency)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    if(len(errors)>0):
+        print('Workload finished with '+str(len(errors))+' failed requests. First: '+str(errors[0]))
+    return sum(done)
+
+if __name__=='__main__':
+    from sys import argv
+    run(argv[1] if len(argv)>1 else '127.0.0.1',int(argv[2]) if len(argv)>2 else 9001)
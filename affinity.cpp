@@ -0,0 +1,53 @@
+#include "affinity.h"
+#include "logging.h"
+#include <cstdio>
+using namespace std;
+
+#ifdef _WIN32
+int set_thread_affinity(int cpu)
+{
+	return -1;
+}
+
+int get_cpu_node(int cpu)
+{
+	return -1;
+}
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+
+int set_thread_affinity(int cpu)
+{
+	if (cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0)
+	{
+		logw("Failed to pin thread to cpu %d. error: %d\n", cpu, ret);
+		return -1;
+	}
+	return 0;
+}
+
+// Each cpu directory in sysfs has a nodeN link to its node.
+int get_cpu_node(int cpu)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* dir = opendir(path);
+	if (!dir) return -1;
+	int node = -1;
+	struct dirent* e;
+	while ((e = readdir(dir)) != NULL)
+	{
+		if (sscanf(e->d_name, "node%d", &node) == 1) break;
+		node = -1;
+	}
+	closedir(dir);
+	return node;
+}
+#endif
@@ -0,0 +1,12 @@
+#pragma once
+
+// Pin the calling thread to one CPU.
+// Thread-local buffers (arenas, log rings, metrics) are allocated when a thread first uses them,
+// so a thread pinned before it serves anything gets them on its local NUMA node (first-touch).
+// Returns:
+// 0 Success
+// -1 Invalid CPU or not supported on this platform.
+int set_thread_affinity(int cpu);
+
+// NUMA node of a CPU, or -1 if it is unknown.
+int get_cpu_node(int cpu);
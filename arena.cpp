@@ -0,0 +1,185 @@
+#include "arena.h"
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+using namespace std;
+
+// Size of a standard block, header included.
+static const size_t ARENA_BLOCK_SIZE = 16 * 1024;
+// Requests larger than this get a block of their own.
+static const size_t ARENA_LARGE_THRESHOLD = ARENA_BLOCK_SIZE / 4;
+// Arenas kept by each thread for later connections.
+static const size_t ARENA_POOL_LIMIT = 256;
+// Arenas that handed out more than this are freed instead of kept,
+// so one large request (or Lua script, see VM) does not pin its memory in the pool.
+static const size_t ARENA_KEEP_LIMIT = 1024 * 1024;
+
+static inline char* align_up(char* p, size_t align)
+{
+	uintptr_t v = (uintptr_t)p;
+	return (char*)((v + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+Arena::Arena()
+{
+	_cur = _end = nullptr;
+	_blocks = _free = _large = nullptr;
+	_used = 0;
+}
+
+Arena::~Arena()
+{
+	reset();
+	while (_free)
+	{
+		Block* next = _free->next;
+		free(_free);
+		_free = next;
+	}
+}
+
+void* Arena::allocate(size_t size, size_t align)
+{
+	char* p = align_up(_cur, align);
+	if (_cur && p + size <= _end)
+	{
+		_cur = p + size;
+		_used += size;
+		return p;
+	}
+	return allocate_slow(size, align);
+}
+
+void* Arena::allocate_slow(size_t size, size_t align)
+{
+	if (size > ARENA_LARGE_THRESHOLD)
+	{
+		Block* b = (Block*)malloc(sizeof(Block) + size + align);
+		if (!b) throw bad_alloc();
+		b->size = sizeof(Block) + size + align;
+		b->next = _large;
+		_large = b;
+		_used += size;
+		return align_up((char*)(b + 1), align);
+	}
+
+	Block* b = _free;
+	if (b)
+	{
+		_free = b->next;
+	}
+	else
+	{
+		b = (Block*)malloc(ARENA_BLOCK_SIZE);
+		if (!b) throw bad_alloc();
+		b->size = ARENA_BLOCK_SIZE;
+	}
+	b->next = _blocks;
+	_blocks = b;
+	_cur = (char*)(b + 1);
+	_end = (char*)b + b->size;
+
+	char* p = align_up(_cur, align);
+	_cur = p + size;
+	_used += size;
+	return p;
+}
+
+void Arena::reset()
+{
+	while (_large)
+	{
+		Block* next = _large->next;
+		free(_large);
+		_large = next;
+	}
+	while (_blocks)
+	{
+		Block* next = _blocks->next;
+		_blocks->next = _free;
+		_free = _blocks;
+		_blocks = next;
+	}
+	_cur = _end = nullptr;
+	_used = 0;
+}
+
+size_t Arena::used() const
+{
+	return _used;
+}
+
+// Arenas released on other threads, waiting for the thread that leased them.
+struct ArenaHome
+{
+	mutex lock;
+	vector<Arena*> returned;
+	bool closed = false; // The thread has exited.
+};
+
+namespace
+{
+	struct ArenaPool
+	{
+		vector<Arena*> arenas;
+		shared_ptr<ArenaHome> home = make_shared<ArenaHome>();
+		~ArenaPool()
+		{
+			for (auto p : arenas) delete p;
+			lock_guard<mutex> lg(home->lock);
+			for (auto p : home->returned) delete p;
+			home->returned.clear();
+			home->closed = true;
+		}
+	};
+	thread_local ArenaPool tls_pool;
+}
+
+ArenaLease::ArenaLease() : _home(tls_pool.home)
+{
+	vector<Arena*>& arenas = tls_pool.arenas;
+	if (arenas.empty())
+	{
+		lock_guard<mutex> lg(_home->lock);
+		arenas.swap(_home->returned);
+	}
+	if (arenas.empty())
+	{
+		_arena = new Arena;
+	}
+	else
+	{
+		_arena = arenas.back();
+		arenas.pop_back();
+	}
+}
+
+ArenaLease::~ArenaLease()
+{
+	bool keep = _arena->used() <= ARENA_KEEP_LIMIT;
+	_arena->reset();
+	if (keep && _home == tls_pool.home)
+	{
+		if (tls_pool.arenas.size() < ARENA_POOL_LIMIT)
+		{
+			tls_pool.arenas.push_back(_arena);
+			return;
+		}
+	}
+	else if (keep)
+	{
+		lock_guard<mutex> lg(_home->lock);
+		if (!_home->closed && _home->returned.size() < ARENA_POOL_LIMIT)
+		{
+			_home->returned.push_back(_arena);
+			return;
+		}
+	}
+	delete _arena;
+}
+
+Arena* ArenaLease::get() const
+{
+	return _arena;
+}
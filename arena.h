@@ -0,0 +1,111 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+
+// Monotonic allocator for per-request data.
+// Memory is only given back by reset(), which keeps standard-sized blocks for the next request,
+// so a warmed-up arena serves a whole request without calling malloc.
+class Arena
+{
+public:
+	Arena();
+	/// NonMoveable,NonCopyable
+	Arena(const Arena&) = delete;
+	Arena& operator = (const Arena&) = delete;
+	~Arena();
+
+	void* allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+	// Everything allocated from this arena becomes invalid.
+	void reset();
+
+	// Bytes handed out since the last reset.
+	size_t used() const;
+private:
+	struct Block
+	{
+		Block* next;
+		size_t size;
+	};
+
+	void* allocate_slow(size_t size, size_t align);
+
+	char* _cur;
+	char* _end;
+	Block* _blocks; // Standard blocks in use. The head is the current one.
+	Block* _free; // Standard blocks kept for reuse.
+	Block* _large; // Oversized allocations, released on reset.
+	size_t _used;
+};
+
+struct ArenaHome;
+
+// Borrows an arena from the calling thread's pool, and gives it back (reset) on destruction.
+// If it is destroyed on another thread (like a Lua VM finishing in the script loop), the arena is handed back
+// to the thread that leased it, which picks it up once its pool runs out. It is freed if that thread has exited.
+class ArenaLease
+{
+public:
+	ArenaLease();
+	/// NonMoveable,NonCopyable
+	ArenaLease(const ArenaLease&) = delete;
+	ArenaLease& operator = (const ArenaLease&) = delete;
+	~ArenaLease();
+
+	Arena* get() const;
+private:
+	Arena* _arena;
+	std::shared_ptr<ArenaHome> _home;
+};
+
+// STL allocator on top of an Arena. Without an arena it falls back to the global heap,
+// so containers using it still work outside of a request.
+template<typename T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	ArenaAllocator() noexcept : _arena(nullptr) {}
+	explicit ArenaAllocator(Arena* arena) noexcept : _arena(arena) {}
+	template<typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) noexcept : _arena(other.arena()) {}
+
+	T* allocate(size_t n)
+	{
+		if (_arena) return static_cast<T*>(_arena->allocate(n * sizeof(T), alignof(T)));
+		return std::allocator<T>().allocate(n);
+	}
+
+	void deallocate(T* p, size_t n) noexcept
+	{
+		if (!_arena) std::allocator<T>().deallocate(p, n);
+	}
+
+	Arena* arena() const
+	{
+		return _arena;
+	}
+
+	template<typename U>
+	bool operator == (const ArenaAllocator<U>& other) const
+	{
+		return _arena == other.arena();
+	}
+
+	template<typename U>
+	bool operator != (const ArenaAllocator<U>& other) const
+	{
+		return _arena != other.arena();
+	}
+private:
+	Arena* _arena;
+};
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+
+// Decoded url parameters, in the order they appear in the url.
+typedef std::vector<std::pair<ArenaString, ArenaString>, ArenaAllocator<std::pair<ArenaString, ArenaString>>> ParamList;
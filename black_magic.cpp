@@ -1,22 +1,46 @@
 #include "black_magic.h"
-#include "log.h"
+#include "logging.h"
+#include "metrics.h"
+#include "fastscan.h"
+#include "h2.h"
+#include "tls.h"
+#include "control.h"
+#include "config.h"
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <cstring>
 using namespace std;
 
 #ifdef WIN32
-int black_magic(serversock& t)
+int black_magic(serversock& t, serversock* tls_server)
 {
 	return -1;
 }
 #else
 char exbuff[10240];
-struct vpack
+// Plaintext of TLS records in exbuff.
+char tlsbuff[16384];
+
+// Seconds to wait for scripts still running when the reactor stops.
+static const int SCRIPT_WAIT_LIMIT = 5;
+
+struct vpack;
+// Connections whose script finished in the script loop, waiting to be sent by the reactor.
+static mutex finished_lock;
+static vector<vpack*> finished_packs;
+
+struct vpack : public RequestCompletion
 {
-	string send_data;
+	// Owns all memory of this connection's request. Declared first so it is released last.
+	ArenaLease lease;
+
+	ArenaString send_data;
 	int sent;
 
-	string recv_data;
+	ArenaString recv_data;
 
 	// 0 Waiting for header
 	// 1 Received complete header, POST data not checked.
@@ -24,14 +48,54 @@ struct vpack
 	// 3 Received complete header, all data ready (or the request is GET)
 	// 4 Request is handled. Sending data...
 	// 5 About to be released.
+	// 6 Waiting for a Lua script. Events are ignored until the script finishes.
+	// 7 HTTP/2 connection. h2 owns all further requests on it.
 	int status;
 
 	Request req;
+	Response res;
 	size_t header_endpos;
 	int post_total;
+	sock* s;
+	chrono::steady_clock::time_point start_time;
+	// Started when the connection is accepted. HTTP/2 streams are timed by the session.
+	RequestTiming timing;
+
+	// Set on connections accepted from the HTTPS listener.
+	unique_ptr<TlsStream> tls;
+
+	unique_ptr<H2Session> h2;
+	// Pending streams of h2 already counted in waiting_scripts.
+	int h2_pending;
+	// EPOLLOUT is on while reading. (HTTP/2 output or TLS handshake messages are left to send)
+	bool out_wait;
+	// Removed from epoll, released once its pending streams are collected.
+	bool h2_closing;
+
+	vpack() : send_data(ArenaAllocator<char>(lease.get())), recv_data(ArenaAllocator<char>(lease.get())), req(lease.get()), res(lease.get())
+	{
+		sent = 0;
+		status = 0;
+		header_endpos = 0;
+		post_total = 0;
+		s = nullptr;
+		h2_pending = 0;
+		out_wait = false;
+		h2_closing = false;
+		req.completion = this;
+		req.timing = &timing;
+	}
+
+	// Called on the script loop. The reactor picks it up on its next round.
+	// On HTTP/2 connections, the session calls this once for any number of finished streams.
+	void complete() override
+	{
+		lock_guard<mutex> lg(finished_lock);
+		finished_packs.push_back(this);
+	}
 };
 
-int black_magic(serversock& t)
+int black_magic(serversock& t, serversock* tls_server)
 {
 	if (t.setNonblocking() < 0)
 	{
@@ -39,32 +103,306 @@ int black_magic(serversock& t)
 		return -1;
 	}
 
+	if (tls_server && tls_server->setNonblocking() < 0)
+	{
+		loge("Failed to set HTTPS serversocket to non-blocking\n");
+		return -1;
+	}
+
 	epoll ep(10240);
 	ep.add(t, EPOLLIN | EPOLLET | EPOLLERR);
+	if (tls_server)
+	{
+		ep.add(*tls_server, EPOLLIN | EPOLLET | EPOLLERR);
+	}
 
-	map<vsock*,vpack> mp;
+	// Scripts write into their connections from the script loop, so this is freed only once none is running. (See the end)
+	map<vsock*,vpack>& mp = *new map<vsock*,vpack>;
 	sock* ps = new sock;
 	bool stop_server = false;
+	int waiting_scripts = 0;
+	vector<vpack*> finished;
+
+	// Called once the whole response is written.
+	auto on_sent = [](vpack& thispack)
+	{
+		thispack.timing.mark(Phase::Send);
+		metrics_on_timing(thispack.req, thispack.res, thispack.timing);
+	};
+
+	// Serialize the response and try to send it. Returns the new status (4 or 5).
+	auto start_send = [&](sock& s, vpack& thispack) -> int
+	{
+		thispack.send_data = thispack.res.toString();
+		thispack.sent = 0;
+		if (thispack.tls)
+		{
+			// Handshake messages still waiting go out first, close_notify last.
+			thispack.tls->write(thispack.send_data.data(), thispack.send_data.size());
+			thispack.tls->shutdown();
+			const char* data;
+			size_t len = thispack.tls->output(data);
+			thispack.send_data.assign(data, len);
+			thispack.tls->consume(len);
+		}
+		logd("Request handled. status switch to 4.\n");
+
+		// Try send it
+		NBSendResult sendres = s.send_nb(thispack.send_data.c_str(), thispack.send_data.size());
+		sendres.setStopAtEdge(true);
+		metrics_on_send(sendres.getBytesDone());
+		if (!sendres.isFinished())
+		{
+			// If it cannot stop at edge, it might be something is wrong.
+			logd("Failed to finish send. status switch to 5.\n");
+			return 5;
+		}
+		else if (!sendres.isSuccess())
+		{
+			if (sendres.getErrCode() == gerrno::WouldBlock)
+			{
+				// If we meet WouldBlock, add EPOLLOUT on it.
+				// Then we keep status at 4.
+				// We will meet again in EPOLLOUT brench when this socket is writable again.
+				// It is said epoll_ctl_add is faster than epoll_ctl_mod, but epoll.add() does not work here.
+				ep.mod(s, EPOLLOUT | EPOLLET | EPOLLERR);
+				thispack.sent = sendres.getBytesDone();
+				logd("Can't send all now. Keep status at 4. Adding EPOLLOUT on vsock=%p\n", &s);
+				return 4;
+			}
+			else
+			{
+				logd("Send is Failed. errno=%d. status switched to 5.\n", (int)sendres.getErrCode());
+				return 5;
+			}
+		}
+		else
+		{
+			logd("Response send finished immediately. status switch to 5.\n");
+			on_sent(thispack);
+			return 5;
+		}
+	};
+
+	// Streams that are pending or no longer pending since the last call are added to waiting_scripts.
+	auto h2_sync = [&](vpack& thispack)
+	{
+		waiting_scripts += thispack.h2->pending() - thispack.h2_pending;
+		thispack.h2_pending = thispack.h2->pending();
+	};
+
+	// Sends what src (an H2Session or a TlsStream) has to send, and turns EPOLLOUT on or off as needed.
+	// Returns false if the connection should be closed.
+	auto flush_output = [&](sock& s, vpack& thispack, auto& src) -> bool
+	{
+		const char* data;
+		size_t len;
+		while ((len = src.output(data)) > 0)
+		{
+			NBSendResult sendres = s.send_nb(data, len);
+			sendres.setStopAtEdge(true);
+			metrics_on_send(sendres.getBytesDone());
+			if (!sendres.isFinished())
+			{
+				return false;
+			}
+			src.consume(sendres.getBytesDone());
+			if (!sendres.isSuccess())
+			{
+				if (sendres.getErrCode() != gerrno::WouldBlock)
+				{
+					logd("Send is Failed on connection %p. errno=%d\n", &s, (int)sendres.getErrCode());
+					return false;
+				}
+				if (!thispack.out_wait)
+				{
+					ep.mod(s, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLERR);
+					thispack.out_wait = true;
+				}
+				return true;
+			}
+		}
+		if (thispack.out_wait)
+		{
+			ep.mod(s, EPOLLIN | EPOLLET | EPOLLERR);
+			thispack.out_wait = false;
+		}
+		return true;
+	};
+
+	// Sends what the session has to send, through TLS on HTTPS connections.
+	// Returns false if the connection should be closed.
+	auto h2_flush = [&](sock& s, vpack& thispack) -> bool
+	{
+		if (!thispack.tls)
+		{
+			return flush_output(s, thispack, *thispack.h2) && !thispack.h2->finished();
+		}
+		const char* data;
+		size_t len;
+		while ((len = thispack.h2->output(data)) > 0)
+		{
+			if (thispack.tls->write(data, len) < 0)
+			{
+				return false;
+			}
+			thispack.h2->consume(len);
+		}
+		return flush_output(s, thispack, *thispack.tls) && !thispack.h2->finished();
+	};
+
+	// Passes received bytes to sink(data, len), decrypted first on HTTPS connections.
+	// Returns false if sink returns false or TLS fails.
+	auto take_input = [&](vpack& thispack, const char* data, size_t len, auto&& sink) -> bool
+	{
+		if (!thispack.tls)
+		{
+			return len == 0 || sink(data, len);
+		}
+		thispack.tls->feed(data, len);
+		int n;
+		while ((n = thispack.tls->read(tlsbuff, sizeof(tlsbuff))) > 0)
+		{
+			if (!sink(tlsbuff, (size_t)n))
+			{
+				return false;
+			}
+		}
+		return n == 0;
+	};
+	// Sink of take_input() for HTTP/1.1 connections.
+	auto append_input = [](vpack& thispack)
+	{
+		return [&thispack](const char* data, size_t len) { thispack.recv_data.append(data, len); return true; };
+	};
+
+	// Streams still waiting for scripts point into the session, so it is only released after they are collected.
+	auto h2_close = [&](sock& s, vpack& thispack)
+	{
+		if (!thispack.h2_closing)
+		{
+			ep.del(s);
+			thispack.h2_closing = true;
+		}
+		if (thispack.h2->pending() > 0)
+		{
+			logd("h2 connection %p closed with %d pending streams.\n", &s, thispack.h2->pending());
+			return;
+		}
+		mp.erase(&s);
+		delete &s;
+		metrics_on_close();
+	};
+
+	// Switches the connection to HTTP/2. data is what the client sent after the upgrade request, or the whole input with prior knowledge.
+	auto h2_begin = [&](sock& s, vpack& thispack, const char* data, size_t len)
+	{
+		thispack.status = 7;
+		bool alive = len == 0 || thispack.h2->feed(data, len) == 0;
+		h2_sync(thispack);
+		if (!h2_flush(s, thispack) || !alive)
+		{
+			h2_close(s, thispack);
+		}
+	};
+
+	// After the listening sockets are handed to a new process, connections left are finished until this time.
+	bool draining = false;
+	chrono::steady_clock::time_point drain_deadline;
+
 	while (!stop_server)
 	{
-		int ret = ep.wait(-1);
-		if (ret <= 0)
+		// The script loop cannot wake up this epoll, so poll for finished scripts while any is running.
+		// Otherwise wake up once a second to see if the server is being upgraded.
+		int ret = ep.wait(waiting_scripts > 0 ? 1 : 1000);
+		if (ret < 0)
 		{
 			loge("epoll error with ret: %d. errno: %d\n", ret, errno);
 			break;
 		}
+
+		if (!draining && ControlDraining())
+		{
+			draining = true;
+			drain_deadline = chrono::steady_clock::now() + chrono::seconds(DRAIN_TIMEOUT);
+			ep.del(t);
+			if (tls_server)
+			{
+				ep.del(*tls_server);
+			}
+			logi("Stopped accepting. Draining %d connections...\n", (int)mp.size());
+			// HTTP/2 clients are told to open new connections. Idle HTTP/1.1 connections get their one request served.
+			vector<vpack*> h2_packs;
+			for (auto& pr : mp)
+			{
+				if (pr.second.status == 7 && !pr.second.h2_closing) h2_packs.push_back(&pr.second);
+			}
+			for (auto pk : h2_packs)
+			{
+				pk->h2->shutdown();
+				if (!h2_flush(*pk->s, *pk))
+				{
+					h2_close(*pk->s, *pk);
+				}
+			}
+		}
+		if (draining && (mp.empty() || chrono::steady_clock::now() >= drain_deadline))
+		{
+			if (!mp.empty())
+			{
+				logw("Drain timeout. %d connections are dropped.\n", (int)mp.size());
+			}
+			break;
+		}
+
+		if (waiting_scripts > 0)
+		{
+			{
+				lock_guard<mutex> lg(finished_lock);
+				finished.swap(finished_packs);
+			}
+			for (auto pk : finished)
+			{
+				if (pk->status == 7)
+				{
+					sock& s = *pk->s;
+					pk->h2->collect();
+					h2_sync(*pk);
+					if (pk->h2_closing || !h2_flush(s, *pk))
+					{
+						h2_close(s, *pk);
+					}
+					continue;
+				}
+				waiting_scripts--;
+				sock& s = *pk->s;
+				request_handler_finished(pk->req, pk->res, pk->start_time);
+				pk->status = start_send(s, *pk);
+				if (pk->status == 5)
+				{
+					mp.erase(&s);
+					ep.del(s);
+					delete &s;
+					metrics_on_close();
+				}
+			}
+			finished.clear();
+		}
+		if (ret == 0) continue;
+
 		// Handle events
 		ep.handle([&](vsock& v, int event) {
 			logd("epoll handle: vsock %p event %d\n", &v, event);
-			if (&v == &t)
+			if (&v == &t || &v == tls_server)
 			{
+				serversock& server = (serversock&)v;
 				if (event & EPOLLIN)
 				{
 					// ServerSocket is readable. We can call accept() on it until it returns WouldBlock
 					while (true)
 					{
 						sock* ps = new sock;
-						auto accres = t.accept_nb(*ps);
+						auto accres = server.accept_nb(*ps);
 						accres.stopAtEdge(true);
 						if (!accres.isFinished())
 						{
@@ -106,8 +444,24 @@ int black_magic(serversock& t)
 								{
 									// else, the socket is now added to epoll. So we don't release it.
 									// Initialize vairables
-									mp[(vsock*)ps].sent = 0;
-									mp[(vsock*)ps].status = 0;
+									metrics_on_accept();
+									vpack& pk = mp[(vsock*)ps];
+									pk.sent = 0;
+									pk.status = 0;
+									pk.s = ps;
+									pk.timing.start();
+									if (&v == tls_server)
+									{
+										pk.tls.reset(new TlsStream);
+										if (pk.tls->start() < 0)
+										{
+											logw("Failed to start TLS on %p\n", ps);
+											mp.erase(ps);
+											ep.del(*ps);
+											delete ps;
+											metrics_on_close();
+										}
+									}
 								}
 							}
 						}
@@ -123,7 +477,58 @@ int black_magic(serversock& t)
 			else
 			{
 				sock& s = (sock&)v;
-				if (event & EPOLLIN)
+				if (mp[&s].status == 6)
+				{
+					// The script owns the connection now. Errors show up when the response is sent.
+					logd("Ignoring event %d on %p while its script is running.\n", event, &s);
+				}
+				else if (mp[&s].status == 7)
+				{
+					vpack& thispack = mp[&s];
+					bool alive = (event & EPOLLERR) == 0;
+					while (alive && (event & EPOLLIN))
+					{
+						auto recres = s.recv_nb(exbuff, 10240);
+						recres.setStopAtEdge(true);
+						if (!recres.isFinished())
+						{
+							alive = false;
+							break;
+						}
+						if (!take_input(thispack, exbuff, recres.getBytesDone(), [&thispack](const char* data, size_t len) { return thispack.h2->feed(data, len) == 0; }))
+						{
+							// GOAWAY is sent below, then the connection is closed.
+							alive = false;
+						}
+						if (!recres.isSuccess())
+						{
+							if (recres.getErrCode() != gerrno::WouldBlock)
+							{
+								// Closed by the client, or recv call error.
+								alive = false;
+							}
+							break;
+						}
+					}
+					h2_sync(thispack);
+					if (!h2_flush(s, thispack) || !alive)
+					{
+						h2_close(s, thispack);
+					}
+				}
+				else if (mp[&s].tls && mp[&s].status < 4 && (event & EPOLLIN) == 0)
+				{
+					// Writable again with handshake messages left to send.
+					if ((event & EPOLLERR) || !flush_output(s, mp[&s], *mp[&s].tls))
+					{
+						logd("TLS handshake failed. Removing from epoll and releasing resource... %p\n", &s);
+						mp.erase(&s);
+						ep.del(s);
+						delete &s;
+						metrics_on_close();
+					}
+				}
+				else if (event & EPOLLIN)
 				{
 					// Socket is readable. Read it
 					while (true)
@@ -137,6 +542,7 @@ int black_magic(serversock& t)
 							mp.erase(&s);
 							ep.del(s);
 							delete &s;
+							metrics_on_close();
 							break;
 						}
 						else if (!recres.isSuccess())
@@ -146,14 +552,36 @@ int black_magic(serversock& t)
 							if (recres.getErrCode() == gerrno::WouldBlock)
 							{
 								// No more data yet
-								thispack.recv_data.append(string(exbuff, recres.getBytesDone()));
+								if (!take_input(thispack, exbuff, recres.getBytesDone(), append_input(thispack)) ||
+									(thispack.tls && !flush_output(s, thispack, *thispack.tls)))
+								{
+									logd("TLS failed. Removing from epoll and releasing resource... %p\n", &s);
+									mp.erase(&s);
+									ep.del(s);
+									delete &s;
+									metrics_on_close();
+									break;
+								}
 
 								if (thispack.status == 0) // 0->1, 0->5
 								{
 									// Check if it contains http request header
-									if (string::npos != (thispack.header_endpos = thispack.recv_data.find("\r\n\r\n")))
+									if (string::npos != (thispack.header_endpos = scan_header_end(thispack.recv_data.data(), thispack.recv_data.size())))
 									{
-										int ret = parse_header(thispack.recv_data, thispack.req);
+										thispack.timing.mark(Phase::Receive);
+										// The preface of HTTP/2 with prior knowledge passes for a request header.
+										if (H2_MAX_STREAMS > 0 && thispack.recv_data.compare(0, 18, H2_PREFACE, 18) == 0)
+										{
+											logd("HTTP/2 connection preface received on %p.\n", &s);
+											thispack.h2.reset(new H2Session([&thispack]() { thispack.complete(); }));
+											thispack.h2->start();
+											h2_begin(s, thispack, thispack.recv_data.data(), thispack.recv_data.size());
+											break;
+										}
+
+										int ret = parse_header(thispack.recv_data.data(), thispack.recv_data.size(), thispack.req);
+										thispack.req.config = ConfigCurrent();
+										thispack.timing.mark(Phase::Parse);
 										if (ret < 0)
 										{
 											thispack.status = 5;
@@ -172,6 +600,7 @@ int black_magic(serversock& t)
 									// check if we have done receiving post data.
 									if (thispack.post_total <= thispack.req.data.size())
 									{
+										thispack.timing.mark(Phase::Receive);
 										thispack.status = 3;
 										logd("http post data received. status switched to 3.\n");
 									}
@@ -183,16 +612,17 @@ int black_magic(serversock& t)
 									// Check if it needs more data
 									if (thispack.req.method == "POST")
 									{
-										auto iter = thispack.req.header.find("Content-Length");
+										const char* content_length_str = thispack.req.header.get(HeaderId::ContentLength);
 										int content_length = 0;
-										if (iter != thispack.req.header.end() && sscanf(iter->second.c_str(), "%d", &content_length) == 1)
+										if (content_length_str && sscanf(content_length_str, "%d", &content_length) == 1)
 										{
 											// More data is need to read.
 											// First check if some posted data is already in str
 											if (thispack.header_endpos + 4 != thispack.recv_data.size())
 											{
 												// Some posted data here
-												thispack.req.data = thispack.recv_data.substr(thispack.header_endpos + 4);
+												thispack.req.data.assign(thispack.recv_data.data() + thispack.header_endpos + 4,
+													thispack.recv_data.size() - thispack.header_endpos - 4);
 											}
 											thispack.recv_data.clear();
 											thispack.post_total = content_length;
@@ -213,52 +643,41 @@ int black_magic(serversock& t)
 									}
 								}
 
-								if (thispack.status == 3) // 3->4->break, 3->4->5
+								// h2c is cleartext only, HTTPS clients pick h2 by ALPN instead.
+								if (thispack.status == 3 && H2_MAX_STREAMS > 0 && !thispack.tls && H2Session::is_upgrade(thispack.req)) // 3->7->break
 								{
-									Response res;
-									int ret = request_handler(thispack.req, res);
-									if (ret < 0)
+									thispack.h2.reset(new H2Session([&thispack]() { thispack.complete(); }));
+									if (thispack.h2->start_upgrade(thispack.req) == 0)
 									{
-										res.set_code(400);
+										logd("Connection %p upgraded to h2c.\n", &s);
+										// Anything after a GET request header is already HTTP/2.
+										size_t used = thispack.req.method == "POST" ? thispack.recv_data.size() : thispack.header_endpos + 4;
+										h2_begin(s, thispack, thispack.recv_data.data() + used, thispack.recv_data.size() - used);
+										break;
 									}
+									thispack.h2.reset();
+								}
 
-									thispack.send_data = res.toString();
-									thispack.sent = 0;
-									thispack.status = 4;
-									logd("Request handled. status switch to 4.\n");
-
-									// Try send it
-									NBSendResult sendres = s.send_nb(thispack.send_data.c_str(), thispack.send_data.size());
-									sendres.setStopAtEdge(true);
-									if (!sendres.isFinished())
+								if (thispack.status == 3) // 3->6->break, 3->4->break, 3->4->5
+								{
+									thispack.start_time = chrono::steady_clock::now();
+									int ret = request_handler(thispack.req, thispack.res);
+									if (ret == REQUEST_PENDING)
 									{
-										// If it cannot stop at edge, it might be something is wrong.
-										thispack.status = 5;
-										logd("Failed to finish send. status switch to 5.\n");
+										thispack.status = 6;
+										waiting_scripts++;
+										logd("Request is waiting for a script. status switch to 6.\n");
+										break;
 									}
-									else if (!sendres.isSuccess())
+									if (ret < 0)
 									{
-										if (sendres.getErrCode() == gerrno::WouldBlock)
-										{
-											// If we meet WouldBlock, add EPOLLOUT on it.
-											// Then we keep status at 4.
-											// We will meet again in EPOLLOUT brench when this socket is writable again.
-											// It is said epoll_ctl_add is faster than epoll_ctl_mod, but epoll.add() does not work here.
-											ep.mod(v, EPOLLOUT | EPOLLET | EPOLLERR);
-											thispack.sent = sendres.getBytesDone();
-											logd("Can't send all now. Keep status at 4. Adding EPOLLOUT on vsock=%p\n", &v);
-											break;
-										}
-										else
-										{
-											thispack.status = 5;
-											logd("Send is Failed. errno=%d. status switched to 5.\n", sendres.getErrCode());
-										}
+										thispack.res.set_code(400);
 									}
-									else
+
+									thispack.status = start_send(s, thispack);
+									if (thispack.status == 4)
 									{
-										thispack.status = 5;
-										logd("Response send finished immediately. status switch to 5.\n");
+										break;
 									}
 								}
 
@@ -269,6 +688,7 @@ int black_magic(serversock& t)
 									mp.erase(&s);
 									ep.del(s);
 									delete &s;
+									metrics_on_close();
 									break;
 								}
 							}
@@ -279,6 +699,7 @@ int black_magic(serversock& t)
 								mp.erase(&s);
 								ep.del(s);
 								delete &s;
+								metrics_on_close();
 								break;
 							}
 						}
@@ -287,7 +708,15 @@ int black_magic(serversock& t)
 							// Finished, Success
 							// Store the data and loop again to read more. (until it reaches WouldBlock)
 							// exbuff will be cleared at the beginning of the loop.
-							mp[&s].recv_data.append(string(exbuff, recres.getBytesDone()));
+							if (!take_input(mp[&s], exbuff, recres.getBytesDone(), append_input(mp[&s])))
+							{
+								logd("TLS failed. Removing from epoll and releasing resource... %p\n", &s);
+								mp.erase(&s);
+								ep.del(s);
+								delete &s;
+								metrics_on_close();
+								break;
+							}
 						}
 					}
 				}
@@ -296,12 +725,14 @@ int black_magic(serversock& t)
 					// Socket is writable (Oh it's you! we meet again here. But it would be a short time.)
 					auto sndres = s.send_nb(mp[&v].send_data.data() + mp[&v].sent, mp[&v].send_data.size() - mp[&v].sent);
 					sndres.setStopAtEdge(true);
+					metrics_on_send(sndres.getBytesDone());
 					if (!sndres.isFinished())
 					{
 						logd("Failed to finish send. Removing from epoll and releasing resource... %p\n", &v);
 						mp.erase(&s);
 						ep.del(s);
 						delete &s;
+						metrics_on_close();
 					}
 					else if (!sndres.isSuccess())
 					{
@@ -317,6 +748,7 @@ int black_magic(serversock& t)
 							mp.erase(&s);
 							ep.del(s);
 							delete &s;
+							metrics_on_close();
 						}
 					}
 					else
@@ -324,9 +756,11 @@ int black_magic(serversock& t)
 						mp[&v].sent += sndres.getBytesDone();
 						// All data is sent!
 						logd("Response send finished. Cleaning up...\n");
+						on_sent(mp[&s]);
 						mp.erase(&s);
 						ep.del(s);
 						delete &s;
+						metrics_on_close();
 					}
 				}
 				else if (event & EPOLLERR)
@@ -336,11 +770,46 @@ int black_magic(serversock& t)
 					mp.erase(&s);
 					ep.del(s);
 					delete &s;
+					metrics_on_close();
 				}
 			}
 		});
 	}
 
+	// Connections left are not answered any more, but their scripts still have to finish before mp goes away.
+	if (waiting_scripts > 0)
+	{
+		logi("Waiting for %d scripts to finish...\n", waiting_scripts);
+	}
+	auto wait_deadline = chrono::steady_clock::now() + chrono::seconds(SCRIPT_WAIT_LIMIT);
+	while (waiting_scripts > 0 && chrono::steady_clock::now() < wait_deadline)
+	{
+		{
+			lock_guard<mutex> lg(finished_lock);
+			finished.swap(finished_packs);
+		}
+		for (auto pk : finished)
+		{
+			if (pk->status == 7)
+			{
+				pk->h2->collect();
+				h2_sync(*pk);
+			}
+			else
+			{
+				waiting_scripts--;
+			}
+		}
+		finished.clear();
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+	if (waiting_scripts > 0)
+	{
+		logw("%d scripts are still running. Their connections are left as they are.\n", waiting_scripts);
+		return 1;
+	}
+
+	delete &mp;
 	return 0;
 }
 #endif
\ No newline at end of file
@@ -1,10 +1,21 @@
 #pragma once
+#include <chrono>
 #include "GSock/gsock.h"
 #include "request.h"
 #include "response.h"
 
 // Black Magic Entrance
-int black_magic(serversock& t);
+// tls_server is an optional second listener whose connections speak HTTPS. See tls.h
+// Returns:
+// 0 Server stopped.
+// 1 Server stopped, but some scripts are still running and own memory of the reactor.
+//   The process has to end without running destructors. (_Exit)
+// -1 Failed to start.
+int black_magic(serversock& t, serversock* tls_server = nullptr);
 
 // Cross compile required
-int request_handler(const Request& req, Response& res);
\ No newline at end of file
+int request_handler(const Request& req, Response& res);
+
+// Counts a request that request_handler returned REQUEST_PENDING for, once its response is filled.
+// start_time is taken right before request_handler is called.
+void request_handler_finished(const Request& req, const Response& res, std::chrono::steady_clock::time_point start_time);
\ No newline at end of file
@@ -1,9 +1,28 @@
 import os
+import shutil
+import signal
+import subprocess
+import tempfile
+import time
 from hashlib import md5
 from sys import argv
+from multiprocessing.pool import ThreadPool
 
 _source_lst=[]
 
+# Build configurations: (compile option, link option)
+# release is the default. Binaries we deploy and benchmark should always be built with release or pgo.
+_configs={
+    'debug':('-O0 -g -DNAIVE_LOG_LEVEL=4',''),
+    'release':('-O2 -DNDEBUG -flto','-O2 -flto'),
+}
+
+# PGO reuses the release options. Profile data is written under build/pgo/profile
+_pgo_dir=os.path.join('build','pgo')
+_pgo_profile_dir=os.path.abspath(os.path.join(_pgo_dir,'profile'))
+_pgo_gen_option=' -fprofile-generate='+_pgo_profile_dir+' -fprofile-update=atomic -DNAIVE_PGO_TRAINING'
+_pgo_use_option=' -fprofile-use='+_pgo_profile_dir+' -fprofile-correction -Wno-missing-profile'
+
 def GetMD5(filename):
     f=open(filename,'rb')
     h=md5()
@@ -34,46 +53,59 @@ def AddNewSource(filename):
     else:
         return False
 
-def BuildSingle(filename,compile_option):
-    print('Considering '+filename+'...')
-    object_name=''
-
-    if(not AddNewSource(filename)):
-        print('Source has been compiled before. '+filename)
-        return False,object_name
+def GetObjectName(filename,object_dir):
+    if(filename.endswith('.cpp')):
+        object_name=filename[:-len('.cpp')]+'.o'
+    else:
+        object_name=filename[:-len('.c')]+'.o'
+    return os.path.normpath(os.path.join(object_dir,object_name))
 
-    compiler='g++ -ILogger -std=c++14'
+def BuildSingle(filename,compile_option,object_dir,force=False):
+    object_name=GetObjectName(filename,object_dir)
 
-    if(filename.endswith('.cpp')):
-        object_name=filename.replace('.cpp','.o')
-    elif(filename.endswith('.c')):
-        object_name=filename.replace('.c','.o')
+    compiler='g++ -std=c++14'
+    if(filename.endswith('.c')):
         compiler='gcc'
 
-    if((not os.path.exists(object_name)) or (os.stat(filename).st_mtime>os.stat(object_name).st_mtime) ):
+    if(force or (not os.path.exists(object_name)) or (os.stat(filename).st_mtime>os.stat(object_name).st_mtime) ):
+        if(not os.path.exists(os.path.dirname(object_name))):
+            os.makedirs(os.path.dirname(object_name),exist_ok=True)
         build_cmd=compiler+' -fPIC '+compile_option+' -c '+filename+' -o '+object_name
         print(build_cmd)
         if(os.system(build_cmd)!=0):
             raise Exception('Failed to build '+filename,filename,object_name)
 
-    return True,object_name
+    return object_name
 
-def BuildAll(lst,compile_option='',link_option=''):
-    klst=[]
+def BuildAll(lst,compile_option='',link_option='',object_dir=os.path.join('build','release'),output='main',force=False):
+    todo=[]
     for s in lst:
-        flg,objname=BuildSingle(s,compile_option)
-        if(flg):
-            klst.append(objname)
+        print('Considering '+s+'...')
+        if(not AddNewSource(s)):
+            print('Source has been compiled before. '+s)
+        else:
+            todo.append(s)
+
+    # Compilers run as separate processes, so a thread pool is enough to build in parallel.
+    pool=ThreadPool(os.cpu_count() or 1)
+    try:
+        klst=pool.map(lambda s:BuildSingle(s,compile_option,object_dir,force),todo)
+    finally:
+        pool.close()
+
     cmd='g++ '
     for s in klst:
         cmd=cmd+s+' '
-    cmd=cmd+' -fPIC -ldl -lpthread '+link_option+'-o main'
+    cmd=cmd+' -fPIC -ldl -lpthread -lssl -lcrypto '+link_option+' -o '+output
     print(cmd)
-    os.system(cmd)
+    if(os.system(cmd)!=0):
+        raise Exception('Failed to link '+output)
 
 def ScanSource(dirname):
     lst=[]
     for par,dirs,files in os.walk(dirname):
+        # Skip build outputs, VCS data and tests (built by RunTests)
+        dirs[:]=[d for d in dirs if d not in ('build','.git','Test')]
         for f in files:
             if(f.endswith('.cpp') or f.endswith('.c')):
                 lst.append(os.path.join(par,f))
@@ -89,27 +121,149 @@ def RemoveFileES(filename):
 def CleanObject(source_list):
     print('Removing main...')
     RemoveFileES('main')
+    print('Removing build...')
+    shutil.rmtree('build',ignore_errors=True)
+    # Objects from older versions of this script live next to the sources.
     for f in source_list:
         if(f.endswith('.c')):
             t=f.replace('.c','.o')
-            print('Removing '+t+'...')
-            RemoveFileES(t)
-        elif(f.endswith('.cpp')):
+        else:
             t=f.replace('.cpp','.o')
+        if(os.path.exists(t)):
             print('Removing '+t+'...')
             RemoveFileES(t)
 
+def WaitForPort(port,timeout=10):
+    import socket
+    deadline=time.time()+timeout
+    while time.time()<deadline:
+        try:
+            s=socket.create_connection(('127.0.0.1',port),timeout=1)
+            s.close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+def RunServer(binary,port,mode,extra_config,action):
+    # Start binary in a temporary directory serving WebTest, call action(), then stop it with SIGTERM.
+    workdir=tempfile.mkdtemp(prefix='naive_run_')
+    f=open(os.path.join(workdir,'config.lua'),'w')
+    f.write('server_root="'+os.path.abspath('WebTest')+'"\nserver_port='+str(port)+'\ndeploy_mode='+str(mode)+'\n'+extra_config)
+    f.close()
+
+    proc=subprocess.Popen([os.path.abspath(binary)],cwd=workdir,stdout=subprocess.DEVNULL)
+    try:
+        if(not WaitForPort(port)):
+            raise Exception('Server did not start.')
+        return action()
+    finally:
+        proc.send_signal(signal.SIGTERM)
+        proc.wait()
+        shutil.rmtree(workdir,ignore_errors=True)
+
+def TrainProfile(binary,port=19001):
+    # Run the instrumented server in both deploy modes against the WebTest workload.
+    # The training build dumps its profile on SIGTERM.
+    import WebTest.workload as workload
+
+    for mode in (0,1):
+        print('Training with deploy_mode='+str(mode)+'...')
+        RunServer(binary,port,mode,'status_page=1\n',lambda: workload.run('127.0.0.1',port,rounds=200,concurrency=8))
+
+def BenchAffinity(binary,cpus,port=19002):
+    # Compare requests per second with and without pinning, in both deploy modes.
+    # Workers (and the rapid mode reactor) are pinned to cpus. The load generator runs on the other CPUs if there are any.
+    import WebTest.workload as workload
+
+    if(hasattr(os,'sched_setaffinity')):
+        rest=os.sched_getaffinity(0)-set(cpus)
+        if(len(rest)>0):
+            os.sched_setaffinity(0,rest)
+
+    def measure():
+        start=time.time()
+        done=workload.run('127.0.0.1',port,rounds=100,concurrency=8)
+        return done/(time.time()-start)
+
+    threads='worker_threads='+str(len(cpus))+'\n'
+    pinned=threads+'worker_cpus={'+','.join(str(c) for c in cpus)+'}\nreactor_cpu='+str(cpus[0])+'\n'
+    for mode in (0,1):
+        for name,extra in (('unpinned',threads),('pinned',pinned)):
+            rps=RunServer(binary,port,mode,extra,measure)
+            print('deploy_mode='+str(mode)+' '+name+': '+str(int(rps))+' requests/s')
+
+def BuildPGO(lst,compile_option='',link_option=''):
+    release_compile,release_link=_configs['release']
+    shutil.rmtree(_pgo_profile_dir,ignore_errors=True)
+
+    print('[PGO] Building instrumented binary...')
+    BuildAll(lst,release_compile+_pgo_gen_option+' '+compile_option,release_link+_pgo_gen_option+' '+link_option,
+        _pgo_dir,os.path.join(_pgo_dir,'main_instrumented'),force=True)
+
+    print('[PGO] Training...')
+    TrainProfile(os.path.join(_pgo_dir,'main_instrumented'))
+
+    # Objects must keep the same path in both stages, otherwise profile data does not match.
+    print('[PGO] Rebuilding with profile...')
+    global _source_lst
+    _source_lst=[]
+    BuildAll(lst,release_compile+_pgo_use_option+' '+compile_option,release_link+_pgo_use_option+' '+link_option,
+        _pgo_dir,'main',force=True)
+
+# Each test is a standalone program built with the sources it covers. It returns non-zero on failure.
+_tests={
+    'alloc_count':['arena.cpp','fastscan.cpp','headermap.cpp','logging.cpp','request.cpp','response.cpp','util.cpp'],
+    'h2_header_list':['arena.cpp','fastscan.cpp','h2.cpp','headermap.cpp','hpack.cpp','logging.cpp','request.cpp','response.cpp','timing.cpp','util.cpp'],
+    'hpack_codec':['hpack.cpp'],
+    'params':['arena.cpp','fastscan.cpp','form.cpp','logging.cpp','util.cpp'],
+}
+
+def RunTests():
+    global _source_lst
+    compile_option,link_option=_configs['release']
+    failed=[]
+    for name,sources in _tests.items():
+        _source_lst=[]
+        output=os.path.join('build','test',name)
+        BuildAll([os.path.join('Test',name+'.cpp')]+sources,compile_option+' -I.',link_option,os.path.join('build','test'),output)
+        print('Running '+name+'...')
+        if(os.system(output)!=0):
+            failed.append(name)
+    if(len(failed)>0):
+        raise Exception('Tests failed: '+' '.join(failed))
+
+# Usage:
+#   python build.py [debug|release|pgo] [compile_option] [link_option]
+#   python build.py clean
+#   python build.py test
+#   python build.py bench [cpu_list]    (Benchmark ./main pinned and unpinned. cpu_list defaults to 0,1)
+# Configuration defaults to release. Extra options are appended to the configuration's own.
 def build():
     slst=ScanSource('.')
-    if(len(argv)>1 and argv[1]=='clean'):
+    args=argv[1:]
+    if(len(args)>0 and args[0]=='clean'):
         CleanObject(slst)
+        return
+    if(len(args)>0 and args[0]=='test'):
+        RunTests()
+        return
+    if(len(args)>0 and args[0]=='bench'):
+        BenchAffinity('main',[int(c) for c in (args[1] if len(args)>1 else '0,1').split(',')])
+        return
+
+    config='release'
+    if(len(args)>0 and (args[0] in _configs or args[0]=='pgo')):
+        config=args[0]
+        args=args[1:]
+    compile_option=args[0] if len(args)>0 else ''
+    link_option=args[1] if len(args)>1 else ''
+
+    if(config=='pgo'):
+        BuildPGO(slst,compile_option,link_option)
     else:
-        if(len(argv)==1):
-            BuildAll(slst)
-        elif(len(argv)==2):
-            BuildAll(slst,argv[1])
-        else:
-            BuildAll(slst,argv[1],argv[2])
+        BuildAll(slst,_configs[config][0]+' '+compile_option,_configs[config][1]+' '+link_option,
+            os.path.join('build',config))
 
 if __name__=='__main__' :
     build()
@@ -0,0 +1,270 @@
+#include "bundle.h"
+#include "config.h"
+#include "util.h"
+#include "logging.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+using namespace std;
+
+#ifdef _WIN32
+int BundleOpen(const string& filename, const shared_ptr<const ContentTypes>& types, shared_ptr<const AssetBundle>& out)
+{
+	return -1;
+}
+
+bool BundleHas(const string& path)
+{
+	return false;
+}
+
+int BundleServe(const Request& req, Response& res, const ArenaString& path)
+{
+	return -1;
+}
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// See pack.py for the layout.
+namespace
+{
+	const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+#pragma pack(push, 1)
+	struct PackHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t entry_count;
+		uint32_t table_size;
+		uint64_t entries_off;
+		uint64_t table_off;
+	};
+
+	struct PackEntry
+	{
+		uint64_t hash;
+		uint64_t path_off;
+		uint32_t path_len;
+		uint32_t etag_len;
+		uint64_t etag_off;
+		uint64_t data_off;
+		uint64_t data_len;
+		uint64_t gzip_off;
+		uint64_t gzip_len;
+	};
+#pragma pack(pop)
+
+	struct BundleFile
+	{
+		PackEntry entry;
+		// Resolved when the bundle is opened, so mime_types in config.lua applies. Points into AssetBundle::types.
+		const string* content_type;
+	};
+}
+
+struct AssetBundle
+{
+	const char* base = nullptr;
+	size_t base_size = 0;
+	vector<uint32_t> table;
+	vector<BundleFile> files;
+	shared_ptr<const ContentTypes> types;
+
+	~AssetBundle()
+	{
+		if (base) munmap((void*)base, base_size);
+	}
+
+	bool in_range(uint64_t off, uint64_t len) const
+	{
+		return off <= base_size && len <= base_size - off;
+	}
+};
+
+namespace
+{
+	// FNV-1a, same as pack.py
+	uint64_t path_hash(const char* path, size_t len)
+	{
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < len; i++)
+		{
+			h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+		}
+		return h;
+	}
+
+	const BundleFile* find_file(const AssetBundle& b, const char* path, size_t len)
+	{
+		const vector<uint32_t>& table = b.table;
+		if (table.empty()) return nullptr;
+		uint64_t h = path_hash(path, len);
+		size_t mask = table.size() - 1;
+		for (size_t slot = h & mask, n = 0; n < table.size(); slot = (slot + 1) & mask, n++)
+		{
+			uint32_t idx = table[slot];
+			if (idx == EMPTY_SLOT) return nullptr;
+			const PackEntry& e = b.files[idx].entry;
+			if (e.hash == h && e.path_len == len && memcmp(b.base + e.path_off, path, len) == 0)
+			{
+				return &b.files[idx];
+			}
+		}
+		return nullptr;
+	}
+}
+
+int BundleOpen(const string& filename, const shared_ptr<const ContentTypes>& types, shared_ptr<const AssetBundle>& out)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		loge("Failed to open bundle %s\n", filename.c_str());
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PackHeader))
+	{
+		loge("Invalid bundle %s\n", filename.c_str());
+		close(fd);
+		return -2;
+	}
+	void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		loge("Failed to map bundle %s. errno: %d\n", filename.c_str(), errno);
+		return -1;
+	}
+	shared_ptr<AssetBundle> b = make_shared<AssetBundle>();
+	b->base = (const char*)p;
+	b->base_size = st.st_size;
+	b->types = types;
+
+	PackHeader h;
+	memcpy(&h, b->base, sizeof(h));
+	bool valid = memcmp(h.magic, "NHPK", 4) == 0 && h.version == 1 &&
+		h.table_size > 0 && (h.table_size & (h.table_size - 1)) == 0 && h.entry_count < h.table_size &&
+		b->in_range(h.table_off, (uint64_t)h.table_size * sizeof(uint32_t)) &&
+		b->in_range(h.entries_off, (uint64_t)h.entry_count * sizeof(PackEntry));
+
+	if (valid)
+	{
+		b->table.resize(h.table_size);
+		memcpy(b->table.data(), b->base + h.table_off, b->table.size() * sizeof(uint32_t));
+		for (auto idx : b->table)
+		{
+			if (idx != EMPTY_SLOT && idx >= h.entry_count) valid = false;
+		}
+
+		b->files.resize(h.entry_count);
+		for (size_t i = 0; valid && i < b->files.size(); i++)
+		{
+			PackEntry& e = b->files[i].entry;
+			memcpy(&e, b->base + h.entries_off + i * sizeof(PackEntry), sizeof(PackEntry));
+			valid = b->in_range(e.path_off, e.path_len) && b->in_range(e.etag_off, e.etag_len) &&
+				b->in_range(e.data_off, e.data_len) && b->in_range(e.gzip_off, e.gzip_len);
+			if (valid)
+			{
+				static const string default_type = "text/plain";
+				const string* type = FindContentType(*types, b->base + e.path_off, e.path_len);
+				b->files[i].content_type = type ? type : &default_type;
+			}
+		}
+	}
+
+	if (!valid)
+	{
+		loge("Invalid bundle %s\n", filename.c_str());
+		return -2;
+	}
+
+	out = move(b);
+	logi("Bundle %s opened with %u files.\n", filename.c_str(), h.entry_count);
+	return 0;
+}
+
+bool BundleHas(const string& path)
+{
+	const AssetBundle* b = BUNDLE.get();
+	return b && find_file(*b, path.data(), path.size());
+}
+
+int BundleServe(const Request& req, Response& res, const ArenaString& path)
+{
+	const AssetBundle* b = BUNDLE.get();
+	if (!b) return -1;
+	const BundleFile* f = find_file(*b, path.data(), path.size());
+	if (!f) return -1;
+	const char* base = b->base;
+	const PackEntry& e = f->entry;
+
+	// Range requests are served from the original content.
+	const char* range = req.header.get(HeaderId::Range);
+	bool use_gzip = e.gzip_len > 0 && !range && accepts_coding(req.header.get(HeaderId::AcceptEncoding), "gzip");
+
+	// ETag is quoted in the bundle, as it is sent. The gzip variant has its own: the same with "-gz" inside the quotes.
+	string etag(base + e.etag_off, e.etag_len);
+	if (use_gzip && etag.size() >= 2 && etag.back() == '"')
+	{
+		etag.insert(etag.size() - 1, "-gz");
+	}
+	const char* if_none_match = req.header.get(HeaderId::IfNoneMatch);
+	if (if_none_match && etag_matches(if_none_match, etag.data(), etag.size()))
+	{
+		res.set_code(304);
+		res.set_raw("ETag", 4, etag.data(), etag.size());
+		if (e.gzip_len > 0)
+		{
+			res.set_raw("Vary", "Accept-Encoding");
+		}
+		return 0;
+	}
+
+	if (range)
+	{
+		int beginat, length;
+		if (e.data_len > INT32_MAX || parse_range_request(range, (int)e.data_len, beginat, length) < 0)
+		{
+			res.set_code(416);
+			return 0;
+		}
+
+		res.set_code(length != (int)e.data_len ? 206 : 200);
+		res.setContent(string(base + e.data_off + beginat, length), *f->content_type);
+		if (length != (int)e.data_len)
+		{
+			char content_range_buff[64] = { 0 };
+			sprintf(content_range_buff, "bytes %d-%d/%d", beginat, beginat + length - 1, (int)e.data_len);
+			res.set_raw("Content-Range", content_range_buff);
+		}
+	}
+	else
+	{
+		res.set_code(200);
+		if (use_gzip)
+		{
+			res.setContent(string(base + e.gzip_off, e.gzip_len), *f->content_type);
+			res.set_raw("Content-Encoding", "gzip");
+		}
+		else
+		{
+			res.setContent(string(base + e.data_off, e.data_len), *f->content_type);
+		}
+	}
+	if (e.gzip_len > 0)
+	{
+		res.set_raw("Vary", "Accept-Encoding");
+	}
+	res.set_raw("Accept-Ranges", "bytes");
+	res.set_raw("ETag", 4, etag.data(), etag.size());
+	return 0;
+}
+#endif
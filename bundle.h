@@ -0,0 +1,26 @@
+#pragma once
+#include <memory>
+#include <string>
+#include "request.h"
+#include "response.h"
+#include "mime.h"
+
+// Static files packed by pack.py into one bundle file. The bundle is mapped into memory when it is opened,
+// so files in it are served without touching the file system.
+// The bundle served is the one of the settings in use (see BUNDLE). It is unmapped with the last snapshot holding it.
+
+// Maps filename into out. Content types of its files are resolved in types.
+// Returns:
+// 0 Success
+// -1 Bundle cannot be opened or mapped.
+// -2 Not a valid bundle.
+int BundleOpen(const std::string& filename, const std::shared_ptr<const ContentTypes>& types, std::shared_ptr<const AssetBundle>& out);
+
+// True if path (url decoded) is served from the bundle.
+bool BundleHas(const std::string& path);
+
+// path is url decoded.
+// Returns:
+// 0 res is filled from the bundle.
+// -1 No bundle is open, or path is not in it.
+int BundleServe(const Request& req, Response& res, const ArenaString& path);
@@ -1,11 +1,123 @@
 #pragma once
+#include <memory>
 #include <string>
+#include <vector>
+
+// Budgets of a Lua CGI script. A script going over one of them is stopped. 0 No limit
+struct LuaLimits
+{
+	// Milliseconds the script may run. Time spent waiting for helpers (like helper.sleep) is not counted.
+	int time_limit = 5000;
+	// Memory of the Lua state in KB.
+	int memory_limit = 65536;
+	// Lua instructions the script may execute.
+	int instruction_limit = 0;
+};
+
+struct ContentTypes;
+struct AssetBundle;
+
+// Everything read from config.lua. A reload publishes a new snapshot instead of changing the current one.
+struct ServerConfig;
+// A snapshot is freed when the last request holding it is done.
+typedef std::shared_ptr<const ServerConfig> ConfigSnapshot;
+
+// The latest snapshot. A request takes it when it is received (see Request::config).
+ConfigSnapshot ConfigCurrent();
+
+// While a scope is alive, the getters below read snap on this thread (the latest snapshot if snap is empty).
+// Scopes may nest. Outside of any scope they read the latest snapshot, and references they return
+// may be freed by the next reload: code running outside of requests should copy what it keeps.
+class ConfigScope
+{
+public:
+	explicit ConfigScope(const ConfigSnapshot& snap);
+	~ConfigScope();
+	ConfigScope(const ConfigScope&) = delete;
+	ConfigScope& operator = (const ConfigScope&) = delete;
+private:
+	ConfigSnapshot _prev;
+};
 
 const int& _get_bind_port();
 const std::string& _get_server_root();
 const int& _get_deploy_mode();
+const int& _get_status_page();
+const int& _get_listing_page_size();
+const int& _get_listing_cache();
+const int& _get_worker_threads();
+const std::vector<int>& _get_worker_cpus();
+const int& _get_reactor_cpu();
+const int& _get_shared_dict_size();
+const int& _get_output_cache_size();
+const std::string& _get_asset_bundle();
+const int& _get_upstream_timeout();
+const int& _get_upstream_keepalive();
+const int& _get_h2_max_streams();
+const int& _get_tls_port();
+const std::string& _get_tls_cert();
+const std::string& _get_tls_key();
+const int& _get_tls_session_cache();
+const std::string& _get_upgrade_socket();
+const int& _get_drain_timeout();
+const int& _get_file_cache_size();
+const std::vector<std::string>& _get_warmup();
+const std::string& _get_warmup_list();
+const int& _get_slow_request_ms();
+const LuaLimits& _get_lua_limits(const char* request_path);
+const std::shared_ptr<const ContentTypes>& _get_content_types();
+const std::shared_ptr<const AssetBundle>& _get_bundle();
 
 #define BIND_PORT _get_bind_port()
 #define SERVER_ROOT _get_server_root()
 // Deploy Mode: 0 Normal, 1 Rapid
-#define DEPLOY_MODE _get_deploy_mode()
\ No newline at end of file
+#define DEPLOY_MODE _get_deploy_mode()
+// Serve internal metrics at /__status. 0 Disabled, 1 Enabled
+#define STATUS_PAGE _get_status_page()
+// Entries per page of directory listings. 0 Disabled
+#define LISTING_PAGE_SIZE _get_listing_page_size()
+// Max number of directory listings kept in memory. 0 Disabled
+#define LISTING_CACHE _get_listing_cache()
+// Threads of the pool in normal deploy mode. 0 Number of hardware threads
+#define WORKER_THREADS _get_worker_threads()
+// CPUs to pin pool workers to, in worker order (wraps around). Empty: not pinned
+#define WORKER_CPUS _get_worker_cpus()
+// CPU to pin the rapid mode reactor to. -1: not pinned
+#define REACTOR_CPU _get_reactor_cpu()
+// Memory limit of helper.shared in KB.
+#define SHARED_DICT_SIZE _get_shared_dict_size()
+// Memory limit of cached Lua responses in KB. 0 Disabled
+#define OUTPUT_CACHE_SIZE _get_output_cache_size()
+// Bundle file made by pack.py to serve static files from. Empty: not used
+#define ASSET_BUNDLE _get_asset_bundle()
+// ASSET_BUNDLE as mapped when the settings were published. nullptr: not used
+#define BUNDLE _get_bundle()
+// Default timeout of helper.http calls in milliseconds.
+#define UPSTREAM_TIMEOUT _get_upstream_timeout()
+// Idle keep-alive connections kept for each upstream of helper.http. 0 Disabled
+#define UPSTREAM_KEEPALIVE _get_upstream_keepalive()
+// Max concurrent streams of an HTTP/2 connection in rapid deploy mode. 0 HTTP/2 Disabled
+#define H2_MAX_STREAMS _get_h2_max_streams()
+// HTTPS port in rapid deploy mode. 0 Disabled
+#define TLS_PORT _get_tls_port()
+// Certificate chain and private key (PEM files) of the HTTPS port.
+#define TLS_CERT _get_tls_cert()
+#define TLS_KEY _get_tls_key()
+// Max number of TLS sessions kept for resumption by session ID.
+#define TLS_SESSION_CACHE _get_tls_session_cache()
+// Unix socket a new process connects to, to take over the listening sockets in rapid deploy mode. Empty: not used
+#define UPGRADE_SOCKET _get_upgrade_socket()
+// Seconds to wait for connections to finish after the listening sockets are handed over.
+#define DRAIN_TIMEOUT _get_drain_timeout()
+// Memory limit of static files and compiled scripts kept in memory in KB. 0 Disabled
+#define FILE_CACHE_SIZE _get_file_cache_size()
+// Globs (relative to server root) of files loaded into the file cache before accepting.
+#define WARMUP _get_warmup()
+// File listing the hot paths of the last run. They are warmed up too. Empty: not used
+#define WARMUP_LIST _get_warmup_list()
+// Requests taking longer than this (milliseconds) are logged with their phases. 0 Disabled
+#define SLOW_REQUEST_MS _get_slow_request_ms()
+// Budgets of the script at request_path: those of the longest matching directory in lua_limits, or the global ones.
+#define LUA_LIMITS(request_path) _get_lua_limits(request_path)
+// Content types built from mime_types. nullptr before config.lua is read.
+#define CONTENT_TYPES _get_content_types()
@@ -0,0 +1,411 @@
+#include "control.h"
+#include "logging.h"
+#include <atomic>
+#include <thread>
+using namespace std;
+
+#ifdef _WIN32
+void ControlBlockSignals()
+{
+
+}
+
+int ControlStart(function<void()> on_reload, const string& upgrade_path, const vector<int>& ports)
+{
+	return -1;
+}
+
+bool ControlDraining()
+{
+	return false;
+}
+
+int UpgradeTakeover(const string& upgrade_path, const vector<int>& ports, vector<int>& fds)
+{
+	return -1;
+}
+
+int UpgradeAdopt(serversock& t, int fd)
+{
+	return -1;
+}
+
+void UpgradeReady()
+{
+
+}
+#else
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+	atomic<bool> draining(false);
+	// Connection to the old process, from UpgradeTakeover() to UpgradeReady().
+	int takeover_conn = -1;
+
+	const char TAKEOVER_REQUEST[] = "TAKEOVER";
+	const char READY_MESSAGE[] = "READY";
+	const int MAX_LISTENERS = 8;
+	// The old process gives up waiting for READY after this.
+	const int READY_TIMEOUT_MS = 60000;
+	const int IO_TIMEOUT_SEC = 5;
+
+	sigset_t control_signals()
+	{
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGHUP);
+		return mask;
+	}
+
+	int socket_port(int fd)
+	{
+		sockaddr_storage ss;
+		socklen_t len = sizeof(ss);
+		if (getsockname(fd, (sockaddr*)&ss, &len) != 0) return -1;
+		if (ss.ss_family == AF_INET) return ntohs(((sockaddr_in*)&ss)->sin_port);
+		if (ss.ss_family == AF_INET6) return ntohs(((sockaddr_in6*)&ss)->sin6_port);
+		return -1;
+	}
+
+	// GSock does not expose the fds of its sockets, so listening sockets are found by looking at all open fds.
+	vector<int> listening_fds()
+	{
+		vector<int> ans;
+		DIR* d = opendir("/proc/self/fd");
+		if (!d) return ans;
+		while (dirent* e = readdir(d))
+		{
+			if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+			int fd = atoi(e->d_name);
+			int value = 0;
+			socklen_t len = sizeof(value);
+			if (fd != dirfd(d) && getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &len) == 0 && value)
+			{
+				ans.push_back(fd);
+			}
+		}
+		closedir(d);
+		return ans;
+	}
+
+	int find_listener(int port)
+	{
+		for (int fd : listening_fds())
+		{
+			if (socket_port(fd) == port) return fd;
+		}
+		return -1;
+	}
+
+	bool make_address(const string& path, sockaddr_un& addr)
+	{
+		if (path.size() >= sizeof(addr.sun_path)) return false;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+		return true;
+	}
+
+	void set_io_timeout(int fd)
+	{
+		timeval tv = { IO_TIMEOUT_SEC, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+
+	// Old process: answers TAKEOVER with the ports it listens on, and the sockets in SCM_RIGHTS.
+	// Returns 0 if the sockets are sent.
+	int send_listeners(int conn, const vector<int>& ports)
+	{
+		char request[sizeof(TAKEOVER_REQUEST)] = { 0 };
+		ssize_t n = recv(conn, request, sizeof(request) - 1, MSG_WAITALL);
+		if (n != (ssize_t)sizeof(request) - 1 || memcmp(request, TAKEOVER_REQUEST, n) != 0)
+		{
+			logw("Invalid request on upgrade socket.\n");
+			return -1;
+		}
+
+		int32_t found_ports[MAX_LISTENERS];
+		int fds[MAX_LISTENERS];
+		int count = 0;
+		for (int port : ports)
+		{
+			int fd = find_listener(port);
+			if (fd >= 0 && count < MAX_LISTENERS)
+			{
+				found_ports[count] = port;
+				fds[count] = fd;
+				count++;
+			}
+		}
+		if (count == 0)
+		{
+			loge("No listening socket found to hand over.\n");
+			return -1;
+		}
+
+		iovec iov = { found_ports, count * sizeof(int32_t) };
+		char control[CMSG_SPACE(sizeof(fds))];
+		memset(control, 0, sizeof(control));
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+		if (sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t)iov.iov_len)
+		{
+			loge("Failed to send listening sockets. errno: %d\n", errno);
+			return -1;
+		}
+		logi("%d listening sockets handed to the new process. Waiting for it to get ready...\n", count);
+		return 0;
+	}
+
+	int open_upgrade_socket(const string& path)
+	{
+		sockaddr_un addr;
+		if (!make_address(path, addr))
+		{
+			loge("upgrade_socket path is too long: %s\n", path.c_str());
+			return -1;
+		}
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) return -1;
+		// A stale file from a dead process, or the one of the process being upgraded (it keeps its own socket open).
+		unlink(path.c_str());
+		if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, 4) != 0)
+		{
+			loge("Failed to listen on upgrade socket %s. errno: %d\n", path.c_str(), errno);
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	void control_loop(int sig_fd, int listen_fd, function<void()> on_reload, vector<int> ports)
+	{
+		typedef chrono::steady_clock Clock;
+		int conn = -1;
+		Clock::time_point ready_deadline;
+		while (true)
+		{
+			pollfd pfd[3];
+			int n = 0;
+			pfd[n++] = { sig_fd, POLLIN, 0 };
+			if (listen_fd >= 0 && conn < 0) pfd[n++] = { listen_fd, POLLIN, 0 };
+			if (conn >= 0) pfd[n++] = { conn, POLLIN, 0 };
+			int timeout = -1;
+			if (conn >= 0)
+			{
+				auto left = chrono::duration_cast<chrono::milliseconds>(ready_deadline - Clock::now()).count();
+				timeout = (int)max<long long>(left, 0);
+			}
+
+			int ret = poll(pfd, n, timeout);
+			if (ret < 0)
+			{
+				if (errno == EINTR) continue;
+				loge("Control thread poll error. errno: %d\n", errno);
+				return;
+			}
+
+			for (int i = 0; i < n; i++)
+			{
+				if (pfd[i].revents == 0) continue;
+				if (pfd[i].fd == sig_fd)
+				{
+					signalfd_siginfo info;
+					if (read(sig_fd, &info, sizeof(info)) == (ssize_t)sizeof(info))
+					{
+						logi("SIGHUP received. Reloading configure...\n");
+						on_reload();
+					}
+				}
+				else if (pfd[i].fd == listen_fd)
+				{
+					conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+					if (conn < 0) continue;
+					set_io_timeout(conn);
+					if (send_listeners(conn, ports) < 0)
+					{
+						close(conn);
+						conn = -1;
+					}
+					else
+					{
+						ready_deadline = Clock::now() + chrono::milliseconds(READY_TIMEOUT_MS);
+					}
+				}
+				else if (pfd[i].fd == conn)
+				{
+					char buff[sizeof(READY_MESSAGE)] = { 0 };
+					ssize_t len = recv(conn, buff, sizeof(buff) - 1, MSG_WAITALL);
+					close(conn);
+					conn = -1;
+					if (len != (ssize_t)sizeof(buff) - 1 || memcmp(buff, READY_MESSAGE, len) != 0)
+					{
+						logw("New process exited before it got ready. Upgrade aborted.\n");
+						continue;
+					}
+					// The upgrade socket belongs to the new process now.
+					close(listen_fd);
+					listen_fd = -1;
+					logi("New process is ready. Draining...\n");
+					draining = true;
+				}
+			}
+
+			if (conn >= 0 && Clock::now() >= ready_deadline)
+			{
+				logw("New process did not get ready in time. Upgrade aborted.\n");
+				close(conn);
+				conn = -1;
+			}
+		}
+	}
+}
+
+void ControlBlockSignals()
+{
+	sigset_t mask = control_signals();
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+}
+
+int ControlStart(function<void()> on_reload, const string& upgrade_path, const vector<int>& ports)
+{
+	sigset_t mask = control_signals();
+	int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (sig_fd < 0)
+	{
+		loge("Failed to create signalfd. errno: %d\n", errno);
+		return -1;
+	}
+
+	int listen_fd = -1;
+	if (!upgrade_path.empty())
+	{
+		listen_fd = open_upgrade_socket(upgrade_path);
+		if (listen_fd < 0)
+		{
+			close(sig_fd);
+			return -1;
+		}
+	}
+
+	thread(control_loop, sig_fd, listen_fd, std::move(on_reload), ports).detach();
+	return 0;
+}
+
+bool ControlDraining()
+{
+	return draining.load(memory_order_relaxed);
+}
+
+int UpgradeTakeover(const string& upgrade_path, const vector<int>& ports, vector<int>& fds)
+{
+	fds.assign(ports.size(), -1);
+	sockaddr_un addr;
+	if (!make_address(upgrade_path, addr)) return -1;
+	int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (conn < 0) return -1;
+	if (connect(conn, (sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		// Nobody there, or a file left by a dead process.
+		close(conn);
+		return -1;
+	}
+	set_io_timeout(conn);
+
+	int32_t got_ports[MAX_LISTENERS];
+	char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+	iovec iov = { got_ports, sizeof(got_ports) };
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t n = -1;
+	if (send(conn, TAKEOVER_REQUEST, sizeof(TAKEOVER_REQUEST) - 1, MSG_NOSIGNAL) == (ssize_t)sizeof(TAKEOVER_REQUEST) - 1)
+	{
+		n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	}
+	cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	{
+		loge("Failed to take over listening sockets from %s\n", upgrade_path.c_str());
+		close(conn);
+		return -2;
+	}
+
+	int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+	int port_count = (int)(n / sizeof(int32_t));
+	int got_fds[MAX_LISTENERS];
+	memcpy(got_fds, CMSG_DATA(cmsg), count * sizeof(int));
+	for (int i = 0; i < count; i++)
+	{
+		auto iter = i < port_count ? find(ports.begin(), ports.end(), got_ports[i]) : ports.end();
+		if (iter != ports.end())
+		{
+			fds[iter - ports.begin()] = got_fds[i];
+		}
+		else
+		{
+			close(got_fds[i]);
+		}
+	}
+	takeover_conn = conn;
+	return 0;
+}
+
+int UpgradeAdopt(serversock& t, int fd)
+{
+	// GSock cannot wrap an existing fd. So t makes a listening socket of its own (on any free port),
+	// which is then replaced by fd under the same number.
+	vector<int> before = listening_fds();
+	if (t.bind(0) < 0 || t.listen(1) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	for (int own : listening_fds())
+	{
+		if (find(before.begin(), before.end(), own) == before.end())
+		{
+			int ret = dup2(fd, own);
+			close(fd);
+			return ret < 0 ? -1 : 0;
+		}
+	}
+	close(fd);
+	return -1;
+}
+
+void UpgradeReady()
+{
+	if (takeover_conn < 0) return;
+	send(takeover_conn, READY_MESSAGE, sizeof(READY_MESSAGE) - 1, MSG_NOSIGNAL);
+	close(takeover_conn);
+	takeover_conn = -1;
+}
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+#include "GSock/gsock.h"
+
+// Controls the running server from outside: config.lua is reloaded on SIGHUP, and a new binary
+// can take over without dropping connections.
+//
+// Binary upgrade (rapid deploy mode): a new process started with the same upgrade_socket connects to
+// the running one and gets its listening sockets through SCM_RIGHTS. Once the new process is ready,
+// the old one stops accepting, finishes its connections and exits.
+
+// Blocks SIGHUP in the calling thread. Call this first in main(), so threads started later
+// inherit the mask and only the control thread picks the signal up.
+void ControlBlockSignals();
+
+// Starts the control thread. on_reload is called on it for each SIGHUP.
+// If upgrade_path is not empty, the sockets listening on ports are handed to a new process that asks for them there.
+// Returns:
+// 0 Success
+// -1 Failed to start. (Or not supported on this platform)
+int ControlStart(std::function<void()> on_reload, const std::string& upgrade_path, const std::vector<int>& ports);
+
+// True once the listening sockets are handed to a new process. The server should stop accepting and drain.
+bool ControlDraining();
+
+// Asks the process serving at upgrade_path for its listening sockets.
+// fds[i] is the socket listening on ports[i], or -1 if the old process does not listen there.
+// Returns:
+// 0 Success. UpgradeReady() must be called once this process is about to serve.
+// -1 No process is running there.
+// -2 Handoff failed.
+int UpgradeTakeover(const std::string& upgrade_path, const std::vector<int>& ports, std::vector<int>& fds);
+
+// Makes t use fd, a listening socket from UpgradeTakeover().
+// Returns:
+// 0 Success
+// -1 Failed. fd is closed.
+int UpgradeAdopt(serversock& t, int fd);
+
+// Tells the old process that this one serves now.
+void UpgradeReady();
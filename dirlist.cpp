@@ -0,0 +1,288 @@
+#include "dirlist.h"
+#include "dirop.h"
+#include "util.h"
+#include "config.h"
+#include "logging.h"
+#include "metrics.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+namespace
+{
+	// Identifies a version of a directory. Adding, removing or renaming an entry updates the mtime.
+	struct DirStamp
+	{
+		time_t sec;
+		long nsec;
+		ino_t ino;
+
+		bool operator == (const DirStamp& s) const
+		{
+			return sec == s.sec && nsec == s.nsec && ino == s.ino;
+		}
+	};
+
+	int get_dir_stamp(const string& real_dir, DirStamp& out_stamp)
+	{
+		struct stat st;
+		if (stat(real_dir.c_str(), &st) != 0) return -1;
+		out_stamp.sec = st.st_mtime;
+#ifdef _WIN32
+		out_stamp.nsec = 0;
+#else
+		out_stamp.nsec = st.st_mtim.tv_nsec;
+#endif
+		out_stamp.ino = st.st_ino;
+		return 0;
+	}
+
+	// Entries are rendered once as <li> items, and pages are put together from them.
+	struct Listing
+	{
+		DirStamp stamp;
+		string items;
+		// Item i is items[offsets[i], offsets[i+1])
+		vector<uint32_t> offsets;
+		// Name i is names[name_offsets[i], name_offsets[i+1])
+		string names;
+		vector<uint32_t> name_offsets;
+
+		size_t count() const
+		{
+			return offsets.size() - 1;
+		}
+
+		// Item indexes ordered by name. Sorted on first use.
+		const vector<uint32_t>& get_by_name() const
+		{
+			call_once(sorted, [this]() {
+				by_name.resize(count());
+				for (size_t i = 0; i < by_name.size(); i++) by_name[i] = (uint32_t)i;
+				sort(by_name.begin(), by_name.end(), [this](uint32_t a, uint32_t b) {
+					size_t alen = name_offsets[a + 1] - name_offsets[a];
+					size_t blen = name_offsets[b + 1] - name_offsets[b];
+					int ret = memcmp(names.data() + name_offsets[a], names.data() + name_offsets[b], min(alen, blen));
+					return ret != 0 ? ret < 0 : alen < blen;
+				});
+			});
+			return by_name;
+		}
+	private:
+		mutable once_flag sorted;
+		mutable vector<uint32_t> by_name;
+	};
+
+	struct CacheSlot
+	{
+		shared_ptr<const Listing> listing;
+		unsigned long long last_used;
+	};
+
+	struct ListingCache
+	{
+		mutex lock;
+		unordered_map<string, CacheSlot> mp;
+		unsigned long long tick = 0;
+	};
+
+	ListingCache& cache()
+	{
+		static ListingCache c;
+		return c;
+	}
+
+	void append_html_escaped(string& out, const char* s, size_t len)
+	{
+		for (size_t i = 0; i < len; i++)
+		{
+			switch (s[i])
+			{
+			case '&': out.append("&amp;"); break;
+			case '<': out.append("&lt;"); break;
+			case '>': out.append("&gt;"); break;
+			case '"': out.append("&quot;"); break;
+			case '\'': out.append("&#39;"); break;
+			default: out.push_back(s[i]);
+			}
+		}
+	}
+
+	// Returns nullptr if the directory cannot be opened.
+	shared_ptr<Listing> build_listing(const string& real_dir, const DirStamp& stamp)
+	{
+		DirWalk w(real_dir);
+		auto p = make_shared<Listing>();
+		p->stamp = stamp;
+
+		string filename;
+		string href;
+		int is_dir;
+		int ret;
+		while ((ret = w.next(filename, is_dir)) > 0)
+		{
+			urlencode(filename, href);
+			p->offsets.push_back((uint32_t)p->items.size());
+			p->name_offsets.push_back((uint32_t)p->names.size());
+			p->names.append(filename);
+			p->items.append("<li><a href=\"").append(href);
+			if (is_dir) p->items.push_back('/');
+			p->items.append("\">");
+			append_html_escaped(p->items, filename.data(), filename.size());
+			if (is_dir) p->items.push_back('/');
+			p->items.append("</a></li>");
+		}
+		if (ret < 0) return nullptr;
+		p->offsets.push_back((uint32_t)p->items.size());
+		p->name_offsets.push_back((uint32_t)p->names.size());
+		return p;
+	}
+
+	shared_ptr<const Listing> get_listing(const ArenaString& request_path)
+	{
+		static int cache_id = metrics_register_cache("dirlist");
+
+		string real_dir = SERVER_ROOT;
+		real_dir.append(request_path.data(), request_path.size());
+
+		// Taken before reading the directory, so changes made while it is read cause a rebuild next time.
+		DirStamp stamp;
+		if (get_dir_stamp(real_dir, stamp) < 0) return nullptr;
+
+		ListingCache& c = cache();
+		string key(request_path.data(), request_path.size());
+		if (LISTING_CACHE > 0)
+		{
+			unique_lock<mutex> ulk(c.lock);
+			auto iter = c.mp.find(key);
+			if (iter != c.mp.end() && iter->second.listing->stamp == stamp)
+			{
+				iter->second.last_used = ++c.tick;
+				metrics_on_cache(cache_id, true);
+				return iter->second.listing;
+			}
+		}
+		metrics_on_cache(cache_id, false);
+
+		logd("Building listing of directory: %s\n", real_dir.c_str());
+		shared_ptr<const Listing> p = build_listing(real_dir, stamp);
+		if (!p || LISTING_CACHE <= 0) return p;
+
+		unique_lock<mutex> ulk(c.lock);
+		auto iter = c.mp.find(key);
+		if (iter == c.mp.end() && c.mp.size() >= (size_t)LISTING_CACHE)
+		{
+			// Evict the least recently used one. The cache is small, so a scan is fine.
+			auto victim = c.mp.begin();
+			for (auto it = c.mp.begin(); it != c.mp.end(); ++it)
+			{
+				if (it->second.last_used < victim->second.last_used) victim = it;
+			}
+			c.mp.erase(victim);
+		}
+		CacheSlot& slot = c.mp[key];
+		slot.listing = p;
+		slot.last_used = ++c.tick;
+		return p;
+	}
+
+	const ArenaString* find_param(const ParamList& url_param, const char* name)
+	{
+		for (const auto& pr : url_param)
+		{
+			if (pr.first == name) return &pr.second;
+		}
+		return nullptr;
+	}
+
+	void append_page_link(string& out, const char* text, size_t page, bool by_name, bool desc)
+	{
+		out.append("<a href=\"?page=").append(to_string(page));
+		if (by_name) out.append("&amp;sort=name");
+		if (desc) out.append("&amp;order=desc");
+		out.append("\">").append(text).append("</a> ");
+	}
+}
+
+int GetDirectoryListing(const ArenaString& request_path, const ParamList& url_param, string& out_html)
+{
+	shared_ptr<const Listing> p = get_listing(request_path);
+	if (!p) return -1;
+
+	const ArenaString* sort_param = find_param(url_param, "sort");
+	const ArenaString* order_param = find_param(url_param, "order");
+	const ArenaString* page_param = find_param(url_param, "page");
+	bool by_name = sort_param && *sort_param == "name";
+	bool desc = order_param && *order_param == "desc";
+
+	size_t n = p->count();
+	size_t begin = 0;
+	size_t end = n;
+	size_t page = 1;
+	size_t pages = 1;
+	if (LISTING_PAGE_SIZE > 0 && n > (size_t)LISTING_PAGE_SIZE)
+	{
+		size_t page_size = LISTING_PAGE_SIZE;
+		pages = (n + page_size - 1) / page_size;
+		if (page_param)
+		{
+			long v = strtol(page_param->c_str(), nullptr, 10);
+			if (v > 0) page = (size_t)v;
+		}
+		if (page > pages) page = pages;
+		begin = (page - 1) * page_size;
+		end = min(n, begin + page_size);
+	}
+
+	string ans;
+	size_t items_len = n ? p->items.size() / n * (end - begin) : 0;
+	ans.reserve(request_path.size() * 2 + items_len + 256);
+	ans.append("<html><head><title>Index of ");
+	append_html_escaped(ans, request_path.data(), request_path.size());
+	ans.append("</title></head><body><h1>Index of ");
+	append_html_escaped(ans, request_path.data(), request_path.size());
+	ans.append("</h1><ul>");
+
+	if (!by_name && !desc && begin == 0 && end == n)
+	{
+		ans.append(p->items);
+	}
+	else
+	{
+		const vector<uint32_t>* order = by_name ? &p->get_by_name() : nullptr;
+		for (size_t i = begin; i < end; i++)
+		{
+			size_t k = desc ? n - 1 - i : i;
+			if (order) k = (*order)[k];
+			ans.append(p->items, p->offsets[k], p->offsets[k + 1] - p->offsets[k]);
+		}
+	}
+	ans.append("</ul>");
+
+	if (pages > 1)
+	{
+		ans.append("<p>");
+		if (page > 1) append_page_link(ans, "Prev", page - 1, by_name, desc);
+		ans.append("Page ").append(to_string(page)).append(" of ").append(to_string(pages)).append(" ");
+		if (page < pages) append_page_link(ans, "Next", page + 1, by_name, desc);
+		ans.append("</p>");
+	}
+	ans.append("</body></html>");
+
+	out_html = std::move(ans);
+	return 0;
+}
+
+void ClearDirectoryListings()
+{
+	ListingCache& c = cache();
+	lock_guard<mutex> lg(c.lock);
+	c.mp.clear();
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+#include "arena.h"
+
+// Generates the index page of a directory.
+// request_path is url decoded and ends with '/'.
+// url_param may contain:
+//   sort=name     Sort entries by name. Otherwise they are listed in directory order.
+//   order=desc    Reverse the order.
+//   page=N        Page number (from 1), if LISTING_PAGE_SIZE is set.
+// Listings are cached per directory and rebuilt when the modification time of the directory changes.
+// Returns:
+// 0 Listing is written to out_html.
+// -1 Directory cannot be opened.
+int GetDirectoryListing(const ArenaString& request_path, const ParamList& url_param, std::string& out_html);
+
+// Drops all cached listings. Called when config.lua is reloaded, since server_root or the page size may have changed.
+void ClearDirectoryListings();
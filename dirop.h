@@ -9,6 +9,7 @@ public:
 	~DirWalk();
 
 	void walk(const std::string& dirname);
+	// Returns 1 if an entry is read, 0 at the end, -1 if the directory cannot be read.
 	int next(std::string& filename,int& is_dir);
 private:
     struct _impl;
@@ -2,7 +2,7 @@
 #include "dirop.h"
 #include <dirent.h>
 #include <cstring>
-#include "log.h"
+#include "logging.h"
 using namespace std;
 
 struct DirWalk::_impl
@@ -37,32 +37,29 @@ void DirWalk::walk(const string& path)
 
 int DirWalk::next(string& filename,int& is_dir)
 {
-        struct dirent* file=NULL;
-        file=readdir(_p->dir);
-        if(file==NULL)
+        if(_p->dir==NULL)
         {
-                return 0;
+                return -1;
         }
-        if(file->d_type==DT_DIR)
+        struct dirent* file=NULL;
+        while((file=readdir(_p->dir))!=NULL)
         {
-                if(strcmp(file->d_name,".")==0 || strcmp(file->d_name,"..")==0)
+                if(file->d_type==DT_DIR)
                 {
-                        return next(filename,is_dir);
+                        if(strcmp(file->d_name,".")==0 || strcmp(file->d_name,"..")==0)
+                        {
+                                continue;
+                        }
+                        is_dir=1;
                 }
-                filename=file->d_name;
-                is_dir=1;
-
-		logd("NextDir: %s\n",filename.c_str());
-                return 1;
-        }
-        else
-        {
-                filename=file->d_name;
-                is_dir=0;
-
-		logd("NextFile: %s\n",filename.c_str());
+                else
+                {
+                        is_dir=0;
+                }
+                filename.assign(file->d_name);
                 return 1;
         }
+        return 0;
 }
 
 #endif // End of ifndef _WIN32
@@ -0,0 +1,213 @@
+#include "fastscan.h"
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FASTSCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(FASTSCAN_SSE2) && defined(__GNUC__)
+#define FASTSCAN_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+	inline int lowest_bit(unsigned int mask)
+	{
+#ifdef _MSC_VER
+		unsigned long idx;
+		_BitScanForward(&idx, mask);
+		return (int)idx;
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+	// Scalar version: the pattern must match at offsets [0,N) of pat.
+	template<int N>
+	size_t scalar_find(const char* data, size_t len, size_t from, const char* pat)
+	{
+		if (len < (size_t)N) return string::npos;
+		size_t i = from;
+		while (i + N <= len)
+		{
+			const char* p = (const char*)memchr(data + i, pat[0], len - N + 1 - i);
+			if (!p) break;
+			i = p - data;
+			if (memcmp(p, pat, N) == 0) return i;
+			i++;
+		}
+		return string::npos;
+	}
+
+#ifndef FASTSCAN_SSE2
+	size_t scalar_header_end(const char* data, size_t len)
+	{
+		return scalar_find<4>(data, len, 0, "\r\n\r\n");
+	}
+
+	size_t scalar_crlf(const char* data, size_t len)
+	{
+		return scalar_find<2>(data, len, 0, "\r\n");
+	}
+
+	size_t scalar_byte(const char* data, size_t len, char c)
+	{
+		const void* p = memchr(data, c, len);
+		return p ? (const char*)p - data : string::npos;
+	}
+#endif
+
+#ifdef FASTSCAN_SSE2
+	// Compare the first and the last byte of the pattern over a whole block,
+	// then verify every candidate. Candidates are rare in HTTP text, so this is mostly a pure vector loop.
+	template<int N>
+	size_t sse2_find(const char* data, size_t len, const char* pat)
+	{
+		size_t i = 0;
+		if (len >= 32 + N - 1)
+		{
+			const __m128i first = _mm_set1_epi8(pat[0]);
+			const __m128i last = _mm_set1_epi8(pat[N - 1]);
+			for (; i + 32 + N - 1 <= len; i += 32)
+			{
+				const char* p = data + i;
+				__m128i a0 = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), first),
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + N - 1)), last));
+				__m128i a1 = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), first),
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 16 + N - 1)), last));
+				unsigned int mask = (unsigned int)_mm_movemask_epi8(a0) | ((unsigned int)_mm_movemask_epi8(a1) << 16);
+				while (mask)
+				{
+					int bit = lowest_bit(mask);
+					if (N <= 2 || memcmp(p + bit + 1, pat + 1, N - 2) == 0) return i + bit;
+					mask &= mask - 1;
+				}
+			}
+		}
+		return scalar_find<N>(data, len, i, pat);
+	}
+
+	size_t sse2_header_end(const char* data, size_t len)
+	{
+		return sse2_find<4>(data, len, "\r\n\r\n");
+	}
+
+	size_t sse2_crlf(const char* data, size_t len)
+	{
+		return sse2_find<2>(data, len, "\r\n");
+	}
+
+	size_t sse2_byte(const char* data, size_t len, char c)
+	{
+		return sse2_find<1>(data, len, &c);
+	}
+#endif
+
+#ifdef FASTSCAN_AVX2
+	template<int N>
+	__attribute__((target("avx2")))
+	size_t avx2_find(const char* data, size_t len, const char* pat)
+	{
+		size_t i = 0;
+		if (len >= 64 + N - 1)
+		{
+			const __m256i first = _mm256_set1_epi8(pat[0]);
+			const __m256i last = _mm256_set1_epi8(pat[N - 1]);
+			for (; i + 64 + N - 1 <= len; i += 64)
+			{
+				const char* p = data + i;
+				__m256i a0 = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), first),
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + N - 1)), last));
+				__m256i a1 = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), first),
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32 + N - 1)), last));
+				unsigned long long mask = (unsigned int)_mm256_movemask_epi8(a0) | ((unsigned long long)(unsigned int)_mm256_movemask_epi8(a1) << 32);
+				while (mask)
+				{
+					int bit = __builtin_ctzll(mask);
+					if (N <= 2 || memcmp(p + bit + 1, pat + 1, N - 2) == 0) return i + bit;
+					mask &= mask - 1;
+				}
+			}
+		}
+		return scalar_find<N>(data, len, i, pat);
+	}
+
+	__attribute__((target("avx2")))
+	size_t avx2_header_end(const char* data, size_t len)
+	{
+		return avx2_find<4>(data, len, "\r\n\r\n");
+	}
+
+	__attribute__((target("avx2")))
+	size_t avx2_crlf(const char* data, size_t len)
+	{
+		return avx2_find<2>(data, len, "\r\n");
+	}
+
+	__attribute__((target("avx2")))
+	size_t avx2_byte(const char* data, size_t len, char c)
+	{
+		return avx2_find<1>(data, len, &c);
+	}
+#endif
+
+	struct ScanKernels
+	{
+		size_t(*header_end)(const char*, size_t);
+		size_t(*crlf)(const char*, size_t);
+		size_t(*byte)(const char*, size_t, char);
+		const char* name;
+	};
+
+	ScanKernels select_kernels()
+	{
+#ifdef FASTSCAN_AVX2
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			return ScanKernels{ avx2_header_end, avx2_crlf, avx2_byte, "avx2" };
+		}
+#endif
+#ifdef FASTSCAN_SSE2
+		return ScanKernels{ sse2_header_end, sse2_crlf, sse2_byte, "sse2" };
+#else
+		return ScanKernels{ scalar_header_end, scalar_crlf, scalar_byte, "scalar" };
+#endif
+	}
+
+	// Selected once, on first use.
+	const ScanKernels& kernels()
+	{
+		static const ScanKernels k = select_kernels();
+		return k;
+	}
+}
+
+size_t scan_header_end(const char* data, size_t len)
+{
+	return kernels().header_end(data, len);
+}
+
+size_t scan_crlf(const char* data, size_t len)
+{
+	return kernels().crlf(data, len);
+}
+
+size_t scan_byte(const char* data, size_t len, char c)
+{
+	return kernels().byte(data, len, c);
+}
+
+const char* scan_kernel_name()
+{
+	return kernels().name;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+
+// Byte scanning kernels used on hot paths (header parsing, url decoding).
+// SSE2 or AVX2 is selected at runtime on x86. Other platforms use the scalar version.
+// All functions return the offset from data, or std::string::npos (size_t(-1)) if not found.
+
+// Position of the first "\r\n\r\n".
+size_t scan_header_end(const char* data, size_t len);
+
+// Position of the first "\r\n".
+size_t scan_crlf(const char* data, size_t len);
+
+// Position of the first c.
+size_t scan_byte(const char* data, size_t len, char c);
+
+// Name of the selected kernel set ("avx2", "sse2" or "scalar")
+const char* scan_kernel_name();
@@ -0,0 +1,501 @@
+#include "filecache.h"
+#include "config.h"
+#include "util.h"
+#include "logging.h"
+#include "metrics.h"
+#include "bundle.h"
+#include "mime.h"
+#include "response.h"
+#include "LuaSrc/include/lua.hpp"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#ifndef _WIN32
+#include <glob.h>
+#endif
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int SHARD_COUNT = 16;
+// Rough cost of an entry besides its key and content.
+static const size_t ENTRY_OVERHEAD = 128;
+// A cached file is trusted this long before it is checked again.
+static const chrono::milliseconds REVALIDATE_INTERVAL(1000);
+
+namespace
+{
+	// Identifies a version of a file.
+	struct FileStamp
+	{
+		off_t size;
+		time_t sec;
+		long nsec;
+
+		bool operator == (const FileStamp& s) const
+		{
+			return size == s.size && sec == s.sec && nsec == s.nsec;
+		}
+	};
+
+	FileStamp make_stamp(const struct stat& st)
+	{
+		FileStamp stamp;
+		stamp.size = st.st_size;
+		stamp.sec = st.st_mtime;
+#ifdef _WIN32
+		stamp.nsec = 0;
+#else
+		stamp.nsec = st.st_mtim.tv_nsec;
+#endif
+		return stamp;
+	}
+
+	struct Entry
+	{
+		// Shared with lookups, so content is used without holding the lock.
+		shared_ptr<const string> content;
+		// Static files only.
+		shared_ptr<const FileCacheHeader> header;
+		bool script;
+		FileStamp stamp;
+		Clock::time_point checked;
+		// Requests served from this entry. Files loaded by warm-up and never used are left out of the hot list.
+		unsigned hits;
+		size_t cost;
+		// Position in Shard::lru
+		list<const string*>::iterator lru_pos;
+	};
+
+	struct Shard
+	{
+		mutex lock;
+		// Key: request path
+		unordered_map<string, Entry> entries;
+		// Keys of entries, most recently used first.
+		list<const string*> lru;
+		size_t used = 0;
+
+		void erase(unordered_map<string, Entry>::iterator iter);
+		void hit(Entry& e);
+	};
+
+	Shard shards[SHARD_COUNT];
+
+	int cache_id()
+	{
+		static int id = metrics_register_cache("file");
+		return id;
+	}
+
+	void Shard::erase(unordered_map<string, Entry>::iterator iter)
+	{
+		used -= iter->second.cost;
+		lru.erase(iter->second.lru_pos);
+		entries.erase(iter);
+	}
+
+	void Shard::hit(Entry& e)
+	{
+		e.hits++;
+		lru.splice(lru.begin(), lru, e.lru_pos);
+		metrics_on_cache(cache_id(), true);
+	}
+
+	// FNV-1a
+	Shard& get_shard(const char* path, size_t len)
+	{
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < len; i++)
+		{
+			h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+		}
+		return shards[h % SHARD_COUNT];
+	}
+
+	size_t shard_limit()
+	{
+		return (size_t)FILE_CACHE_SIZE * 1024 / SHARD_COUNT;
+	}
+
+	// Reads the whole file. The size is taken from the opened file, so a file replaced meanwhile is not cut short.
+	int read_file(const string& realpath, string& out, FileStamp& out_stamp)
+	{
+		FILE* fp = fopen(realpath.c_str(), "rb");
+		if (!fp) return -1;
+		struct stat st;
+		if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+		{
+			fclose(fp);
+			return -1;
+		}
+		out_stamp = make_stamp(st);
+		out.resize(st.st_size);
+		size_t n = st.st_size > 0 ? fread(&out[0], 1, out.size(), fp) : 0;
+		fclose(fp);
+		return n == out.size() ? 0 : -1;
+	}
+
+	int write_chunk(lua_State*, const void* p, size_t sz, void* ud)
+	{
+		((string*)ud)->append((const char*)p, sz);
+		return 0;
+	}
+
+	// Returns false if source does not compile.
+	bool compile(const string& source, string& out_chunk)
+	{
+		lua_State* L = luaL_newstate();
+		if (!L) return false;
+		// Same chunk name as LuaTask::start(), so error messages read the same.
+		bool ok = luaL_loadbuffer(L, source.data(), source.size(), "LuaVM") == LUA_OK &&
+			lua_dump(L, write_chunk, &out_chunk, 0) == 0;
+		lua_close(L);
+		return ok;
+	}
+
+	// Everything but Date, Server and Connection, so a hit does not format or look up anything.
+	shared_ptr<const FileCacheHeader> make_header(const string& request_path, const FileStamp& stamp)
+	{
+		static const string default_type = "text/plain";
+		const string* content_type = FindContentType(request_path.data(), request_path.size());
+		char buff[128];
+		auto h = make_shared<FileCacheHeader>();
+		snprintf(buff, sizeof(buff), "\"%llx-%llx\"",
+			(unsigned long long)stamp.sec * 1000000000ULL + stamp.nsec, (unsigned long long)stamp.size);
+		h->etag = buff;
+
+		string& b = h->block;
+		b.append("HTTP/1.1 200 OK\r\nContent-Type: ");
+		b.append(content_type ? *content_type : default_type);
+		b.append("\r\nContent-Length: ");
+		b.append(to_string((long long)stamp.size));
+		b.append("\r\nAccept-Ranges: bytes\r\nETag: ");
+		b.append(h->etag);
+		b.append("\r\nLast-Modified: ");
+		b.append(buff, FormatHttpDate(stamp.sec, buff, sizeof(buff)));
+		b.append("\r\n");
+		return h;
+	}
+
+	void insert(Shard& s, const string& key, shared_ptr<const string> content, shared_ptr<const FileCacheHeader> header,
+		bool script, const FileStamp& stamp, Clock::time_point now, bool used)
+	{
+		size_t cost = ENTRY_OVERHEAD + key.size() * 2 + content->size() + (header ? header->block.size() : 0);
+		size_t limit = shard_limit();
+		if (cost > limit) return;
+
+		lock_guard<mutex> lg(s.lock);
+		unsigned hits = 0;
+		auto iter = s.entries.find(key);
+		if (iter != s.entries.end())
+		{
+			// Changed on disk. It keeps its place in the hot list.
+			hits = iter->second.hits;
+			s.erase(iter);
+		}
+		iter = s.entries.emplace(key, Entry()).first;
+		Entry& e = iter->second;
+		e.content = std::move(content);
+		e.header = std::move(header);
+		e.script = script;
+		e.stamp = stamp;
+		e.checked = now;
+		e.hits = hits + (used ? 1 : 0);
+		e.cost = cost;
+		s.lru.push_front(&iter->first);
+		e.lru_pos = s.lru.begin();
+		s.used += cost;
+
+		while (s.used > limit && s.lru.back() != &iter->first)
+		{
+			s.erase(s.entries.find(*s.lru.back()));
+		}
+	}
+
+	// used is false for warm-up, which is neither a hit nor a miss.
+	// Returns:
+	// 0 out is filled, from the cache or just loaded into it.
+	// 1 Not cached: the cache is off or the file is too large. out is untouched.
+	// -1 The file cannot be read.
+	int lookup(const char* request_path, bool script, bool used, shared_ptr<const string>& out,
+		shared_ptr<const FileCacheHeader>* out_header = nullptr)
+	{
+		if (FILE_CACHE_SIZE <= 0) return 1;
+		size_t len = strlen(request_path);
+		Shard& s = get_shard(request_path, len);
+		thread_local string key;
+		key.assign(request_path, len);
+		Clock::time_point now = Clock::now();
+
+		bool found = false;
+		FileStamp cached_stamp;
+		{
+			lock_guard<mutex> lg(s.lock);
+			auto iter = s.entries.find(key);
+			if (iter != s.entries.end() && iter->second.script == script)
+			{
+				Entry& e = iter->second;
+				if (now - e.checked < REVALIDATE_INTERVAL)
+				{
+					if (used) s.hit(e);
+					out = e.content;
+					if (out_header) *out_header = e.header;
+					return 0;
+				}
+				found = true;
+				cached_stamp = e.stamp;
+			}
+		}
+
+		string realpath = SERVER_ROOT;
+		realpath.append(request_path);
+		struct stat st;
+		if (stat(realpath.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+		{
+			if (found)
+			{
+				lock_guard<mutex> lg(s.lock);
+				auto iter = s.entries.find(key);
+				if (iter != s.entries.end()) s.erase(iter);
+			}
+			return -1;
+		}
+
+		if (found && make_stamp(st) == cached_stamp)
+		{
+			lock_guard<mutex> lg(s.lock);
+			auto iter = s.entries.find(key);
+			if (iter != s.entries.end() && iter->second.script == script && iter->second.stamp == cached_stamp)
+			{
+				Entry& e = iter->second;
+				e.checked = now;
+				if (used) s.hit(e);
+				out = e.content;
+				if (out_header) *out_header = e.header;
+				return 0;
+			}
+		}
+
+		if (used) metrics_on_cache(cache_id(), false);
+		// Checked before reading, so large files are never read in whole just to be dropped.
+		if (ENTRY_OVERHEAD + len * 2 + (size_t)st.st_size > shard_limit()) return 1;
+
+		string content;
+		FileStamp stamp;
+		if (read_file(realpath, content, stamp) < 0) return -1;
+		if (script)
+		{
+			string chunk;
+			if (compile(content, chunk))
+			{
+				content.swap(chunk);
+			}
+		}
+		auto p = make_shared<const string>(std::move(content));
+		shared_ptr<const FileCacheHeader> header;
+		if (!script) header = make_header(key, stamp);
+		insert(s, key, p, header, script, stamp, now, used);
+		out = std::move(p);
+		if (out_header) *out_header = std::move(header);
+		return 0;
+	}
+
+	// Adds the request paths of files matching pattern.
+	template<typename Func>
+	void expand_pattern(const string& pattern, Func add)
+	{
+		string path = pattern;
+		if (path.empty() || path[0] != '/') path.insert(0, "/");
+#ifdef _WIN32
+		if (path.find_first_of("*?[") != string::npos)
+		{
+			logw("Warm-up pattern %s is skipped. Wildcards are not supported on this platform.\n", pattern.c_str());
+			return;
+		}
+		add(path);
+#else
+		const string& root = SERVER_ROOT;
+		glob_t g;
+		int ret = glob((root + path).c_str(), 0, nullptr, &g);
+		if (ret == 0)
+		{
+			for (size_t i = 0; i < g.gl_pathc; i++)
+			{
+				const char* found = g.gl_pathv[i];
+				if (strncmp(found, root.c_str(), root.size()) == 0)
+				{
+					add(string(found + root.size()));
+				}
+			}
+		}
+		else if (ret == GLOB_NOMATCH)
+		{
+			logw("Warm-up pattern %s matches no file.\n", pattern.c_str());
+		}
+		globfree(&g);
+#endif
+	}
+}
+
+int FileCacheGet(const char* request_path, shared_ptr<const string>& out, shared_ptr<const FileCacheHeader>* header)
+{
+	return lookup(request_path, false, true, out, header) == 0 ? 0 : -1;
+}
+
+int FileCacheGetScript(const char* request_path, shared_ptr<const string>& out)
+{
+	int ret = lookup(request_path, true, true, out);
+	if (ret == 1)
+	{
+		string source;
+		if (GetFileContent(request_path, source) < 0) return -1;
+		out = make_shared<const string>(std::move(source));
+		return 0;
+	}
+	return ret;
+}
+
+void FileCacheClear()
+{
+	for (auto& s : shards)
+	{
+		lock_guard<mutex> lg(s.lock);
+		s.entries.clear();
+		s.lru.clear();
+		s.used = 0;
+	}
+}
+
+int FileCacheWarmup(const vector<string>& patterns, const string& hot_list, int threads)
+{
+	if (FILE_CACHE_SIZE <= 0)
+	{
+		logw("file_cache_size is 0. Warm-up is skipped.\n");
+		return 0;
+	}
+
+	vector<string> paths;
+	unordered_set<string> seen;
+	auto add = [&](string path) {
+		// Files in the bundle never reach the file cache.
+		if (!BundleHas(path) && seen.insert(path).second)
+		{
+			paths.push_back(std::move(path));
+		}
+	};
+
+	// Hot files of the last run go first. They are the ones worth having if the cache turns out too small.
+	if (!hot_list.empty())
+	{
+		FILE* fp = fopen(hot_list.c_str(), "r");
+		if (fp)
+		{
+			char line[4096];
+			while (fgets(line, sizeof(line), fp))
+			{
+				size_t len = strcspn(line, "\r\n");
+				if (len > 0 && line[0] == '/') add(string(line, len));
+			}
+			fclose(fp);
+		}
+		else
+		{
+			logi("Hot list %s not found. It is written on reload and on exit.\n", hot_list.c_str());
+		}
+	}
+	for (const auto& pattern : patterns)
+	{
+		expand_pattern(pattern, add);
+	}
+	if (paths.empty()) return 0;
+
+	if (threads <= 0) threads = (int)thread::hardware_concurrency();
+	if (threads <= 0) threads = 1;
+	if ((size_t)threads > paths.size()) threads = (int)paths.size();
+
+	logi("Warming up %d files on %d threads...\n", (int)paths.size(), threads);
+	Clock::time_point start = Clock::now();
+	atomic<size_t> next(0);
+	atomic<int> loaded(0);
+	atomic<size_t> bytes(0);
+	vector<thread> workers;
+	for (int i = 0; i < threads; i++)
+	{
+		workers.emplace_back([&]() {
+			size_t idx;
+			while ((idx = next++) < paths.size())
+			{
+				const string& path = paths[idx];
+				bool script = endwith(path, ".lua");
+				shared_ptr<const string> content;
+				if (lookup(path.c_str(), script, false, content) == 0)
+				{
+					loaded++;
+					bytes += content->size();
+				}
+				else
+				{
+					logd("Warm-up skipped %s\n", path.c_str());
+				}
+			}
+		});
+	}
+	for (auto& t : workers)
+	{
+		t.join();
+	}
+	long long ms = chrono::duration_cast<chrono::milliseconds>(Clock::now() - start).count();
+	logi("Warm-up done: %d files, %d KB in %lld ms.\n", loaded.load(), (int)(bytes.load() / 1024), ms);
+	return loaded;
+}
+
+int FileCacheSaveHotList(const string& filename)
+{
+	vector<pair<unsigned, string>> used;
+	for (auto& s : shards)
+	{
+		lock_guard<mutex> lg(s.lock);
+		for (const auto& pr : s.entries)
+		{
+			if (pr.second.hits > 0) used.emplace_back(pr.second.hits, pr.first);
+		}
+	}
+	sort(used.begin(), used.end(), [](const pair<unsigned, string>& a, const pair<unsigned, string>& b) {
+		return a.first > b.first;
+	});
+
+	// Written aside and renamed, so a process starting meanwhile never reads half a list.
+	string temp = filename + ".tmp";
+	FILE* fp = fopen(temp.c_str(), "w");
+	if (!fp)
+	{
+		loge("Failed to write hot list %s\n", temp.c_str());
+		return -1;
+	}
+	for (const auto& pr : used)
+	{
+		fprintf(fp, "%s\n", pr.second.c_str());
+	}
+	bool ok = fclose(fp) == 0;
+#ifdef _WIN32
+	remove(filename.c_str());
+#endif
+	if (!ok || rename(temp.c_str(), filename.c_str()) != 0)
+	{
+		loge("Failed to write hot list %s\n", filename.c_str());
+		remove(temp.c_str());
+		return -1;
+	}
+	logi("Hot list saved to %s with %d files.\n", filename.c_str(), (int)used.size());
+	return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+// Files under SERVER_ROOT kept in memory: contents of static files, and Lua scripts compiled to binary chunks,
+// so hot paths skip fopen/fread and the Lua parser. A cached file is checked against its size and mtime
+// at most once a second. The memory used is capped by FILE_CACHE_SIZE. Least recently used files are dropped first.
+// The cache can be filled before the server starts accepting, see FileCacheWarmup().
+
+// Response header of a cached static file, built when the file is loaded.
+struct FileCacheHeader
+{
+	// Status line of a 200 response and the headers that only depend on the file:
+	// Content-Type, Content-Length, Accept-Ranges, ETag and Last-Modified. Every line ends with CRLF.
+	// See Response::setPrepared()
+	std::string block;
+	// Quoted, as it is sent.
+	std::string etag;
+};
+
+// request_path is relative to SERVER_ROOT.
+// If header is not nullptr, it is set to the response header of the file.
+// Returns:
+// 0 out holds the content of the file.
+// -1 The file is not cached (cannot be read, too large, or the cache is off).
+int FileCacheGet(const char* request_path, std::shared_ptr<const std::string>& out,
+	std::shared_ptr<const FileCacheHeader>* header = nullptr);
+
+// Same as FileCacheGet, but out holds a binary chunk that luaL_loadbuffer() takes like the source.
+// Scripts that do not compile are kept as source, so the error is reported when they run.
+// Files that are not cached are read as they are.
+// Returns:
+// 0 Success
+// -1 The script cannot be read.
+int FileCacheGetScript(const char* request_path, std::shared_ptr<const std::string>& out);
+
+// Drops all cached files. Called when config.lua is reloaded, since server_root may have changed.
+void FileCacheClear();
+
+// Loads files into the cache on up to threads threads, and returns when all are loaded.
+// patterns are globs relative to SERVER_ROOT, like "/js/*.js". Paths ending with .lua are compiled.
+// hot_list is a file written by FileCacheSaveHotList(). It is skipped if empty or missing.
+// Returns the number of files loaded.
+int FileCacheWarmup(const std::vector<std::string>& patterns, const std::string& hot_list, int threads);
+
+// Writes the paths of cached files that were used, most used first, so the next run can warm them up.
+// Returns:
+// 0 Success
+// -1 The file cannot be written.
+int FileCacheSaveHotList(const std::string& filename);
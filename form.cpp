@@ -0,0 +1,291 @@
+#include "form.h"
+#include "util.h"
+#include "fastscan.h"
+#include "logging.h"
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+using namespace std;
+
+// File parts saved for one request. Each one is a temporary file, so a body of many tiny parts is refused past this.
+static const size_t FORM_FILE_LIMIT = 64;
+
+// Case-insensitive. Returns the length of prefix if str starts with it, 0 otherwise.
+static size_t starts_with(const char* str, size_t len, const char* prefix)
+{
+	size_t n = strlen(prefix);
+	if (len < n) return 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		if (tolower((unsigned char)str[i]) != prefix[i]) return 0;
+	}
+	return n;
+}
+
+// Position of the first ';' in [value+i, value+len) outside of quoted strings, or len.
+static size_t next_separator(const char* value, size_t len, size_t i)
+{
+	bool quoted = false;
+	for (; i < len; i++)
+	{
+		char c = value[i];
+		if (quoted)
+		{
+			if (c == '\\') i++;
+			else if (c == '"') quoted = false;
+		}
+		else if (c == '"')
+		{
+			quoted = true;
+		}
+		else if (c == ';')
+		{
+			return i;
+		}
+	}
+	return len;
+}
+
+// Finds a parameter of a header value, like boundary in "multipart/form-data; boundary=xyz"
+// or filename in "form-data; name=\"a\"; filename=\"b.txt\"". Quotes are removed.
+// Quoted values are skipped while looking for the parameter, so a filename like "x; name=y" is only a filename.
+// name is in lower case. Returns false if there is no such parameter.
+static bool find_param(const char* value, size_t len, const char* name, string& out)
+{
+	size_t i = 0;
+	while (i < len)
+	{
+		i = next_separator(value, len, i);
+		if (i == len) return false;
+		i++;
+		while (i < len && (value[i] == ' ' || value[i] == '\t')) i++;
+
+		size_t name_len = starts_with(value + i, len - i, name);
+		if (name_len == 0 || i + name_len >= len || value[i + name_len] != '=') continue;
+		i += name_len + 1;
+
+		out.clear();
+		if (i < len && value[i] == '"')
+		{
+			for (i++; i < len && value[i] != '"'; i++)
+			{
+				if (value[i] == '\\' && i + 1 < len) i++;
+				out.push_back(value[i]);
+			}
+		}
+		else
+		{
+			for (; i < len && value[i] != ';' && value[i] != ' ' && value[i] != '\t'; i++)
+			{
+				out.push_back(value[i]);
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+// Position of "\r\n" + delim in [data+from, data+len).
+// The delimiter must be followed by "--", CRLF or white space, so a longer line starting with it is content.
+static size_t find_delimiter(const char* data, size_t len, size_t from, const string& delim)
+{
+	while (from < len)
+	{
+		size_t pos = scan_byte(data + from, len - from, '\r');
+		if (pos == string::npos) return string::npos;
+		pos += from;
+		size_t end = pos + 2 + delim.size();
+		if (end + 2 > len) return string::npos;
+		if (data[pos + 1] == '\n' && memcmp(data + pos + 2, delim.data(), delim.size()) == 0)
+		{
+			char c = data[end];
+			if ((c == '-' && data[end + 1] == '-') || (c == '\r' && data[end + 1] == '\n') || c == ' ' || c == '\t') return pos;
+		}
+		from = pos + 1;
+	}
+	return string::npos;
+}
+
+// Writes [data, data+len) to a new temporary file.
+// Returns:
+// 0 Success
+// -1 The file cannot be created or written.
+static int save_temp(const char* data, size_t len, string& out_path)
+{
+#ifdef _WIN32
+	char* name = _tempnam(nullptr, "naive");
+	if (!name) return -1;
+	out_path = name;
+	free(name);
+	FILE* fp = fopen(out_path.c_str(), "wb");
+	if (!fp) return -1;
+#else
+	const char* dir = getenv("TMPDIR");
+	out_path = dir && *dir ? dir : "/tmp";
+	out_path.append("/naive-upload-XXXXXX");
+	int fd = mkstemp(&out_path[0]);
+	if (fd < 0) return -1;
+	FILE* fp = fdopen(fd, "wb");
+	if (!fp)
+	{
+		close(fd);
+		remove(out_path.c_str());
+		return -1;
+	}
+#endif
+	size_t n = len > 0 ? fwrite(data, 1, len, fp) : 0;
+	if (fclose(fp) != 0 || n != len)
+	{
+		remove(out_path.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+FormData::FormData()
+{
+}
+
+FormData::~FormData()
+{
+	for (const auto& f : files)
+	{
+		// Fails harmlessly if the script has moved it away.
+		remove(f.path.c_str());
+	}
+}
+
+int FormData::parse(const char* content_type, const char* body, size_t len)
+{
+	if (!content_type) return 0;
+	size_t type_len = strlen(content_type);
+	if (starts_with(content_type, type_len, "application/x-www-form-urlencoded"))
+	{
+		return parse_urlencoded(body, len, fields);
+	}
+	if (!starts_with(content_type, type_len, "multipart/form-data"))
+	{
+		return 0;
+	}
+
+	string delim;
+	if (!find_param(content_type, type_len, "boundary", delim) || delim.empty())
+	{
+		logd("FormData: No boundary in %s\n", content_type);
+		return -1;
+	}
+	delim.insert(0, "--");
+
+	// The first delimiter may follow a preamble.
+	size_t pos;
+	if (len >= delim.size() && memcmp(body, delim.data(), delim.size()) == 0)
+	{
+		pos = 0;
+	}
+	else
+	{
+		pos = find_delimiter(body, len, 0, delim);
+		if (pos == string::npos) return -1;
+		pos += 2;
+	}
+
+	string name, filename;
+	ParamNames names;
+	while (true)
+	{
+		pos += delim.size();
+		if (pos + 2 > len) return -1;
+		if (body[pos] == '-' && body[pos + 1] == '-')
+		{
+			// Close delimiter
+			return 0;
+		}
+		size_t line_end = scan_crlf(body + pos, len - pos);
+		if (line_end == string::npos) return -1;
+		pos += line_end + 2;
+
+		// Part headers. A part without headers starts with the empty line right away.
+		size_t content_begin;
+		if (pos + 2 <= len && body[pos] == '\r' && body[pos + 1] == '\n')
+		{
+			content_begin = pos + 2;
+		}
+		else
+		{
+			size_t header_end = scan_header_end(body + pos, len - pos);
+			if (header_end == string::npos) return -1;
+			content_begin = pos + header_end + 4;
+		}
+		size_t next = find_delimiter(body, len, content_begin, delim);
+		if (next == string::npos) return -1;
+
+		bool has_name = false, is_file = false;
+		string part_type;
+		while (pos + 2 < content_begin)
+		{
+			size_t eol = pos + scan_crlf(body + pos, content_begin - pos);
+			const char* line = body + pos;
+			size_t line_len = eol - pos;
+			size_t n;
+			if ((n = starts_with(line, line_len, "content-disposition:")) != 0)
+			{
+				has_name = find_param(line + n, line_len - n, "name", name);
+				is_file = find_param(line + n, line_len - n, "filename", filename);
+			}
+			else if ((n = starts_with(line, line_len, "content-type:")) != 0)
+			{
+				while (n < line_len && line[n] == ' ') n++;
+				part_type.assign(line + n, line_len - n);
+			}
+			pos = eol + 2;
+		}
+
+		const char* content = body + content_begin;
+		size_t content_len = next - content_begin;
+		if (!has_name)
+		{
+			logd("FormData: Part without a name is skipped.\n");
+		}
+		else if (is_file)
+		{
+			// An empty file input is sent as a part with an empty filename and no content.
+			if (!filename.empty() || content_len > 0)
+			{
+				if (files.size() >= FORM_FILE_LIMIT)
+				{
+					logw("FormData: More than %d files. The rest are not saved.\n", (int)FORM_FILE_LIMIT);
+					return -1;
+				}
+				FormFile f;
+				if (save_temp(content, content_len, f.path) < 0)
+				{
+					loge("FormData: Failed to save uploaded file %s\n", filename.c_str());
+					return -1;
+				}
+				f.name = name;
+				f.filename = filename;
+				f.content_type = part_type.empty() ? "application/octet-stream" : part_type;
+				f.size = content_len;
+				files.push_back(std::move(f));
+			}
+		}
+		else
+		{
+			if (fields.size() >= PARAM_LIMIT)
+			{
+				logw("FormData: More than %d fields. The rest are ignored.\n", (int)PARAM_LIMIT);
+				return -1;
+			}
+			if (names.add(fields, name.data(), name.size()))
+			{
+				ArenaAllocator<char> alloc = fields.get_allocator();
+				fields.emplace_back(ArenaString(name.data(), name.size(), alloc), ArenaString(content, content_len, alloc));
+			}
+		}
+		pos = next + 2;
+	}
+}
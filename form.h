@@ -0,0 +1,41 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "arena.h"
+
+// A file part of a multipart/form-data body. The content is saved to a temporary file.
+struct FormFile
+{
+	// Name of the form field.
+	std::string name;
+	// As sent by the client. May be empty.
+	std::string filename;
+	std::string content_type;
+	// Temporary file holding the content. Removed when the FormData is destroyed, unless it has been moved away.
+	std::string path;
+	size_t size;
+};
+
+// Fields and files of a POST body.
+class FormData
+{
+public:
+	FormData();
+	/// NonMoveable,NonCopyable
+	FormData(const FormData&) = delete;
+	FormData& operator = (const FormData&) = delete;
+	~FormData();
+
+	// content_type is the Content-Type of the request (may be nullptr).
+	// application/x-www-form-urlencoded and multipart/form-data are parsed. Other bodies leave both lists empty.
+	// Returns:
+	// 0 Success
+	// -1 The body is malformed, a file part cannot be saved, or there are more file parts (64) or fields (PARAM_LIMIT)
+	//    than allowed. Parts before the error are kept.
+	int parse(const char* content_type, const char* body, size_t len);
+
+	// The first value of a name wins, as in url parameters.
+	ParamList fields;
+	// In the order of the body.
+	std::vector<FormFile> files;
+};
@@ -1,50 +1,43 @@
 #include "get.h"
-#include "vmop.h"
+#include "luatask.h"
+#include "outputcache.h"
 #include "request.h"
 #include "response.h"
 #include "util.h"
 #include "config.h"
-#include "log.h"
-#include "dirop.h"
-#include <cstring>
+#include "logging.h"
+#include "dirlist.h"
+#include "metrics.h"
+#include "mime.h"
+#include "bundle.h"
+#include "filecache.h"
 using namespace std;
 
+// Unknown types are served as plain text.
+static const string& GetContentTypeOrDefault(const ArenaString& path)
+{
+	static const string default_type = "text/plain";
+	const string* p = FindContentType(path.data(), path.size());
+	return p ? *p : default_type;
+}
+
 static int request_handler_get_dynamic(const Request& req,Response& res,
-	const string& path_decoded, const map<string,string>& url_param)
+	const ArenaString& path_decoded)
 {
 	logd("Loading lua file: %s\n", path_decoded.c_str());
 
-	string lua_code;
-	int ret = GetFileContent(path_decoded, lua_code);
+	shared_ptr<const string> lua_code;
+	int ret = FileCacheGetScript(path_decoded.c_str(), lua_code);
+	req.mark(Phase::Read);
 	if (ret < 0)
 	{
 		return -1;
 	}
 
-	VM v;
-	auto L = v.get();
-	lua_newtable(L);
-	lua_pushstring(L, req.http_version.c_str());
-	lua_setfield(L, 1, "http_version"); // request["http_version"]=...
-
-	lua_pushstring(L, "GET");
-	lua_setfield(L, 1, "method"); // request["method"]="GET"
-
-	for (const auto& pr : req.header)
-	{
-		lua_pushstring(L, pr.second.c_str());
-		lua_setfield(L, 1, pr.first.c_str()); // request[...]=...
-	}
-
-	// Parameter table
-	lua_newtable(L);
-	for (const auto& pr : url_param)
-	{
-		lua_pushstring(L, pr.second.c_str());
-		lua_setfield(L, 2, pr.first.c_str()); // request["param"][...]=...
-	}
-	lua_setfield(L, 1, "param");
-
+	LuaTask* task = new LuaTask;
+	task->set_limits(LUA_LIMITS(path_decoded.c_str()));
+	auto L = task->get();
+	push_request_table(L, req);
 	lua_setglobal(L, "request");
 
 	// Lua CGI program should fill the response table.
@@ -52,130 +45,61 @@ static int request_handler_get_dynamic(const Request& req,Response& res,
 	lua_newtable(L);
 	lua_setglobal(L, "response");
 
-	logd("Preparing helper...\n");
-
-	if (v.runCode("helper={} helper.print=function(...) local t=table.pack(...) "s +
-		"if(response.output==nil) then response.output='' end " +
-		"local temp='' " +
-		"for i,v in ipairs(t) do " +
-		"if(#(temp)>0) then temp = temp .. '\\t' end " +
-		"temp = temp .. tostring(v) " +
-		"end " +
-		"response.output = response.output .. temp .. '\\n' " +
-		"end ") < 0)
-	{
-		loge("Failed to prepare helper.\n");
-		return -2;
-	}
-
 	logd("Executing lua file: %s\n", path_decoded.c_str());
-	if (v.runCode(lua_code) < 0)
-	{
-		loge("Failed to run user lua code.\n");
-		return -3;
-	}
-
-	logd("Execution finished successfully.\n");
-
-	v.getglobal("response");
-
-	if (!lua_istable(L, -1)) // type(response)~="table"
-	{
-		logd("LuaVM: variable 'response' is not a table.\n");
-		return -4;
-	}
-
-	v.pushnil();
-
-	while (lua_next(L, -2))
-	{
-		if (lua_isstring(L, -2))  // type(key)=="string"
-		{
-			const char* item_name = lua_tostring(L, -2);
-			const char* item_value = lua_tostring(L, -1);
-
-			if ((!item_name) || (!item_value))
-			{
-				logd("LuaVM: An item cannot be converted to string. Key: %s\n", item_name);
-			}
-			else
-			{
-				if (strcmp(item_name, "output") != 0)
-				{
-					res.set_raw(item_name, item_value);
-				}
-				else
-				{
-					res.setContentRaw(item_value);
-				}
-			}
-		}
-		lua_pop(L, 1);
-	}
-
-	res.set_code(200);
-	return 0;
+	return run_request_script(task, *lua_code, req, res);
 }
 
-int request_handler_get(const Request& req, Response& res)
+// path is url decoded.
+// Returns:
+// 0 res is filled.
+// 1 Target not found. res is filled with 404.
+// REQUEST_PENDING A script finishes res later.
+static int request_handler_get_path(const Request& req, Response& res, ArenaString& path, const ParamList& url_param)
 {
-	// URL decoded path
-	string path;
-	map<string, string> url_param;
-	if (urldecode(req.path, path, url_param) < 0)
-	{
-		loge("Failed to decode url : %s\n", req.path.c_str());
-		return -1;
-	}
-
 	// Request to / would be dispatched to /index.html or /index.lua
-	if (endwith(path, "/"))
+	if (!path.empty() && path.back() == '/')
 	{
-		Request xreq = req;
-		xreq.path += "index.html";
-		if (request_handler_get(xreq, res) > 0)
+		size_t dir_len = path.size();
+		path.append("index.html");
+		int ret = request_handler_get_path(req, res, path, url_param);
+		path.resize(dir_len);
+		if (ret == 1)
 		{
-			Request yreq = req;
-			yreq.path += "index.lua";
-			if (request_handler_get(yreq, res) > 0)
+			path.append("index.lua");
+			ret = request_handler_get_path(req, res, path, url_param);
+			path.resize(dir_len);
+			if (ret == 1)
 			{
 				// Display a list
+				metrics_set_route(RouteType::Listing);
 				string ans;
-
-				ans.append("<html><head><title>Index of " + path + "</title></head><body><h1>Index of " + path + "</h1><ul>");
-				string real_dir = SERVER_ROOT + path;
-				logd("About to list Directory: %s\n", real_dir.c_str());
-				DirWalk w(real_dir);
-				logd("DirWalk Created.\n");
-				string filename;
-				int is_dir;
-				while (w.next(filename, is_dir) > 0)
+				int ret = GetDirectoryListing(path, url_param, ans);
+				req.mark(Phase::Read);
+				if (ret < 0)
 				{
-					string realname;
-					urlencode(filename, realname);
-
-					ans.append("<li><a href='" + realname);
-					if (is_dir)
-					{
-						ans.append("/");
-					}
-					ans.append("'>" + filename);
-					if (is_dir)
-					{
-						ans.append("/");
-					}
-					ans.append("</a></li>");
+					res.set_code(404);
+					return 1;
 				}
-				ans.append("</ul></body></html>");
-
 				res.set_code(200);
-				res.setContent(ans);
+				res.setContent(std::move(ans), "text/html");
+			}
+			else if (ret == REQUEST_PENDING)
+			{
+				return REQUEST_PENDING;
 			}
 		}
 		return 0;
 	}
 
-	int request_type = get_request_path_type(path);
+	if (BundleServe(req, res, path) == 0)
+	{
+		req.mark(Phase::Read);
+		metrics_set_route(RouteType::Static);
+		return 0;
+	}
+
+	int request_type = get_request_path_type(path.c_str());
+	req.mark(Phase::Route);
 	if (request_type < 0)
 	{
 		// Invalid request (File not found)
@@ -186,56 +110,86 @@ int request_handler_get(const Request& req, Response& res)
 	{
 		// Static Target
 		// Just read out and send it.
+		metrics_set_route(RouteType::Static);
+		// Hot files are served from memory. Others are read as they are requested.
+		shared_ptr<const string> cached;
+		shared_ptr<const FileCacheHeader> cached_header;
 		int content_length;
-		if (GetFileLength(path, content_length) < 0)
+		if (FileCacheGet(path.c_str(), cached, &cached_header) == 0)
+		{
+			content_length = (int)cached->size();
+		}
+		else if (GetFileLength(path.c_str(), content_length) < 0)
 		{
 			// File not readable.
 			res.set_code(500);
 			return 0;
 		}
+		req.mark(Phase::Read);
+
+		if (cached_header)
+		{
+			const char* if_none_match = req.header.get(HeaderId::IfNoneMatch);
+			if (if_none_match && etag_matches(if_none_match, cached_header->etag.data(), cached_header->etag.size()))
+			{
+				res.set_code(304);
+				res.set_raw("ETag", cached_header->etag);
+				return 0;
+			}
+		}
 
 		// Requesting partial content?
-		auto range_iter = req.header.find("Range");
-		if (range_iter != req.header.end())
+		const char* range = req.header.get(HeaderId::Range);
+		if (range)
 		{
 			int beginat, length;
-			// FIXME: Why mp["Range"] cause compile error?
-			if (parse_range_request(range_iter->second, content_length, beginat, length) < 0)
+			if (parse_range_request(range, content_length, beginat, length) < 0)
 			{
 				res.set_code(416);
 				return 0;
 			}
 
 			logd("Range Request: begin: %d, length: %d\n", beginat, length);
-			string content_type;
-			if (GetFileContentType(path, content_type) < 0) content_type = "text/plain";
+			const string& content_type = GetContentTypeOrDefault(path);
 
 			if (length != content_length)
 			{
 				// partial content
 				string content;
-				if (GetFileContentEx(path, beginat, length, content) < 0)
+				if (cached)
+				{
+					content.assign(*cached, beginat, length);
+				}
+				else if (GetFileContentEx(path.c_str(), beginat, length, content) < 0)
 				{
 					/// Error while reading file.
 					res.set_code(500);
 					return 0;
 				}
+				req.mark(Phase::Read);
 				
 				res.set_code(206);
-				res.setContent(content, content_type);
+				res.setContent(std::move(content), content_type);
+			}
+			else if (cached_header)
+			{
+				// full content, same as without Range.
+				res.setPrepared(200, shared_ptr<const string>(cached_header, &cached_header->block), cached);
+				return 0;
 			}
 			else
 			{
 				// full content
 				string content;
-				if (GetFileContent(path, content) < 0)
+				if (GetFileContent(path.c_str(), content) < 0)
 				{
 					/// Error while reading file.
 					res.set_code(500);
 					return 0;
 				}
+				req.mark(Phase::Read);
 				res.set_code(200);
-				res.setContent(content, content_type);
+				res.setContent(std::move(content), content_type);
 			}
 
 			char content_range_buff[64] = { 0 };
@@ -245,22 +199,28 @@ int request_handler_get(const Request& req, Response& res)
 			res.set_raw("Accept-Ranges", "bytes");
 			return 0;
 		}
+		else if (cached_header)
+		{
+			// The header was made when the file was cached. Only Date and Connection are added when it is sent.
+			res.setPrepared(200, shared_ptr<const string>(cached_header, &cached_header->block), cached);
+			return 0;
+		}
 		else
 		{
 			// Just a normal request without Range in request header.
-			string content_type;
-			if (GetFileContentType(path, content_type) < 0) content_type = "text/plain";
+			const string& content_type = GetContentTypeOrDefault(path);
 
 			string content;
-			if (GetFileContent(path, content) < 0)
+			if (GetFileContent(path.c_str(), content) < 0)
 			{
 				/// Error while reading file.
 				res.set_code(500);
 				return 0;
 			}
+			req.mark(Phase::Read);
 			res.set_code(200);
 			res.set_raw("Accept-Ranges", "bytes");
-			res.setContent(content, content_type);
+			res.setContent(std::move(content), content_type);
 
 			return 0;
 		}
@@ -268,10 +228,34 @@ int request_handler_get(const Request& req, Response& res)
 	else
 	{
 		// Dynamic Target
-		if (request_handler_get_dynamic(req, res, path, url_param) < 0)
+		metrics_set_route(RouteType::Dynamic);
+		int ret = request_handler_get_dynamic(req, res, path);
+		if (ret < 0)
 		{
 			res.set_code(500);
 		}
+		return ret == REQUEST_PENDING ? REQUEST_PENDING : 0;
+	}
+}
+
+int request_handler_get(const Request& req, Response& res)
+{
+	// URL decoded path
+	ArenaString path(ArenaAllocator<char>(req.arena()));
+	ParamList url_param(ArenaAllocator<ParamList::value_type>(req.arena()));
+	if (urldecode(req.path.data(), req.path.size(), path, url_param) < 0)
+	{
+		loge("Failed to decode url : %s\n", req.path.c_str());
+		return -1;
+	}
+
+	if (OutputCacheLookup(path, url_param, req, res) == 0)
+	{
+		req.mark(Phase::Read);
+		metrics_set_route(RouteType::Dynamic);
 		return 0;
 	}
+	req.mark(Phase::Route);
+
+	return request_handler_get_path(req, res, path, url_param);
 }
\ No newline at end of file
@@ -0,0 +1,920 @@
+#include "h2.h"
+#include "hpack.h"
+#include "black_magic.h"
+#include "config.h"
+#include "logging.h"
+#include "metrics.h"
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+namespace
+{
+	enum FrameType : uint8_t
+	{
+		FRAME_DATA = 0,
+		FRAME_HEADERS = 1,
+		FRAME_PRIORITY = 2,
+		FRAME_RST_STREAM = 3,
+		FRAME_SETTINGS = 4,
+		FRAME_PUSH_PROMISE = 5,
+		FRAME_PING = 6,
+		FRAME_GOAWAY = 7,
+		FRAME_WINDOW_UPDATE = 8,
+		FRAME_CONTINUATION = 9
+	};
+
+	const uint8_t FLAG_END_STREAM = 0x1;
+	const uint8_t FLAG_ACK = 0x1;
+	const uint8_t FLAG_END_HEADERS = 0x4;
+	const uint8_t FLAG_PADDED = 0x8;
+	const uint8_t FLAG_PRIORITY = 0x20;
+
+	enum ErrorCode : uint32_t
+	{
+		NO_ERROR = 0,
+		PROTOCOL_ERROR = 1,
+		INTERNAL_ERROR = 2,
+		FLOW_CONTROL_ERROR = 3,
+		STREAM_CLOSED = 5,
+		FRAME_SIZE_ERROR = 6,
+		REFUSED_STREAM = 7,
+		COMPRESSION_ERROR = 9,
+		ENHANCE_YOUR_CALM = 11
+	};
+
+	enum SettingId : uint16_t
+	{
+		SETTINGS_HEADER_TABLE_SIZE = 1,
+		SETTINGS_ENABLE_PUSH = 2,
+		SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+		SETTINGS_INITIAL_WINDOW_SIZE = 4,
+		SETTINGS_MAX_FRAME_SIZE = 5,
+		SETTINGS_MAX_HEADER_LIST_SIZE = 6
+	};
+
+	const size_t FRAME_HEADER_SIZE = 9;
+	const int64_t MAX_WINDOW = 0x7FFFFFFF;
+	const uint32_t DEFAULT_WINDOW = 65535;
+	// Receive window of the connection and of each stream. Consumed data is acknowledged once half of it is used.
+	const int64_t RECV_WINDOW = 1 << 20;
+	// Largest frame we accept. This is the protocol default, so it is not in our SETTINGS.
+	const uint32_t MAX_RECV_FRAME = 16384;
+	const size_t MAX_HEADER_BLOCK = 64 * 1024;
+	// Decoded size of a request's fields (name + value + 32 each, RFC 9113 6.5.2), sent as SETTINGS_MAX_HEADER_LIST_SIZE.
+	// A short indexed field can stand for a large table entry, so MAX_HEADER_BLOCK does not bound this.
+	// Fields past it are dropped and the request is answered with 431. Far past it, the peer is cut off.
+	const size_t MAX_HEADER_LIST = 64 * 1024;
+	const size_t MAX_HEADER_LIST_ABUSE = 16 * MAX_HEADER_LIST;
+	// DATA frames are produced until this much output is waiting.
+	const size_t OUTPUT_HIGH_WATER = 256 * 1024;
+
+	uint32_t read_u32(const unsigned char* p)
+	{
+		return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+	}
+
+	void put_u32(string& out, uint32_t v)
+	{
+		char b[4] = { (char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v };
+		out.append(b, 4);
+	}
+
+	void put_frame_header(string& out, size_t len, uint8_t type, uint8_t flags, uint32_t stream_id)
+	{
+		char b[FRAME_HEADER_SIZE] = { (char)(len >> 16), (char)(len >> 8), (char)len, (char)type, (char)flags,
+			(char)(stream_id >> 24), (char)(stream_id >> 16), (char)(stream_id >> 8), (char)stream_id };
+		out.append(b, FRAME_HEADER_SIZE);
+	}
+
+	// HTTP2-Settings is base64url without padding.
+	bool base64url_decode(const char* s, string& out)
+	{
+		unsigned int acc = 0;
+		int bits = 0;
+		for (; *s; s++)
+		{
+			int v;
+			char c = *s;
+			if (c >= 'A' && c <= 'Z') v = c - 'A';
+			else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+			else if (c >= '0' && c <= '9') v = c - '0' + 52;
+			else if (c == '-' || c == '+') v = 62;
+			else if (c == '_' || c == '/') v = 63;
+			else if (c == '=') break;
+			else return false;
+			acc = (acc << 6) | v;
+			bits += 6;
+			if (bits >= 8)
+			{
+				bits -= 8;
+				out.push_back((char)(acc >> bits));
+			}
+		}
+		return true;
+	}
+
+	// Streams finished by the script loop, picked up by collect() on the reactor.
+	struct FinishedQueue
+	{
+		mutex lock;
+		vector<uint32_t> ids;
+		bool notified = false;
+		function<void()> notify;
+
+		void push(uint32_t id)
+		{
+			// notify is called under the lock, so once collect() has taken every id,
+			// no notification for this session can still be on its way.
+			lock_guard<mutex> lg(lock);
+			ids.push_back(id);
+			if (!notified)
+			{
+				notified = true;
+				notify();
+			}
+		}
+	};
+
+	enum class StreamState
+	{
+		// Headers received, waiting for the rest of the request body.
+		Receiving,
+		// request_handler returned REQUEST_PENDING.
+		Waiting,
+		// Response headers are sent, the body is not sent completely.
+		Sending
+	};
+
+	struct Stream : public RequestCompletion
+	{
+		// Owns all memory of this stream's request. Declared first so it is released last.
+		ArenaLease lease;
+		Request req;
+		Response res;
+		FinishedQueue* queue;
+		uint32_t id;
+		StreamState state;
+		// RST_STREAM arrived while its script was running.
+		bool reset;
+		int64_t send_window;
+		int64_t recv_consumed;
+		size_t data_sent;
+		chrono::steady_clock::time_point start_time;
+		// From the end of the request header block until the last frame of the response is queued.
+		RequestTiming timing;
+
+		Stream(FinishedQueue* q, uint32_t stream_id, int64_t window) : req(lease.get()), res(lease.get())
+		{
+			queue = q;
+			id = stream_id;
+			state = StreamState::Receiving;
+			reset = false;
+			send_window = window;
+			recv_consumed = 0;
+			data_sent = 0;
+			req.completion = this;
+			req.timing = &timing;
+			req.config = ConfigCurrent();
+			timing.start();
+		}
+
+		void complete() override
+		{
+			queue->push(id);
+		}
+	};
+
+	bool equal_nocase(const char* a, const char* b, size_t len)
+	{
+		for (size_t i = 0; i < len; i++)
+		{
+			if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+		}
+		return true;
+	}
+
+	// Connection-specific fields are not allowed in HTTP/2.
+	bool is_connection_header(HeaderId id)
+	{
+		return id == HeaderId::Connection || id == HeaderId::TransferEncoding || id == HeaderId::Upgrade;
+	}
+
+	// Values that differ on almost every response would only push useful entries out of the HPACK table.
+	bool is_volatile_header(HeaderId id)
+	{
+		return id == HeaderId::ContentLength || id == HeaderId::ContentRange || id == HeaderId::ETag ||
+			id == HeaderId::LastModified || id == HeaderId::SetCookie || id == HeaderId::Location;
+	}
+}
+
+struct H2Session::_impl
+{
+	FinishedQueue finished;
+	HpackDecoder decoder;
+	HpackEncoder encoder;
+	unordered_map<uint32_t, unique_ptr<Stream>> streams;
+	// Streams in Sending state, served round robin.
+	vector<uint32_t> sending;
+
+	// Input that does not make up a whole frame yet.
+	string in;
+	size_t preface_left = H2_PREFACE_LEN;
+	string out;
+	size_t out_sent = 0;
+
+	// Highest stream id opened by the client.
+	uint32_t last_stream = 0;
+	// Stream of a header block continued in CONTINUATION frames. 0 if none.
+	uint32_t header_stream = 0;
+	uint8_t header_flags = 0;
+	string header_block;
+
+	int64_t send_window = DEFAULT_WINDOW;
+	int64_t recv_window = DEFAULT_WINDOW;
+	int64_t recv_consumed = 0;
+	int64_t peer_initial_window = DEFAULT_WINDOW;
+	uint32_t peer_max_frame = 16384;
+
+	int pending = 0;
+	bool goaway = false;
+
+	void send_settings()
+	{
+		const uint16_t ids[] = { SETTINGS_MAX_CONCURRENT_STREAMS, SETTINGS_INITIAL_WINDOW_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE };
+		const uint32_t values[] = { (uint32_t)H2_MAX_STREAMS, (uint32_t)RECV_WINDOW, (uint32_t)MAX_HEADER_LIST };
+		put_frame_header(out, 6 * 3, FRAME_SETTINGS, 0, 0);
+		for (int i = 0; i < 3; i++)
+		{
+			out.push_back((char)(ids[i] >> 8));
+			out.push_back((char)ids[i]);
+			put_u32(out, values[i]);
+		}
+		// The connection window is not changed by SETTINGS.
+		send_window_update(0, RECV_WINDOW - DEFAULT_WINDOW);
+		recv_window = RECV_WINDOW;
+	}
+
+	void send_window_update(uint32_t stream_id, int64_t increment)
+	{
+		put_frame_header(out, 4, FRAME_WINDOW_UPDATE, 0, stream_id);
+		put_u32(out, (uint32_t)increment);
+	}
+
+	void send_rst(uint32_t stream_id, uint32_t code)
+	{
+		put_frame_header(out, 4, FRAME_RST_STREAM, 0, stream_id);
+		put_u32(out, code);
+	}
+
+	void send_goaway(uint32_t code)
+	{
+		put_frame_header(out, 8, FRAME_GOAWAY, 0, 0);
+		put_u32(out, last_stream);
+		put_u32(out, code);
+		goaway = true;
+	}
+
+	int connection_error(uint32_t code)
+	{
+		logd("h2 connection error %u\n", code);
+		send_goaway(code);
+		return -1;
+	}
+
+	void close_stream(uint32_t stream_id)
+	{
+		streams.erase(stream_id);
+		for (size_t i = 0; i < sending.size(); i++)
+		{
+			if (sending[i] == stream_id)
+			{
+				sending.erase(sending.begin() + i);
+				break;
+			}
+		}
+	}
+
+	void stream_error(Stream* st, uint32_t code)
+	{
+		send_rst(st->id, code);
+		if (st->state == StreamState::Waiting) st->reset = true;
+		else close_stream(st->id);
+	}
+
+	// The last frame of the response is in out.
+	void on_sent(Stream* st)
+	{
+		st->timing.mark(Phase::Send);
+		metrics_on_timing(st->req, st->res, st->timing);
+	}
+
+	void send_headers(Stream* st)
+	{
+		Response& res = st->res;
+		res.finish_headers();
+		string block;
+		encoder.begin(block);
+		encoder.encode_status(res.get_code() ? res.get_code() : 500, block);
+		const string* prepared = res.get_prepared();
+		if (prepared)
+		{
+			// "Name: value" lines after the status line.
+			size_t pos = prepared->find("\r\n");
+			while (pos != string::npos && pos + 2 < prepared->size())
+			{
+				size_t begin = pos + 2;
+				pos = prepared->find("\r\n", begin);
+				size_t colon = prepared->find(':', begin);
+				if (pos == string::npos || colon > pos) break;
+				size_t value = colon + 1;
+				while (value < pos && (*prepared)[value] == ' ') value++;
+				HeaderId id = GetHeaderId(prepared->data() + begin, colon - begin);
+				encoder.encode(prepared->data() + begin, colon - begin, prepared->data() + value, pos - value, block, !is_volatile_header(id));
+			}
+		}
+		for (const auto& f : res.get_headers())
+		{
+			if (is_connection_header(f.id)) continue;
+			encoder.encode(f.name, f.name_len, f.value, f.value_len, block, !is_volatile_header(f.id));
+		}
+
+		bool end_stream = res.get_content().empty();
+		size_t off = 0;
+		do
+		{
+			size_t len = min((size_t)peer_max_frame, block.size() - off);
+			bool last = off + len == block.size();
+			uint8_t flags = (last ? FLAG_END_HEADERS : 0) | (off == 0 && end_stream ? FLAG_END_STREAM : 0);
+			put_frame_header(out, len, off == 0 ? FRAME_HEADERS : FRAME_CONTINUATION, flags, st->id);
+			out.append(block, off, len);
+			off += len;
+		} while (off < block.size());
+
+		if (end_stream)
+		{
+			on_sent(st);
+			close_stream(st->id);
+		}
+		else
+		{
+			st->state = StreamState::Sending;
+			sending.push_back(st->id);
+		}
+	}
+
+	void dispatch(Stream* st)
+	{
+		Request& req = st->req;
+		if (req.method == "POST" && !req.header.get(HeaderId::ContentLength))
+		{
+			// Content-Length is optional in HTTP/2, but handlers expect it.
+			req.header.set(HeaderId::ContentLength, to_string(req.data.size()));
+		}
+		// Waiting for DATA frames.
+		st->timing.mark(Phase::Receive);
+		st->start_time = chrono::steady_clock::now();
+		int ret = request_handler(req, st->res);
+		if (ret == REQUEST_PENDING)
+		{
+			st->state = StreamState::Waiting;
+			pending++;
+			return;
+		}
+		if (ret < 0)
+		{
+			st->res.set_code(400);
+		}
+		send_headers(st);
+	}
+
+	// Writes DATA frames of sending streams, one frame per stream per round, as flow control allows.
+	void produce_data()
+	{
+		bool progress = true;
+		while (progress && !sending.empty() && send_window > 0 && out.size() - out_sent < OUTPUT_HIGH_WATER)
+		{
+			progress = false;
+			for (size_t i = 0; i < sending.size() && send_window > 0;)
+			{
+				Stream* st = streams[sending[i]].get();
+				const string& body = st->res.get_content();
+				int64_t allowed = min<int64_t>(peer_max_frame, min(send_window, st->send_window));
+				if (allowed <= 0)
+				{
+					// Blocked by the window of the stream.
+					i++;
+					continue;
+				}
+				size_t len = min(body.size() - st->data_sent, (size_t)allowed);
+				bool last = st->data_sent + len == body.size();
+				put_frame_header(out, len, FRAME_DATA, last ? FLAG_END_STREAM : 0, st->id);
+				out.append(body, st->data_sent, len);
+				st->data_sent += len;
+				st->send_window -= len;
+				send_window -= len;
+				progress = true;
+				if (last)
+				{
+					on_sent(st);
+					streams.erase(st->id);
+					sending.erase(sending.begin() + i);
+				}
+				else
+				{
+					i++;
+				}
+			}
+		}
+	}
+
+	int apply_setting(uint16_t id, uint32_t value)
+	{
+		switch (id)
+		{
+		case SETTINGS_HEADER_TABLE_SIZE:
+			encoder.set_max_table_size(value);
+			break;
+		case SETTINGS_ENABLE_PUSH:
+			if (value > 1) return connection_error(PROTOCOL_ERROR);
+			break;
+		case SETTINGS_INITIAL_WINDOW_SIZE:
+		{
+			if (value > MAX_WINDOW) return connection_error(FLOW_CONTROL_ERROR);
+			int64_t delta = (int64_t)value - peer_initial_window;
+			peer_initial_window = value;
+			for (auto& it : streams)
+			{
+				it.second->send_window += delta;
+				if (it.second->send_window > MAX_WINDOW) return connection_error(FLOW_CONTROL_ERROR);
+			}
+			break;
+		}
+		case SETTINGS_MAX_FRAME_SIZE:
+			if (value < 16384 || value > 16777215) return connection_error(PROTOCOL_ERROR);
+			peer_max_frame = value;
+			break;
+		default:
+			// Unknown settings are ignored.
+			break;
+		}
+		return 0;
+	}
+
+	int on_settings(uint8_t flags, uint32_t stream_id, const unsigned char* p, size_t len)
+	{
+		if (stream_id != 0) return connection_error(PROTOCOL_ERROR);
+		if (flags & FLAG_ACK)
+		{
+			return len == 0 ? 0 : connection_error(FRAME_SIZE_ERROR);
+		}
+		if (len % 6 != 0) return connection_error(FRAME_SIZE_ERROR);
+		for (size_t i = 0; i < len; i += 6)
+		{
+			if (apply_setting((uint16_t)((p[i] << 8) | p[i + 1]), read_u32(p + i + 2)) < 0) return -1;
+		}
+		put_frame_header(out, 0, FRAME_SETTINGS, FLAG_ACK, 0);
+		return 0;
+	}
+
+	// Decodes the request of a new stream. list_size is the size of all fields, counted as in MAX_HEADER_LIST.
+	// Fields past MAX_HEADER_LIST are only counted. Returns -1 on compression error.
+	int decode_request(Stream* st, bool& malformed, size_t& list_size)
+	{
+		Request& req = st->req;
+		malformed = false;
+		list_size = 0;
+		bool regular = false;
+		// Clients may split cookies into several fields. They are joined once at the end.
+		string cookie;
+		int ret = decoder.decode((const unsigned char*)header_block.data(), header_block.size(),
+			[&](const string& name, const string& value)
+		{
+			list_size += name.size() + value.size() + 32;
+			if (list_size > MAX_HEADER_LIST) return;
+			if (!name.empty() && name[0] == ':')
+			{
+				// Pseudo-header fields come before regular ones.
+				if (regular) malformed = true;
+				else if (name == ":method") req.method.assign(value.data(), value.size());
+				else if (name == ":path") req.path.assign(value.data(), value.size());
+				else if (name == ":authority") req.header.set(HeaderId::Host, value);
+				else if (name != ":scheme") malformed = true;
+				return;
+			}
+			regular = true;
+			for (char c : name)
+			{
+				if (c >= 'A' && c <= 'Z') malformed = true;
+			}
+			HeaderId id = GetHeaderId(name.data(), name.size());
+			if (is_connection_header(id) && !(id == HeaderId::TransferEncoding && value == "trailers"))
+			{
+				malformed = true;
+			}
+			if (id == HeaderId::Cookie)
+			{
+				if (!cookie.empty()) cookie.append("; ");
+				cookie.append(value);
+			}
+			else
+			{
+				req.header.set(name.data(), name.size(), value.data(), value.size());
+			}
+		});
+		if (!cookie.empty()) req.header.set(HeaderId::Cookie, cookie);
+		return ret;
+	}
+
+	int on_header_block(uint32_t stream_id, bool end_stream)
+	{
+		auto it = streams.find(stream_id);
+		if (it != streams.end())
+		{
+			// Trailers. Their fields are not used, but the decoder has to see them.
+			Stream* st = it->second.get();
+			if (decoder.decode((const unsigned char*)header_block.data(), header_block.size(),
+				[](const string&, const string&) {}) < 0)
+			{
+				return connection_error(COMPRESSION_ERROR);
+			}
+			if (st->state != StreamState::Receiving) stream_error(st, STREAM_CLOSED);
+			else if (!end_stream) stream_error(st, PROTOCOL_ERROR);
+			else dispatch(st);
+			return 0;
+		}
+
+		if (stream_id <= last_stream) return connection_error(PROTOCOL_ERROR);
+		last_stream = stream_id;
+
+		unique_ptr<Stream> st(new Stream(&finished, stream_id, peer_initial_window));
+		bool malformed;
+		size_t list_size;
+		if (decode_request(st.get(), malformed, list_size) < 0) return connection_error(COMPRESSION_ERROR);
+		st->timing.mark(Phase::Parse);
+		if (list_size > MAX_HEADER_LIST_ABUSE) return connection_error(ENHANCE_YOUR_CALM);
+		if (goaway)
+		{
+			// Streams above the last one in our GOAWAY are ignored.
+			return 0;
+		}
+		if (streams.size() >= (size_t)H2_MAX_STREAMS)
+		{
+			send_rst(stream_id, REFUSED_STREAM);
+			return 0;
+		}
+		if (list_size > MAX_HEADER_LIST)
+		{
+			// Some fields were dropped, so the request is answered without being handled.
+			Stream* p = st.get();
+			streams.emplace(stream_id, std::move(st));
+			p->res.set_code(431);
+			send_headers(p);
+			return 0;
+		}
+		if (malformed || st->req.method.empty() || st->req.path.empty())
+		{
+			send_rst(stream_id, PROTOCOL_ERROR);
+			return 0;
+		}
+		st->req.http_version = "HTTP/2.0";
+		Stream* p = st.get();
+		streams.emplace(stream_id, std::move(st));
+		if (end_stream) dispatch(p);
+		return 0;
+	}
+
+	int on_headers(uint8_t flags, uint32_t stream_id, const unsigned char* p, size_t len)
+	{
+		if (stream_id == 0 || (stream_id & 1) == 0) return connection_error(PROTOCOL_ERROR);
+		size_t pad = 0;
+		if (flags & FLAG_PADDED)
+		{
+			if (len < 1) return connection_error(FRAME_SIZE_ERROR);
+			pad = p[0];
+			p++;
+			len--;
+		}
+		if (flags & FLAG_PRIORITY)
+		{
+			// Priorities are not used.
+			if (len < 5) return connection_error(FRAME_SIZE_ERROR);
+			p += 5;
+			len -= 5;
+		}
+		if (pad > len) return connection_error(PROTOCOL_ERROR);
+		header_block.assign((const char*)p, len - pad);
+		header_flags = flags;
+		if (flags & FLAG_END_HEADERS)
+		{
+			return on_header_block(stream_id, (flags & FLAG_END_STREAM) != 0);
+		}
+		header_stream = stream_id;
+		return 0;
+	}
+
+	int on_continuation(uint8_t flags, uint32_t stream_id, const unsigned char* p, size_t len)
+	{
+		if (stream_id != header_stream) return connection_error(PROTOCOL_ERROR);
+		if (header_block.size() + len > MAX_HEADER_BLOCK) return connection_error(ENHANCE_YOUR_CALM);
+		header_block.append((const char*)p, len);
+		if (flags & FLAG_END_HEADERS)
+		{
+			header_stream = 0;
+			return on_header_block(stream_id, (header_flags & FLAG_END_STREAM) != 0);
+		}
+		return 0;
+	}
+
+	int on_data(uint8_t flags, uint32_t stream_id, const unsigned char* p, size_t len)
+	{
+		if (stream_id == 0) return connection_error(PROTOCOL_ERROR);
+		// Flow control counts the whole payload, padding included.
+		recv_window -= len;
+		if (recv_window < 0) return connection_error(FLOW_CONTROL_ERROR);
+		recv_consumed += len;
+		if (recv_consumed >= RECV_WINDOW / 2)
+		{
+			send_window_update(0, recv_consumed);
+			recv_window += recv_consumed;
+			recv_consumed = 0;
+		}
+
+		auto it = streams.find(stream_id);
+		if (it == streams.end() || it->second->state != StreamState::Receiving)
+		{
+			if (stream_id > last_stream) return connection_error(PROTOCOL_ERROR);
+			if (it != streams.end()) stream_error(it->second.get(), STREAM_CLOSED);
+			else send_rst(stream_id, STREAM_CLOSED);
+			return 0;
+		}
+		Stream* st = it->second.get();
+		size_t pad = 0;
+		if (flags & FLAG_PADDED)
+		{
+			if (len < 1) return connection_error(FRAME_SIZE_ERROR);
+			pad = p[0];
+			p++;
+			len--;
+		}
+		if (pad > len) return connection_error(PROTOCOL_ERROR);
+		st->req.data.append((const char*)p, len - pad);
+		st->recv_consumed += len + (flags & FLAG_PADDED ? 1 : 0);
+
+		if (flags & FLAG_END_STREAM)
+		{
+			dispatch(st);
+		}
+		else if (st->recv_consumed >= RECV_WINDOW / 2)
+		{
+			send_window_update(stream_id, st->recv_consumed);
+			st->recv_consumed = 0;
+		}
+		return 0;
+	}
+
+	int on_window_update(uint32_t stream_id, const unsigned char* p, size_t len)
+	{
+		if (len != 4) return connection_error(FRAME_SIZE_ERROR);
+		int64_t increment = read_u32(p) & 0x7FFFFFFF;
+		if (stream_id == 0)
+		{
+			if (increment == 0) return connection_error(PROTOCOL_ERROR);
+			send_window += increment;
+			if (send_window > MAX_WINDOW) return connection_error(FLOW_CONTROL_ERROR);
+			return 0;
+		}
+		auto it = streams.find(stream_id);
+		if (it == streams.end())
+		{
+			return stream_id > last_stream ? connection_error(PROTOCOL_ERROR) : 0;
+		}
+		Stream* st = it->second.get();
+		if (increment == 0)
+		{
+			stream_error(st, PROTOCOL_ERROR);
+			return 0;
+		}
+		st->send_window += increment;
+		if (st->send_window > MAX_WINDOW) stream_error(st, FLOW_CONTROL_ERROR);
+		return 0;
+	}
+
+	int on_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const unsigned char* p, size_t len)
+	{
+		if (header_stream && type != FRAME_CONTINUATION) return connection_error(PROTOCOL_ERROR);
+		switch (type)
+		{
+		case FRAME_DATA:
+			return on_data(flags, stream_id, p, len);
+		case FRAME_HEADERS:
+			return on_headers(flags, stream_id, p, len);
+		case FRAME_CONTINUATION:
+			return on_continuation(flags, stream_id, p, len);
+		case FRAME_PRIORITY:
+			if (stream_id == 0) return connection_error(PROTOCOL_ERROR);
+			return len == 5 ? 0 : connection_error(FRAME_SIZE_ERROR);
+		case FRAME_RST_STREAM:
+		{
+			if (stream_id == 0 || stream_id > last_stream) return connection_error(PROTOCOL_ERROR);
+			if (len != 4) return connection_error(FRAME_SIZE_ERROR);
+			auto it = streams.find(stream_id);
+			if (it != streams.end())
+			{
+				if (it->second->state == StreamState::Waiting) it->second->reset = true;
+				else close_stream(stream_id);
+			}
+			return 0;
+		}
+		case FRAME_SETTINGS:
+			return on_settings(flags, stream_id, p, len);
+		case FRAME_PUSH_PROMISE:
+			// Clients cannot push.
+			return connection_error(PROTOCOL_ERROR);
+		case FRAME_PING:
+			if (stream_id != 0) return connection_error(PROTOCOL_ERROR);
+			if (len != 8) return connection_error(FRAME_SIZE_ERROR);
+			if (!(flags & FLAG_ACK))
+			{
+				put_frame_header(out, 8, FRAME_PING, FLAG_ACK, 0);
+				out.append((const char*)p, 8);
+			}
+			return 0;
+		case FRAME_GOAWAY:
+			if (stream_id != 0) return connection_error(PROTOCOL_ERROR);
+			// Streams already open are finished, no new one is accepted.
+			goaway = true;
+			return 0;
+		case FRAME_WINDOW_UPDATE:
+			return on_window_update(stream_id, p, len);
+		default:
+			// Unknown frame types are ignored.
+			return 0;
+		}
+	}
+
+	// Handles all complete frames in [p, p+len). Returns bytes used, or -1 on connection error.
+	long long parse(const unsigned char* p, size_t len)
+	{
+		size_t pos = 0;
+		if (preface_left)
+		{
+			size_t n = min(preface_left, len);
+			if (memcmp(p, H2_PREFACE + (H2_PREFACE_LEN - preface_left), n) != 0)
+			{
+				return connection_error(PROTOCOL_ERROR);
+			}
+			preface_left -= n;
+			pos = n;
+		}
+		while (len - pos >= FRAME_HEADER_SIZE)
+		{
+			const unsigned char* h = p + pos;
+			size_t flen = ((size_t)h[0] << 16) | ((size_t)h[1] << 8) | h[2];
+			if (flen > MAX_RECV_FRAME) return connection_error(FRAME_SIZE_ERROR);
+			if (len - pos - FRAME_HEADER_SIZE < flen) break;
+			if (on_frame(h[3], h[4], read_u32(h + 5) & 0x7FFFFFFF, h + FRAME_HEADER_SIZE, flen) < 0) return -1;
+			pos += FRAME_HEADER_SIZE + flen;
+		}
+		return pos;
+	}
+};
+
+H2Session::H2Session(function<void()> notify) : _p(new _impl)
+{
+	_p->finished.notify = std::move(notify);
+}
+
+H2Session::~H2Session()
+{
+	delete _p;
+}
+
+void H2Session::start()
+{
+	_p->send_settings();
+}
+
+bool H2Session::is_upgrade(const Request& req)
+{
+	const char* upgrade = req.header.get(HeaderId::Upgrade);
+	return upgrade && strlen(upgrade) == 3 && equal_nocase(upgrade, "h2c", 3) && req.header.get("HTTP2-Settings", 14);
+}
+
+int H2Session::start_upgrade(const Request& req)
+{
+	string settings;
+	const char* encoded = req.header.get("HTTP2-Settings", 14);
+	if (!encoded || !base64url_decode(encoded, settings) || settings.size() % 6 != 0)
+	{
+		return -1;
+	}
+
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	_p->out.append(switching, sizeof(switching) - 1);
+	_p->send_settings();
+	for (size_t i = 0; i < settings.size(); i += 6)
+	{
+		const unsigned char* s = (const unsigned char*)settings.data() + i;
+		if (_p->apply_setting((uint16_t)((s[0] << 8) | s[1]), read_u32(s + 2)) < 0) return 0;
+	}
+
+	// The request is stream 1, half-closed from the client side.
+	_p->last_stream = 1;
+	Stream* st = new Stream(&_p->finished, 1, _p->peer_initial_window);
+	_p->streams.emplace(1, unique_ptr<Stream>(st));
+	st->req.method.assign(req.method.data(), req.method.size());
+	st->req.path.assign(req.path.data(), req.path.size());
+	st->req.http_version = "HTTP/2.0";
+	for (const auto& f : req.header)
+	{
+		if (is_connection_header(f.id) || (f.name_len == 14 && equal_nocase(f.name, "HTTP2-Settings", 14))) continue;
+		st->req.header.set(f.name, f.name_len, f.value, f.value_len);
+	}
+	st->req.data = req.data;
+	_p->dispatch(st);
+	return 0;
+}
+
+int H2Session::feed(const char* data, size_t len)
+{
+	if (_p->goaway && _p->streams.empty()) return 0;
+	long long used;
+	if (_p->in.empty())
+	{
+		used = _p->parse((const unsigned char*)data, len);
+		if (used >= 0) _p->in.assign(data + used, len - used);
+	}
+	else
+	{
+		_p->in.append(data, len);
+		used = _p->parse((const unsigned char*)_p->in.data(), _p->in.size());
+		if (used >= 0) _p->in.erase(0, used);
+	}
+	return used < 0 ? -1 : 0;
+}
+
+void H2Session::collect()
+{
+	vector<uint32_t> ids;
+	{
+		lock_guard<mutex> lg(_p->finished.lock);
+		ids.swap(_p->finished.ids);
+		_p->finished.notified = false;
+	}
+	for (auto id : ids)
+	{
+		auto it = _p->streams.find(id);
+		if (it == _p->streams.end()) continue;
+		Stream* st = it->second.get();
+		_p->pending--;
+		request_handler_finished(st->req, st->res, st->start_time);
+		if (st->reset) _p->close_stream(id);
+		else _p->send_headers(st);
+	}
+}
+
+size_t H2Session::output(const char*& data)
+{
+	if (_p->out.size() - _p->out_sent < OUTPUT_HIGH_WATER && !_p->sending.empty())
+	{
+		_p->out.erase(0, _p->out_sent);
+		_p->out_sent = 0;
+		_p->produce_data();
+	}
+	data = _p->out.data() + _p->out_sent;
+	return _p->out.size() - _p->out_sent;
+}
+
+void H2Session::consume(size_t n)
+{
+	_p->out_sent += n;
+	if (_p->out_sent == _p->out.size())
+	{
+		_p->out.clear();
+		_p->out_sent = 0;
+	}
+}
+
+void H2Session::shutdown()
+{
+	if (!_p->goaway)
+	{
+		_p->send_goaway(NO_ERROR);
+	}
+}
+
+int H2Session::pending() const
+{
+	return _p->pending;
+}
+
+bool H2Session::finished() const
+{
+	return _p->goaway && _p->streams.empty() && _p->out_sent == _p->out.size();
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <functional>
+#include "request.h"
+
+// HTTP/2 over cleartext TCP (h2c), for the rapid mode reactor.
+// A session turns the bytes of one connection into streams, runs request_handler() for each of them,
+// and produces the bytes to send back. It does no I/O by itself.
+
+// Clients with prior knowledge start the connection with this. Its first line looks like an HTTP/1.1 request line.
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+class H2Session
+{
+public:
+	// notify is called, from any thread, when streams that waited for a Lua script are ready.
+	// The owner should then call collect() on its own thread. notify is not called again until collect() has run.
+	explicit H2Session(std::function<void()> notify);
+	/// NonMoveable,NonCopyable
+	H2Session(const H2Session&) = delete;
+	H2Session& operator = (const H2Session&) = delete;
+	// Must not be destroyed while pending() is not 0.
+	~H2Session();
+
+	// Connection started with H2_PREFACE. The preface is passed to feed() as well.
+	void start();
+
+	// req is an HTTP/1.1 request with "Upgrade: h2c". The request becomes stream 1, and its response is sent over HTTP/2.
+	// Returns:
+	// 0 Session started. "101 Switching Protocols" is in the output.
+	// -1 HTTP2-Settings is missing or invalid. The request should be served as HTTP/1.1
+	int start_upgrade(const Request& req);
+
+	// Handles received bytes.
+	// Returns:
+	// 0 Success
+	// -1 Connection error. A GOAWAY is in the output. Send it and close the connection.
+	int feed(const char* data, size_t len);
+
+	// Queues responses of streams whose scripts are finished.
+	void collect();
+
+	// Bytes waiting to be sent. Returns 0 if there is nothing to send.
+	size_t output(const char*& data);
+	// n bytes from output() are sent.
+	void consume(size_t n);
+
+	// Sends GOAWAY. Streams already started are finished, then the session is finished().
+	void shutdown();
+
+	// Streams whose handlers returned REQUEST_PENDING, and that are not collected yet.
+	int pending() const;
+
+	// GOAWAY is sent or received, no stream is left and all output is taken.
+	bool finished() const;
+
+	// True if req asks to upgrade to h2c.
+	static bool is_upgrade(const Request& req);
+private:
+	struct _impl;
+	_impl* _p;
+};
@@ -0,0 +1,208 @@
+#include "headermap.h"
+#include <cstring>
+using namespace std;
+
+static const char* header_names[(int)HeaderId::Max] = {
+	nullptr,
+	"Accept",
+	"Accept-Encoding",
+	"Accept-Language",
+	"Accept-Ranges",
+	"Cache-Control",
+	"Connection",
+	"Content-Encoding",
+	"Content-Length",
+	"Content-Range",
+	"Content-Type",
+	"Cookie",
+	"Date",
+	"ETag",
+	"Expect",
+	"Host",
+	"If-Modified-Since",
+	"If-None-Match",
+	"Last-Modified",
+	"Location",
+	"Range",
+	"Referer",
+	"Server",
+	"Set-Cookie",
+	"Transfer-Encoding",
+	"Upgrade",
+	"User-Agent",
+};
+
+static inline char ascii_lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static bool iequal(const char* a, const char* b, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		if (ascii_lower(a[i]) != ascii_lower(b[i])) return false;
+	}
+	return true;
+}
+
+const char* GetHeaderName(HeaderId id)
+{
+	if ((int)id <= 0 || id >= HeaderId::Max) return nullptr;
+	return header_names[(int)id];
+}
+
+HeaderId GetHeaderId(const char* name, size_t len)
+{
+	// Lengths of the well-known names, filled on first use.
+	static const struct NameLengths
+	{
+		size_t v[(int)HeaderId::Max];
+		NameLengths()
+		{
+			v[0] = 0;
+			for (int i = 1; i < (int)HeaderId::Max; i++) v[i] = strlen(header_names[i]);
+		}
+	} lengths;
+
+	for (int i = 1; i < (int)HeaderId::Max; i++)
+	{
+		if (lengths.v[i] == len && iequal(header_names[i], name, len)) return (HeaderId)i;
+	}
+	return HeaderId::Unknown;
+}
+
+HeaderMap::HeaderMap(Arena* arena) : _buf(ArenaAllocator<char>(arena)), _overflow(ArenaAllocator<Entry>(arena))
+{
+	_count = 0;
+}
+
+const HeaderMap::Entry& HeaderMap::entry(size_t idx) const
+{
+	return idx < INLINE_FIELDS ? _inline[idx] : _overflow[idx - INLINE_FIELDS];
+}
+
+const HeaderMap::Entry* HeaderMap::find(HeaderId id, const char* name, size_t name_len) const
+{
+	for (size_t i = 0; i < _count; i++)
+	{
+		const Entry& e = entry(i);
+		if (id != HeaderId::Unknown)
+		{
+			if (e.id == id) return &e;
+		}
+		else if (e.id == HeaderId::Unknown && e.name_len == name_len && iequal(_buf.data() + e.name_off, name, name_len))
+		{
+			return &e;
+		}
+	}
+	return nullptr;
+}
+
+HeaderMap::Entry* HeaderMap::find(HeaderId id, const char* name, size_t name_len)
+{
+	return const_cast<Entry*>(static_cast<const HeaderMap*>(this)->find(id, name, name_len));
+}
+
+// Data is stored NUL-terminated. Returns the offset of the data.
+uint32_t HeaderMap::append(const char* data, size_t len)
+{
+	uint32_t off = (uint32_t)_buf.size();
+	_buf.append(data, len);
+	_buf.push_back('\0');
+	return off;
+}
+
+void HeaderMap::set(const char* name, size_t name_len, const char* value, size_t value_len)
+{
+	if (name_len == 0 || name_len > UINT16_MAX) return;
+
+	HeaderId id = GetHeaderId(name, name_len);
+	Entry* e = find(id, name, name_len);
+	if (e)
+	{
+		// The old value is left in the buffer. Fields are rarely replaced.
+		e->value_off = append(value, value_len);
+		e->value_len = (uint32_t)value_len;
+		return;
+	}
+
+	Entry n;
+	n.id = id;
+	n.name_len = (uint16_t)name_len;
+	n.name_off = append(name, name_len);
+	n.value_off = append(value, value_len);
+	n.value_len = (uint32_t)value_len;
+	if (_count < INLINE_FIELDS)
+	{
+		_inline[_count] = n;
+	}
+	else
+	{
+		_overflow.push_back(n);
+	}
+	_count++;
+}
+
+void HeaderMap::set(const string& name, const string& value)
+{
+	set(name.data(), name.size(), value.data(), value.size());
+}
+
+void HeaderMap::set(HeaderId id, const string& value)
+{
+	const char* name = GetHeaderName(id);
+	if (name) set(name, strlen(name), value.data(), value.size());
+}
+
+const char* HeaderMap::get(HeaderId id) const
+{
+	if (id == HeaderId::Unknown) return nullptr;
+	const Entry* e = find(id, nullptr, 0);
+	return e ? _buf.data() + e->value_off : nullptr;
+}
+
+const char* HeaderMap::get(const char* name, size_t name_len) const
+{
+	const Entry* e = find(GetHeaderId(name, name_len), name, name_len);
+	return e ? _buf.data() + e->value_off : nullptr;
+}
+
+const char* HeaderMap::get(const string& name) const
+{
+	return get(name.data(), name.size());
+}
+
+size_t HeaderMap::size() const
+{
+	return _count;
+}
+
+bool HeaderMap::empty() const
+{
+	return _count == 0;
+}
+
+HeaderField HeaderMap::at(size_t idx) const
+{
+	const Entry& e = entry(idx);
+	HeaderField f;
+	f.id = e.id;
+	f.name = _buf.data() + e.name_off;
+	f.name_len = e.name_len;
+	f.value = _buf.data() + e.value_off;
+	f.value_len = e.value_len;
+	return f;
+}
+
+void HeaderMap::clear()
+{
+	_buf.clear();
+	_overflow.clear();
+	_count = 0;
+}
+
+void HeaderMap::reserve(size_t bytes)
+{
+	_buf.reserve(bytes);
+}
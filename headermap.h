@@ -0,0 +1,115 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "arena.h"
+
+// Well-known headers are interned as ids when they are added, so lookups compare integers.
+enum class HeaderId : uint8_t
+{
+	Unknown = 0,
+	Accept,
+	AcceptEncoding,
+	AcceptLanguage,
+	AcceptRanges,
+	CacheControl,
+	Connection,
+	ContentEncoding,
+	ContentLength,
+	ContentRange,
+	ContentType,
+	Cookie,
+	Date,
+	ETag,
+	Expect,
+	Host,
+	IfModifiedSince,
+	IfNoneMatch,
+	LastModified,
+	Location,
+	Range,
+	Referer,
+	Server,
+	SetCookie,
+	TransferEncoding,
+	Upgrade,
+	UserAgent,
+	Max
+};
+
+// Canonical spelling of a well-known header, e.g. "Content-Length". nullptr for HeaderId::Unknown
+const char* GetHeaderName(HeaderId id);
+// HeaderId::Unknown if the name is not a well-known header. Case-insensitive.
+HeaderId GetHeaderId(const char* name, size_t len);
+
+struct HeaderField
+{
+	HeaderId id;
+	const char* name;
+	size_t name_len;
+	// NUL-terminated.
+	const char* value;
+	size_t value_len;
+};
+
+// Flat header storage with case-insensitive names.
+// Names and values live in a single buffer, and the first fields are stored inline,
+// so a typical request costs one allocation for all of its headers (from the arena if one is given).
+class HeaderMap
+{
+public:
+	explicit HeaderMap(Arena* arena = nullptr);
+
+	// Add a field, or replace the value of an existing field with the same name.
+	void set(const char* name, size_t name_len, const char* value, size_t value_len);
+	void set(const std::string& name, const std::string& value);
+	void set(HeaderId id, const std::string& value);
+
+	// Returns the NUL-terminated value, or nullptr if there is no such field.
+	const char* get(HeaderId id) const;
+	const char* get(const char* name, size_t name_len) const;
+	const char* get(const std::string& name) const;
+
+	size_t size() const;
+	bool empty() const;
+	HeaderField at(size_t idx) const;
+	void clear();
+	// Reserve buffer space for names and values in bytes.
+	void reserve(size_t bytes);
+
+	class const_iterator
+	{
+	public:
+		const_iterator(const HeaderMap* m, size_t idx) : _m(m), _idx(idx) {}
+		HeaderField operator * () const { return _m->at(_idx); }
+		const_iterator& operator ++ () { _idx++; return *this; }
+		bool operator != (const const_iterator& it) const { return _idx != it._idx; }
+	private:
+		const HeaderMap* _m;
+		size_t _idx;
+	};
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, _count); }
+
+private:
+	struct Entry
+	{
+		uint32_t name_off;
+		uint32_t value_off;
+		uint32_t value_len;
+		uint16_t name_len;
+		HeaderId id;
+	};
+
+	static const size_t INLINE_FIELDS = 16;
+
+	Entry* find(HeaderId id, const char* name, size_t name_len);
+	const Entry* find(HeaderId id, const char* name, size_t name_len) const;
+	const Entry& entry(size_t idx) const;
+	uint32_t append(const char* data, size_t len);
+
+	ArenaString _buf;
+	Entry _inline[INLINE_FIELDS];
+	std::vector<Entry, ArenaAllocator<Entry>> _overflow;
+	size_t _count;
+};
@@ -0,0 +1,476 @@
+#include "hpack.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+using namespace std;
+
+namespace
+{
+	// RFC 7541 Appendix A
+	const char* static_table[61][2] = {
+		{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+		{ ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+		{ ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+		{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+		{ "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+		{ "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+		{ "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+		{ "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+		{ "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+		{ "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+		{ "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+		{ "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+		{ "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+		{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+		{ "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+		{ "www-authenticate", "" }
+	};
+	const size_t STATIC_COUNT = 61;
+	const size_t ENTRY_OVERHEAD = 32;
+	// Largest dynamic table we keep for encoding, whatever the peer allows.
+	const size_t ENCODER_TABLE_SIZE = 4096;
+
+	const vector<HpackEntry>& static_entries()
+	{
+		static const vector<HpackEntry> entries = []()
+		{
+			vector<HpackEntry> v(STATIC_COUNT);
+			for (size_t i = 0; i < STATIC_COUNT; i++)
+			{
+				v[i].name = static_table[i][0];
+				v[i].value = static_table[i][1];
+			}
+			return v;
+		}();
+		return entries;
+	}
+
+	// RFC 7541 Appendix B. Symbol 256 is EOS.
+	static const uint32_t huffman_codes[257] = {
+		0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+		0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+		0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+		0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+		0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+		0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+		0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+		0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+		0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+		0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+		0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+		0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+		0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+		0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+		0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+		0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+		0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+		0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+		0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+		0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+		0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+		0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+		0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+		0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+		0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+		0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+		0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+		0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+		0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+		0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+		0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+		0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+		0x3fffffff,
+	};
+	static const uint8_t huffman_lengths[257] = {
+		13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+		28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+		6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+		5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+		13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+		7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+		15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+		6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+		20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+		24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+		22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+		21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+		26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+		19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+		20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+		26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+		30,
+	};
+
+	// The code is canonical: codes of the same length are consecutive, in symbol order.
+	// So decoding only needs the first code of each length and the symbols sorted by length.
+	struct HuffmanDecodeTable
+	{
+		uint32_t first[31];
+		uint16_t count[31];
+		uint16_t offset[31];
+		uint16_t symbols[257];
+
+		HuffmanDecodeTable()
+		{
+			memset(count, 0, sizeof(count));
+			for (int i = 0; i < 257; i++) count[huffman_lengths[i]]++;
+			uint32_t code = 0;
+			uint16_t off = 0;
+			for (int len = 1; len <= 30; len++)
+			{
+				code = (code + count[len - 1]) << 1;
+				first[len] = code;
+				offset[len] = off;
+				off += count[len];
+			}
+			first[0] = 0;
+			offset[0] = 0;
+			uint16_t next[31];
+			memcpy(next, offset, sizeof(next));
+			for (int i = 0; i < 257; i++) symbols[next[huffman_lengths[i]]++] = (uint16_t)i;
+		}
+	};
+
+	bool huffman_decode(const unsigned char* p, size_t len, string& out)
+	{
+		static const HuffmanDecodeTable t;
+		const unsigned char* end = p + len;
+		uint64_t acc = 0;
+		int avail = 0;
+		while (true)
+		{
+			while (avail <= 56 && p < end)
+			{
+				acc = (acc << 8) | *p++;
+				avail += 8;
+			}
+			if (avail == 0) return true;
+			// Try the shortest codes first. The code is prefix free, so the first match is the symbol.
+			int found = 0;
+			for (int bits = 5; bits <= 30 && bits <= avail; bits++)
+			{
+				uint32_t code = (uint32_t)(acc >> (avail - bits)) & ((1u << bits) - 1);
+				if (code - t.first[bits] < t.count[bits])
+				{
+					uint16_t sym = t.symbols[t.offset[bits] + code - t.first[bits]];
+					if (sym == 256) return false;
+					out.push_back((char)sym);
+					avail -= bits;
+					found = bits;
+					break;
+				}
+			}
+			if (!found)
+			{
+				// Padding is the most significant bits of EOS (all ones), shorter than a byte.
+				uint32_t mask = (1u << avail) - 1;
+				return p == end && avail < 8 && ((uint32_t)acc & mask) == mask;
+			}
+		}
+	}
+
+	size_t huffman_length(const char* s, size_t len)
+	{
+		size_t bits = 0;
+		for (size_t i = 0; i < len; i++) bits += huffman_lengths[(unsigned char)s[i]];
+		return (bits + 7) / 8;
+	}
+
+	void huffman_encode(string& out, const char* s, size_t len)
+	{
+		uint64_t acc = 0;
+		int bits = 0;
+		for (size_t i = 0; i < len; i++)
+		{
+			unsigned char c = s[i];
+			acc = (acc << huffman_lengths[c]) | huffman_codes[c];
+			bits += huffman_lengths[c];
+			while (bits >= 8)
+			{
+				bits -= 8;
+				out.push_back((char)(acc >> bits));
+			}
+		}
+		if (bits > 0)
+		{
+			out.push_back((char)((acc << (8 - bits)) | (0xFF >> bits)));
+		}
+	}
+
+	bool decode_integer(const unsigned char*& p, const unsigned char* end, int prefix_bits, size_t& out)
+	{
+		if (p >= end) return false;
+		size_t mask = (1u << prefix_bits) - 1;
+		out = *p++ & mask;
+		if (out < mask) return true;
+		for (int shift = 0; shift <= 28; shift += 7)
+		{
+			if (p >= end) return false;
+			unsigned char b = *p++;
+			out += (size_t)(b & 0x7F) << shift;
+			if (!(b & 0x80)) return true;
+		}
+		return false;
+	}
+
+	void encode_integer(string& out, uint8_t first_byte, int prefix_bits, size_t value)
+	{
+		size_t mask = (1u << prefix_bits) - 1;
+		if (value < mask)
+		{
+			out.push_back((char)(first_byte | value));
+			return;
+		}
+		out.push_back((char)(first_byte | mask));
+		value -= mask;
+		while (value >= 0x80)
+		{
+			out.push_back((char)(0x80 | (value & 0x7F)));
+			value >>= 7;
+		}
+		out.push_back((char)value);
+	}
+
+	bool decode_string(const unsigned char*& p, const unsigned char* end, string& out)
+	{
+		if (p >= end) return false;
+		bool huffman = (*p & 0x80) != 0;
+		size_t len;
+		if (!decode_integer(p, end, 7, len) || len > (size_t)(end - p)) return false;
+		out.clear();
+		if (huffman)
+		{
+			if (!huffman_decode(p, len, out)) return false;
+		}
+		else
+		{
+			out.assign((const char*)p, len);
+		}
+		p += len;
+		return true;
+	}
+
+	void encode_string(string& out, const char* s, size_t len)
+	{
+		size_t hlen = huffman_length(s, len);
+		if (hlen < len)
+		{
+			encode_integer(out, 0x80, 7, hlen);
+			huffman_encode(out, s, len);
+		}
+		else
+		{
+			encode_integer(out, 0, 7, len);
+			out.append(s, len);
+		}
+	}
+}
+
+HpackTable::HpackTable()
+{
+	_size = 0;
+	_max_size = 4096;
+}
+
+const HpackEntry* HpackTable::get(size_t idx) const
+{
+	if (idx == 0) return nullptr;
+	if (idx <= STATIC_COUNT) return &static_entries()[idx - 1];
+	idx -= STATIC_COUNT + 1;
+	return idx < _entries.size() ? &_entries[idx] : nullptr;
+}
+
+void HpackTable::add(const char* name, size_t name_len, const char* value, size_t value_len)
+{
+	size_t size = name_len + value_len + ENTRY_OVERHEAD;
+	if (size > _max_size)
+	{
+		// Not an error. The table just becomes empty.
+		evict(0);
+		return;
+	}
+	evict(_max_size - size);
+	_entries.emplace_front();
+	_entries.front().name.assign(name, name_len);
+	_entries.front().value.assign(value, value_len);
+	_size += size;
+}
+
+void HpackTable::set_max_size(size_t max_size)
+{
+	_max_size = max_size;
+	evict(max_size);
+}
+
+size_t HpackTable::max_size() const
+{
+	return _max_size;
+}
+
+void HpackTable::evict(size_t max_size)
+{
+	while (_size > max_size)
+	{
+		const HpackEntry& e = _entries.back();
+		_size -= e.name.size() + e.value.size() + ENTRY_OVERHEAD;
+		_entries.pop_back();
+	}
+}
+
+size_t HpackTable::find(const char* name, size_t name_len, const char* value, size_t value_len, bool& exact) const
+{
+	size_t name_match = 0;
+	exact = false;
+	auto check = [&](const HpackEntry& e, size_t idx)
+	{
+		if (e.name.size() != name_len || memcmp(e.name.data(), name, name_len) != 0) return false;
+		if (e.value.size() == value_len && memcmp(e.value.data(), value, value_len) == 0)
+		{
+			exact = true;
+			name_match = idx;
+			return true;
+		}
+		if (!name_match) name_match = idx;
+		return false;
+	};
+	const vector<HpackEntry>& st = static_entries();
+	for (size_t i = 0; i < STATIC_COUNT; i++)
+	{
+		if (check(st[i], i + 1)) return name_match;
+	}
+	for (size_t i = 0; i < _entries.size(); i++)
+	{
+		if (check(_entries[i], STATIC_COUNT + 1 + i)) return name_match;
+	}
+	return name_match;
+}
+
+HpackDecoder::HpackDecoder(size_t max_table_size)
+{
+	_settings_size = max_table_size;
+	_table.set_max_size(max_table_size);
+}
+
+int HpackDecoder::decode(const unsigned char* data, size_t len,
+	const function<void(const string& name, const string& value)>& on_field)
+{
+	const unsigned char* p = data;
+	const unsigned char* end = data + len;
+	while (p < end)
+	{
+		unsigned char b = *p;
+		size_t idx;
+		if (b & 0x80)
+		{
+			// Indexed field
+			if (!decode_integer(p, end, 7, idx)) return -1;
+			const HpackEntry* e = _table.get(idx);
+			if (!e) return -1;
+			on_field(e->name, e->value);
+		}
+		else if ((b & 0xE0) == 0x20)
+		{
+			// Dynamic table size update
+			if (!decode_integer(p, end, 5, idx) || idx > _settings_size) return -1;
+			_table.set_max_size(idx);
+		}
+		else
+		{
+			// Literal field. 01: with incremental indexing, 0000: without indexing, 0001: never indexed
+			bool add = (b & 0x40) != 0;
+			if (!decode_integer(p, end, add ? 6 : 4, idx)) return -1;
+			if (idx)
+			{
+				const HpackEntry* e = _table.get(idx);
+				if (!e) return -1;
+				_name = e->name;
+			}
+			else if (!decode_string(p, end, _name))
+			{
+				return -1;
+			}
+			if (!decode_string(p, end, _value)) return -1;
+			if (add) _table.add(_name.data(), _name.size(), _value.data(), _value.size());
+			on_field(_name, _value);
+		}
+	}
+	return 0;
+}
+
+HpackEncoder::HpackEncoder()
+{
+	_table.set_max_size(ENCODER_TABLE_SIZE);
+	_pending_size = ENCODER_TABLE_SIZE;
+	_size_changed = false;
+}
+
+void HpackEncoder::set_max_table_size(size_t max_size)
+{
+	_pending_size = min(max_size, ENCODER_TABLE_SIZE);
+	_size_changed = _pending_size != _table.max_size();
+}
+
+void HpackEncoder::begin(string& out)
+{
+	if (_size_changed)
+	{
+		_table.set_max_size(_pending_size);
+		encode_integer(out, 0x20, 5, _pending_size);
+		_size_changed = false;
+	}
+}
+
+void HpackEncoder::encode_status(int code, string& out)
+{
+	switch (code)
+	{
+	case 200: out.push_back((char)(0x80 | 8)); return;
+	case 204: out.push_back((char)(0x80 | 9)); return;
+	case 206: out.push_back((char)(0x80 | 10)); return;
+	case 304: out.push_back((char)(0x80 | 11)); return;
+	case 400: out.push_back((char)(0x80 | 12)); return;
+	case 404: out.push_back((char)(0x80 | 13)); return;
+	case 500: out.push_back((char)(0x80 | 14)); return;
+	}
+	char buff[16];
+	int len = snprintf(buff, sizeof(buff), "%03d", code);
+	encode(":status", 7, buff, len, out);
+}
+
+void HpackEncoder::encode(const char* name, size_t name_len, const char* value, size_t value_len, string& out, bool index)
+{
+	// Field names must be lower case in HTTP/2. Names longer than buff are rare, so they are lowered on the heap.
+	char buff[256];
+	string long_name;
+	char* lower = buff;
+	if (name_len > sizeof(buff))
+	{
+		long_name.resize(name_len);
+		lower = &long_name[0];
+	}
+	for (size_t i = 0; i < name_len; i++)
+	{
+		lower[i] = (char)tolower((unsigned char)name[i]);
+	}
+
+	bool exact;
+	size_t idx = _table.find(lower, name_len, value, value_len, exact);
+	if (exact)
+	{
+		encode_integer(out, 0x80, 7, idx);
+		return;
+	}
+	if (index)
+	{
+		encode_integer(out, 0x40, 6, idx);
+	}
+	else
+	{
+		encode_integer(out, 0x00, 4, idx);
+	}
+	if (!idx) encode_string(out, lower, name_len);
+	encode_string(out, value, value_len);
+	if (index) _table.add(lower, name_len, value, value_len);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+// HPACK header compression of HTTP/2 (RFC 7541).
+// Names and values are passed as (pointer, length). Names are lower case on the wire.
+
+struct HpackEntry
+{
+	std::string name;
+	std::string value;
+};
+
+// Static table followed by the dynamic table. Size of an entry is name + value + 32 bytes.
+class HpackTable
+{
+public:
+	HpackTable();
+
+	// Returns nullptr if idx is neither in the static nor in the dynamic table. idx starts from 1.
+	const HpackEntry* get(size_t idx) const;
+	void add(const char* name, size_t name_len, const char* value, size_t value_len);
+	void set_max_size(size_t max_size);
+	size_t max_size() const;
+
+	// Index of an entry with the same name and value, or (if there is none) with the same name.
+	// Returns 0 if nothing matches. exact tells which of them is found.
+	size_t find(const char* name, size_t name_len, const char* value, size_t value_len, bool& exact) const;
+private:
+	void evict(size_t max_size);
+
+	// Newest first.
+	std::deque<HpackEntry> _entries;
+	size_t _size;
+	size_t _max_size;
+};
+
+class HpackDecoder
+{
+public:
+	// max_table_size is the SETTINGS_HEADER_TABLE_SIZE we sent to the peer.
+	explicit HpackDecoder(size_t max_table_size = 4096);
+
+	// Decodes a whole header block and calls on_field for every field in order.
+	// Returns:
+	// 0 Success
+	// -1 Compression error. The connection cannot be used any more.
+	int decode(const unsigned char* data, size_t len,
+		const std::function<void(const std::string& name, const std::string& value)>& on_field);
+private:
+	HpackTable _table;
+	size_t _settings_size;
+	std::string _name;
+	std::string _value;
+};
+
+class HpackEncoder
+{
+public:
+	HpackEncoder();
+
+	// SETTINGS_HEADER_TABLE_SIZE received from the peer. Takes effect from the next header block.
+	void set_max_table_size(size_t max_size);
+
+	// Call before the first field of every header block.
+	void begin(std::string& out);
+	void encode_status(int code, std::string& out);
+	// Fields with index set to false never enter the dynamic table (values that change on every response).
+	void encode(const char* name, size_t name_len, const char* value, size_t value_len, std::string& out, bool index = true);
+private:
+	HpackTable _table;
+	size_t _pending_size;
+	bool _size_changed;
+};
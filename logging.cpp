@@ -0,0 +1,270 @@
+#include "logging.h"
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+namespace
+{
+	// Per-thread ring size. Must be a power of 2.
+	const size_t RING_SIZE = 1 << 16;
+	const size_t MAX_LINE = 2048;
+
+	struct RecordHeader
+	{
+		uint32_t length;
+		int32_t level;
+	};
+
+	// Single producer (the owning thread), single consumer (the writer thread).
+	// head and tail only grow, positions are taken modulo RING_SIZE.
+	struct LogRing
+	{
+		char buff[RING_SIZE];
+		atomic<size_t> head;
+		atomic<size_t> tail;
+		atomic<uint64_t> dropped;
+		// Set when the owning thread exits. The writer releases the ring after draining it.
+		atomic<bool> retired;
+
+		LogRing() : head(0), tail(0), dropped(0), retired(false) {}
+
+		void copy_in(size_t pos, const void* src, size_t len)
+		{
+			size_t off = pos & (RING_SIZE - 1);
+			size_t first = RING_SIZE - off < len ? RING_SIZE - off : len;
+			memcpy(buff + off, src, first);
+			memcpy(buff, (const char*)src + first, len - first);
+		}
+
+		void copy_out(size_t pos, void* dst, size_t len) const
+		{
+			size_t off = pos & (RING_SIZE - 1);
+			size_t first = RING_SIZE - off < len ? RING_SIZE - off : len;
+			memcpy(dst, buff + off, first);
+			memcpy((char*)dst + first, buff, len - first);
+		}
+	};
+
+	struct RingOwner
+	{
+		LogRing* ring = nullptr;
+		~RingOwner()
+		{
+			if (ring) ring->retired.store(true, memory_order_release);
+		}
+	};
+
+	mutex registry_lock;
+	vector<LogRing*> registry;
+
+	once_flag writer_once;
+	thread* writer = nullptr;
+	atomic<bool> writer_stop(false);
+
+	thread_local RingOwner tls_owner;
+	thread_local time_t tls_last_second = 0;
+	thread_local char tls_stamp[16];
+
+	const char* level_tag(int level)
+	{
+		switch (level)
+		{
+		case LOG_LEVEL_ERROR: return "E";
+		case LOG_LEVEL_WARNING: return "W";
+		case LOG_LEVEL_INFO: return "I";
+		case LOG_LEVEL_DEBUG: return "D";
+		default: return "X";
+		}
+	}
+
+	// Returns true if any record was written out.
+	bool drain_ring(LogRing& r)
+	{
+		size_t tail = r.tail.load(memory_order_relaxed);
+		size_t head = r.head.load(memory_order_acquire);
+		if (tail == head) return false;
+
+		char line[MAX_LINE];
+		while (tail != head)
+		{
+			RecordHeader h;
+			r.copy_out(tail, &h, sizeof(h));
+			r.copy_out(tail + sizeof(h), line, h.length);
+			fwrite(line, 1, h.length, h.level <= LOG_LEVEL_WARNING ? stderr : stdout);
+			tail += sizeof(h) + h.length;
+		}
+		r.tail.store(tail, memory_order_release);
+		return true;
+	}
+
+	// Returns true if any record was written out.
+	bool drain_all()
+	{
+		vector<LogRing*> rings;
+		{
+			lock_guard<mutex> g(registry_lock);
+			rings = registry;
+		}
+
+		bool busy = false;
+		for (auto p : rings)
+		{
+			// Check retired before draining, so nothing pushed before retirement is lost.
+			bool retired = p->retired.load(memory_order_acquire);
+			if (drain_ring(*p)) busy = true;
+
+			uint64_t dropped = p->dropped.exchange(0, memory_order_relaxed);
+			if (dropped)
+			{
+				fprintf(stderr, "[Logger] %llu log messages dropped.\n", (unsigned long long)dropped);
+			}
+
+			if (retired)
+			{
+				lock_guard<mutex> g(registry_lock);
+				for (auto it = registry.begin(); it != registry.end(); ++it)
+				{
+					if (*it == p)
+					{
+						registry.erase(it);
+						break;
+					}
+				}
+				delete p;
+			}
+		}
+		return busy;
+	}
+
+	void writer_main()
+	{
+		int idle_ms = 0;
+		while (true)
+		{
+			if (drain_all())
+			{
+				idle_ms = 0;
+				continue;
+			}
+			if (writer_stop.load(memory_order_acquire))
+			{
+				drain_all();
+				break;
+			}
+			fflush(stdout);
+			fflush(stderr);
+			// Back off while idle. Producers never wake us, so they never touch a lock or a syscall.
+			idle_ms = idle_ms < 8 ? idle_ms + 1 : 8;
+			this_thread::sleep_for(chrono::milliseconds(idle_ms));
+		}
+		fflush(stdout);
+		fflush(stderr);
+	}
+
+	void stop_writer()
+	{
+		writer_stop.store(true, memory_order_release);
+		if (writer)
+		{
+			writer->join();
+		}
+	}
+
+	void start_writer()
+	{
+		writer = new thread(writer_main);
+		atexit(stop_writer);
+	}
+
+	LogRing& local_ring()
+	{
+		if (!tls_owner.ring)
+		{
+			call_once(writer_once, start_writer);
+			tls_owner.ring = new LogRing;
+			lock_guard<mutex> g(registry_lock);
+			registry.push_back(tls_owner.ring);
+		}
+		return *tls_owner.ring;
+	}
+
+	const char* current_stamp()
+	{
+		time_t now = time(NULL);
+		if (now != tls_last_second)
+		{
+			struct tm tt;
+#ifdef _WIN32
+			localtime_s(&tt, &now);
+#else
+			localtime_r(&now, &tt);
+#endif
+			strftime(tls_stamp, sizeof(tls_stamp), "%H:%M:%S", &tt);
+			tls_last_second = now;
+		}
+		return tls_stamp;
+	}
+}
+
+void log_write(int level, const char* fmt, ...)
+{
+	char line[MAX_LINE];
+	int n = snprintf(line, MAX_LINE, "[%s][%s] ", current_stamp(), level_tag(level));
+	va_list ap;
+	va_start(ap, fmt);
+	int m = vsnprintf(line + n, MAX_LINE - n, fmt, ap);
+	va_end(ap);
+	if (m < 0) return;
+	size_t len = n + m < (int)MAX_LINE ? n + m : MAX_LINE - 1;
+
+	LogRing& r = local_ring();
+	size_t head = r.head.load(memory_order_relaxed);
+	size_t tail = r.tail.load(memory_order_acquire);
+	RecordHeader h{ (uint32_t)len, level };
+	if (RING_SIZE - (head - tail) < sizeof(h) + len)
+	{
+		r.dropped.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+	r.copy_in(head, &h, sizeof(h));
+	r.copy_in(head + sizeof(h), line, len);
+	r.head.store(head + sizeof(h) + len, memory_order_release);
+}
+
+void log_flush()
+{
+	if (!writer) return;
+
+	vector<pair<LogRing*, size_t>> targets;
+	{
+		lock_guard<mutex> g(registry_lock);
+		for (auto p : registry)
+		{
+			targets.push_back(make_pair(p, p->head.load(memory_order_acquire)));
+		}
+	}
+
+	// Rings can be released by the writer once retired, so only poll those still registered.
+	for (auto& pr : targets)
+	{
+		while (true)
+		{
+			{
+				lock_guard<mutex> g(registry_lock);
+				bool alive = false;
+				for (auto p : registry) if (p == pr.first) alive = true;
+				if (!alive || pr.first->tail.load(memory_order_acquire) >= pr.second) break;
+			}
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	}
+}
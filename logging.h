@@ -0,0 +1,31 @@
+#pragma once
+
+// Log levels. Smaller is more important.
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Build-time threshold. Calls above this level are compiled out and their arguments are never evaluated.
+// Build with -DNAIVE_LOG_LEVEL=4 to get debug output.
+#ifndef NAIVE_LOG_LEVEL
+#define NAIVE_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Formats the message on the calling thread and pushes it to the per-thread ring buffer.
+// Never blocks: if the ring is full, the message is dropped and counted.
+// A background writer thread drains all rings to stdout (stderr for warnings and errors).
+void log_write(int level, const char* fmt, ...)
+#ifdef __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+;
+
+// Wait until everything logged before this call has been written out.
+void log_flush();
+
+#define logx(level, fmt, ...) do { if ((level) <= NAIVE_LOG_LEVEL) log_write((level), fmt, ##__VA_ARGS__); } while (0)
+#define logd(fmt, ...) logx(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define logi(fmt, ...) logx(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define logw(fmt, ...) logx(LOG_LEVEL_WARNING, fmt, ##__VA_ARGS__)
+#define loge(fmt, ...) logx(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
@@ -0,0 +1,1449 @@
+#include "luatask.h"
+#include "affinity.h"
+#include "config.h"
+#include "form.h"
+#include "logging.h"
+#include "metrics.h"
+#include "shareddict.h"
+#include "timing.h"
+#include "upstream.h"
+#include "util.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// helper.readfile reads this much at a time, so other scripts keep running while a large file is read.
+static const size_t READ_CHUNK = 64 * 1024;
+static const double TCP_DEFAULT_TIMEOUT = 5.0;
+static const size_t TCP_MAX_RESPONSE = 64 * 1024 * 1024;
+// Instructions between two checks of the budgets.
+static const int BUDGET_CHECK_INTERVAL = 1000;
+
+namespace
+{
+	enum class OpType
+	{
+		None,
+		Sleep,
+		ReadFile,
+		Tcp,
+		Http
+	};
+
+	class ScriptLoop;
+
+	// A socket the script loop waits on for a task. epoll_event.data.ptr points to one of these.
+	struct SocketWait
+	{
+		LuaTask::_impl* task;
+		// Index into http of the task, or -1 for its Tcp operation.
+		int http_index;
+		int fd;
+		// Registered in epoll. 0: not registered.
+		unsigned events;
+	};
+
+	struct HttpWait
+	{
+		unique_ptr<UpstreamCall> call;
+		Clock::time_point deadline;
+		SocketWait wait;
+	};
+}
+
+struct LuaTask::_impl
+{
+	LuaTask* self;
+	VM vm;
+	lua_State* co = nullptr;
+
+	// What the script is waiting for.
+	OpType op = OpType::None;
+	Clock::time_point deadline; // Sleep, the timeout of Tcp, and the earliest timeout of Http
+	FILE* fp = nullptr; // ReadFile
+	int fd = -1; // Tcp
+	int tcp_stage = 0; // Tcp: 0 Connecting, 1 Sending, 2 Receiving
+	string out; // Tcp: Data to send
+	size_t sent = 0;
+	string result;
+	string error; // Not empty if the operation failed.
+	vector<HttpWait> http; // Http: calls, in the order of the request tables
+	size_t http_pending = 0;
+	bool http_all = false; // Http: helper.http_all returns a list
+	UpstreamRequest http_req; // Http: request being read from Lua
+
+	// Budgets. The running time only grows while the coroutine is resumed, so waits are not counted.
+	size_t memory_limit = 0; // bytes
+	uint64_t time_limit = 0; // ticks of timing_now()
+	long long instruction_limit = 0;
+	uint64_t run_time = 0;
+	uint64_t resumed_at = 0;
+	long long instructions = 0;
+	bool over_budget = false; // Ran out of time or instructions
+
+	// Used by the script loop.
+	function<void(LuaTask*, int)> on_done;
+	ConfigSnapshot config; // Read while the loop works for this task.
+	multimap<Clock::time_point, _impl*>::iterator timer;
+	bool has_timer = false;
+	SocketWait tcp_wait{ nullptr, -1, -1, 0 };
+};
+
+typedef LuaTask::_impl TaskImpl;
+
+static void close_op(TaskImpl* p)
+{
+	if (p->fp)
+	{
+		fclose(p->fp);
+		p->fp = nullptr;
+	}
+#ifndef _WIN32
+	if (p->fd >= 0)
+	{
+		close(p->fd);
+		p->fd = -1;
+	}
+#endif
+	p->http.clear();
+	p->http_pending = 0;
+}
+
+// Drops the current operation and what it has collected.
+static void reset_op(TaskImpl* p)
+{
+	close_op(p);
+	string().swap(p->result);
+	string().swap(p->out);
+	p->error.clear();
+	p->op = OpType::None;
+}
+
+// Table of a finished call: { status=..., headers={...}, body=... } or { error=... }
+static void push_http_response(lua_State* L, UpstreamResponse& r)
+{
+	lua_newtable(L);
+	if (!r.error.empty())
+	{
+		lua_pushstring(L, r.error.c_str());
+		lua_setfield(L, -2, "error");
+		return;
+	}
+	lua_pushinteger(L, r.status);
+	lua_setfield(L, -2, "status");
+	lua_newtable(L);
+	for (const auto& h : r.headers)
+	{
+		lua_pushlstring(L, h.second.data(), h.second.size());
+		lua_setfield(L, -2, h.first.c_str());
+	}
+	lua_setfield(L, -2, "headers");
+	lua_pushlstring(L, r.body.data(), r.body.size());
+	lua_setfield(L, -2, "body");
+}
+
+// Pushes what the waiting helper function returns, and clears the operation.
+static int push_op_result(lua_State* L, TaskImpl* p)
+{
+	int n = 0;
+	if (p->op == OpType::ReadFile || p->op == OpType::Tcp)
+	{
+		if (p->error.empty())
+		{
+			lua_pushlstring(L, p->result.data(), p->result.size());
+			n = 1;
+		}
+		else
+		{
+			// Tcp keeps what is received before a timeout.
+			if (p->op == OpType::Tcp && !p->result.empty()) lua_pushlstring(L, p->result.data(), p->result.size());
+			else lua_pushnil(L);
+			lua_pushstring(L, p->error.c_str());
+			n = 2;
+		}
+	}
+	else if (p->op == OpType::Http)
+	{
+		if (p->http_all)
+		{
+			lua_createtable(L, (int)p->http.size(), 0);
+			for (size_t i = 0; i < p->http.size(); i++)
+			{
+				push_http_response(L, p->http[i].call->response());
+				lua_rawseti(L, -2, (lua_Integer)i + 1);
+			}
+			n = 1;
+		}
+		else if (p->http[0].call->response().error.empty())
+		{
+			push_http_response(L, p->http[0].call->response());
+			n = 1;
+		}
+		else
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, p->http[0].call->response().error.c_str());
+			n = 2;
+		}
+	}
+	reset_op(p);
+	return n;
+}
+
+// Returns true when the file is read.
+static bool step_readfile(TaskImpl* p)
+{
+	size_t old = p->result.size();
+	p->result.resize(old + READ_CHUNK);
+	size_t n = fread(&p->result[old], 1, READ_CHUNK, p->fp);
+	p->result.resize(old + n);
+	if (n < READ_CHUNK)
+	{
+		if (ferror(p->fp)) p->error = "read error";
+		return true;
+	}
+	return false;
+}
+
+#ifndef _WIN32
+// Called when the socket is ready for its stage. Returns true when the exchange is over.
+static bool step_tcp(TaskImpl* p)
+{
+	if (p->tcp_stage == 0)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		{
+			p->error = "connect failed";
+			return true;
+		}
+		p->tcp_stage = 1;
+	}
+	if (p->tcp_stage == 1)
+	{
+		while (p->sent < p->out.size())
+		{
+			ssize_t n = send(p->fd, p->out.data() + p->sent, p->out.size() - p->sent, MSG_NOSIGNAL);
+			if (n < 0)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return false;
+				p->error = "send failed";
+				return true;
+			}
+			p->sent += n;
+		}
+		// Tell the peer we are done, so services that answer and close can do so.
+		shutdown(p->fd, SHUT_WR);
+		p->tcp_stage = 2;
+	}
+	char buff[16 * 1024];
+	while (true)
+	{
+		ssize_t n = recv(p->fd, buff, sizeof(buff), 0);
+		if (n > 0)
+		{
+			if (p->result.size() + n > TCP_MAX_RESPONSE)
+			{
+				p->error = "response too large";
+				return true;
+			}
+			p->result.append(buff, n);
+		}
+		else if (n == 0)
+		{
+			return true;
+		}
+		else
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return false;
+			p->error = "recv failed";
+			return true;
+		}
+	}
+}
+
+static unsigned tcp_wanted_events(TaskImpl* p)
+{
+	return p->tcp_stage < 2 ? EPOLLOUT : EPOLLIN;
+}
+#endif
+
+// Sets deadline to the earliest timeout of the calls still in flight.
+static void update_http_deadline(TaskImpl* p)
+{
+	bool first = true;
+	for (const auto& h : p->http)
+	{
+		if (h.call->done()) continue;
+		if (first || h.deadline < p->deadline) p->deadline = h.deadline;
+		first = false;
+	}
+}
+
+// Fails the calls whose timeout has passed. Returns how many calls are failed.
+static size_t expire_http(TaskImpl* p, Clock::time_point now)
+{
+	size_t n = 0;
+	for (auto& h : p->http)
+	{
+		if (!h.call->done() && h.deadline <= now)
+		{
+			h.call->fail("timeout");
+			n++;
+		}
+	}
+	p->http_pending -= n;
+	return n;
+}
+
+// Wait for the current operation on this thread.
+static void finish_op_blocking(TaskImpl* p)
+{
+	switch (p->op)
+	{
+	case OpType::Sleep:
+		this_thread::sleep_until(p->deadline);
+		break;
+	case OpType::ReadFile:
+		while (!step_readfile(p));
+		break;
+	case OpType::Tcp:
+#ifndef _WIN32
+		while (true)
+		{
+			long long remain = chrono::duration_cast<chrono::milliseconds>(p->deadline - Clock::now()).count();
+			if (remain <= 0)
+			{
+				p->error = "timeout";
+				break;
+			}
+			struct pollfd pfd;
+			pfd.fd = p->fd;
+			pfd.events = p->tcp_stage < 2 ? POLLOUT : POLLIN;
+			pfd.revents = 0;
+			int ret = poll(&pfd, 1, (int)remain);
+			if (ret < 0 && errno != EINTR)
+			{
+				p->error = "poll failed";
+				break;
+			}
+			if (ret > 0 && step_tcp(p)) break;
+		}
+#endif
+		break;
+	case OpType::Http:
+#ifndef _WIN32
+	{
+		vector<struct pollfd> pfds;
+		vector<UpstreamCall*> calls;
+		while (p->http_pending > 0)
+		{
+			Clock::time_point now = Clock::now();
+			expire_http(p, now);
+			if (p->http_pending == 0) break;
+			update_http_deadline(p);
+
+			pfds.clear();
+			calls.clear();
+			for (auto& h : p->http)
+			{
+				if (h.call->done()) continue;
+				struct pollfd pfd;
+				pfd.fd = h.call->fd();
+				pfd.events = h.call->wants_write() ? POLLOUT : POLLIN;
+				pfd.revents = 0;
+				pfds.push_back(pfd);
+				calls.push_back(h.call.get());
+			}
+			long long remain = chrono::duration_cast<chrono::milliseconds>(p->deadline - now).count() + 1;
+			int ret = poll(pfds.data(), pfds.size(), (int)remain);
+			if (ret < 0 && errno != EINTR)
+			{
+				for (auto c : calls) c->fail("poll failed");
+				p->http_pending = 0;
+				break;
+			}
+			for (size_t i = 0; ret > 0 && i < pfds.size(); i++)
+			{
+				if (pfds[i].revents && calls[i]->step()) p->http_pending--;
+			}
+		}
+	}
+#endif
+		break;
+	case OpType::None:
+		break;
+	}
+}
+
+// Runs the coroutine until it finishes or waits again. nargs values are on its stack.
+// Returns:
+// 0 Finished
+// 1 Waiting
+// -1 Error
+static int resume(TaskImpl* p, int nargs)
+{
+	// The memory limit only holds in lua_resume(). Results of helpers are pushed outside of it,
+	// where a memory error would abort the process.
+	p->vm.set_memory_limit(p->memory_limit);
+	p->resumed_at = timing_now();
+	int ret = lua_resume(p->co, nullptr, nargs);
+	p->run_time += timing_now() - p->resumed_at;
+	p->vm.set_memory_limit(0);
+	if (ret == LUA_YIELD)
+	{
+		// Drop the yielded values (the wait marker of helpers). Results are pushed on resume.
+		lua_settop(p->co, 0);
+		if (p->op == OpType::None)
+		{
+			// Plain coroutine.yield() from the script. Let others run, then continue.
+			p->op = OpType::Sleep;
+			p->deadline = Clock::now();
+		}
+		return 1;
+	}
+	if (ret != LUA_OK)
+	{
+		loge("LuaVM Error: %s\n", lua_tostring(p->co, -1));
+		return -1;
+	}
+	return 0;
+}
+
+// Count hook of scripts with budgets. Raising an error here stops the script.
+// Once the script is over budget, the hook fires on every instruction, so a pcall() in the script
+// cannot keep it going: the first instruction outside of the pcall() fails too.
+static void budget_hook(lua_State* L, lua_Debug*)
+{
+	TaskImpl* p = *(TaskImpl**)lua_getextraspace(L);
+	if (p->over_budget)
+	{
+		luaL_error(L, "Script is over its budget");
+	}
+	p->instructions += BUDGET_CHECK_INTERVAL;
+	if (p->instruction_limit && p->instructions > p->instruction_limit)
+	{
+		p->over_budget = true;
+		lua_sethook(L, budget_hook, LUA_MASKCOUNT, 1);
+		luaL_error(L, "Script exceeded its instruction limit (%I)", (lua_Integer)p->instruction_limit);
+	}
+	if (p->time_limit && p->run_time + (timing_now() - p->resumed_at) > p->time_limit)
+	{
+		p->over_budget = true;
+		lua_sethook(L, budget_hook, LUA_MASKCOUNT, 1);
+		luaL_error(L, "Script exceeded its time limit (%d ms)", (int)(p->time_limit / timing_ticks_per_us() / 1000));
+	}
+	if (p->vm.memory_exceeded())
+	{
+		// Memory errors may be caught by the script as well.
+		lua_sethook(L, budget_hook, LUA_MASKCOUNT, 1);
+		luaL_error(L, "Script exceeded its memory limit (%d KB)", (int)(p->memory_limit / 1024));
+	}
+}
+
+static TaskImpl* get_task(lua_State* L)
+{
+	return (TaskImpl*)lua_touserdata(L, lua_upvalueindex(1));
+}
+
+// Yielded by helpers that wait. Never seen by scripts.
+static char wait_marker;
+
+// Replaces coroutine.resume and coroutine.wrap of scripts. Called with wait_marker and cancel_wait.
+// When a coroutine yields the marker, its resumer yields the marker too, and hands what it is resumed with
+// (the results of the helper) back to the coroutine. Other yields work as usual.
+static const char WAIT_PASSING_CODE[] =
+	"local marker, cancel = ... "
+	"local create, raw_resume, raw_yield = coroutine.create, coroutine.resume, coroutine.yield "
+	"local isyieldable, status, pack, unpack = coroutine.isyieldable, coroutine.status, table.pack, table.unpack "
+	"local function pass_waits(co, r) "
+	"while r[1] and r[2] == marker and status(co) == 'suspended' do "
+	"if not isyieldable() then cancel() end "
+	"r = pack(raw_resume(co, raw_yield(marker))) "
+	"end "
+	"return r "
+	"end "
+	"coroutine.resume = function(co, ...) "
+	"local r = pass_waits(co, pack(raw_resume(co, ...))) "
+	"return unpack(r, 1, r.n) "
+	"end "
+	"coroutine.wrap = function(f) "
+	"local co = create(f) "
+	"return function(...) "
+	"local r = pass_waits(co, pack(raw_resume(co, ...))) "
+	"if not r[1] then error(r[2], 2) end "
+	"return unpack(r, 2, r.n) "
+	"end "
+	"end ";
+
+// Yields with wait_marker. Helpers called from a coroutine of the script yield to its resumer,
+// and the coroutine.resume/wrap of scripts (see WAIT_PASSING_CODE) pass the yield up to the script's own coroutine.
+// That way a wait never blocks the thread, whichever coroutine it is made from.
+static int wait_op(lua_State* L, TaskImpl* p)
+{
+	if (!lua_isyieldable(L))
+	{
+		// Inside a metamethod, an iterator of a C function or a table.sort comparator.
+		reset_op(p);
+		return luaL_error(L, "helper functions that wait cannot be called here (metamethod or C function)");
+	}
+	lua_pushlightuserdata(L, &wait_marker);
+	return lua_yield(L, 1);
+}
+
+// Called by the coroutine.resume/wrap of scripts when a wait reaches a coroutine that cannot yield.
+static int cancel_wait(lua_State* L)
+{
+	reset_op(get_task(L));
+	return luaL_error(L, "helper functions that wait cannot be called here (metamethod or C function)");
+}
+
+// helper.sleep(seconds)
+static int helper_sleep(lua_State* L)
+{
+	TaskImpl* p = get_task(L);
+	double seconds = luaL_checknumber(L, 1);
+	p->op = OpType::Sleep;
+	p->deadline = Clock::now() + chrono::microseconds(seconds_to_us(seconds));
+	return wait_op(L, p);
+}
+
+// helper.readfile(path) path is relative to server_root, like request paths.
+// Returns the content, or nil and an error message.
+static int helper_readfile(lua_State* L)
+{
+	TaskImpl* p = get_task(L);
+	const char* path = luaL_checkstring(L, 1);
+	FILE* fp;
+	{
+		// Lua errors and yields longjmp out of this function, so no C++ object may live past this block.
+		string realpath = SERVER_ROOT;
+		realpath.append(path);
+		fp = fopen(realpath.c_str(), "rb");
+	}
+	if (!fp)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "cannot open file");
+		return 2;
+	}
+	p->op = OpType::ReadFile;
+	p->fp = fp;
+	return wait_op(L, p);
+}
+
+// helper.tcp(ip, port, data [, timeout_seconds])
+// Sends data to ip:port and reads until the peer closes the connection.
+// Returns the response, or nil and an error message. On timeout, data received so far is returned with "timeout".
+static int helper_tcp(lua_State* L)
+{
+	TaskImpl* p = get_task(L);
+	const char* ip = luaL_checkstring(L, 1);
+	int port = (int)luaL_checkinteger(L, 2);
+	size_t len;
+	const char* data = luaL_checklstring(L, 3, &len);
+	double timeout = luaL_optnumber(L, 4, TCP_DEFAULT_TIMEOUT);
+#ifdef _WIN32
+	lua_pushnil(L);
+	lua_pushstring(L, "not supported");
+	return 2;
+#else
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	memset(&addr, 0, sizeof(addr));
+	struct sockaddr_in* a4 = (struct sockaddr_in*)&addr;
+	struct sockaddr_in6* a6 = (struct sockaddr_in6*)&addr;
+	if (inet_pton(AF_INET, ip, &a4->sin_addr) == 1)
+	{
+		a4->sin_family = AF_INET;
+		a4->sin_port = htons(port);
+		addr_len = sizeof(*a4);
+	}
+	else if (inet_pton(AF_INET6, ip, &a6->sin6_addr) == 1)
+	{
+		a6->sin6_family = AF_INET6;
+		a6->sin6_port = htons(port);
+		addr_len = sizeof(*a6);
+	}
+	else
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "invalid address");
+		return 2;
+	}
+
+	int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || (connect(fd, (struct sockaddr*)&addr, addr_len) < 0 && errno != EINPROGRESS))
+	{
+		if (fd >= 0) close(fd);
+		lua_pushnil(L);
+		lua_pushstring(L, "connect failed");
+		return 2;
+	}
+	p->op = OpType::Tcp;
+	p->fd = fd;
+	p->tcp_stage = 0;
+	p->out.assign(data, len);
+	p->sent = 0;
+	p->deadline = Clock::now() + chrono::microseconds(seconds_to_us(timeout));
+	return wait_op(L, p);
+#endif
+}
+
+// Copies the string field name of the table at idx into out. Returns false if it is not a string.
+static bool get_string_field(lua_State* L, int idx, const char* name, string& out)
+{
+	lua_getfield(L, idx, name);
+	size_t len;
+	const char* str = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &len) : nullptr;
+	if (str) out.assign(str, len);
+	lua_pop(L, 1);
+	return str != nullptr;
+}
+
+// Reads the request table at idx { url=..., method=..., headers={...}, body=..., timeout=... } and starts the call.
+static void add_http_call(lua_State* L, int idx, TaskImpl* p)
+{
+	UpstreamRequest& req = p->http_req;
+	if (!get_string_field(L, idx, "url", req.url))
+	{
+		luaL_error(L, "helper.http: url is required");
+	}
+	if (!get_string_field(L, idx, "method", req.method)) req.method = "GET";
+	if (!get_string_field(L, idx, "body", req.body)) req.body.clear();
+	req.headers.clear();
+	lua_getfield(L, idx, "headers");
+	if (lua_istable(L, -1))
+	{
+		lua_pushnil(L);
+		while (lua_next(L, -2))
+		{
+			if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING)
+			{
+				req.headers.emplace_back(lua_tostring(L, -2), lua_tostring(L, -1));
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	lua_getfield(L, idx, "timeout");
+	double timeout = lua_type(L, -1) == LUA_TNUMBER ? lua_tonumber(L, -1) : UPSTREAM_TIMEOUT / 1000.0;
+	lua_pop(L, 1);
+
+	p->http.emplace_back();
+	HttpWait& h = p->http.back();
+	h.call.reset(new UpstreamCall);
+	h.deadline = Clock::now() + chrono::microseconds(seconds_to_us(timeout));
+	h.wait = SocketWait{ p, (int)p->http.size() - 1, -1, 0 };
+	h.call->start(req);
+}
+
+static int start_http(lua_State* L, TaskImpl* p, bool all)
+{
+	p->op = OpType::Http;
+	p->http_all = all;
+	p->http_pending = 0;
+	for (const auto& h : p->http)
+	{
+		if (!h.call->done()) p->http_pending++;
+	}
+	if (p->http_pending == 0)
+	{
+		// Every call failed to start.
+		return push_op_result(L, p);
+	}
+	update_http_deadline(p);
+	return wait_op(L, p);
+}
+
+// helper.http(request) request is { url=..., method=..., headers={...}, body=..., timeout=... }
+// Returns { status=..., headers={...}, body=... }, or nil and an error message.
+static int helper_http(lua_State* L)
+{
+	TaskImpl* p = get_task(L);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	close_op(p);
+	p->http.reserve(1);
+	add_http_call(L, 1, p);
+	return start_http(L, p, false);
+}
+
+// helper.http_all({ request, ... }) Runs the requests at the same time and waits for all of them.
+// Returns a list of results in the same order. Failed ones are { error=... }.
+static int helper_http_all(lua_State* L)
+{
+	TaskImpl* p = get_task(L);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	close_op(p);
+	int n = (int)lua_rawlen(L, 1);
+	// Calls must not move once they are started, SocketWait pointers are handed to epoll.
+	p->http.reserve(n);
+	for (int i = 1; i <= n; i++)
+	{
+		lua_rawgeti(L, 1, i);
+		if (!lua_istable(L, -1))
+		{
+			luaL_error(L, "helper.http_all: item %d is not a table", i);
+		}
+		add_http_call(L, lua_gettop(L), p);
+		lua_pop(L, 1);
+	}
+	return start_http(L, p, true);
+}
+
+#ifndef _WIN32
+namespace
+{
+	// Waits for suspended scripts on a thread of its own. Scripts resume on this thread too.
+	// There are as many loops as pool workers (WORKER_THREADS), so resumed scripts run on as many cores as requests do.
+	class ScriptLoop
+	{
+	public:
+		// Loops are started on first use and never stopped. Tasks are spread over them round-robin:
+		// in rapid mode every task comes from the reactor thread, so the submitting thread cannot choose.
+		static ScriptLoop& pick()
+		{
+			static const vector<ScriptLoop*> loops = start_loops();
+			static atomic<unsigned> next(0);
+			return *loops[next++ % loops.size()];
+		}
+
+		void submit(TaskImpl* p)
+		{
+			{
+				lock_guard<mutex> lg(_lock);
+				_incoming.push_back(p);
+			}
+			uint64_t v = 1;
+			if (write(_evfd, &v, sizeof(v)) < 0)
+			{
+				loge("Failed to wake up script loop. errno: %d\n", errno);
+			}
+		}
+	private:
+		static vector<ScriptLoop*> start_loops()
+		{
+			int count = WORKER_THREADS;
+			if (count <= 0) count = (int)thread::hardware_concurrency();
+			if (count <= 0) count = 1;
+			vector<ScriptLoop*> loops;
+			for (int i = 0; i < count; i++)
+			{
+				loops.push_back(new ScriptLoop(i));
+			}
+			logi("Script loops started with %d threads.\n", count);
+			return loops;
+		}
+
+		explicit ScriptLoop(int idx)
+		{
+			_epfd = epoll_create1(EPOLL_CLOEXEC);
+			_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			struct epoll_event e;
+			e.events = EPOLLIN;
+			e.data.ptr = nullptr;
+			epoll_ctl(_epfd, EPOLL_CTL_ADD, _evfd, &e);
+			thread(&ScriptLoop::run, this, idx).detach();
+		}
+
+		void arm(TaskImpl* p)
+		{
+			switch (p->op)
+			{
+			case OpType::Sleep:
+				add_timer(p);
+				break;
+			case OpType::ReadFile:
+				_readers.push_back(p);
+				break;
+			case OpType::Tcp:
+				p->tcp_wait.task = p;
+				if (watch(&p->tcp_wait, p->fd, tcp_wanted_events(p)) < 0)
+				{
+					p->error = "epoll failed";
+					complete(p);
+					return;
+				}
+				add_timer(p);
+				break;
+			case OpType::Http:
+				for (auto& h : p->http)
+				{
+					if (h.call->done()) continue;
+					if (watch(&h.wait, h.call->fd(), h.call->wants_write() ? EPOLLOUT : EPOLLIN) < 0)
+					{
+						h.call->fail("epoll failed");
+						p->http_pending--;
+					}
+				}
+				if (p->http_pending == 0)
+				{
+					complete(p);
+					return;
+				}
+				add_timer(p);
+				break;
+			case OpType::None:
+				complete(p);
+				break;
+			}
+		}
+
+		// Registers the socket, or updates the events it is waited for.
+		int watch(SocketWait* w, int fd, unsigned events)
+		{
+			struct epoll_event e;
+			e.events = events;
+			e.data.ptr = w;
+			if (w->events && w->fd == fd)
+			{
+				if (w->events == events) return 0;
+				w->events = events;
+				return epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &e);
+			}
+			// A call that retries on a new connection has closed the old socket, which leaves epoll by itself.
+			w->fd = fd;
+			w->events = events;
+			if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &e) < 0)
+			{
+				w->events = 0;
+				return -1;
+			}
+			return 0;
+		}
+
+		void unwatch(SocketWait* w)
+		{
+			if (w->events)
+			{
+				epoll_ctl(_epfd, EPOLL_CTL_DEL, w->fd, nullptr);
+				w->events = 0;
+			}
+		}
+
+		void on_http_ready(SocketWait* w)
+		{
+			TaskImpl* p = w->task;
+			ConfigScope scope(p->config);
+			HttpWait& h = p->http[w->http_index];
+			if (h.call->step())
+			{
+				unwatch(w);
+				if (--p->http_pending == 0) complete(p);
+			}
+			else if (watch(w, h.call->fd(), h.call->wants_write() ? EPOLLOUT : EPOLLIN) < 0)
+			{
+				h.call->fail("epoll failed");
+				if (--p->http_pending == 0) complete(p);
+			}
+		}
+
+		void add_timer(TaskImpl* p)
+		{
+			p->timer = _timers.emplace(p->deadline, p);
+			p->has_timer = true;
+		}
+
+		// The operation is over. Resume the script.
+		void complete(TaskImpl* p)
+		{
+			ConfigScope scope(p->config);
+			if (p->has_timer)
+			{
+				_timers.erase(p->timer);
+				p->has_timer = false;
+			}
+			unwatch(&p->tcp_wait);
+			for (auto& h : p->http)
+			{
+				unwatch(&h.wait);
+			}
+
+			int ret = resume(p, push_op_result(p->co, p));
+			if (ret == 1)
+			{
+				arm(p);
+			}
+			else
+			{
+				p->on_done(p->self, ret);
+				delete p->self;
+			}
+		}
+
+		int next_timeout() const
+		{
+			if (!_readers.empty()) return 0;
+			if (_timers.empty()) return -1;
+			long long ms = chrono::duration_cast<chrono::milliseconds>(_timers.begin()->first - Clock::now()).count();
+			if (ms <= 0) return 0;
+			// Round up, so the timer has really expired when we wake up.
+			return (int)ms + 1;
+		}
+
+		void run(int idx)
+		{
+			// On the CPUs of the workers, in the same order.
+			vector<int> cpus = WORKER_CPUS;
+			if (!cpus.empty() && set_thread_affinity(cpus[idx % cpus.size()]) == 0)
+			{
+				logd("Script loop %d pinned to cpu %d\n", idx, cpus[idx % cpus.size()]);
+			}
+
+			struct epoll_event events[256];
+			while (true)
+			{
+				int n = epoll_wait(_epfd, events, 256, next_timeout());
+				if (n < 0 && errno != EINTR)
+				{
+					loge("Script loop epoll error. errno: %d\n", errno);
+				}
+				for (int i = 0; i < n; i++)
+				{
+					SocketWait* w = (SocketWait*)events[i].data.ptr;
+					if (!w)
+					{
+						uint64_t v;
+						if (read(_evfd, &v, sizeof(v)) < 0) {}
+						vector<TaskImpl*> lst;
+						{
+							lock_guard<mutex> lg(_lock);
+							lst.swap(_incoming);
+						}
+						for (auto q : lst) arm(q);
+					}
+					else if (w->http_index >= 0)
+					{
+						on_http_ready(w);
+					}
+					else if (step_tcp(w->task))
+					{
+						complete(w->task);
+					}
+					else
+					{
+						watch(w, w->fd, tcp_wanted_events(w->task));
+					}
+				}
+
+				// One chunk for every file being read.
+				if (!_readers.empty())
+				{
+					vector<TaskImpl*> lst;
+					lst.swap(_readers);
+					for (auto p : lst)
+					{
+						if (step_readfile(p)) complete(p);
+						else _readers.push_back(p);
+					}
+				}
+
+				// Expired timers are collected first, so a script that keeps yielding cannot hold the loop.
+				Clock::time_point now = Clock::now();
+				vector<TaskImpl*> expired;
+				for (auto it = _timers.begin(); it != _timers.end() && it->first <= now; ++it)
+				{
+					expired.push_back(it->second);
+				}
+				for (auto p : expired)
+				{
+					if (p->op == OpType::Tcp) p->error = "timeout";
+					if (p->op == OpType::Http)
+					{
+						_timers.erase(p->timer);
+						p->has_timer = false;
+						for (auto& h : p->http)
+						{
+							if (!h.call->done() && h.deadline <= now) unwatch(&h.wait);
+						}
+						expire_http(p, now);
+						if (p->http_pending > 0)
+						{
+							// Other calls are still in time.
+							update_http_deadline(p);
+							add_timer(p);
+							continue;
+						}
+					}
+					complete(p);
+				}
+			}
+		}
+
+		int _epfd;
+		int _evfd;
+		mutex _lock;
+		vector<TaskImpl*> _incoming;
+		vector<TaskImpl*> _readers;
+		multimap<Clock::time_point, TaskImpl*> _timers;
+	};
+}
+#endif
+
+LuaTask::LuaTask() : _p(new _impl)
+{
+	_p->self = this;
+	if (_p->vm.runCode("helper={} helper.print=function(...) local t=table.pack(...) "s +
+		"if(response.output==nil) then response.output='' end " +
+		"local temp='' " +
+		"for i,v in ipairs(t) do " +
+		"if(#(temp)>0) then temp = temp .. '\\t' end " +
+		"temp = temp .. tostring(v) " +
+		"end " +
+		"response.output = response.output .. temp .. '\\n' " +
+		"end ") < 0)
+	{
+		loge("Failed to prepare helper.\n");
+	}
+
+	lua_State* L = _p->vm.get();
+	// Threads of the state (the coroutine of the script and its own coroutines) start with a copy of this.
+	*(TaskImpl**)lua_getextraspace(L) = _p;
+	lua_getglobal(L, "helper");
+	lua_pushlightuserdata(L, _p);
+	lua_pushcclosure(L, helper_sleep, 1);
+	lua_setfield(L, -2, "sleep");
+	lua_pushlightuserdata(L, _p);
+	lua_pushcclosure(L, helper_readfile, 1);
+	lua_setfield(L, -2, "readfile");
+	lua_pushlightuserdata(L, _p);
+	lua_pushcclosure(L, helper_tcp, 1);
+	lua_setfield(L, -2, "tcp");
+	lua_pushlightuserdata(L, _p);
+	lua_pushcclosure(L, helper_http, 1);
+	lua_setfield(L, -2, "http");
+	lua_pushlightuserdata(L, _p);
+	lua_pushcclosure(L, helper_http_all, 1);
+	lua_setfield(L, -2, "http_all");
+	shared_push_table(L);
+	lua_setfield(L, -2, "shared");
+	lua_pop(L, 1);
+
+	if (luaL_loadbuffer(L, WAIT_PASSING_CODE, sizeof(WAIT_PASSING_CODE) - 1, "helper") != LUA_OK)
+	{
+		loge("Failed to prepare coroutines: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pushlightuserdata(L, &wait_marker);
+	lua_pushlightuserdata(L, _p);
+	lua_pushcclosure(L, cancel_wait, 1);
+	if (lua_pcall(L, 2, 0, 0) != LUA_OK)
+	{
+		loge("Failed to prepare coroutines: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+}
+
+LuaTask::~LuaTask()
+{
+	close_op(_p);
+	delete _p;
+}
+
+lua_State* LuaTask::get()
+{
+	return _p->vm.get();
+}
+
+void LuaTask::set_config(const ConfigSnapshot& config)
+{
+	_p->config = config;
+}
+
+void LuaTask::set_limits(const LuaLimits& limits)
+{
+	_p->memory_limit = (size_t)limits.memory_limit * 1024;
+	_p->time_limit = (uint64_t)(limits.time_limit * 1000.0 * timing_ticks_per_us());
+	_p->instruction_limit = limits.instruction_limit;
+}
+
+int LuaTask::start(const string& code)
+{
+	lua_State* L = _p->vm.get();
+	_p->co = lua_newthread(L);
+	// Keep the coroutine referenced, otherwise it could be collected while it waits.
+	luaL_ref(L, LUA_REGISTRYINDEX);
+	// Coroutines created by the script inherit the hook.
+	if (_p->time_limit || _p->instruction_limit || _p->memory_limit)
+	{
+		lua_sethook(_p->co, budget_hook, LUA_MASKCOUNT, BUDGET_CHECK_INTERVAL);
+	}
+	if (luaL_loadbuffer(_p->co, code.c_str(), code.size(), "LuaVM"))
+	{
+		loge("LuaVM Error: %s\n", lua_tostring(_p->co, -1));
+		return -1;
+	}
+	return resume(_p, 0);
+}
+
+int LuaTask::run_blocking()
+{
+	while (true)
+	{
+		finish_op_blocking(_p);
+		int ret = resume(_p, push_op_result(_p->co, _p));
+		if (ret != 1) return ret;
+	}
+}
+
+void LuaTask::run_async(function<void(LuaTask*, int)> on_done)
+{
+#ifdef _WIN32
+	int ret = run_blocking();
+	on_done(this, ret);
+	delete this;
+#else
+	_p->on_done = std::move(on_done);
+	ScriptLoop::pick().submit(_p);
+#endif
+}
+
+// response.cache_vary = { "name", ... }
+static void read_cache_vary(lua_State* L, int idx, OutputCachePolicy& policy)
+{
+	policy.has_vary = true;
+	int len = (int)lua_rawlen(L, idx);
+	for (int i = 1; i <= len; i++)
+	{
+		lua_rawgeti(L, idx, i);
+		size_t name_len;
+		const char* name = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &name_len) : nullptr;
+		if (name)
+		{
+			policy.vary.emplace_back(name, name_len);
+		}
+		else
+		{
+			logd("LuaVM: Item %d of response.cache_vary is not a string.\n", i);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+int LuaTask::fill_response(Response& res, OutputCachePolicy* policy)
+{
+	lua_State* L = _p->vm.get();
+	lua_getglobal(L, "response");
+	if (!lua_istable(L, -1)) // type(response)~="table"
+	{
+		logd("LuaVM: variable 'response' is not a table.\n");
+		lua_pop(L, 1);
+		return -1;
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, -2))
+	{
+		if (lua_type(L, -2) == LUA_TSTRING)  // type(key)=="string"
+		{
+			size_t name_len, value_len;
+			const char* item_name = lua_tolstring(L, -2, &name_len);
+			if (strcmp(item_name, "cache_ttl") == 0)
+			{
+				if (policy && lua_type(L, -1) == LUA_TNUMBER) policy->ttl = lua_tonumber(L, -1);
+				lua_pop(L, 1);
+				continue;
+			}
+			if (strcmp(item_name, "cache_vary") == 0)
+			{
+				if (policy && lua_istable(L, -1)) read_cache_vary(L, lua_gettop(L), *policy);
+				lua_pop(L, 1);
+				continue;
+			}
+
+			// lua_tolstring converts numbers in place, which is fine for values (not for keys).
+			const char* item_value = lua_tolstring(L, -1, &value_len);
+
+			if (!item_value)
+			{
+				logd("LuaVM: An item cannot be converted to string. Key: %s\n", item_name);
+			}
+			else if (strcmp(item_name, "output") != 0)
+			{
+				res.set_raw(item_name, name_len, item_value, value_len);
+			}
+			else
+			{
+				res.setContentRaw(string(item_value, value_len));
+			}
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	res.set_code(200);
+	return 0;
+}
+
+int LuaTask::error_code() const
+{
+	return _p->over_budget ? 503 : 500;
+}
+
+static int form_gc(lua_State* L)
+{
+	((FormData*)lua_touserdata(L, 1))->~FormData();
+	return 0;
+}
+
+// Parses req.data into request.form and request.files of the table at 1.
+static void load_request_form(lua_State* L, const Request& req)
+{
+	// The FormData lives in the VM, so the temporary files are removed when it is closed.
+	FormData* form = new (lua_newuserdata(L, sizeof(FormData))) FormData;
+	if (luaL_newmetatable(L, "NaiveFormData"))
+	{
+		lua_pushcfunction(L, form_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	luaL_ref(L, LUA_REGISTRYINDEX);
+
+	if (form->parse(req.header.get(HeaderId::ContentType), req.data.data(), req.data.size()) < 0)
+	{
+		logw("LuaVM: Failed to parse the posted form. Fields read so far are kept.\n");
+	}
+
+	// request.form = { name=value, ... }
+	lua_createtable(L, 0, (int)form->fields.size());
+	for (const auto& pr : form->fields)
+	{
+		lua_pushlstring(L, pr.first.data(), pr.first.size());
+		lua_pushlstring(L, pr.second.data(), pr.second.size());
+		lua_rawset(L, -3);
+	}
+	lua_setfield(L, 1, "form");
+
+	// request.files = { { name=..., filename=..., content_type=..., path=..., size=... }, ... }
+	lua_createtable(L, (int)form->files.size(), 0);
+	for (size_t i = 0; i < form->files.size(); i++)
+	{
+		const FormFile& f = form->files[i];
+		lua_createtable(L, 0, 5);
+		lua_pushlstring(L, f.name.data(), f.name.size());
+		lua_setfield(L, -2, "name");
+		lua_pushlstring(L, f.filename.data(), f.filename.size());
+		lua_setfield(L, -2, "filename");
+		lua_pushlstring(L, f.content_type.data(), f.content_type.size());
+		lua_setfield(L, -2, "content_type");
+		lua_pushlstring(L, f.path.data(), f.path.size());
+		lua_setfield(L, -2, "path");
+		lua_pushinteger(L, (lua_Integer)f.size);
+		lua_setfield(L, -2, "size");
+		lua_rawseti(L, -2, (lua_Integer)i + 1);
+	}
+	lua_setfield(L, 1, "files");
+}
+
+// Pushes a table of the ParamList given as light userdata at 1.
+// Run with lua_pcall(): a memory error must not longjmp over the caller, which owns the list.
+static int push_param_table(lua_State* L)
+{
+	const ParamList* params = (const ParamList*)lua_touserdata(L, 1);
+	lua_createtable(L, 0, (int)params->size());
+	for (const auto& pr : *params)
+	{
+		lua_pushlstring(L, pr.first.data(), pr.first.size());
+		lua_pushlstring(L, pr.second.data(), pr.second.size());
+		lua_rawset(L, -3);
+	}
+	return 1;
+}
+
+// Sets request[key] of the table at 1 from req. Fixed fields shadow headers of the same name.
+// Returns false if req has no such field.
+static bool load_request_field(lua_State* L, const Request& req, const char* key, size_t len)
+{
+	bool is_post = req.method == "POST";
+	if (strcmp(key, "method") == 0)
+	{
+		lua_pushlstring(L, req.method.data(), req.method.size());
+	}
+	else if (strcmp(key, "http_version") == 0)
+	{
+		lua_pushlstring(L, req.http_version.data(), req.http_version.size());
+	}
+	else if (strcmp(key, "param") == 0)
+	{
+		if (is_post)
+		{
+			// Posted content. May contain binary content.
+			lua_pushlstring(L, req.data.data(), req.data.size());
+		}
+		else
+		{
+			// Decoded again from the path: the handler's list is gone when an asynchronous script reads this.
+			// Lua errors longjmp, so the table is built under lua_pcall and an error is raised again
+			// only after the list is destroyed.
+			int status;
+			{
+				ArenaString path(ArenaAllocator<char>(req.arena()));
+				ParamList url_param(ArenaAllocator<ParamList::value_type>(req.arena()));
+				urldecode(req.path.data(), req.path.size(), path, url_param);
+				lua_pushcfunction(L, push_param_table);
+				lua_pushlightuserdata(L, &url_param);
+				status = lua_pcall(L, 1, 1, 0);
+			}
+			if (status != LUA_OK) lua_error(L);
+		}
+	}
+	else if (strcmp(key, "form") == 0 || strcmp(key, "files") == 0)
+	{
+		if (!is_post) return false;
+		load_request_form(L, req);
+		return true;
+	}
+	else
+	{
+		// Header names are case-insensitive.
+		const char* value = req.header.get(key, len);
+		if (!value) return false;
+		lua_pushstring(L, value);
+	}
+	lua_pushlstring(L, key, len);
+	lua_insert(L, -2);
+	lua_rawset(L, 1);
+	return true;
+}
+
+// __index of request tables. A field is read from the Request the first time, then it is a plain field.
+static int request_index(lua_State* L)
+{
+	if (lua_type(L, 2) != LUA_TSTRING) return 0;
+	size_t len;
+	const char* key = lua_tolstring(L, 2, &len);
+	const Request* req = (const Request*)lua_touserdata(L, lua_upvalueindex(1));
+	if (!load_request_field(L, *req, key, len)) return 0;
+
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 1);
+	return 1;
+}
+
+static int request_next(lua_State* L)
+{
+	lua_settop(L, 2);
+	if (lua_next(L, 1)) return 2;
+	lua_pushnil(L);
+	return 1;
+}
+
+// __pairs of request tables. Loads all fields but form and files, then iterates the table.
+static int request_pairs(lua_State* L)
+{
+	const Request* req = (const Request*)lua_touserdata(L, lua_upvalueindex(1));
+	lua_settop(L, 1);
+
+	// Reading a field through __index stores it.
+	static const char* const fields[] = { "method", "http_version", "param" };
+	for (const char* key : fields)
+	{
+		lua_getfield(L, 1, key);
+		lua_pop(L, 1);
+	}
+	for (const auto& f : req->header)
+	{
+		// Well-known headers always use their canonical spelling, whatever case the client sent.
+		lua_getfield(L, 1, f.id != HeaderId::Unknown ? GetHeaderName(f.id) : f.name);
+		lua_pop(L, 1);
+	}
+
+	lua_pushcfunction(L, request_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+void push_request_table(lua_State* L, const Request& req)
+{
+	lua_newtable(L);
+	lua_createtable(L, 0, 2);
+	lua_pushlightuserdata(L, (void*)&req);
+	lua_pushcclosure(L, request_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushlightuserdata(L, (void*)&req);
+	lua_pushcclosure(L, request_pairs, 1);
+	lua_setfield(L, -2, "__pairs");
+	lua_setmetatable(L, -2);
+}
+
+int run_request_script(LuaTask* task, const string& code, const Request& req, Response& res)
+{
+	unique_ptr<LuaTask> holder(task);
+	int ret = task->start(code);
+	// Up to the first wait of the script. If it goes on in the script loop, the owner marks the rest.
+	req.mark(Phase::Script);
+	if (ret == 1)
+	{
+		if (req.completion)
+		{
+			RequestCompletion* completion = req.completion;
+			Response* pres = &res;
+			const Request* preq = &req;
+			task->set_config(req.config);
+			holder.release()->run_async([completion, preq, pres](LuaTask* t, int status) {
+				metrics_on_lua_exec(status >= 0);
+				OutputCachePolicy policy;
+				if (status < 0)
+				{
+					pres->set_code(t->error_code());
+				}
+				else if (t->fill_response(*pres, &policy) < 0)
+				{
+					pres->set_code(500);
+				}
+				else
+				{
+					OutputCacheStore(*preq, *pres, policy);
+				}
+				completion->complete();
+			});
+			return REQUEST_PENDING;
+		}
+		ret = task->run_blocking();
+		req.mark(Phase::Script);
+	}
+
+	metrics_on_lua_exec(ret >= 0);
+	if (ret < 0)
+	{
+		loge("Failed to run user lua code.\n");
+		if (task->error_code() != 500)
+		{
+			res.set_code(task->error_code());
+			return 0;
+		}
+		return -1;
+	}
+	logd("Execution finished successfully.\n");
+	OutputCachePolicy policy;
+	if (task->fill_response(res, &policy) < 0)
+	{
+		return -1;
+	}
+	OutputCacheStore(req, res, policy);
+	return 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <string>
+#include <functional>
+#include "vmop.h"
+#include "config.h"
+#include "request.h"
+#include "response.h"
+#include "outputcache.h"
+
+// A Lua CGI script running as a coroutine.
+// The helper functions that wait (helper.sleep, helper.readfile, helper.tcp, helper.http) yield the coroutine
+// instead of blocking, also when they are called from a coroutine created by the script.
+// A yielded task is either driven to the end on the calling thread (run_blocking),
+// or handed to a script loop (run_async). There is one loop thread for every pool worker: each waits for
+// the scripts it was given and resumes each of them when what it waits for is ready.
+class LuaTask
+{
+public:
+	LuaTask();
+	/// NonMoveable,NonCopyable
+	LuaTask(const LuaTask&) = delete;
+	LuaTask& operator = (const LuaTask&) = delete;
+	~LuaTask();
+
+	// Globals (like request) should be set here before start().
+	lua_State* get();
+
+	// Budgets of the script, checked while it runs. Call before start().
+	void set_limits(const LuaLimits& limits);
+
+	// Settings the script loop reads while it works for this task (see ConfigScope). Call before run_async().
+	// Empty: the latest snapshot.
+	void set_config(const ConfigSnapshot& config);
+
+	// Load the script and run it until it finishes or waits.
+	// Returns:
+	// 0 Script finished.
+	// 1 Script is waiting. Call run_blocking() or run_async().
+	// -1 Failed to load or run the script.
+	int start(const std::string& code);
+
+	// Keep running the script on this thread until it finishes.
+	// Returns:
+	// 0 Script finished.
+	// -1 Script failed.
+	int run_blocking();
+
+	// Hand the task over to the script loop. The loop takes ownership of the task:
+	// on_done(task, status) is called on the loop thread when the script ends
+	// (status follows run_blocking), and the task is deleted right after it.
+	void run_async(std::function<void(LuaTask*, int)> on_done);
+
+	// Copy the response table filled by the script into res.
+	// response.cache_ttl and response.cache_vary go to policy (if not nullptr) instead of the headers.
+	// Returns:
+	// 0 Success
+	// -1 response is not a table.
+	int fill_response(Response& res, OutputCachePolicy* policy = nullptr);
+
+	// Status code to answer with when the script failed:
+	// 503 if it ran out of time or instructions, 500 otherwise.
+	int error_code() const;
+
+	struct _impl;
+private:
+	_impl* _p;
+};
+
+// Pushes a request table for req. Its fields are read from req the first time a script uses them:
+// method, http_version, param (url parameters, or the posted content), headers (case-insensitive),
+// and for POST requests form and files, parsed from the posted content (see FormData).
+// pairs() loads all of them but form and files. req must outlive the script.
+void push_request_table(lua_State* L, const Request& req);
+
+// Runs a CGI script for req, then fills res from its response table. Takes ownership of task.
+// If the script waits and req.completion is set, the script goes on in the script loop.
+// Responses of GET requests are offered to the output cache.
+// Returns:
+// 0 res is filled. (With 503 if the script went over its budget)
+// REQUEST_PENDING res will be filled before req.completion->complete() is called.
+// -1 Script failed, or response is not a table.
+int run_request_script(LuaTask* task, const std::string& code, const Request& req, Response& res);
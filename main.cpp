@@ -5,19 +5,44 @@
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <memory>
 #include "config.h"
 #include "dirop.h"
 #include "GSock/gsock.h"
 #include "GSock/gsock_helper.h"
-#include "NaiveThreadPool/ThreadPool.h"
+#include "workpool.h"
+#include "affinity.h"
 #include "vmop.h"
-#include "log.h"
+#include "logging.h"
 #include "util.h"
 #include "black_magic.h"
 #include "get.h"
 #include "post.h"
+#include "metrics.h"
+#include "mime.h"
+#include "bundle.h"
+#include "fastscan.h"
+#include "tls.h"
+#include "control.h"
+#include "dirlist.h"
+#include "outputcache.h"
+#include "filecache.h"
 using namespace std;
 
+#ifdef NAIVE_PGO_TRAINING
+#include <csignal>
+#include <unistd.h>
+extern "C" void __gcov_dump(void);
+// Instrumented builds never leave the accept loop, so build.py stops them with SIGTERM.
+static void pgo_dump_and_exit(int)
+{
+	__gcov_dump();
+	_exit(0);
+}
+#endif
+
 void request_handler_unknown(const Request& req, Response& res)
 {
 	res.set_code(501);
@@ -25,30 +50,53 @@ void request_handler_unknown(const Request& req, Response& res)
 
 // Returns:
 // 0 Request is handled successfully.
+// REQUEST_PENDING res is filled later. (See Request::completion)
 // -1 Failed to handle GET request. (Error)
 // -2 Failed to handle POST request. (Error)
 int request_handler(const Request& req,Response& res)
 {
 	logd("==========request(%p)=========\nMethod: %s\nPath: %s\nVersion: %s\n", 
 		&req, req.method.c_str(), req.path.c_str(), req.http_version.c_str());
-	for (auto& pr : req.header)
+#if NAIVE_LOG_LEVEL >= LOG_LEVEL_DEBUG
+	for (const auto& f : req.header)
 	{
-		logx(4, "%s\t %s\n", pr.first.c_str(), pr.second.c_str());
+		logx(LOG_LEVEL_DEBUG, "%s\t %s\n", f.name, f.value);
 	}
+#endif
 	logd("^^^^^^^^^^request(%p)^^^^^^^^^^\n", &req);
 
-	if (req.method == "GET")
+	ConfigScope scope(req.config);
+	auto start_time = chrono::steady_clock::now();
+	int ret = 0;
+	metrics_take_route(); // Clear any route left by a previous request.
+
+	if (STATUS_PAGE && req.method == "GET" &&
+		(req.path == METRICS_STATUS_PATH || req.path == METRICS_STATUS_PATH "/metrics"))
+	{
+		request_handler_status(req, res);
+	}
+	else if (req.method == "GET")
 	{
-		if (request_handler_get(req,res) < 0)
+		ret = request_handler_get(req, res);
+		if (ret < 0)
 		{
-			return -1;
+			ret = -1;
+		}
+		else if (ret != REQUEST_PENDING)
+		{
+			ret = 0;
 		}
 	}
 	else if (req.method == "POST")
 	{
-		if (request_handler_post(req, res) < 0)
+		ret = request_handler_post(req, res);
+		if (ret < 0)
+		{
+			ret = -2;
+		}
+		else if (ret != REQUEST_PENDING)
 		{
-			return -2;
+			ret = 0;
 		}
 	}
 	else
@@ -56,7 +104,25 @@ int request_handler(const Request& req,Response& res)
 		request_handler_unknown(req, res);
 	}
 
-	return 0;
+	req.mark(Phase::Handle);
+	// Callers answer 400 on failure. Pending requests are counted by request_handler_finished().
+	RouteType route = metrics_take_route();
+	if (ret != REQUEST_PENDING)
+	{
+		metrics_on_request(req.method.c_str(), ret < 0 ? 400 : res.get_code(), route,
+			chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_time).count());
+	}
+
+	return ret;
+}
+
+void request_handler_finished(const Request& req, const Response& res, chrono::steady_clock::time_point start_time)
+{
+	ConfigScope scope(req.config);
+	// Only scripts finish later. What they did after request_handler returned is theirs.
+	req.mark(Phase::Script);
+	metrics_on_request(req.method.c_str(), res.get_code(), RouteType::Dynamic,
+		chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_time).count());
 }
 
 // Used in blocked socket (Normal mode)
@@ -67,33 +133,41 @@ int request_handler(const Request& req,Response& res)
 // -3: Post without content length
 int receive_request(sock& s,Request& req)
 {
-	string str;
+	ArenaString str(ArenaAllocator<char>(req.arena()));
 	char buff[1024];
 	size_t endpos;
+	str.reserve(sizeof(buff));
+	size_t scanned = 0;
 	while (true)
 	{
 		int ret = s.recv(buff, 1024);
 		if (ret <= 0) return -1;
-		str.append(string(buff, ret));
-		if (string::npos != (endpos = str.find("\r\n\r\n")))
+		str.append(buff, ret);
+		// Only scan new data. The terminator may be split between two reads, so step back 3 bytes.
+		size_t from = scanned > 3 ? scanned - 3 : 0;
+		if (string::npos != (endpos = scan_header_end(str.data() + from, str.size() - from)))
 		{
+			endpos += from;
 			break;
 		}
+		scanned = str.size();
 	}
-	int ret = parse_header(str, req);
+	req.mark(Phase::Receive);
+	int ret = parse_header(str.data(), str.size(), req);
+	req.mark(Phase::Parse);
 	if (ret < 0) return -2;
 	if (req.method == "POST")
 	{
-		auto iter = req.header.find("Content-Length");
+		const char* content_length_str = req.header.get(HeaderId::ContentLength);
 		int content_length = 0;
-		if (iter != req.header.end() && sscanf(iter->second.c_str(), "%d", &content_length) == 1)
+		if (content_length_str && sscanf(content_length_str, "%d", &content_length) == 1)
 		{
 			// Try to receive posted data.
 			// First check if some posted data is already in str
 			if (endpos + 4 != str.size())
 			{
 				// Some posted data here
-				req.data = str.substr(endpos + 4);
+				req.data.assign(str.data() + endpos + 4, str.size() - endpos - 4);
 			}
 
 			int done = 0;
@@ -101,9 +175,10 @@ int receive_request(sock& s,Request& req)
 			{
 				int ret = s.recv(buff, std::min(1024, content_length - done));
 				if (ret <= 0) return -1;
-				req.data.append(string(buff, ret));
+				req.data.append(buff, ret);
 				done += ret;
 			}
+			req.mark(Phase::Receive);
 		}
 		else return -3;
 	}
@@ -114,35 +189,356 @@ int receive_request(sock& s,Request& req)
 // Used in blocked socket (Normal mode)
 void send_response(sock& s, Response& res)
 {
-	string str = res.toString();
+	ArenaString str = res.toString();
 	sock_helper sp(s);
-	sp.sendall(str);
+	if (sp.sendall(str.data(), (int)str.size()) >= 0)
+	{
+		metrics_on_send(str.size());
+	}
+}
+
+struct NormalModeContext;
+
+// A connection in normal mode. Lives in the job that accepted it, unless a Lua script waits:
+// then the script finishes in the script loop, and the response is sent by whoever lets go last.
+struct Connection : public RequestCompletion
+{
+	// Owns all memory of the request. Declared first so it is released last.
+	ArenaLease arena;
+	Request req;
+	Response res;
+	sock* ps;
+	NormalModeContext* ctx;
+	chrono::steady_clock::time_point start_time;
+	RequestTiming timing;
+	// The job and a waiting script both hold the connection.
+	atomic<int> holders;
+
+	Connection() : req(arena.get()), res(arena.get()), ps(nullptr), ctx(nullptr), holders(1)
+	{
+		req.completion = this;
+		req.timing = &timing;
+	}
+
+	// Called on the script loop.
+	void complete() override;
+	// Called by the job if the request is pending.
+	void release();
+	// Sends the response, then closes.
+	void finish();
+	// Releases the socket and the connection.
+	void close();
+};
+
+// Shared by all jobs of the normal mode.
+struct NormalModeContext
+{
+	// Sockets and connections are recycled instead of being allocated for every connection.
+	ObjectPool<sock> sock_pool;
+	ObjectPool<Connection> conn_pool;
+	WorkStealingPool* tp;
+
+	NormalModeContext() : sock_pool(1024), conn_pool(1024), tp(nullptr) {}
+};
+
+void Connection::complete()
+{
+	if (--holders > 0) return;
+	// Sending blocks, which the script loop must not do.
+	if (ctx->tp->start([this]() {
+		request_handler_finished(req, res, start_time);
+		finish();
+	}) < 0)
+	{
+		request_handler_finished(req, res, start_time);
+		close();
+	}
+}
+
+void Connection::release()
+{
+	// The script has already finished.
+	if (--holders > 0) return;
+	request_handler_finished(req, res, start_time);
+	finish();
+}
+
+void Connection::finish()
+{
+	send_response(*ps, res);
+	timing.mark(Phase::Send);
+	metrics_on_timing(req, res, timing);
+	close();
+}
+
+void Connection::close()
+{
+	NormalModeContext* c = ctx;
+	// An idle pooled connection must not keep an old snapshot alive.
+	req.config.reset();
+	c->sock_pool.release(ps);
+	c->conn_pool.release(this);
+	metrics_on_close();
+}
+
+// A published snapshot is never changed. Getters hand out references into it,
+// which stay valid as long as the request reading them holds the snapshot. (see ConfigScope)
+struct ServerConfig
+{
+	int server_port = 9001;
+	string server_root = ".";
+	int deploy_mode = 0;
+	int status_page = 0;
+	int listing_page_size = 0;
+	int listing_cache = 64;
+	int worker_threads = 0;
+	vector<int> worker_cpus;
+	int reactor_cpu = -1;
+	int shared_dict_size = 16384;
+	int output_cache_size = 16384;
+	string asset_bundle;
+	int upstream_timeout = 5000;
+	int upstream_keepalive = 16;
+	int h2_max_streams = 128;
+	int tls_port = 0;
+	string tls_cert;
+	string tls_key;
+	int tls_session_cache = 20480;
+	string upgrade_socket;
+	int drain_timeout = 30;
+	int file_cache_size = 16384;
+	vector<string> warmup;
+	string warmup_list;
+	int slow_request_ms = 0;
+	LuaLimits lua_limits;
+	// Directories with their own budgets, longest first.
+	vector<pair<string, LuaLimits>> lua_limits_dirs;
+	vector<pair<string, string>> mime_types;
+	// Set up from the settings above before the snapshot is published, and freed with it.
+	shared_ptr<const ContentTypes> content_types;
+	shared_ptr<const AssetBundle> bundle;
+};
+
+// Only accessed with atomic_load() and atomic_store(). latest_config is the same pointer,
+// checked by getters outside of scopes without taking a reference.
+static ConfigSnapshot current_config = make_shared<ServerConfig>();
+static atomic<const ServerConfig*> latest_config(current_config.get());
+
+// What the getters read on this thread: the snapshot of the innermost scope, or outside of scopes the latest one.
+static thread_local ConfigSnapshot thread_config;
+static thread_local int scope_depth = 0;
+
+static void publish_config(unique_ptr<ServerConfig> c)
+{
+	ConfigSnapshot snap(move(c));
+	atomic_store(&current_config, snap);
+	latest_config.store(snap.get(), memory_order_release);
+}
+
+ConfigSnapshot ConfigCurrent()
+{
+	return atomic_load(&current_config);
+}
+
+ConfigScope::ConfigScope(const ConfigSnapshot& snap) : _prev(move(thread_config))
+{
+	scope_depth++;
+	thread_config = snap ? snap : ConfigCurrent();
+}
+
+ConfigScope::~ConfigScope()
+{
+	scope_depth--;
+	thread_config = move(_prev);
+}
+
+static const ServerConfig& config()
+{
+	if (scope_depth == 0 && thread_config.get() != latest_config.load(memory_order_acquire))
+	{
+		thread_config = ConfigCurrent();
+	}
+	return *thread_config;
 }
 
-int _server_port;
-string _server_root;
-int _deploy_mode;
 const int& _get_bind_port()
 {
-	return _server_port;
+	return config().server_port;
 }
 const string& _get_server_root()
 {
-	return _server_root;
+	return config().server_root;
 }
 const int& _get_deploy_mode()
 {
-	return _deploy_mode;
+	return config().deploy_mode;
+}
+const int& _get_status_page()
+{
+	return config().status_page;
+}
+const int& _get_listing_page_size()
+{
+	return config().listing_page_size;
+}
+const int& _get_listing_cache()
+{
+	return config().listing_cache;
+}
+const int& _get_worker_threads()
+{
+	return config().worker_threads;
+}
+const vector<int>& _get_worker_cpus()
+{
+	return config().worker_cpus;
+}
+const int& _get_reactor_cpu()
+{
+	return config().reactor_cpu;
+}
+const int& _get_shared_dict_size()
+{
+	return config().shared_dict_size;
+}
+const int& _get_output_cache_size()
+{
+	return config().output_cache_size;
+}
+const string& _get_asset_bundle()
+{
+	return config().asset_bundle;
+}
+const int& _get_upstream_timeout()
+{
+	return config().upstream_timeout;
+}
+const int& _get_upstream_keepalive()
+{
+	return config().upstream_keepalive;
+}
+const int& _get_h2_max_streams()
+{
+	return config().h2_max_streams;
+}
+const int& _get_tls_port()
+{
+	return config().tls_port;
+}
+const string& _get_tls_cert()
+{
+	return config().tls_cert;
+}
+const string& _get_tls_key()
+{
+	return config().tls_key;
+}
+const int& _get_tls_session_cache()
+{
+	return config().tls_session_cache;
+}
+const string& _get_upgrade_socket()
+{
+	return config().upgrade_socket;
+}
+const int& _get_drain_timeout()
+{
+	return config().drain_timeout;
+}
+const int& _get_file_cache_size()
+{
+	return config().file_cache_size;
+}
+const vector<string>& _get_warmup()
+{
+	return config().warmup;
+}
+const string& _get_warmup_list()
+{
+	return config().warmup_list;
+}
+const int& _get_slow_request_ms()
+{
+	return config().slow_request_ms;
+}
+const LuaLimits& _get_lua_limits(const char* request_path)
+{
+	const ServerConfig& c = config();
+	for (const auto& pr : c.lua_limits_dirs)
+	{
+		if (strncmp(request_path, pr.first.c_str(), pr.first.size()) == 0)
+		{
+			return pr.second;
+		}
+	}
+	return c.lua_limits;
+}
+const shared_ptr<const ContentTypes>& _get_content_types()
+{
+	return config().content_types;
+}
+const shared_ptr<const AssetBundle>& _get_bundle()
+{
+	return config().bundle;
 }
 
-int read_config()
+// Optional settings keep their default value if they are not set in config.lua
+// Returns:
+// 0 Value is read or not set.
+// -1 Value is set but not an integer.
+static int read_optional_integer(lua_State* L, const char* name, int& out_value)
+{
+	int ret = 0;
+	lua_getglobal(L, name);
+	if (!lua_isnil(L, -1))
+	{
+		if (lua_isinteger(L, -1))
+		{
+			out_value = lua_tointeger(L, -1);
+		}
+		else
+		{
+			loge("%s is not integer\n", name);
+			ret = -1;
+		}
+	}
+	lua_pop(L, 1);
+	return ret;
+}
+
+// Reads { time_limit=..., memory_limit=..., instruction_limit=... } on the top of the stack. Fields not set are kept.
+// Returns:
+// 0 Success
+// -1 A field is not an integer.
+static int read_lua_limits(lua_State* L, LuaLimits& out)
+{
+	const char* names[] = { "time_limit", "memory_limit", "instruction_limit" };
+	int* values[] = { &out.time_limit, &out.memory_limit, &out.instruction_limit };
+	for (int i = 0; i < 3; i++)
+	{
+		lua_getfield(L, -1, names[i]);
+		if (lua_isinteger(L, -1))
+		{
+			*values[i] = (int)lua_tointeger(L, -1);
+		}
+		else if (!lua_isnil(L, -1))
+		{
+			loge("%s in lua_limits is not integer\n", names[i]);
+			return -1;
+		}
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+static int read_config(ServerConfig& c)
 {
 	// read config.lua 
 	string content;
 	if (GetFileContent("config.lua", content) < 0)
 	{
-		_server_port = 9001;
-		_server_root = ".";
+		c.server_port = 9001;
+		c.server_root = ".";
 		logd("Configure file not found. Fallback to default.\n");
 		return 0;
 	}
@@ -167,58 +563,445 @@ int read_config()
 		loge("server_port is not integer");
 		return -1;
 	}
-	_server_port = lua_tointeger(L, -1);
+	c.server_port = lua_tointeger(L, -1);
 	if (!lua_isstring(L, -2))
 	{
 		loge("server_root is not string");
 		return -2;
 	}
-	_server_root = lua_tostring(L, -2);
+	c.server_root = lua_tostring(L, -2);
 	if (!lua_isinteger(L, -3))
 	{
 		loge("deploy_mode is not integer");
 		return -3;
 	}
-	_deploy_mode = lua_tointeger(L, -3);
+	c.deploy_mode = lua_tointeger(L, -3);
+	lua_pop(L, 3);
+
+	if (read_optional_integer(L, "status_page", c.status_page) < 0)
+	{
+		return -4;
+	}
 
-	logd("Read from configure file:\nServerRoot: %s\nBindPort: %d\nDeploy Mode: %d\n", _server_root.c_str(), _server_port,_deploy_mode);
+	if (read_optional_integer(L, "listing_page_size", c.listing_page_size) < 0 ||
+		read_optional_integer(L, "listing_cache", c.listing_cache) < 0)
+	{
+		return -6;
+	}
+
+	if (read_optional_integer(L, "worker_threads", c.worker_threads) < 0)
+	{
+		return -7;
+	}
+
+	// worker_cpus = { 0, 2, 4, 6 } pins pool workers, reactor_cpu = 1 pins the rapid mode reactor.
+	if (read_optional_integer(L, "reactor_cpu", c.reactor_cpu) < 0)
+	{
+		return -8;
+	}
+	lua_getglobal(L, "worker_cpus");
+	if (lua_istable(L, -1))
+	{
+		int len = (int)luaL_len(L, -1);
+		for (int i = 1; i <= len; i++)
+		{
+			lua_geti(L, -1, i);
+			if (!lua_isinteger(L, -1))
+			{
+				loge("Invalid item in worker_cpus\n");
+				return -8;
+			}
+			c.worker_cpus.push_back((int)lua_tointeger(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	else if (!lua_isnil(L, -1))
+	{
+		loge("worker_cpus is not table\n");
+		return -8;
+	}
+	lua_pop(L, 1);
+
+	if (read_optional_integer(L, "shared_dict_size", c.shared_dict_size) < 0)
+	{
+		return -9;
+	}
+
+	if (read_optional_integer(L, "output_cache_size", c.output_cache_size) < 0)
+	{
+		return -10;
+	}
+
+	lua_getglobal(L, "asset_bundle");
+	if (lua_isstring(L, -1))
+	{
+		c.asset_bundle = lua_tostring(L, -1);
+	}
+	else if (!lua_isnil(L, -1))
+	{
+		loge("asset_bundle is not string\n");
+		return -11;
+	}
+	lua_pop(L, 1);
+
+	if (read_optional_integer(L, "upstream_timeout", c.upstream_timeout) < 0 ||
+		read_optional_integer(L, "upstream_keepalive", c.upstream_keepalive) < 0)
+	{
+		return -12;
+	}
+
+	if (read_optional_integer(L, "h2_max_streams", c.h2_max_streams) < 0)
+	{
+		return -13;
+	}
+
+	if (read_optional_integer(L, "tls_port", c.tls_port) < 0 ||
+		read_optional_integer(L, "tls_session_cache", c.tls_session_cache) < 0)
+	{
+		return -14;
+	}
+	lua_getglobal(L, "tls_cert");
+	lua_getglobal(L, "tls_key");
+	if (lua_isstring(L, -2) && lua_isstring(L, -1))
+	{
+		c.tls_cert = lua_tostring(L, -2);
+		c.tls_key = lua_tostring(L, -1);
+	}
+	else if (c.tls_port != 0)
+	{
+		loge("tls_cert or tls_key is not string\n");
+		return -14;
+	}
+	lua_pop(L, 2);
+
+	// upgrade_socket="/run/naive.sock" lets a new process take over the listening sockets. See control.h
+	if (read_optional_integer(L, "drain_timeout", c.drain_timeout) < 0)
+	{
+		return -15;
+	}
+	lua_getglobal(L, "upgrade_socket");
+	if (lua_isstring(L, -1))
+	{
+		c.upgrade_socket = lua_tostring(L, -1);
+	}
+	else if (!lua_isnil(L, -1))
+	{
+		loge("upgrade_socket is not string\n");
+		return -15;
+	}
+	lua_pop(L, 1);
+
+	// warmup = { "/*.html", "/js/*.js" } is loaded into the file cache before the server accepts.
+	if (read_optional_integer(L, "file_cache_size", c.file_cache_size) < 0)
+	{
+		return -16;
+	}
+	lua_getglobal(L, "warmup");
+	if (lua_istable(L, -1))
+	{
+		int len = (int)luaL_len(L, -1);
+		for (int i = 1; i <= len; i++)
+		{
+			lua_geti(L, -1, i);
+			if (lua_type(L, -1) != LUA_TSTRING)
+			{
+				loge("Invalid item in warmup\n");
+				return -16;
+			}
+			c.warmup.push_back(lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	else if (!lua_isnil(L, -1))
+	{
+		loge("warmup is not table\n");
+		return -16;
+	}
+	lua_pop(L, 1);
+	lua_getglobal(L, "warmup_list");
+	if (lua_isstring(L, -1))
+	{
+		c.warmup_list = lua_tostring(L, -1);
+	}
+	else if (!lua_isnil(L, -1))
+	{
+		loge("warmup_list is not string\n");
+		return -16;
+	}
+	lua_pop(L, 1);
+
+	if (read_optional_integer(L, "slow_request_ms", c.slow_request_ms) < 0)
+	{
+		return -17;
+	}
+
+	// lua_limits = { ["/report/"] = { time_limit=60000 } } overrides the budgets of scripts under a directory.
+	if (read_optional_integer(L, "lua_time_limit", c.lua_limits.time_limit) < 0 ||
+		read_optional_integer(L, "lua_memory_limit", c.lua_limits.memory_limit) < 0 ||
+		read_optional_integer(L, "lua_instruction_limit", c.lua_limits.instruction_limit) < 0)
+	{
+		return -18;
+	}
+	lua_getglobal(L, "lua_limits");
+	if (lua_istable(L, -1))
+	{
+		lua_pushnil(L);
+		while (lua_next(L, -2))
+		{
+			if (lua_type(L, -2) != LUA_TSTRING || !lua_istable(L, -1))
+			{
+				loge("Invalid item in lua_limits\n");
+				return -18;
+			}
+			LuaLimits limits = c.lua_limits;
+			if (read_lua_limits(L, limits) < 0)
+			{
+				return -18;
+			}
+			c.lua_limits_dirs.emplace_back(lua_tostring(L, -2), limits);
+			lua_pop(L, 1);
+		}
+		sort(c.lua_limits_dirs.begin(), c.lua_limits_dirs.end(), [](const pair<string, LuaLimits>& a, const pair<string, LuaLimits>& b) {
+			return a.first.size() > b.first.size();
+		});
+	}
+	else if (!lua_isnil(L, -1))
+	{
+		loge("lua_limits is not table\n");
+		return -18;
+	}
+	lua_pop(L, 1);
+
+	// mime_types = { svg="image/svg+xml", ... } adds or overrides content types by extension.
+	lua_getglobal(L, "mime_types");
+	if (lua_istable(L, -1))
+	{
+		lua_pushnil(L);
+		while (lua_next(L, -2))
+		{
+			if (lua_type(L, -2) != LUA_TSTRING || !lua_isstring(L, -1))
+			{
+				loge("Invalid item in mime_types\n");
+				return -5;
+			}
+			c.mime_types.emplace_back(lua_tostring(L, -2), lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	else if (!lua_isnil(L, -1))
+	{
+		loge("mime_types is not table\n");
+		return -5;
+	}
+	lua_pop(L, 1);
+
+	logd("Read from configure file:\nServerRoot: %s\nBindPort: %d\nDeploy Mode: %d\n", c.server_root.c_str(), c.server_port, c.deploy_mode);
+	return 0;
+}
+
+// Settings only used at startup. A reload keeps their old values.
+template<typename T>
+static void keep_startup_setting(const char* name, const T& old_value, T& new_value)
+{
+	if (new_value != old_value)
+	{
+		logw("%s cannot be changed by reloading. Restart or upgrade the server to apply it.\n", name);
+		new_value = old_value;
+	}
+}
+
+// Called on SIGHUP. If config.lua fails, nothing is changed.
+// Requests keep the snapshot they were received with, so one running across the reload sees only old values.
+// The old snapshot is freed when the last of them is done.
+static void reload_config()
+{
+	unique_ptr<ServerConfig> c(new ServerConfig);
+	int ret = read_config(*c);
+	if (ret < 0)
+	{
+		loge("Failed to read configure (%d). Keeping the old one.\n", ret);
+		return;
+	}
+
+	ConfigSnapshot snap = ConfigCurrent();
+	const ServerConfig& old = *snap;
+	keep_startup_setting("server_port", old.server_port, c->server_port);
+	keep_startup_setting("deploy_mode", old.deploy_mode, c->deploy_mode);
+	keep_startup_setting("worker_threads", old.worker_threads, c->worker_threads);
+	keep_startup_setting("worker_cpus", old.worker_cpus, c->worker_cpus);
+	keep_startup_setting("reactor_cpu", old.reactor_cpu, c->reactor_cpu);
+	keep_startup_setting("tls_port", old.tls_port, c->tls_port);
+	keep_startup_setting("tls_cert", old.tls_cert, c->tls_cert);
+	keep_startup_setting("tls_key", old.tls_key, c->tls_key);
+	keep_startup_setting("tls_session_cache", old.tls_session_cache, c->tls_session_cache);
+	keep_startup_setting("upgrade_socket", old.upgrade_socket, c->upgrade_socket);
+
+	c->content_types = MakeContentTypes(c->mime_types);
+	if (!c->content_types)
+	{
+		loge("Invalid item in mime_types. Keeping the old configure.\n");
+		return;
+	}
+	// Reopened even if the name is the same, since the bundle is usually repacked before a reload.
+	if (!c->asset_bundle.empty() && BundleOpen(c->asset_bundle, c->content_types, c->bundle) < 0)
+	{
+		loge("Failed to open asset bundle %s. The old one is still served.\n", c->asset_bundle.c_str());
+		c->bundle = old.bundle;
+	}
+
+	// Saved before the file cache is cleared. A reload is also the way to refresh the list by hand.
+	if (!old.warmup_list.empty())
+	{
+		FileCacheSaveHotList(old.warmup_list);
+	}
+
+	string root = c->server_root;
+	publish_config(move(c));
+	// Cached pages may come from the old server_root or from old scripts.
+	ClearDirectoryListings();
+	OutputCacheClear();
+	FileCacheClear();
+	logi("Configure reloaded. Server root is %s\n", root.c_str());
+}
+
+// inherited_fd is a listening socket taken over from the old process, or -1 to bind a new one.
+static int open_listener(serversock& t, int port, int inherited_fd)
+{
+	if (inherited_fd >= 0)
+	{
+		if (UpgradeAdopt(t, inherited_fd) < 0)
+		{
+			loge("Failed to use the socket of port %d from the old process\n", port);
+			return -1;
+		}
+		return 0;
+	}
+	if (t.set_reuse() < 0)
+	{
+		logw("Failed to set reuse flag. This is not an error.\n");
+	}
+	if (t.bind(port) < 0)
+	{
+		loge("Failed to bind at port %d\n", port);
+		return -1;
+	}
+	if (t.listen(1024) < 0)
+	{
+		loge("Failed to listen at port %d\n", port);
+		return -1;
+	}
 	return 0;
 }
 
 int main()
 {
+	// Before any thread is started, see control.h
+	ControlBlockSignals();
 	logi("NaiveHTTPServer Started.\n");
-	if (read_config() < 0)
+#ifdef NAIVE_PGO_TRAINING
+	signal(SIGTERM, pgo_dump_and_exit);
+#endif
+	unique_ptr<ServerConfig> c(new ServerConfig);
+	if (read_config(*c) < 0)
 	{
 		loge("Failed to read configure. Fatal error.\n");
 		return 0;
 	}
-
-	serversock t;
-	if (t.set_reuse() < 0)
+	c->content_types = MakeContentTypes(c->mime_types);
+	if (!c->content_types)
 	{
-		logw("Failed to set reuse flag. This is not an error.\n");
+		loge("Invalid item in mime_types. Fatal error.\n");
+		return 0;
 	}
-	if(t.bind(BIND_PORT)<0)
+
+	// Content types of the bundle depend on mime_types, so it is opened after them.
+	if (!c->asset_bundle.empty() && BundleOpen(c->asset_bundle, c->content_types, c->bundle) < 0)
 	{
-		loge("Failed to bind at port %d\n",BIND_PORT);
+		loge("Failed to open asset bundle %s. Fatal error.\n", c->asset_bundle.c_str());
 		return 0;
 	}
-	if(t.listen(1024)<0)
+	publish_config(move(c));
+
+	vector<int> ports = { BIND_PORT };
+	if (DEPLOY_MODE != 0 && TLS_PORT != 0)
+	{
+		ports.push_back(TLS_PORT);
+	}
+	vector<int> inherited(ports.size(), -1);
+	bool upgrading = false;
+	string upgrade_path = UPGRADE_SOCKET;
+	if (DEPLOY_MODE == 0 && !upgrade_path.empty())
+	{
+		logw("upgrade_socket is only used in rapid deploy mode.\n");
+		upgrade_path.clear();
+	}
+	if (!upgrade_path.empty() && UpgradeTakeover(upgrade_path, ports, inherited) == 0)
+	{
+		logi("Taking over from the running server.\n");
+		upgrading = true;
+	}
+
+	// Before listening, so the first requests do not find the caches cold.
+	// When upgrading, the old process keeps serving until UpgradeReady().
+	if (!WARMUP.empty() || !WARMUP_LIST.empty())
+	{
+		FileCacheWarmup(WARMUP, WARMUP_LIST, WORKER_THREADS);
+	}
+
+	serversock t;
+	if (open_listener(t, BIND_PORT, inherited[0]) < 0)
 	{
-		loge("Failed to listen at port %d\n",BIND_PORT);
 		return 0;
 	}
 	logi("Server started at port %d\n",BIND_PORT);
 	logi("Server root is %s\n", SERVER_ROOT.c_str());
 
+	serversock tls_server;
+	if (DEPLOY_MODE != 0 && TLS_PORT != 0)
+	{
+		if (TlsInit(TLS_CERT, TLS_KEY) < 0)
+		{
+			loge("Failed to initialize TLS. Fatal error.\n");
+			return 0;
+		}
+		if (open_listener(tls_server, TLS_PORT, inherited[1]) < 0)
+		{
+			return 0;
+		}
+		logi("HTTPS started at port %d\n", TLS_PORT);
+	}
+
+	if (ControlStart(reload_config, upgrade_path, ports) < 0)
+	{
+		logw("Failed to start control thread. SIGHUP and upgrades are not handled.\n");
+	}
+
 	if (DEPLOY_MODE != 0)
 	{
+		if (REACTOR_CPU >= 0 && set_thread_affinity(REACTOR_CPU) == 0)
+		{
+			logi("Reactor pinned to cpu %d (node %d)\n", REACTOR_CPU, get_cpu_node(REACTOR_CPU));
+		}
+		if (upgrading)
+		{
+			// The old process stops accepting now. Connections arriving meanwhile wait in the shared backlog.
+			UpgradeReady();
+		}
 		logi("Entering rapid mode, black magic started.\n");
-		int ret = black_magic(t);
-		if (ret == 0)
+		int ret = black_magic(t, TLS_PORT != 0 ? &tls_server : nullptr);
+		if (ret >= 0)
 		{
 			logi("Server closed from rapid mode.\n");
+			if (!WARMUP_LIST.empty())
+			{
+				FileCacheSaveHotList(WARMUP_LIST);
+			}
+			if (ret == 1)
+			{
+				// Script threads still use the reactor's memory and globals destroyed on return.
+				log_flush();
+				_Exit(0);
+			}
 		}
 		else
 		{
@@ -228,43 +1011,76 @@ int main()
 		return 0;
 	}
 
+	if (TLS_PORT != 0)
+	{
+		logw("tls_port is only used in rapid deploy mode.\n");
+	}
 	logi("Starting thread pool...\n");
-	ThreadPool tp(10);
+	NormalModeContext ctx;
+	WorkStealingPool tp(WORKER_THREADS, [](int idx) {
+		// Copied, as there is no request holding a snapshot here.
+		vector<int> cpus = WORKER_CPUS;
+		if (cpus.empty()) return;
+		int cpu = cpus[idx % cpus.size()];
+		if (set_thread_affinity(cpu) == 0)
+		{
+			logd("Worker %d pinned to cpu %d (node %d)\n", idx, cpu, get_cpu_node(cpu));
+		}
+	});
+	ctx.tp = &tp;
 	logi("Server is now ready for connections.\n");
 	while(true)
 	{
-		sock* ps=new sock;
+		sock* ps=ctx.sock_pool.acquire();
 		int ret=t.accept(*ps);
 		if(ret<0)
 		{
 			loge("Failed to accept connection. Abort.\n");
+			ctx.sock_pool.release(ps);
 			break;
 		}
-		if(tp.start([ps](){
+		metrics_on_accept();
+		uint64_t accepted = timing_now();
+		if(tp.start([ps, &ctx, accepted](){
+			metrics_on_job_started();
 			logd("receving request on sock %p\n", ps);
-			Request req;
-			int ret = receive_request(*ps, req);
+			// Everything about this request is allocated here, and released at once when the connection is done.
+			Connection* c = ctx.conn_pool.acquire();
+			c->ps = ps;
+			c->ctx = &ctx;
+			c->timing.start(accepted);
+			c->timing.mark(Phase::Queue);
+			c->req.config = ConfigCurrent();
+			int ret = receive_request(*ps, c->req);
 			if (ret < 0)
 			{
 				logd("Failed to receive request on sock %p\n", ps);
+				c->close();
+				return;
 			}
-			else
+
+			c->holders = 2;
+			c->start_time = chrono::steady_clock::now();
+			ret = request_handler(c->req, c->res);
+			if (ret == REQUEST_PENDING)
+			{
+				c->release();
+				return;
+			}
+			if (ret < 0)
 			{
-				Response res;
-				ret = request_handler(req, res);
-				if (ret < 0)
-				{
-					res.set_code(400);
-				}
-				send_response(*ps, res);
+				c->res.set_code(400);
 			}
-			delete ps;
+			c->finish();
 		})<0)
 		{
 			logw("Failed to start job at thread pool.\n");
+			ctx.sock_pool.release(ps);
+			metrics_on_close();
 		}
 		else
 		{
+			metrics_on_job_queued();
 			logd("Job started with sock: %p\n",ps);
 		}
 	}
@@ -0,0 +1,470 @@
+#include "metrics.h"
+#include "logging.h"
+#include "config.h"
+#include <atomic>
+#include <cstdarg>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+using namespace std;
+
+namespace
+{
+	enum MethodIndex { METHOD_GET = 0, METHOD_POST, METHOD_OTHER, METHOD_MAX };
+	const char* method_names[METHOD_MAX] = { "GET","POST","OTHER" };
+
+	const int status_codes[] = { 200,206,400,403,404,405,416,500,501,503 };
+	const int STATUS_OTHER = sizeof(status_codes) / sizeof(status_codes[0]);
+	const int STATUS_MAX = STATUS_OTHER + 1;
+
+	const char* route_names[(int)RouteType::Max] = { "other","static","dynamic","listing" };
+	const char* phase_names[(int)Phase::Max] = { "queue","receive","parse","route","read","script","handle","send" };
+
+	const int MAX_CACHES = 16;
+
+	// Log-linear buckets: 4 linear sub-buckets per power of two (in microseconds).
+	// Values below 4us get one bucket each. The last bucket catches everything above ~70 minutes.
+	const int LATENCY_SUB_BUCKETS = 4;
+	const int LATENCY_BUCKETS = 32 * LATENCY_SUB_BUCKETS;
+
+	typedef atomic<uint64_t> counter_t;
+
+	// Value-initialized with new ThreadMetrics(), which zeroes all atomics.
+	struct ThreadMetrics
+	{
+		counter_t accepted;
+		counter_t closed;
+		counter_t bytes_sent;
+		counter_t jobs_queued;
+		counter_t jobs_started;
+		counter_t lua_exec;
+		counter_t lua_error;
+		counter_t requests[METHOD_MAX][STATUS_MAX];
+		counter_t cache_hit[MAX_CACHES];
+		counter_t cache_miss[MAX_CACHES];
+		counter_t latency[(int)RouteType::Max][LATENCY_BUCKETS];
+		counter_t latency_sum_us[(int)RouteType::Max];
+		counter_t phase_latency[(int)Phase::Max][LATENCY_BUCKETS];
+		counter_t phase_sum_us[(int)Phase::Max];
+	};
+
+	// Registered thread metrics are never released, so counters of exited threads are kept.
+	mutex registry_lock;
+	vector<ThreadMetrics*> registry;
+
+	mutex cache_name_lock;
+	string cache_names[MAX_CACHES];
+	int cache_count = 0;
+
+	const chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+
+	thread_local ThreadMetrics* tls_metrics = nullptr;
+	thread_local RouteType tls_route = RouteType::Other;
+
+	ThreadMetrics& local()
+	{
+		if (!tls_metrics)
+		{
+			tls_metrics = new ThreadMetrics();
+			lock_guard<mutex> g(registry_lock);
+			registry.push_back(tls_metrics);
+		}
+		return *tls_metrics;
+	}
+
+	// Only the owning thread writes a counter, so a plain load/store pair is enough.
+	inline void bump(counter_t& c, uint64_t n = 1)
+	{
+		c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+	}
+
+	inline uint64_t sum(const counter_t ThreadMetrics::* field)
+	{
+		uint64_t ans = 0;
+		for (auto p : registry)
+		{
+			ans += (p->*field).load(memory_order_relaxed);
+		}
+		return ans;
+	}
+
+	int method_index(const char* method)
+	{
+		if (strcmp(method, "GET") == 0) return METHOD_GET;
+		else if (strcmp(method, "POST") == 0) return METHOD_POST;
+		else return METHOD_OTHER;
+	}
+
+	int status_index(int code)
+	{
+		for (int i = 0; i < STATUS_OTHER; i++)
+		{
+			if (status_codes[i] == code) return i;
+		}
+		return STATUS_OTHER;
+	}
+
+	int latency_bucket(uint64_t us)
+	{
+		if (us < LATENCY_SUB_BUCKETS) return (int)us;
+#ifdef _MSC_VER
+		unsigned long msb;
+		_BitScanReverse64(&msb, us);
+#else
+		int msb = 63 - __builtin_clzll(us);
+#endif
+		int idx = (msb - 1) * LATENCY_SUB_BUCKETS + (int)((us >> (msb - 2)) & (LATENCY_SUB_BUCKETS - 1));
+		return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1;
+	}
+
+	// Exclusive upper bound of a bucket, in microseconds.
+	uint64_t latency_bucket_upper(int idx)
+	{
+		if (idx < LATENCY_SUB_BUCKETS) return idx + 1;
+		int msb = idx / LATENCY_SUB_BUCKETS + 1;
+		int sub = idx % LATENCY_SUB_BUCKETS;
+		return (uint64_t)(LATENCY_SUB_BUCKETS + sub + 1) << (msb - 2);
+	}
+
+	// Snapshot of everything, summed over all registered threads.
+	struct Snapshot
+	{
+		uint64_t accepted = 0;
+		uint64_t closed = 0;
+		uint64_t bytes_sent = 0;
+		uint64_t jobs_queued = 0;
+		uint64_t jobs_started = 0;
+		uint64_t lua_exec = 0;
+		uint64_t lua_error = 0;
+		uint64_t requests[METHOD_MAX][STATUS_MAX] = {};
+		int cache_count = 0;
+		string cache_names[MAX_CACHES];
+		uint64_t cache_hit[MAX_CACHES] = {};
+		uint64_t cache_miss[MAX_CACHES] = {};
+		uint64_t latency[(int)RouteType::Max][LATENCY_BUCKETS] = {};
+		uint64_t latency_sum_us[(int)RouteType::Max] = {};
+		uint64_t phase_latency[(int)Phase::Max][LATENCY_BUCKETS] = {};
+		uint64_t phase_sum_us[(int)Phase::Max] = {};
+		double uptime = 0;
+	};
+
+	void take_snapshot(Snapshot& s)
+	{
+		{
+			lock_guard<mutex> g(cache_name_lock);
+			s.cache_count = cache_count;
+			for (int i = 0; i < cache_count; i++) s.cache_names[i] = cache_names[i];
+		}
+
+		lock_guard<mutex> g(registry_lock);
+		s.accepted = sum(&ThreadMetrics::accepted);
+		s.closed = sum(&ThreadMetrics::closed);
+		s.bytes_sent = sum(&ThreadMetrics::bytes_sent);
+		s.jobs_queued = sum(&ThreadMetrics::jobs_queued);
+		s.jobs_started = sum(&ThreadMetrics::jobs_started);
+		s.lua_exec = sum(&ThreadMetrics::lua_exec);
+		s.lua_error = sum(&ThreadMetrics::lua_error);
+		for (auto p : registry)
+		{
+			for (int m = 0; m < METHOD_MAX; m++)
+				for (int c = 0; c < STATUS_MAX; c++)
+					s.requests[m][c] += p->requests[m][c].load(memory_order_relaxed);
+			for (int i = 0; i < MAX_CACHES; i++)
+			{
+				s.cache_hit[i] += p->cache_hit[i].load(memory_order_relaxed);
+				s.cache_miss[i] += p->cache_miss[i].load(memory_order_relaxed);
+			}
+			for (int r = 0; r < (int)RouteType::Max; r++)
+			{
+				for (int b = 0; b < LATENCY_BUCKETS; b++)
+					s.latency[r][b] += p->latency[r][b].load(memory_order_relaxed);
+				s.latency_sum_us[r] += p->latency_sum_us[r].load(memory_order_relaxed);
+			}
+			for (int ph = 0; ph < (int)Phase::Max; ph++)
+			{
+				for (int b = 0; b < LATENCY_BUCKETS; b++)
+					s.phase_latency[ph][b] += p->phase_latency[ph][b].load(memory_order_relaxed);
+				s.phase_sum_us[ph] += p->phase_sum_us[ph].load(memory_order_relaxed);
+			}
+		}
+
+		s.uptime = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+	}
+
+	// Approximated by the upper bound of the bucket holding the requested rank.
+	uint64_t latency_percentile(const uint64_t* buckets, uint64_t total, double pct)
+	{
+		if (total == 0) return 0;
+		uint64_t rank = (uint64_t)(total * pct);
+		if (rank >= total) rank = total - 1;
+		uint64_t seen = 0;
+		for (int b = 0; b < LATENCY_BUCKETS; b++)
+		{
+			seen += buckets[b];
+			if (seen > rank) return latency_bucket_upper(b);
+		}
+		return latency_bucket_upper(LATENCY_BUCKETS - 1);
+	}
+
+	void appendf(string& out, const char* fmt, ...)
+	{
+		char buff[512];
+		va_list ap;
+		va_start(ap, fmt);
+		int ret = vsnprintf(buff, sizeof(buff), fmt, ap);
+		va_end(ap);
+		if (ret > 0) out.append(buff, (size_t)ret < sizeof(buff) ? ret : sizeof(buff) - 1);
+	}
+}
+
+void metrics_on_accept()
+{
+	bump(local().accepted);
+}
+
+void metrics_on_close()
+{
+	bump(local().closed);
+}
+
+void metrics_on_send(size_t bytes)
+{
+	bump(local().bytes_sent, bytes);
+}
+
+void metrics_on_job_queued()
+{
+	bump(local().jobs_queued);
+}
+
+void metrics_on_job_started()
+{
+	bump(local().jobs_started);
+}
+
+void metrics_on_lua_exec(bool success)
+{
+	ThreadMetrics& m = local();
+	bump(m.lua_exec);
+	if (!success) bump(m.lua_error);
+}
+
+void metrics_on_request(const char* method, int status_code, RouteType route, long long elapsed_us)
+{
+	ThreadMetrics& m = local();
+	bump(m.requests[method_index(method)][status_index(status_code)]);
+	if (elapsed_us < 0) elapsed_us = 0;
+	bump(m.latency[(int)route][latency_bucket(elapsed_us)]);
+	bump(m.latency_sum_us[(int)route], elapsed_us);
+}
+
+void metrics_on_timing(const Request& req, const Response& res, const RequestTiming& timing)
+{
+	ThreadMetrics& m = local();
+	double ticks_per_us = timing_ticks_per_us();
+	long long us[(int)Phase::Max];
+	for (int i = 0; i < (int)Phase::Max; i++)
+	{
+		us[i] = (long long)(timing.spent[i] / ticks_per_us);
+		// Phases a request never went through are left out, so they do not drag the percentiles down.
+		if (timing.spent[i] == 0) continue;
+		bump(m.phase_latency[i][latency_bucket(us[i])]);
+		bump(m.phase_sum_us[i], us[i]);
+	}
+
+	if (SLOW_REQUEST_MS <= 0) return;
+	double total_ms = (timing.last - timing.begin) / ticks_per_us / 1000;
+	if (total_ms < SLOW_REQUEST_MS) return;
+	string phases;
+	for (int i = 0; i < (int)Phase::Max; i++)
+	{
+		if (timing.spent[i] == 0) continue;
+		appendf(phases, "%s%s %.3f", phases.empty() ? "" : ", ", phase_names[i], us[i] / 1000.0);
+	}
+	logw("Slow request: %s %s %d %.3f ms (%s)\n", req.method.c_str(), req.path.c_str(), res.get_code(), total_ms, phases.c_str());
+}
+
+void metrics_set_route(RouteType route)
+{
+	tls_route = route;
+}
+
+RouteType metrics_take_route()
+{
+	RouteType r = tls_route;
+	tls_route = RouteType::Other;
+	return r;
+}
+
+int metrics_register_cache(const char* name)
+{
+	lock_guard<mutex> g(cache_name_lock);
+	if (cache_count >= MAX_CACHES)
+	{
+		logw("Too many caches registered. Metrics of cache %s will be ignored.\n", name);
+		return -1;
+	}
+	cache_names[cache_count] = name;
+	return cache_count++;
+}
+
+void metrics_on_cache(int cache_id, bool hit)
+{
+	if (cache_id < 0 || cache_id >= MAX_CACHES) return;
+	ThreadMetrics& m = local();
+	if (hit) bump(m.cache_hit[cache_id]);
+	else bump(m.cache_miss[cache_id]);
+}
+
+static string render_json(const Snapshot& s)
+{
+	string out;
+	appendf(out, "{\n\"uptime_seconds\": %.3f,\n", s.uptime);
+	// Counters only. Rates are left to the reader (accepted over uptime_seconds between two reads), so that
+	// several readers do not disturb each other.
+	appendf(out, "\"connections\": {\"active\": %llu, \"accepted\": %llu},\n",
+		(unsigned long long)(s.accepted - s.closed), (unsigned long long)s.accepted);
+	appendf(out, "\"bytes_sent\": %llu,\n", (unsigned long long)s.bytes_sent);
+	appendf(out, "\"thread_pool\": {\"queue_depth\": %llu},\n", (unsigned long long)(s.jobs_queued - s.jobs_started));
+	appendf(out, "\"lua\": {\"executions\": %llu, \"errors\": %llu},\n",
+		(unsigned long long)s.lua_exec, (unsigned long long)s.lua_error);
+
+	out.append("\"requests\": {");
+	for (int m = 0; m < METHOD_MAX; m++)
+	{
+		appendf(out, "%s\"%s\": {", m ? ", " : "", method_names[m]);
+		for (int c = 0; c < STATUS_MAX; c++)
+		{
+			if (c < STATUS_OTHER) appendf(out, "%s\"%d\": %llu", c ? ", " : "", status_codes[c], (unsigned long long)s.requests[m][c]);
+			else appendf(out, ", \"other\": %llu", (unsigned long long)s.requests[m][c]);
+		}
+		out.append("}");
+	}
+	out.append("},\n");
+
+	out.append("\"caches\": {");
+	for (int i = 0; i < s.cache_count; i++)
+	{
+		uint64_t total = s.cache_hit[i] + s.cache_miss[i];
+		appendf(out, "%s\"%s\": {\"hits\": %llu, \"misses\": %llu, \"hit_rate\": %.4f}", i ? ", " : "", s.cache_names[i].c_str(),
+			(unsigned long long)s.cache_hit[i], (unsigned long long)s.cache_miss[i], total ? (double)s.cache_hit[i] / total : 0.0);
+	}
+	out.append("},\n");
+
+	out.append("\"latency_us\": {");
+	for (int r = 0; r < (int)RouteType::Max; r++)
+	{
+		uint64_t total = 0;
+		for (int b = 0; b < LATENCY_BUCKETS; b++) total += s.latency[r][b];
+		appendf(out, "%s\"%s\": {\"count\": %llu, \"avg\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu}",
+			r ? ", " : "", route_names[r], (unsigned long long)total, total ? (double)s.latency_sum_us[r] / total : 0.0,
+			(unsigned long long)latency_percentile(s.latency[r], total, 0.5),
+			(unsigned long long)latency_percentile(s.latency[r], total, 0.9),
+			(unsigned long long)latency_percentile(s.latency[r], total, 0.99),
+			(unsigned long long)latency_percentile(s.latency[r], total, 0.999));
+	}
+	out.append("},\n");
+
+	out.append("\"phase_us\": {");
+	for (int ph = 0; ph < (int)Phase::Max; ph++)
+	{
+		uint64_t total = 0;
+		for (int b = 0; b < LATENCY_BUCKETS; b++) total += s.phase_latency[ph][b];
+		appendf(out, "%s\"%s\": {\"count\": %llu, \"avg\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu}",
+			ph ? ", " : "", phase_names[ph], (unsigned long long)total, total ? (double)s.phase_sum_us[ph] / total : 0.0,
+			(unsigned long long)latency_percentile(s.phase_latency[ph], total, 0.5),
+			(unsigned long long)latency_percentile(s.phase_latency[ph], total, 0.9),
+			(unsigned long long)latency_percentile(s.phase_latency[ph], total, 0.99),
+			(unsigned long long)latency_percentile(s.phase_latency[ph], total, 0.999));
+	}
+	out.append("}\n}\n");
+	return out;
+}
+
+// Only power-of-two boundaries are exported. Each of them is also an internal bucket boundary, so no interpolation is needed.
+static void append_histogram(string& out, const char* name, const char* label, const char* value, const uint64_t* buckets, uint64_t sum_us)
+{
+	uint64_t cumulative = 0;
+	int b = 0;
+	for (int k = 2; k <= 27; k++)
+	{
+		int upto = (k - 1) * LATENCY_SUB_BUCKETS;
+		for (; b < upto; b++) cumulative += buckets[b];
+		appendf(out, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", name, label, value, (double)(1ull << k) / 1e6, (unsigned long long)cumulative);
+	}
+	for (; b < LATENCY_BUCKETS; b++) cumulative += buckets[b];
+	appendf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, value, (unsigned long long)cumulative);
+	appendf(out, "%s_sum{%s=\"%s\"} %.6f\n", name, label, value, sum_us / 1e6);
+	appendf(out, "%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long)cumulative);
+}
+
+static string render_prometheus(const Snapshot& s)
+{
+	string out;
+	appendf(out, "# TYPE naive_uptime_seconds gauge\nnaive_uptime_seconds %.3f\n", s.uptime);
+	appendf(out, "# TYPE naive_connections_active gauge\nnaive_connections_active %llu\n", (unsigned long long)(s.accepted - s.closed));
+	appendf(out, "# TYPE naive_connections_accepted_total counter\nnaive_connections_accepted_total %llu\n", (unsigned long long)s.accepted);
+	appendf(out, "# TYPE naive_bytes_sent_total counter\nnaive_bytes_sent_total %llu\n", (unsigned long long)s.bytes_sent);
+	appendf(out, "# TYPE naive_threadpool_queue_depth gauge\nnaive_threadpool_queue_depth %llu\n", (unsigned long long)(s.jobs_queued - s.jobs_started));
+	appendf(out, "# TYPE naive_lua_executions_total counter\nnaive_lua_executions_total %llu\n", (unsigned long long)s.lua_exec);
+	appendf(out, "# TYPE naive_lua_errors_total counter\nnaive_lua_errors_total %llu\n", (unsigned long long)s.lua_error);
+
+	out.append("# TYPE naive_requests_total counter\n");
+	for (int m = 0; m < METHOD_MAX; m++)
+	{
+		for (int c = 0; c < STATUS_MAX; c++)
+		{
+			if (!s.requests[m][c]) continue;
+			if (c < STATUS_OTHER) appendf(out, "naive_requests_total{method=\"%s\",code=\"%d\"} %llu\n", method_names[m], status_codes[c], (unsigned long long)s.requests[m][c]);
+			else appendf(out, "naive_requests_total{method=\"%s\",code=\"other\"} %llu\n", method_names[m], (unsigned long long)s.requests[m][c]);
+		}
+	}
+
+	out.append("# TYPE naive_cache_hits_total counter\n");
+	for (int i = 0; i < s.cache_count; i++)
+	{
+		appendf(out, "naive_cache_hits_total{cache=\"%s\"} %llu\n", s.cache_names[i].c_str(), (unsigned long long)s.cache_hit[i]);
+	}
+	out.append("# TYPE naive_cache_misses_total counter\n");
+	for (int i = 0; i < s.cache_count; i++)
+	{
+		appendf(out, "naive_cache_misses_total{cache=\"%s\"} %llu\n", s.cache_names[i].c_str(), (unsigned long long)s.cache_miss[i]);
+	}
+
+	out.append("# TYPE naive_request_duration_seconds histogram\n");
+	for (int r = 0; r < (int)RouteType::Max; r++)
+	{
+		append_histogram(out, "naive_request_duration_seconds", "route", route_names[r], s.latency[r], s.latency_sum_us[r]);
+	}
+	out.append("# TYPE naive_request_phase_seconds histogram\n");
+	for (int ph = 0; ph < (int)Phase::Max; ph++)
+	{
+		append_histogram(out, "naive_request_phase_seconds", "phase", phase_names[ph], s.phase_latency[ph], s.phase_sum_us[ph]);
+	}
+	return out;
+}
+
+int request_handler_status(const Request& req, Response& res)
+{
+	Snapshot s;
+	take_snapshot(s);
+
+	if (req.path == METRICS_STATUS_PATH "/metrics")
+	{
+		res.set_code(200);
+		res.setContent(render_prometheus(s), "text/plain; version=0.0.4");
+	}
+	else
+	{
+		res.set_code(200);
+		res.setContent(render_json(s), "application/json");
+	}
+	res.set_raw("Cache-Control", "no-cache");
+	return 0;
+}
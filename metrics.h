@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include "request.h"
+#include "response.h"
+
+// Route classes used to split latency histograms.
+enum class RouteType
+{
+	Other = 0,
+	Static,
+	Dynamic,
+	Listing,
+	Max
+};
+
+// All counters are kept per-thread and only aggregated on read.
+// Writers never contend with each other.
+void metrics_on_accept();
+void metrics_on_close();
+void metrics_on_send(size_t bytes);
+void metrics_on_job_queued();
+void metrics_on_job_started();
+void metrics_on_lua_exec(bool success);
+void metrics_on_request(const char* method, int status_code, RouteType route, long long elapsed_us);
+// Called by the owner of a timed request once its response is sent. Phase durations go to their own histograms,
+// and requests slower than SLOW_REQUEST_MS are logged with them.
+void metrics_on_timing(const Request& req, const Response& res, const RequestTiming& timing);
+
+// Handlers call this to tell which route class the current request belongs to.
+// The value is consumed (and reset) by the next metrics_take_route() on the same thread.
+void metrics_set_route(RouteType route);
+RouteType metrics_take_route();
+
+// Caches register once (usually from a function-local static) and get an id back.
+// Returns -1 if there is no more slot for a new cache.
+int metrics_register_cache(const char* name);
+void metrics_on_cache(int cache_id, bool hit);
+
+// Path of the internal status page. Prometheus-style text is served at STATUS_PATH "/metrics"
+#define METRICS_STATUS_PATH "/__status"
+
+// Returns:
+// 0 Request is handled.
+int request_handler_status(const Request& req, Response& res);
@@ -0,0 +1,185 @@
+#include "mime.h"
+#include "config.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+using namespace std;
+
+namespace
+{
+	struct BuiltinMime
+	{
+		const char* ext;
+		const char* type;
+	};
+
+	// Must stay sorted by extension (lower case). Checked at compile time below.
+	constexpr BuiltinMime builtin_types[] = {
+		{ "7z", "application/x-7z-compressed" },
+		{ "apk", "application/vnd.android.package-archive" },
+		{ "avif", "image/avif" },
+		{ "bmp", "application/x-bmp" },
+		{ "class", "java/*" },
+		{ "css", "text/css" },
+		{ "csv", "text/csv" },
+		{ "doc", "application/msword" },
+		{ "exe", "application/x-msdownload" },
+		{ "gif", "image/gif" },
+		{ "gz", "application/gzip" },
+		{ "htm", "text/html" },
+		{ "html", "text/html" },
+		{ "ico", "image/x-icon" },
+		{ "java", "java/*" },
+		{ "jpeg", "image/jpeg" },
+		{ "jpg", "image/jpeg" },
+		{ "js", "application/x-javascript" },
+		{ "json", "application/json" },
+		{ "m4a", "audio/mp4" },
+		{ "map", "application/json" },
+		{ "md", "text/markdown" },
+		{ "mjs", "application/x-javascript" },
+		{ "mp3", "audio/mp3" },
+		{ "mp4", "video/mpeg4" },
+		{ "mpg", "video/mpg" },
+		{ "ogg", "audio/ogg" },
+		{ "otf", "font/otf" },
+		{ "pdf", "application/pdf" },
+		{ "png", "image/png" },
+		{ "rmvb", "application/vnd.rn-realmedia-vbr" },
+		{ "svg", "image/svg+xml" },
+		{ "swf", "application/x-shockwave-flash" },
+		{ "tar", "application/x-tar" },
+		{ "torrent", "application/x-bittorrent" },
+		{ "ttf", "font/ttf" },
+		{ "txt", "text/plain" },
+		{ "wasm", "application/wasm" },
+		{ "wav", "audio/wav" },
+		{ "webm", "video/webm" },
+		{ "webmanifest", "application/manifest+json" },
+		{ "webp", "image/webp" },
+		{ "woff", "font/woff" },
+		{ "woff2", "font/woff2" },
+		{ "xhtml", "text/html" },
+		{ "xml", "application/xml" },
+		{ "zip", "application/zip" },
+	};
+
+	constexpr int const_strcmp(const char* a, const char* b)
+	{
+		while (*a && *a == *b)
+		{
+			a++;
+			b++;
+		}
+		return (unsigned char)*a - (unsigned char)*b;
+	}
+
+	constexpr bool builtin_sorted()
+	{
+		for (size_t i = 1; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++)
+		{
+			if (const_strcmp(builtin_types[i - 1].ext, builtin_types[i].ext) >= 0) return false;
+		}
+		return true;
+	}
+
+	static_assert(builtin_sorted(), "builtin_types must be sorted by extension");
+
+	// Extensions longer than this are never looked up.
+	const size_t MAX_EXT = 15;
+
+	struct MimeEntry
+	{
+		string ext;
+		string type;
+	};
+
+	bool entry_less(const MimeEntry& e, const char* ext)
+	{
+		return strcmp(e.ext.c_str(), ext) < 0;
+	}
+
+	void fill_builtin(vector<MimeEntry>& v)
+	{
+		for (const auto& b : builtin_types)
+		{
+			v.push_back(MimeEntry{ b.ext, b.type });
+		}
+	}
+
+	// Copies the lower-cased extension into out. Returns false if there is no usable extension.
+	bool extract_extension(const char* begin, const char* end, char(&out)[MAX_EXT + 1])
+	{
+		const char* p = end;
+		while (p != begin && p[-1] != '.' && p[-1] != '/') p--;
+		if (p == begin || p[-1] != '.') return false;
+		size_t len = end - p;
+		if (len == 0 || len > MAX_EXT) return false;
+		for (size_t i = 0; i < len; i++)
+		{
+			char c = p[i];
+			out[i] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+		}
+		out[len] = 0;
+		return true;
+	}
+}
+
+struct ContentTypes
+{
+	// Sorted by extension.
+	vector<MimeEntry> entries;
+};
+
+const string* FindContentType(const ContentTypes& types, const char* path, size_t len)
+{
+	char ext[MAX_EXT + 1];
+	if (!extract_extension(path, path + len, ext)) return nullptr;
+
+	const vector<MimeEntry>& t = types.entries;
+	auto iter = lower_bound(t.begin(), t.end(), (const char*)ext, entry_less);
+	if (iter != t.end() && iter->ext == ext) return &iter->type;
+	return nullptr;
+}
+
+const string* FindContentType(const char* path, size_t len)
+{
+	const shared_ptr<const ContentTypes>& types = CONTENT_TYPES;
+	if (!types)
+	{
+		// Before config.lua is read.
+		static const shared_ptr<const ContentTypes> builtin = MakeContentTypes({});
+		return FindContentType(*builtin, path, len);
+	}
+	return FindContentType(*types, path, len);
+}
+
+shared_ptr<const ContentTypes> MakeContentTypes(const vector<pair<string, string>>& types)
+{
+	shared_ptr<ContentTypes> result = make_shared<ContentTypes>();
+	vector<MimeEntry>* t = &result->entries;
+	fill_builtin(*t);
+	for (const auto& item : types)
+	{
+		const string& extension = item.first;
+		if (extension.empty()) return nullptr;
+		string dotted = extension[0] == '.' ? extension : "." + extension;
+		char ext[MAX_EXT + 1];
+		if (!extract_extension(dotted.data(), dotted.data() + dotted.size(), ext) || strlen(ext) + 1 != dotted.size())
+		{
+			return nullptr;
+		}
+
+		auto iter = lower_bound(t->begin(), t->end(), (const char*)ext, entry_less);
+		if (iter != t->end() && iter->ext == ext)
+		{
+			iter->type = item.second;
+		}
+		else
+		{
+			t->insert(iter, MimeEntry{ ext, item.second });
+		}
+	}
+	return result;
+}
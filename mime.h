@@ -0,0 +1,20 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Content types by extension: the builtin ones, overridden by mime_types of config.lua.
+// A table is built for every config snapshot and lives as long as it. (see CONTENT_TYPES)
+struct ContentTypes;
+
+// Builds a table from the builtin types and types. Extensions are given with or without the leading dot.
+// Returns nullptr if an extension is invalid.
+std::shared_ptr<const ContentTypes> MakeContentTypes(const std::vector<std::pair<std::string, std::string>>& types);
+
+// Returns the content type for the extension of path (case-insensitive), or nullptr if it is unknown.
+// The returned string lives as long as types.
+const std::string* FindContentType(const ContentTypes& types, const char* path, size_t len);
+
+// Same, in the table of the settings in use. The returned string stays valid while the request runs.
+const std::string* FindContentType(const char* path, size_t len);
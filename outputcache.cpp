@@ -0,0 +1,255 @@
+#include "outputcache.h"
+#include "config.h"
+#include "util.h"
+#include "logging.h"
+#include "metrics.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int SHARD_COUNT = 16;
+// Rough cost of an entry besides its key, headers and content.
+static const size_t ENTRY_OVERHEAD = 128;
+
+namespace
+{
+	struct CachedResponse
+	{
+		int code;
+		vector<pair<string, string>> headers;
+		string content;
+	};
+
+	struct Entry
+	{
+		// Shared with lookups, so content is copied out without holding the lock.
+		shared_ptr<const CachedResponse> response;
+		Clock::time_point expire;
+		size_t cost;
+		// Position in Shard::lru
+		list<const string*>::iterator lru_pos;
+	};
+
+	// How the responses of a path are told apart.
+	struct VarySpec
+	{
+		bool has_vary = false;
+		vector<string> vary;
+	};
+
+	struct Shard
+	{
+		mutex lock;
+		// Key: decoded path
+		unordered_map<string, VarySpec> paths;
+		// Key: decoded path, '\0', then the variant (see append_variant)
+		unordered_map<string, Entry> entries;
+		// Keys of entries, most recently used first.
+		list<const string*> lru;
+		size_t used = 0;
+
+		void erase(unordered_map<string, Entry>::iterator iter);
+	};
+
+	Shard shards[SHARD_COUNT];
+	// Lets lookups skip the locks while nothing is cached.
+	atomic<size_t> entry_count(0);
+
+	void Shard::erase(unordered_map<string, Entry>::iterator iter)
+	{
+		used -= iter->second.cost;
+		lru.erase(iter->second.lru_pos);
+		entries.erase(iter);
+		entry_count--;
+	}
+
+	// FNV-1a
+	Shard& get_shard(const char* path, size_t len)
+	{
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < len; i++)
+		{
+			h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+		}
+		return shards[h % SHARD_COUNT];
+	}
+
+	// Keys are built from fields written as "<length>:<bytes>", or "-" for a missing value. Decoded parameters may
+	// hold any byte ('\0' and '=' included), so without the length "?a=x%00b%3Dy" would share the key of "?a=x&b=y".
+	void append_field(string& key, const char* data, size_t len)
+	{
+		char buff[24];
+		int n = snprintf(buff, sizeof(buff), "%llu:", (unsigned long long)len);
+		key.append(buff, n);
+		key.append(data, len);
+	}
+
+	void append_variant(string& key, const VarySpec& spec, const ParamList& url_param, const Request& req)
+	{
+		if (!spec.has_vary)
+		{
+			for (const auto& pr : url_param)
+			{
+				append_field(key, pr.first.data(), pr.first.size());
+				append_field(key, pr.second.data(), pr.second.size());
+			}
+			return;
+		}
+
+		for (const auto& name : spec.vary)
+		{
+			const ArenaString* param = nullptr;
+			for (const auto& pr : url_param)
+			{
+				if (pr.first.size() == name.size() && memcmp(pr.first.data(), name.data(), name.size()) == 0)
+				{
+					param = &pr.second;
+					break;
+				}
+			}
+			if (param) append_field(key, param->data(), param->size());
+			else key.push_back('-');
+
+			const char* value = req.header.get(name);
+			if (value) append_field(key, value, strlen(value));
+			else key.push_back('-');
+		}
+	}
+}
+
+int OutputCacheLookup(const ArenaString& path, const ParamList& url_param, const Request& req, Response& res)
+{
+	if (OUTPUT_CACHE_SIZE <= 0 || entry_count.load(memory_order_relaxed) == 0) return -1;
+	static int cache_id = metrics_register_cache("output");
+
+	Shard& s = get_shard(path.data(), path.size());
+	shared_ptr<const CachedResponse> response;
+	{
+		thread_local string key;
+		key.assign(path.data(), path.size());
+		lock_guard<mutex> lg(s.lock);
+		auto spec = s.paths.find(key);
+		if (spec == s.paths.end())
+		{
+			// Not a script that asked for caching.
+			return -1;
+		}
+		key.push_back('\0');
+		append_variant(key, spec->second, url_param, req);
+
+		auto iter = s.entries.find(key);
+		if (iter != s.entries.end() && iter->second.expire <= Clock::now())
+		{
+			s.erase(iter);
+			iter = s.entries.end();
+		}
+		if (iter == s.entries.end())
+		{
+			metrics_on_cache(cache_id, false);
+			return -1;
+		}
+		s.lru.splice(s.lru.begin(), s.lru, iter->second.lru_pos);
+		response = iter->second.response;
+	}
+	metrics_on_cache(cache_id, true);
+
+	res.set_code(response->code);
+	for (const auto& h : response->headers)
+	{
+		res.set_raw(h.first, h.second);
+	}
+	res.setContentRaw(response->content);
+	return 0;
+}
+
+void OutputCacheStore(const Request& req, const Response& res, const OutputCachePolicy& policy)
+{
+	if (policy.ttl <= 0 || OUTPUT_CACHE_SIZE <= 0 || res.get_code() != 200 || req.method != "GET") return;
+
+	ArenaString path(ArenaAllocator<char>(req.arena()));
+	ParamList url_param(ArenaAllocator<ParamList::value_type>(req.arena()));
+	if (urldecode(req.path.data(), req.path.size(), path, url_param) < 0) return;
+
+	auto response = make_shared<CachedResponse>();
+	response->code = res.get_code();
+	size_t cost = ENTRY_OVERHEAD + res.get_content().size();
+	for (const auto& f : res.get_headers())
+	{
+		// Set again with the content.
+		if (f.id == HeaderId::ContentLength) continue;
+		response->headers.emplace_back(string(f.name, f.name_len), string(f.value, f.value_len));
+		cost += f.name_len + f.value_len;
+	}
+	response->content = res.get_content();
+
+	size_t limit = (size_t)OUTPUT_CACHE_SIZE * 1024 / SHARD_COUNT;
+	string key(path.data(), path.size());
+
+	Shard& s = get_shard(path.data(), path.size());
+	lock_guard<mutex> lg(s.lock);
+	VarySpec& spec = s.paths[key];
+	if (spec.has_vary != policy.has_vary || spec.vary != policy.vary)
+	{
+		// The script changed what its responses vary on. Responses kept before are keyed differently.
+		key.push_back('\0');
+		for (auto iter = s.entries.begin(); iter != s.entries.end(); )
+		{
+			auto cur = iter++;
+			if (cur->first.compare(0, key.size(), key) == 0) s.erase(cur);
+		}
+		key.pop_back();
+		spec.has_vary = policy.has_vary;
+		spec.vary = policy.vary;
+	}
+	key.push_back('\0');
+	append_variant(key, spec, url_param, req);
+	// The full key is kept in entries and its path in paths. Parameters or varied headers may make it the largest part.
+	cost += key.size() + path.size();
+	if (cost > limit)
+	{
+		logd("Response of %s is too large to cache.\n", path.c_str());
+		return;
+	}
+
+	auto iter = s.entries.find(key);
+	if (iter != s.entries.end())
+	{
+		s.erase(iter);
+	}
+	iter = s.entries.emplace(std::move(key), Entry()).first;
+	entry_count++;
+	Entry& e = iter->second;
+	e.response = std::move(response);
+	e.expire = Clock::now() + chrono::microseconds(seconds_to_us(policy.ttl));
+	e.cost = cost;
+	s.lru.push_front(&iter->first);
+	e.lru_pos = s.lru.begin();
+	s.used += cost;
+
+	while (s.used > limit && s.lru.back() != &iter->first)
+	{
+		s.erase(s.entries.find(*s.lru.back()));
+	}
+}
+
+void OutputCacheClear()
+{
+	for (auto& sd : shards)
+	{
+		lock_guard<mutex> lg(sd.lock);
+		entry_count -= sd.entries.size();
+		sd.entries.clear();
+		sd.paths.clear();
+		sd.lru.clear();
+		sd.used = 0;
+	}
+}
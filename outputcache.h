@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "arena.h"
+#include "request.h"
+#include "response.h"
+
+// Responses of Lua scripts that set response.cache_ttl are kept in memory, and later GETs
+// of the same path are answered from here without running the script again.
+// Responses are told apart by all url params, or only by the params and request headers
+// named in response.cache_vary if it is set.
+// The memory used is capped by OUTPUT_CACHE_SIZE. Least recently used responses are dropped first.
+
+struct OutputCachePolicy
+{
+	// Seconds. 0: Not cached.
+	double ttl = 0;
+	bool has_vary = false;
+	std::vector<std::string> vary;
+};
+
+// path and url_param are decoded from req.path.
+// Returns:
+// 0 res is filled from the cache.
+// -1 Not cached.
+int OutputCacheLookup(const ArenaString& path, const ParamList& url_param, const Request& req, Response& res);
+
+// Keeps res (filled by a script for req) if policy asks for it. Only GET requests with code 200 are kept.
+void OutputCacheStore(const Request& req, const Response& res, const OutputCachePolicy& policy);
+
+// Drops all cached responses. Called when config.lua is reloaded, since scripts may have changed.
+void OutputCacheClear();
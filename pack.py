@@ -0,0 +1,101 @@
+import os
+import struct
+import gzip
+from hashlib import md5
+from sys import argv
+
+# Packs the static files under a server root into one bundle file.
+# Set asset_bundle in config.lua to serve them from the bundle. Lua scripts are not packed.
+#
+# Layout (little-endian), must match bundle.cpp:
+#   Header  magic "NHPK", u32 version, u32 entry_count, u32 table_size, u64 entries_off, u64 table_off
+#   Table   u32[table_size] entry index (0xFFFFFFFF: empty). Open addressing on FNV-1a of the path, linear probing.
+#   Entries u64 hash, u64 path_off, u32 path_len, u32 etag_len, u64 etag_off,
+#           u64 data_off, u64 data_len, u64 gzip_off, u64 gzip_len (gzip_len 0: no gzip variant)
+#   Paths, ETags and contents follow.
+
+_magic=b'NHPK'
+_version=1
+_header=struct.Struct('<4sIIIQQ')
+_entry=struct.Struct('<QQIIQQQQQ')
+_empty=0xFFFFFFFF
+
+# Gzip variants are only kept if they save at least this much.
+_min_gzip_saving=0.1
+_min_gzip_size=256
+
+def FNV1a(data):
+    h=14695981039346656037
+    for b in data:
+        h=((h^b)*1099511628211)&0xFFFFFFFFFFFFFFFF
+    return h
+
+def CollectFiles(root):
+    files=[]
+    for dirpath,dirnames,filenames in os.walk(root):
+        dirnames.sort()
+        for name in sorted(filenames):
+            if(name.endswith('.lua')):
+                continue
+            full=os.path.join(dirpath,name)
+            rel=os.path.relpath(full,root).replace(os.sep,'/')
+            files.append(('/'+rel,full))
+    return files
+
+def Pack(root,output,use_gzip=True):
+    files=CollectFiles(root)
+    table_size=1
+    while(table_size<len(files)*2):
+        table_size*=2
+
+    table_off=_header.size
+    entries_off=table_off+4*table_size
+    blob_off=entries_off+_entry.size*len(files)
+
+    blob=bytearray()
+    entries=[]
+    table=[_empty]*table_size
+    saved=0
+    for idx,(path,full) in enumerate(files):
+        with open(full,'rb') as f:
+            content=f.read()
+        path_bytes=path.encode('utf-8')
+        etag=('"'+md5(content).hexdigest()[:16]+'"').encode('ascii')
+
+        path_off=blob_off+len(blob)
+        blob+=path_bytes
+        etag_off=blob_off+len(blob)
+        blob+=etag
+        data_off=blob_off+len(blob)
+        blob+=content
+
+        gzip_off,gzip_len=0,0
+        if(use_gzip and len(content)>=_min_gzip_size):
+            compressed=gzip.compress(content,9)
+            if(len(compressed)<=len(content)*(1-_min_gzip_saving)):
+                gzip_off=blob_off+len(blob)
+                gzip_len=len(compressed)
+                blob+=compressed
+                saved+=len(content)-len(compressed)
+
+        h=FNV1a(path_bytes)
+        slot=h&(table_size-1)
+        while(table[slot]!=_empty):
+            slot=(slot+1)&(table_size-1)
+        table[slot]=idx
+        entries.append(_entry.pack(h,path_off,len(path_bytes),len(etag),etag_off,data_off,len(content),gzip_off,gzip_len))
+
+    with open(output,'wb') as f:
+        f.write(_header.pack(_magic,_version,len(files),table_size,entries_off,table_off))
+        f.write(struct.pack('<%dI'%table_size,*table))
+        for e in entries:
+            f.write(e)
+        f.write(blob)
+
+    print('Packed {} files into {} ({} bytes, gzip variants save {} bytes)'.format(len(files),output,blob_off+len(blob),saved))
+
+if __name__ == "__main__":
+    if(len(argv)<3):
+        print('Usage: python pack.py <server_root> <output> [--no-gzip]')
+    else:
+        Pack(argv[1],argv[2],'--no-gzip' not in argv[3:])
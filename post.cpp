@@ -1,45 +1,32 @@
 #include "post.h"
-#include "vmop.h"
+#include "luatask.h"
 #include "request.h"
 #include "response.h"
 #include "util.h"
 #include "config.h"
-#include "log.h"
+#include "logging.h"
 #include "dirop.h"
-#include <cstring>
+#include "metrics.h"
+#include "filecache.h"
 using namespace std;
 
 static int request_handler_post_dynamic(const Request& req, Response& res,
-	const string& path_decoded, const map<string, string>& url_param) 
+	const ArenaString& path_decoded)
 {
 	logd("Loading lua file: %s\n", path_decoded.c_str());
 
-	string lua_code;
-	int ret = GetFileContent(path_decoded, lua_code);
+	shared_ptr<const string> lua_code;
+	int ret = FileCacheGetScript(path_decoded.c_str(), lua_code);
+	req.mark(Phase::Read);
 	if (ret < 0)
 	{
 		return -1;
 	}
 
-	VM v;
-	auto L = v.get();
-	lua_newtable(L);
-	lua_pushstring(L, req.http_version.c_str());
-	lua_setfield(L, 1, "http_version"); // request["http_version"]=...
-
-	lua_pushstring(L, "POST");
-	lua_setfield(L, 1, "method"); // request["method"]="POST"
-
-	for (const auto& pr : req.header)
-	{
-		lua_pushstring(L, pr.second.c_str());
-		lua_setfield(L, 1, pr.first.c_str()); // request[...]=...
-	}
-
-	// Parameter (Posted Content). May contain binary content.
-	lua_pushlstring(L, req.data.data(), req.data.size());
-	lua_setfield(L, 1, "param");
-
+	LuaTask* task = new LuaTask;
+	task->set_limits(LUA_LIMITS(path_decoded.c_str()));
+	auto L = task->get();
+	push_request_table(L, req);
 	lua_setglobal(L, "request");
 
 	// Lua CGI program should fill the response table.
@@ -47,95 +34,29 @@ static int request_handler_post_dynamic(const Request& req, Response& res,
 	lua_newtable(L);
 	lua_setglobal(L, "response");
 
-	logd("Preparing helper...\n");
-
-	if (v.runCode("helper={} helper.print=function(...) local t=table.pack(...) "s +
-		"if(response.output==nil) then response.output='' end " +
-		"local temp='' " +
-		"for i,v in ipairs(t) do " +
-		"if(#(temp)>0) then temp = temp .. '\\t' end " +
-		"temp = temp .. tostring(v) " +
-		"end " +
-		"response.output = response.output .. temp .. '\\n' " +
-		"end ") < 0)
-	{
-		loge("Failed to prepare helper.\n");
-		return -2;
-	}
-
 	logd("Executing lua file: %s\n", path_decoded.c_str());
-	if (v.runCode(lua_code) < 0)
-	{
-		loge("Failed to run user lua code.\n");
-		return -3;
-	}
-
-	logd("Execution finished successfully.\n");
-
-	v.getglobal("response");
-
-	if (!lua_istable(L, -1)) // type(response)~="table"
-	{
-		logd("LuaVM: variable 'response' is not a table.\n");
-		return -4;
-	}
-
-	v.pushnil();
-
-	while (lua_next(L, -2))
-	{
-		if (lua_isstring(L, -2))  // type(key)=="string"
-		{
-			const char* item_name = lua_tostring(L, -2);
-			const char* item_value = lua_tostring(L, -1);
-
-			if ((!item_name) || (!item_value))
-			{
-				logd("LuaVM: An item cannot be converted to string. Key: %s\n", item_name);
-			}
-			else
-			{
-				if (strcmp(item_name, "output") != 0)
-				{
-					res.set_raw(item_name, item_value);
-				}
-				else
-				{
-					res.setContentRaw(item_value);
-				}
-			}
-		}
-		lua_pop(L, 1);
-	}
-
-	res.set_code(200);
-	return 0;
+	return run_request_script(task, *lua_code, req, res);
 }
 
 int request_handler_post(const Request& req, Response& res)
 {
 	// URL decoded path
-	string path;
-	map<string, string> url_param;
-	if (urldecode(req.path, path, url_param) < 0)
+	ArenaString path(ArenaAllocator<char>(req.arena()));
+	ParamList url_param(ArenaAllocator<ParamList::value_type>(req.arena()));
+	if (urldecode(req.path.data(), req.path.size(), path, url_param) < 0)
 	{
 		loge("Failed to decode url : %s\n", req.path.c_str());
 		return -1;
 	}
 
 	// Request to / would be dispatched to /index.lua
-	if (endwith(path, "/"))
+	if (!path.empty() && path.back() == '/')
 	{
-		Request xreq = req;
-		xreq.path += "index.lua";
-		if (request_handler_post(xreq, res) < 0)
-		{
-			res.set_code(404);
-		}
-		return 0;
+		path.append("index.lua");
 	}
 
-	int request_type = get_request_path_type(path);
+	int request_type = get_request_path_type(path.c_str());
+	req.mark(Phase::Route);
 	if (request_type < 0)
 	{
 		res.set_code(404);
@@ -150,10 +71,12 @@ int request_handler_post(const Request& req, Response& res)
 	}
 	else
 	{
-		if (request_handler_post_dynamic(req,res,path,url_param) < 0)
+		metrics_set_route(RouteType::Dynamic);
+		int ret = request_handler_post_dynamic(req, res, path);
+		if (ret < 0)
 		{
 			res.set_code(500);
 		}
-		return 0;
+		return ret == REQUEST_PENDING ? REQUEST_PENDING : 0;
 	}
 }
\ No newline at end of file
@@ -1,37 +1,53 @@
 #include "request.h"
 #include "config.h"
+#include "fastscan.h"
 #include <vector>
 
 using namespace std;
 
-int parse_header(const std::string& header_raw,Request& req)
+Request::Request(Arena* arena) : method(ArenaAllocator<char>(arena)), path(ArenaAllocator<char>(arena)),
+	http_version(ArenaAllocator<char>(arena)), header(arena), completion(nullptr), timing(nullptr), _arena(arena)
 {
-	int now = 0;
+
+}
+
+Arena* Request::arena() const
+{
+	return _arena;
+}
+
+int parse_header(const char* header_raw, size_t len, Request& req)
+{
+	const char* s = header_raw;
+	size_t now = 0;
 	size_t target;
-	if (string::npos != (target = header_raw.find("\r\n")))
+	// Names and values take no more room than the raw header (posted data excluded).
+	size_t header_len = scan_header_end(s, len);
+	req.header.reserve(header_len != string::npos ? header_len : len);
+	if (string::npos != (target = scan_crlf(s, len)))
 	{
 		size_t endpos = 0;
 		size_t beginpos = 0;
-		if (string::npos != (endpos = header_raw.find(" ")) &&
-			endpos < target)
+		if (string::npos != (endpos = scan_byte(s, target, ' ')))
 		{
-			req.method = header_raw.substr(0, endpos);
+			req.method.assign(s, endpos);
 		}
 		else return -1;
 		beginpos = endpos + 1;
-		if (string::npos != (endpos = header_raw.find(" ", beginpos)) &&
-			endpos < target)
+		if (string::npos != (endpos = scan_byte(s + beginpos, target - beginpos, ' ')))
 		{
-			req.path = header_raw.substr(beginpos, endpos - beginpos);
+			endpos += beginpos;
+			req.path.assign(s + beginpos, endpos - beginpos);
 		}
 		else return -1;
 		beginpos = endpos + 1;
-		req.http_version = header_raw.substr(beginpos,target-beginpos);
+		req.http_version.assign(s + beginpos, target - beginpos);
 		now = target + 2;
 	}
 
-	while (string::npos != (target = header_raw.find("\r\n", now)))
+	while (string::npos != (target = scan_crlf(s + now, len - now)))
 	{
+		target += now;
 		if (target - now == 0)
 		{
 			// This is the final \r\n\r\n, stop.
@@ -39,12 +55,12 @@ int parse_header(const std::string& header_raw,Request& req)
 		}
 		// Analyze this line [now,target)
 		size_t endpos = 0;
-		if (string::npos != (endpos = header_raw.find(":", now)) &&
-			endpos < target)
+		if (string::npos != (endpos = scan_byte(s + now, target - now, ':')))
 		{
+			endpos += now;
 			size_t curpos = endpos + 1;
-			while(header_raw[curpos] == ' ') curpos++;
-			req.header[header_raw.substr(now, endpos-now)] = header_raw.substr(curpos, target - curpos);
+			while(curpos < target && s[curpos] == ' ') curpos++;
+			req.header.set(s + now, endpos - now, s + curpos, target - curpos);
 		}
 		else return -2;
 		now = target + 2;
@@ -1,16 +1,56 @@
 #pragma once
 #include <string>
-#include <map>
+#include "arena.h"
+#include "headermap.h"
+#include "timing.h"
+#include "config.h"
+
+// Returned by request handlers that finish the response later (see Request::completion).
+#define REQUEST_PENDING 2
+
+// Implemented by the owner of a request, so a handler can finish the response after it has returned.
+class RequestCompletion
+{
+public:
+	virtual ~RequestCompletion() {}
+	// Called once the response is filled. May be called on any thread.
+	virtual void complete() = 0;
+};
 
 class Request
 {
 public:
-	std::string method;
-	std::string path;
-	std::string http_version;
-	std::map<std::string, std::string> header;
+	// Everything parsed into the request is allocated from arena (if not nullptr).
+	explicit Request(Arena* arena = nullptr);
+
+	ArenaString method;
+	ArenaString path;
+	ArenaString http_version;
+	HeaderMap header;
 	// data contains data after http header. (work with POST requests)
 	std::string data;
+
+	// If not nullptr, handlers may return REQUEST_PENDING and call completion->complete() later.
+	// Otherwise the response must be filled before handlers return.
+	RequestCompletion* completion;
+
+	// If not nullptr, the phases of this request are timed in it. The owner starts it and takes the result.
+	RequestTiming* timing;
+
+	// Marks the end of phase p, if the request is timed.
+	void mark(Phase p) const
+	{
+		if (timing) timing->mark(p);
+	}
+
+	// Settings of this request, taken by the owner when it is received. request_handler() reads all settings from it,
+	// so a reload in the middle does not mix old and new values. Empty: the latest snapshot.
+	ConfigSnapshot config;
+
+	// Handlers allocate request-scoped data from here. May be nullptr.
+	Arena* arena() const;
+private:
+	Arena* _arena;
 };
 
-int parse_header(const std::string& header_raw, Request& req);
+int parse_header(const char* header_raw, size_t len, Request& req);
@@ -1,18 +1,28 @@
 #include <ctime>
+#include <cstdio>
+#include <utility>
 
 #include "response.h"
 #include "util.h"
-#include "log.h"
+#include "logging.h"
 using namespace std;
 
-static string default_header(const string& header, const string& info)
+static string default_header(const char* header, const char* info)
 {
 	return string("<html><head><title>") + header + "</title></head><body><h1>" + header + "</h1>" + info + "</body></html>";
 }
 
+Response::Response(Arena* arena) : header(ArenaAllocator<char>(arena)), mp(arena)
+{
+	code = 0;
+}
+
 /// Set code will reset response status
 void Response::set_code(int code)
 {
+	this->code = code;
+	prepared.reset();
+	prepared_data.reset();
 	header = "HTTP/1.1 ";
 	switch (code)
 	{
@@ -22,6 +32,9 @@ void Response::set_code(int code)
 	case 206:
 		header.append("206 Partial Content");
 		break;
+	case 304:
+		header.append("304 Not Modified");
+		break;
 	case 400:
 		header.append("400 Bad Request");
 		break;
@@ -34,23 +47,26 @@ void Response::set_code(int code)
 		break;
 	case 405:
 		header.append("405 Method Not Allowed");
-		setContent(default_header(header, "The method is not allowed."));
+		setContent(default_header(header.c_str(), "The method is not allowed."));
 		break;
 	case 416:
 		header.append("416 Requested Range Not Satisfiable");
-		setContent(default_header(header, "Invalid range request header."));
+		setContent(default_header(header.c_str(), "Invalid range request header."));
+		break;
+	case 431:
+		header.append("431 Request Header Fields Too Large");
 		break;
 	case 500:
 		header.append("500 Internal Server Error");
-		setContent(default_header(header, "Server has encoutered an internal error while processing your request."));
+		setContent(default_header(header.c_str(), "Server has encoutered an internal error while processing your request."));
 		break;
 	case 501:
 		header.append("501 Not Implemented");
-		setContent(default_header(header, "The method is not implemented."));
+		setContent(default_header(header.c_str(), "The method is not implemented."));
 		break;
 	case 503:
 		header.append("503 Service Unavailable");
-		setContent(default_header(header, "Service is not available for now. Please try later."));
+		setContent(default_header(header.c_str(), "Service is not available for now. Please try later."));
 		break;
 	default:
 		logw("No response code found: %d\n", code);
@@ -58,25 +74,56 @@ void Response::set_code(int code)
 	header.append("\r\n");
 }
 
+int Response::get_code() const
+{
+	return code;
+}
+
 void Response::set_raw(const string & name, const string & value)
 {
-	mp[name] = value;
+	mp.set(name, value);
+}
+
+void Response::set_raw(const char* name, size_t name_len, const char* value, size_t value_len)
+{
+	mp.set(name, name_len, value, value_len);
 }
 
 void Response::setContentLength(int length)
 {
-	set_raw("Content-Length", to_string(length));
+	mp.set(HeaderId::ContentLength, to_string(length));
 }
 
 void Response::setContentType(const string & content_type)
 {
-	set_raw("Content-Type", content_type);
+	mp.set(HeaderId::ContentType, content_type);
 }
 
 void Response::setContentRaw(const string& content)
 {
 	setContentLength(content.size());
 	data = content;
+	prepared_data.reset();
+}
+
+void Response::setContentRaw(string&& content)
+{
+	setContentLength(content.size());
+	data = std::move(content);
+	prepared_data.reset();
+}
+
+void Response::setPrepared(int code, shared_ptr<const string> header_block, shared_ptr<const string> content)
+{
+	this->code = code;
+	header.clear();
+	prepared = std::move(header_block);
+	prepared_data = std::move(content);
+}
+
+const string* Response::get_prepared() const
+{
+	return prepared.get();
 }
 
 void Response::setContent(const string & content, const string & content_type)
@@ -85,6 +132,22 @@ void Response::setContent(const string & content, const string & content_type)
 	setContentType(content_type);
 }
 
+void Response::setContent(string&& content, const string & content_type)
+{
+	setContentRaw(std::move(content));
+	setContentType(content_type);
+}
+
+const HeaderMap& Response::get_headers() const
+{
+	return mp;
+}
+
+const string& Response::get_content() const
+{
+	return prepared_data ? *prepared_data : data;
+}
+
 // Use struct tm::tm_wday for weekday value.
 static const char* GetWeekAbbr(int weekday)
 {
@@ -108,40 +171,86 @@ static const char* GetMonthAbbr(int month)
 	else return m[month - 1];
 }
 
+size_t FormatHttpDate(time_t t, char* buff, size_t size)
+{
+	struct tm tt;
+#ifdef _WIN32
+	gmtime_s(&tt, &t);
+#else
+	gmtime_r(&t, &tt);
+#endif
+	int ret = snprintf(buff, size, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+		GetWeekAbbr(tt.tm_wday),
+		tt.tm_mday, GetMonthAbbr(tt.tm_mon + 1), tt.tm_year + 1900,
+		tt.tm_hour, tt.tm_min, tt.tm_sec);
+	return ret > 0 ? (size_t)ret : 0;
+}
+
 // Standard format: Fri, 09 Mar 2018 07:06:13 GMT
-static string GetCurrentDateString()
+// The string only changes once a second, so each thread keeps the last one. Returns its length.
+static size_t GetCurrentDateString(const char*& out)
 {
+	thread_local time_t last = -1;
+	thread_local char buff[64];
+	thread_local size_t len = 0;
+
 	time_t t;
-	struct tm* tt = NULL;
 	time(&t);
-	tt = localtime(&t);
-	
-	char buff[128] = { 0 };
-	sprintf(buff, "%s, %02d %s %04d %02d:%02d:%02d GMT",
-		GetWeekAbbr(tt->tm_wday),
-		tt->tm_mday, GetMonthAbbr(tt->tm_mon + 1), tt->tm_year + 1900,
-		tt->tm_hour, tt->tm_min, tt->tm_sec);
+	if (t != last)
+	{
+		len = FormatHttpDate(t, buff, sizeof(buff));
+		last = t;
+	}
+	out = buff;
+	return len;
+}
 
-	return buff;
+void Response::finish_headers()
+{
+	static const char server[] = "NaiveHTTPServer by Kiritow";
+	const char* date;
+	size_t date_len = GetCurrentDateString(date);
+	mp.set("Server", 6, server, sizeof(server) - 1);
+	mp.set("Date", 4, date, date_len);
 }
 
-string Response::toString()
+ArenaString Response::toString()
 {
 	/// Server does not support keep-alive connection.
-	set_raw("Connection", "close");
-	set_raw("Server", "NaiveHTTPServer by Kiritow");
-	set_raw("Date", GetCurrentDateString());
+	static const char conn[] = "close";
+	mp.set("Connection", 10, conn, sizeof(conn) - 1);
+	finish_headers();
+
+	size_t total = header.size() + 2 + data.size();
+	for (const auto& f : mp)
+	{
+		total += f.name_len + f.value_len + 4;
+	}
 
-	string ans;
+	const string& content = get_content();
+	if (prepared)
+	{
+		total += prepared->size() + content.size() - data.size();
+	}
+
+	ArenaString ans(header.get_allocator());
+	ans.reserve(total);
 	ans.append(header);
-	for (auto& pr : mp)
+	if (prepared)
+	{
+		ans.append(prepared->data(), prepared->size());
+	}
+	for (const auto& f : mp)
 	{
-		ans.append(pr.first + ": " + pr.second + "\r\n");
+		ans.append(f.name, f.name_len);
+		ans.append(": ", 2);
+		ans.append(f.value, f.value_len);
+		ans.append("\r\n", 2);
 	}
 	ans.append("\r\n");
-	if (!data.empty())
+	if (!content.empty())
 	{
-		ans.append(data);
+		ans.append(content.data(), content.size());
 	}
 	return ans;
 }
\ No newline at end of file
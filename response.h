@@ -1,28 +1,61 @@
 #pragma once
 #include <string>
-#include <map>
+#include <memory>
+#include <ctime>
 #include "NetworkProvider.h"
+#include "headermap.h"
 
 class Response
 {
 public:
+	// The status line and headers are allocated from arena (if not nullptr).
+	explicit Response(Arena* arena = nullptr);
+
 	/// Set code will reset response status
 	void set_code(int code);
 
+	/// Returns the code set by set_code(). 0 if it is never set.
+	int get_code() const;
+
 	void set_raw(const std::string& name, const std::string& value);
+	void set_raw(const char* name, size_t name_len, const char* value, size_t value_len);
 
 	void setContentLength(int length);
 
 	void setContentType(const std::string& content_type);
 
 	void setContent(const std::string& content, const std::string& content_type = "text/html");
+	// Takes over content without copying it.
+	void setContent(std::string&& content, const std::string& content_type);
+
+	// Sends header_block (the status line and headers, each line ending with CRLF) and content as they are,
+	// without copying them. Only Server, Date and Connection, and fields set with set_raw(), are added.
+	// Calling set_code() or setContentRaw() drops them.
+	void setPrepared(int code, std::shared_ptr<const std::string> header_block, std::shared_ptr<const std::string> content);
+
+	// The block given to setPrepared(), or nullptr.
+	const std::string* get_prepared() const;
 
 	// This function only set content and content length. Content type will not be set.
 	void setContentRaw(const std::string& content);
+	void setContentRaw(std::string&& content);
 
-	std::string toString();
+	// Headers and content set so far.
+	const HeaderMap& get_headers() const;
+	const std::string& get_content() const;
+
+	// Adds Server and Date. toString() does this as well.
+	void finish_headers();
+
+	ArenaString toString();
 private:
-	std::string header;
-	std::map<std::string, std::string> mp;
+	int code;
+	ArenaString header;
+	HeaderMap mp;
 	std::string data;
-};
\ No newline at end of file
+	std::shared_ptr<const std::string> prepared;
+	std::shared_ptr<const std::string> prepared_data;
+};
+
+// Formats t like "Fri, 09 Mar 2018 07:06:13 GMT". Returns the length.
+size_t FormatHttpDate(time_t t, char* buff, size_t size);
\ No newline at end of file
@@ -0,0 +1,385 @@
+#include "shareddict.h"
+#include "config.h"
+#include "logging.h"
+#include "metrics.h"
+#include "util.h"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int SHARD_COUNT = 64;
+// Rough cost of an entry besides its key and string.
+static const size_t ENTRY_OVERHEAD = 96;
+
+namespace
+{
+	struct Entry
+	{
+		SharedValue value;
+		bool has_expire;
+		Clock::time_point expire;
+		// Position in Shard::lru
+		list<const string*>::iterator lru_pos;
+
+		bool expired(Clock::time_point now) const
+		{
+			return has_expire && expire <= now;
+		}
+	};
+
+	size_t entry_cost(const string& key, const SharedValue& value)
+	{
+		return key.size() + value.str.size() + ENTRY_OVERHEAD;
+	}
+
+	struct Shard
+	{
+		mutex lock;
+		unordered_map<string, Entry> entries;
+		// Keys of entries, most recently used first.
+		list<const string*> lru;
+		size_t used = 0;
+
+		void erase(unordered_map<string, Entry>::iterator iter)
+		{
+			used -= entry_cost(iter->first, iter->second.value);
+			lru.erase(iter->second.lru_pos);
+			entries.erase(iter);
+		}
+
+		// Returns entries.end() if key is not found or expired.
+		unordered_map<string, Entry>::iterator find(const string& key, Clock::time_point now)
+		{
+			auto iter = entries.find(key);
+			if (iter == entries.end()) return iter;
+			if (iter->second.expired(now))
+			{
+				erase(iter);
+				return entries.end();
+			}
+			lru.splice(lru.begin(), lru, iter->second.lru_pos);
+			return iter;
+		}
+
+		// Inserts or replaces the value of key, then drops old entries until the shard fits in limit.
+		void put(const string& key, const SharedValue& value, bool has_expire, Clock::time_point expire, size_t limit)
+		{
+			auto iter = entries.find(key);
+			if (iter == entries.end())
+			{
+				iter = entries.emplace(key, Entry()).first;
+				lru.push_front(&iter->first);
+				iter->second.lru_pos = lru.begin();
+			}
+			else
+			{
+				used -= entry_cost(key, iter->second.value);
+				lru.splice(lru.begin(), lru, iter->second.lru_pos);
+			}
+			iter->second.value = value;
+			iter->second.has_expire = has_expire;
+			iter->second.expire = expire;
+			used += entry_cost(key, value);
+
+			while (used > limit && lru.back() != &iter->first)
+			{
+				erase(entries.find(*lru.back()));
+			}
+		}
+	};
+
+	Shard shards[SHARD_COUNT];
+
+	Shard& get_shard(const string& key)
+	{
+		return shards[hash<string>()(key) % SHARD_COUNT];
+	}
+
+	size_t shard_limit()
+	{
+		return (size_t)SHARED_DICT_SIZE * 1024 / SHARD_COUNT;
+	}
+
+	bool is_number(const SharedValue& value)
+	{
+		return value.type == SharedValue::Integer || value.type == SharedValue::Number;
+	}
+
+	double to_double(const SharedValue& value)
+	{
+		return value.type == SharedValue::Integer ? (double)value.integer : value.number;
+	}
+}
+
+int shared_get(const string& key, SharedValue& out_value)
+{
+	static int cache_id = metrics_register_cache("shared");
+	Shard& s = get_shard(key);
+	lock_guard<mutex> lg(s.lock);
+	auto iter = s.find(key, Clock::now());
+	metrics_on_cache(cache_id, iter != s.entries.end());
+	if (iter == s.entries.end()) return -1;
+	out_value = iter->second.value;
+	return 0;
+}
+
+int shared_set(const string& key, const SharedValue& value, double ttl)
+{
+	Shard& s = get_shard(key);
+	if (value.type == SharedValue::Nil)
+	{
+		lock_guard<mutex> lg(s.lock);
+		auto iter = s.entries.find(key);
+		if (iter != s.entries.end()) s.erase(iter);
+		return 0;
+	}
+
+	size_t limit = shard_limit();
+	if (entry_cost(key, value) > limit) return -1;
+
+	Clock::time_point now = Clock::now();
+	lock_guard<mutex> lg(s.lock);
+	s.put(key, value, ttl > 0, now + chrono::microseconds(seconds_to_us(ttl)), limit);
+	return 0;
+}
+
+int shared_incr(const string& key, const SharedValue& delta, const SharedValue& init, double ttl, SharedValue& out_value)
+{
+	if (!is_number(delta) || !is_number(init)) return -1;
+
+	Shard& s = get_shard(key);
+	Clock::time_point now = Clock::now();
+	lock_guard<mutex> lg(s.lock);
+	auto iter = s.find(key, now);
+	const SharedValue& base = iter != s.entries.end() ? iter->second.value : init;
+	if (!is_number(base)) return -1;
+
+	out_value.str.clear();
+	if (base.type == SharedValue::Integer && delta.type == SharedValue::Integer)
+	{
+		out_value.type = SharedValue::Integer;
+		// Wraps around like Lua integers. Signed overflow would be undefined.
+		out_value.integer = (long long)((uint64_t)base.integer + (uint64_t)delta.integer);
+	}
+	else
+	{
+		out_value.type = SharedValue::Number;
+		out_value.number = to_double(base) + to_double(delta);
+	}
+
+	if (iter != s.entries.end())
+	{
+		// Numbers take no extra memory, and the expire time is kept.
+		iter->second.value = out_value;
+	}
+	else
+	{
+		s.put(key, out_value, ttl > 0, now + chrono::microseconds(seconds_to_us(ttl)), shard_limit());
+	}
+	return 0;
+}
+
+int shared_ttl(const string& key, double& out_seconds)
+{
+	Shard& s = get_shard(key);
+	Clock::time_point now = Clock::now();
+	lock_guard<mutex> lg(s.lock);
+	auto iter = s.find(key, now);
+	if (iter == s.entries.end()) return -1;
+	if (!iter->second.has_expire)
+	{
+		out_seconds = -1;
+	}
+	else
+	{
+		out_seconds = chrono::duration_cast<chrono::duration<double>>(iter->second.expire - now).count();
+	}
+	return 0;
+}
+
+// Lua errors longjmp out of the functions below, so they keep nothing on the C++ stack
+// that needs a destructor. Keys and values go through these per-thread buffers instead.
+static thread_local string tls_key;
+static thread_local SharedValue tls_value;
+static thread_local SharedValue tls_arg;
+static thread_local SharedValue tls_init;
+
+static const string& check_key(lua_State* L)
+{
+	size_t len;
+	const char* key = luaL_checklstring(L, 1, &len);
+	tls_key.assign(key, len);
+	return tls_key;
+}
+
+// Reads a number, a string or nil at idx.
+static void check_value(lua_State* L, int idx, SharedValue& out_value)
+{
+	int type = lua_type(L, idx);
+	if (type == LUA_TNUMBER)
+	{
+		if (lua_isinteger(L, idx))
+		{
+			out_value.type = SharedValue::Integer;
+			out_value.integer = lua_tointeger(L, idx);
+		}
+		else
+		{
+			out_value.type = SharedValue::Number;
+			out_value.number = lua_tonumber(L, idx);
+		}
+		out_value.str.clear();
+	}
+	else if (type == LUA_TSTRING)
+	{
+		size_t len;
+		const char* str = lua_tolstring(L, idx, &len);
+		out_value.type = SharedValue::String;
+		out_value.str.assign(str, len);
+	}
+	else if (type <= LUA_TNIL)
+	{
+		out_value.type = SharedValue::Nil;
+		out_value.str.clear();
+	}
+	else
+	{
+		luaL_argerror(L, idx, "number, string or nil expected");
+	}
+}
+
+// Reads a number (or a string convertible to one) at idx.
+static void check_number(lua_State* L, int idx, SharedValue& out_value)
+{
+	lua_Number n = luaL_checknumber(L, idx);
+	if (lua_isinteger(L, idx))
+	{
+		out_value.type = SharedValue::Integer;
+		out_value.integer = lua_tointeger(L, idx);
+	}
+	else
+	{
+		out_value.type = SharedValue::Number;
+		out_value.number = n;
+	}
+	out_value.str.clear();
+}
+
+static void push_value(lua_State* L, const SharedValue& value)
+{
+	switch (value.type)
+	{
+	case SharedValue::Integer:
+		lua_pushinteger(L, value.integer);
+		break;
+	case SharedValue::Number:
+		lua_pushnumber(L, value.number);
+		break;
+	case SharedValue::String:
+		lua_pushlstring(L, value.str.data(), value.str.size());
+		break;
+	default:
+		lua_pushnil(L);
+		break;
+	}
+}
+
+// helper.shared.get(key) Returns the value, or nil.
+static int shared_lua_get(lua_State* L)
+{
+	const string& key = check_key(L);
+	if (shared_get(key, tls_value) < 0)
+	{
+		lua_pushnil(L);
+	}
+	else
+	{
+		push_value(L, tls_value);
+	}
+	return 1;
+}
+
+// helper.shared.set(key, value [, ttl]) Returns true, or nil and an error message.
+static int shared_lua_set(lua_State* L)
+{
+	const string& key = check_key(L);
+	check_value(L, 2, tls_arg);
+	double ttl = luaL_optnumber(L, 3, 0);
+	if (shared_set(key, tls_arg, ttl) < 0)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "no memory");
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// helper.shared.incr(key, delta [, init [, ttl]]) Returns the new value, or nil and an error message.
+static int shared_lua_incr(lua_State* L)
+{
+	const string& key = check_key(L);
+	check_number(L, 2, tls_arg);
+	tls_init.type = SharedValue::Integer;
+	tls_init.integer = 0;
+	if (!lua_isnoneornil(L, 3))
+	{
+		check_number(L, 3, tls_init);
+	}
+	double ttl = luaL_optnumber(L, 4, 0);
+	if (shared_incr(key, tls_arg, tls_init, ttl, tls_value) < 0)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "not a number");
+		return 2;
+	}
+	push_value(L, tls_value);
+	return 1;
+}
+
+// helper.shared.delete(key)
+static int shared_lua_delete(lua_State* L)
+{
+	const string& key = check_key(L);
+	tls_arg.type = SharedValue::Nil;
+	tls_arg.str.clear();
+	shared_set(key, tls_arg, 0);
+	return 0;
+}
+
+// helper.shared.ttl(key) Returns seconds left, -1 if the key never expires, or nil if it is not found.
+static int shared_lua_ttl(lua_State* L)
+{
+	const string& key = check_key(L);
+	double seconds;
+	if (shared_ttl(key, seconds) < 0)
+	{
+		lua_pushnil(L);
+	}
+	else
+	{
+		lua_pushnumber(L, seconds);
+	}
+	return 1;
+}
+
+void shared_push_table(lua_State* L)
+{
+	lua_newtable(L);
+	lua_pushcfunction(L, shared_lua_get);
+	lua_setfield(L, -2, "get");
+	lua_pushcfunction(L, shared_lua_set);
+	lua_setfield(L, -2, "set");
+	lua_pushcfunction(L, shared_lua_incr);
+	lua_setfield(L, -2, "incr");
+	lua_pushcfunction(L, shared_lua_delete);
+	lua_setfield(L, -2, "delete");
+	lua_pushcfunction(L, shared_lua_ttl);
+	lua_setfield(L, -2, "ttl");
+}
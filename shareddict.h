@@ -0,0 +1,42 @@
+#pragma once
+#include <string>
+#include "vmop.h"
+
+// Server-wide key/value store, shared by all Lua scripts as helper.shared.
+// Values are copied in and out, so no Lua state is shared between VMs.
+// Keys are spread over shards with a lock each. The memory used is capped by SHARED_DICT_SIZE,
+// and the least recently used keys of a shard are dropped to make room for new ones.
+
+struct SharedValue
+{
+	enum Type { Nil, Integer, Number, String };
+	Type type = Nil;
+	long long integer = 0;
+	double number = 0;
+	std::string str;
+};
+
+// Returns:
+// 0 Found.
+// -1 Not found or expired.
+int shared_get(const std::string& key, SharedValue& out_value);
+
+// ttl is in seconds. ttl <= 0: never expires. Setting a Nil value deletes the key.
+// Returns:
+// 0 Success
+// -1 Value is larger than a shard can hold.
+int shared_set(const std::string& key, const SharedValue& value, double ttl);
+
+// Adds delta (Integer or Number) to a number. A missing key starts from init, and gets ttl.
+// Returns:
+// 0 Success. out_value is the new value.
+// -1 Value is not a number.
+int shared_incr(const std::string& key, const SharedValue& delta, const SharedValue& init, double ttl, SharedValue& out_value);
+
+// Returns:
+// 0 Found. out_seconds is the time left, or -1 if the key never expires.
+// -1 Not found or expired.
+int shared_ttl(const std::string& key, double& out_seconds);
+
+// Pushes the helper.shared table onto the stack.
+void shared_push_table(lua_State* L);
@@ -0,0 +1,30 @@
+#include "timing.h"
+using namespace std;
+
+namespace
+{
+	double measure_ticks_per_us()
+	{
+#ifdef NAIVE_TIMING_TSC
+		// Against steady_clock for 10ms. Invariant TSCs tick at a fixed rate, whatever the CPU frequency.
+		auto t0 = chrono::steady_clock::now();
+		uint64_t c0 = timing_now();
+		chrono::steady_clock::time_point t1;
+		do
+		{
+			t1 = chrono::steady_clock::now();
+		} while (t1 - t0 < chrono::milliseconds(10));
+		uint64_t c1 = timing_now();
+		return (c1 - c0) / chrono::duration<double, micro>(t1 - t0).count();
+#else
+		return 1000;
+#endif
+	}
+
+	const double ticks_per_us = measure_ticks_per_us();
+}
+
+double timing_ticks_per_us()
+{
+	return ticks_per_us;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define NAIVE_TIMING_TSC 1
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define NAIVE_TIMING_TSC 1
+#endif
+
+// Phases of a request. The owner of a request and its handlers mark the end of each phase they go through:
+// the time since the previous mark is added to the phase being marked.
+enum class Phase
+{
+	// Waiting for a pool thread. (Normal mode only)
+	Queue = 0,
+	// Receiving the header and posted data. Includes the TLS handshake.
+	Receive,
+	// parse_header(), or HPACK decoding on HTTP/2.
+	Parse,
+	// Finding the target: url decoding, get_request_path_type(), bundle lookup.
+	Route,
+	// Reading files, bundles and caches.
+	Read,
+	// Running Lua, including the time a script waits for its helpers.
+	Script,
+	// The rest of the handler: listings, the status page, filling the response.
+	Handle,
+	// Until the last byte is written. (On HTTP/2: queued to the connection)
+	Send,
+	Max
+};
+
+// Timestamps are cycle counter readings where there is one (a few ns, no syscall), steady_clock nanoseconds otherwise.
+inline uint64_t timing_now()
+{
+#ifdef NAIVE_TIMING_TSC
+	return __rdtsc();
+#else
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Measured once at startup.
+double timing_ticks_per_us();
+
+// Phase durations of one request in ticks. Kept by the owner of the request, see Request::timing.
+struct RequestTiming
+{
+	uint64_t begin = 0;
+	uint64_t last = 0;
+	uint64_t spent[(int)Phase::Max] = {};
+
+	void start(uint64_t now = timing_now())
+	{
+		begin = last = now;
+	}
+
+	void mark(Phase p)
+	{
+		uint64_t now = timing_now();
+		// Counters of different CPUs may be slightly apart. Never go back in time.
+		if (now > last)
+		{
+			spent[(int)p] += now - last;
+			last = now;
+		}
+	}
+};
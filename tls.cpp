@@ -0,0 +1,223 @@
+#include "tls.h"
+#include "config.h"
+#include "logging.h"
+#include "metrics.h"
+#include <cstring>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+using namespace std;
+
+namespace
+{
+	SSL_CTX* ctx = nullptr;
+
+	// Session resumption shows up on the status page as the hit rate of this cache.
+	int resume_cache_id()
+	{
+		static int id = metrics_register_cache("tls_resume");
+		return id;
+	}
+
+	void log_ssl_errors(const char* what)
+	{
+		unsigned long e;
+		while ((e = ERR_get_error()) != 0)
+		{
+			char buff[256];
+			ERR_error_string_n(e, buff, sizeof(buff));
+			logd("%s: %s\n", what, buff);
+		}
+	}
+
+	// Prefers h2 if the client offers it and HTTP/2 is enabled.
+	int select_alpn(SSL*, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void*)
+	{
+		static const unsigned char with_h2[] = "\x02h2\x08http/1.1";
+		static const unsigned char without_h2[] = "\x08http/1.1";
+		const unsigned char* protos = H2_MAX_STREAMS > 0 ? with_h2 : without_h2;
+		unsigned int len = H2_MAX_STREAMS > 0 ? sizeof(with_h2) - 1 : sizeof(without_h2) - 1;
+		unsigned char* selected;
+		if (SSL_select_next_proto(&selected, outlen, protos, len, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		{
+			return SSL_TLSEXT_ERR_NOACK;
+		}
+		*out = selected;
+		return SSL_TLSEXT_ERR_OK;
+	}
+}
+
+int TlsInit(const string& cert_file, const string& key_file)
+{
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx)
+	{
+		loge("Failed to create TLS context\n");
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	// Renegotiation would let a client make the reactor do handshakes at will.
+	SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+	// Output goes to a memory BIO, so partial writes only make things harder.
+	SSL_CTX_clear_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1 ||
+		SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(ctx) != 1)
+	{
+		log_ssl_errors("TlsInit");
+		loge("Failed to load certificate %s or key %s\n", cert_file.c_str(), key_file.c_str());
+		SSL_CTX_free(ctx);
+		ctx = nullptr;
+		return -1;
+	}
+
+	// Resumption: session IDs from the server-side cache (TLS 1.2) and session tickets (TLS 1.2 and 1.3).
+	// Ticket keys are made by OpenSSL at startup, so tickets do not outlive the process.
+	static const unsigned char sid_ctx[] = "NaiveHTTPServer";
+	SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE);
+	SSL_CTX_set_timeout(ctx, 3600);
+
+	SSL_CTX_set_alpn_select_cb(ctx, select_alpn, nullptr);
+	resume_cache_id();
+	logi("TLS certificate %s loaded.\n", cert_file.c_str());
+	return 0;
+}
+
+struct TlsStream::_impl
+{
+	SSL* ssl = nullptr;
+	BIO* rbio = nullptr;
+	BIO* wbio = nullptr;
+	string out;
+	size_t out_sent = 0;
+	bool counted = false;
+
+	// Moves records made by OpenSSL into out.
+	void drain()
+	{
+		size_t pending = BIO_ctrl_pending(wbio);
+		if (pending == 0) return;
+		if (out_sent == out.size())
+		{
+			out.clear();
+			out_sent = 0;
+		}
+		size_t old = out.size();
+		out.resize(old + pending);
+		int n = BIO_read(wbio, &out[old], (int)pending);
+		out.resize(old + (n > 0 ? n : 0));
+	}
+};
+
+TlsStream::TlsStream() : _p(new _impl)
+{
+
+}
+
+TlsStream::~TlsStream()
+{
+	if (_p->ssl)
+	{
+		// OpenSSL drops the session of a connection that is freed without close_notify.
+		// HTTP/2 connections and clients that just close the socket would never be resumed then.
+		// (Sessions of connections that failed with an alert are already dropped)
+		if (SSL_is_init_finished(_p->ssl))
+		{
+			SSL_set_shutdown(_p->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		}
+		// Frees both BIOs as well.
+		SSL_free(_p->ssl);
+	}
+	delete _p;
+}
+
+int TlsStream::start()
+{
+	if (!ctx) return -1;
+	_p->ssl = SSL_new(ctx);
+	if (!_p->ssl) return -1;
+	_p->rbio = BIO_new(BIO_s_mem());
+	_p->wbio = BIO_new(BIO_s_mem());
+	if (!_p->rbio || !_p->wbio)
+	{
+		BIO_free(_p->rbio);
+		BIO_free(_p->wbio);
+		_p->rbio = _p->wbio = nullptr;
+		return -1;
+	}
+	// An empty read BIO means "wait for more", not end of file.
+	BIO_set_mem_eof_return(_p->rbio, -1);
+	SSL_set_bio(_p->ssl, _p->rbio, _p->wbio);
+	SSL_set_accept_state(_p->ssl);
+	return 0;
+}
+
+void TlsStream::feed(const char* data, size_t len)
+{
+	BIO_write(_p->rbio, data, (int)len);
+}
+
+int TlsStream::read(char* buf, int len)
+{
+	int ret = SSL_read(_p->ssl, buf, len);
+	_p->drain();
+	if (!_p->counted && SSL_is_init_finished(_p->ssl))
+	{
+		_p->counted = true;
+		metrics_on_cache(resume_cache_id(), SSL_session_reused(_p->ssl) == 1);
+	}
+	if (ret > 0) return ret;
+
+	int err = SSL_get_error(_p->ssl, ret);
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+	{
+		return 0;
+	}
+	if (err != SSL_ERROR_ZERO_RETURN)
+	{
+		log_ssl_errors("TlsStream::read");
+	}
+	return -1;
+}
+
+int TlsStream::write(const char* data, size_t len)
+{
+	while (len > 0)
+	{
+		int n = SSL_write(_p->ssl, data, (int)(len > 1 << 30 ? 1 << 30 : len));
+		_p->drain();
+		if (n <= 0)
+		{
+			log_ssl_errors("TlsStream::write");
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void TlsStream::shutdown()
+{
+	SSL_shutdown(_p->ssl);
+	_p->drain();
+}
+
+size_t TlsStream::output(const char*& data)
+{
+	data = _p->out.data() + _p->out_sent;
+	return _p->out.size() - _p->out_sent;
+}
+
+void TlsStream::consume(size_t n)
+{
+	_p->out_sent += n;
+	if (_p->out_sent == _p->out.size())
+	{
+		_p->out.clear();
+		_p->out_sent = 0;
+	}
+}
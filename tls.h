@@ -0,0 +1,55 @@
+#pragma once
+#include <string>
+
+// TLS for the rapid mode reactor, on top of OpenSSL.
+// TlsStream does no I/O by itself: ciphertext read from the socket goes into feed(),
+// and ciphertext to send is taken from output(), so it fits the reactor's non-blocking sockets.
+
+// Loads the certificate chain and private key (PEM). Only call this during startup.
+// Returns:
+// 0 Success
+// -1 Context cannot be created, or the files cannot be loaded.
+int TlsInit(const std::string& cert_file, const std::string& key_file);
+
+class TlsStream
+{
+public:
+	TlsStream();
+	/// NonMoveable,NonCopyable
+	TlsStream(const TlsStream&) = delete;
+	TlsStream& operator = (const TlsStream&) = delete;
+	~TlsStream();
+
+	// Server side of a new connection. TlsInit() must have succeeded.
+	// Returns:
+	// 0 Success
+	// -1 Failed to create the connection.
+	int start();
+
+	// Ciphertext received from the peer.
+	void feed(const char* data, size_t len);
+
+	// Decrypts received data into buf. The handshake runs as needed, its messages are put to output().
+	// Returns:
+	// >0 Bytes decrypted
+	// 0 More input is needed.
+	// -1 TLS error, or the peer closed the connection. An alert may be in output().
+	int read(char* buf, int len);
+
+	// Encrypts data into output().
+	// Returns:
+	// 0 Success
+	// -1 TLS error.
+	int write(const char* data, size_t len);
+
+	// Puts close_notify into output().
+	void shutdown();
+
+	// Ciphertext waiting to be sent. Returns 0 if there is nothing to send.
+	size_t output(const char*& data);
+	// n bytes from output() are sent.
+	void consume(size_t n);
+private:
+	struct _impl;
+	_impl* _p;
+};
@@ -0,0 +1,574 @@
+#include "upstream.h"
+#include "config.h"
+#include "logging.h"
+#include "fastscan.h"
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <mutex>
+#include <unordered_map>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <strings.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// Idle connections older than this are not reused. Most servers close them after a while anyway.
+static const int IDLE_SECONDS = 30;
+static const size_t MAX_RESPONSE = 64 * 1024 * 1024;
+
+#ifdef _WIN32
+struct UpstreamCall::_impl
+{
+	UpstreamResponse res;
+};
+
+UpstreamCall::UpstreamCall() : _p(new _impl) {}
+UpstreamCall::~UpstreamCall() { delete _p; }
+int UpstreamCall::start(const UpstreamRequest& req)
+{
+	_p->res.error = "not supported";
+	return -1;
+}
+bool UpstreamCall::step() { return true; }
+void UpstreamCall::fail(const char* error) { _p->res.error = error; }
+bool UpstreamCall::done() const { return true; }
+int UpstreamCall::fd() const { return -1; }
+bool UpstreamCall::wants_write() const { return false; }
+UpstreamResponse& UpstreamCall::response() { return _p->res; }
+#else
+namespace
+{
+	struct Target
+	{
+		// ip:port, the key of the connection pool.
+		string key;
+		struct sockaddr_storage addr;
+		socklen_t addr_len;
+		string host;
+		string path;
+	};
+
+	// Returns:
+	// 0 Success
+	// -1 Invalid url, or host is not an address.
+	int parse_url(const string& url, Target& t)
+	{
+		static const char scheme[] = "http://";
+		if (url.compare(0, sizeof(scheme) - 1, scheme) != 0) return -1;
+		size_t host_begin = sizeof(scheme) - 1;
+		size_t path_begin = url.find('/', host_begin);
+		if (path_begin == string::npos) path_begin = url.size();
+		t.host = url.substr(host_begin, path_begin - host_begin);
+		t.path = path_begin < url.size() ? url.substr(path_begin) : "/";
+
+		string ip;
+		int port = 80;
+		size_t colon;
+		if (!t.host.empty() && t.host[0] == '[')
+		{
+			size_t end = t.host.find(']');
+			if (end == string::npos) return -1;
+			ip = t.host.substr(1, end - 1);
+			colon = t.host[end + 1] == ':' ? end + 1 : string::npos;
+		}
+		else
+		{
+			colon = t.host.find(':');
+			ip = t.host.substr(0, colon);
+		}
+		if (colon != string::npos)
+		{
+			char* end;
+			long v = strtol(t.host.c_str() + colon + 1, &end, 10);
+			if (*end != 0 || v <= 0 || v > 65535) return -1;
+			port = (int)v;
+		}
+		if (ip == "localhost") ip = "127.0.0.1";
+
+		memset(&t.addr, 0, sizeof(t.addr));
+		struct sockaddr_in* a4 = (struct sockaddr_in*)&t.addr;
+		struct sockaddr_in6* a6 = (struct sockaddr_in6*)&t.addr;
+		if (inet_pton(AF_INET, ip.c_str(), &a4->sin_addr) == 1)
+		{
+			a4->sin_family = AF_INET;
+			a4->sin_port = htons(port);
+			t.addr_len = sizeof(*a4);
+		}
+		else if (inet_pton(AF_INET6, ip.c_str(), &a6->sin6_addr) == 1)
+		{
+			a6->sin6_family = AF_INET6;
+			a6->sin6_port = htons(port);
+			t.addr_len = sizeof(*a6);
+		}
+		else
+		{
+			return -1;
+		}
+		t.key = ip + ":" + to_string(port);
+		return 0;
+	}
+
+	// A pooled connection may have been closed by the upstream while it was idle.
+	// Also false if there is unread data: it would be taken for the response to the next request.
+	bool is_alive(int fd)
+	{
+		char c;
+		ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+
+	// Idle keep-alive connections of every upstream. Used from the script loop and from workers.
+	class ConnectionPool
+	{
+	public:
+		// Returns -1 if there is no usable connection.
+		int take(const string& key)
+		{
+			Clock::time_point now = Clock::now();
+			while (true)
+			{
+				Idle c;
+				{
+					lock_guard<mutex> lg(_lock);
+					auto iter = _idle.find(key);
+					if (iter == _idle.end() || iter->second.empty()) return -1;
+					c = iter->second.back();
+					iter->second.pop_back();
+				}
+				if (now - c.since < chrono::seconds(IDLE_SECONDS) && is_alive(c.fd)) return c.fd;
+				close(c.fd);
+			}
+		}
+
+		void put(const string& key, int fd)
+		{
+			{
+				lock_guard<mutex> lg(_lock);
+				auto& lst = _idle[key];
+				if ((int)lst.size() < UPSTREAM_KEEPALIVE)
+				{
+					lst.push_back(Idle{ fd, Clock::now() });
+					return;
+				}
+			}
+			close(fd);
+		}
+	private:
+		struct Idle
+		{
+			int fd;
+			Clock::time_point since;
+		};
+
+		mutex _lock;
+		unordered_map<string, vector<Idle>> _idle;
+	};
+
+	ConnectionPool& pool()
+	{
+		static ConnectionPool p;
+		return p;
+	}
+
+	bool name_is(const string& name, const char* target)
+	{
+		return strcasecmp(name.c_str(), target) == 0;
+	}
+}
+
+struct UpstreamCall::_impl
+{
+	Target target;
+	string out;
+	size_t sent = 0;
+	int fd = -1;
+	// A pooled connection that may turn out to be closed. The request is then sent again on a new one (see can_retry).
+	bool reused = false;
+	// The method may be sent twice without changing the result (RFC 9110 9.2.2).
+	bool idempotent = true;
+	// 0 Connecting, 1 Sending, 2 Receiving, 3 Done
+	int stage = 3;
+	bool head = false;
+
+	string in;
+	// Set when the response header is parsed.
+	size_t body_begin = string::npos;
+	enum class Framing { None, Length, Chunked, UntilClose } framing = Framing::None;
+	size_t content_length = 0;
+	bool keep_alive = false;
+	// Chunked: position of the next unread byte in `in`, and what is left of the current chunk.
+	size_t chunk_pos = 0;
+	size_t chunk_left = 0;
+	bool chunk_crlf = false;
+
+	UpstreamResponse res;
+
+	int connect_new()
+	{
+		fd = socket(target.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) return -1;
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (connect(fd, (struct sockaddr*)&target.addr, target.addr_len) < 0 && errno != EINPROGRESS)
+		{
+			close(fd);
+			fd = -1;
+			return -1;
+		}
+		reused = false;
+		stage = 0;
+		return 0;
+	}
+
+	void close_fd()
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	bool finish(const char* error)
+	{
+		if (error)
+		{
+			res.error = error;
+			close_fd();
+		}
+		else if (keep_alive && framing != Framing::UntilClose && fd >= 0 && is_alive(fd))
+		{
+			pool().put(target.key, fd);
+			fd = -1;
+		}
+		else
+		{
+			close_fd();
+		}
+		stage = 3;
+		return true;
+	}
+
+	// The pooled connection failed before any response came. The upstream may still have run the request,
+	// so it is only sent again if that is harmless: nothing of it was sent yet, or the method is idempotent.
+	bool can_retry() const
+	{
+		return reused && in.empty() && (idempotent || sent == 0);
+	}
+
+	// Try again on a new connection.
+	bool retry()
+	{
+		close_fd();
+		sent = 0;
+		in.clear();
+		if (connect_new() < 0) return finish("connect failed");
+		return false;
+	}
+
+	// Returns:
+	// 0 Need more data
+	// 1 Header parsed
+	// -1 Invalid response
+	int parse_header()
+	{
+		size_t end, line_end;
+		while (true)
+		{
+			end = scan_header_end(in.data(), in.size());
+			if (end == string::npos) return 0;
+
+			line_end = in.find("\r\n");
+			// HTTP/1.1 200 OK
+			if (in.compare(0, 5, "HTTP/") != 0 || line_end < 12) return -1;
+			res.status = atoi(in.c_str() + 9);
+			if (res.status < 100) return -1;
+			if (res.status >= 200 || res.status == 101) break;
+			// Interim response (100 Continue, 103 Early Hints). The final one follows.
+			in.erase(0, end + 4);
+		}
+		body_begin = end + 4;
+		bool http11 = in.compare(0, 8, "HTTP/1.1") == 0;
+
+		keep_alive = http11;
+		bool chunked = false;
+		bool has_length = false;
+		size_t pos = line_end + 2;
+		while (pos < end)
+		{
+			size_t eol = in.find("\r\n", pos);
+			if (eol == string::npos || eol > end) eol = end;
+			size_t colon = in.find(':', pos);
+			if (colon != string::npos && colon < eol)
+			{
+				string name = in.substr(pos, colon - pos);
+				size_t v = colon + 1;
+				while (v < eol && (in[v] == ' ' || in[v] == '\t')) v++;
+				string value = in.substr(v, eol - v);
+				for (auto& c : name) c = tolower((unsigned char)c);
+				if (name_is(name, "content-length"))
+				{
+					content_length = strtoull(value.c_str(), nullptr, 10);
+					has_length = true;
+				}
+				else if (name_is(name, "transfer-encoding") && strcasestr(value.c_str(), "chunked"))
+				{
+					chunked = true;
+				}
+				else if (name_is(name, "connection"))
+				{
+					if (strcasestr(value.c_str(), "close")) keep_alive = false;
+					else if (strcasestr(value.c_str(), "keep-alive")) keep_alive = true;
+				}
+				res.headers.emplace_back(std::move(name), std::move(value));
+			}
+			pos = eol + 2;
+		}
+
+		// 101 Switching Protocols: we never ask for it, and the connection is no longer HTTP.
+		if (res.status == 101) keep_alive = false;
+		if (head || res.status < 200 || res.status == 204 || res.status == 304) framing = Framing::None;
+		else if (chunked) framing = Framing::Chunked;
+		else if (has_length) framing = Framing::Length;
+		else framing = Framing::UntilClose;
+		chunk_pos = body_begin;
+		return 1;
+	}
+
+	// Returns:
+	// 0 Need more data
+	// 1 The last chunk is read
+	// -1 Invalid chunk
+	int decode_chunks()
+	{
+		while (true)
+		{
+			if (chunk_left > 0)
+			{
+				size_t n = min(chunk_left, in.size() - chunk_pos);
+				res.body.append(in, chunk_pos, n);
+				chunk_pos += n;
+				chunk_left -= n;
+				if (chunk_left > 0) return 0;
+				chunk_crlf = true;
+			}
+			if (chunk_crlf)
+			{
+				if (in.size() - chunk_pos < 2) return 0;
+				if (in.compare(chunk_pos, 2, "\r\n") != 0) return -1;
+				chunk_pos += 2;
+				chunk_crlf = false;
+			}
+			size_t eol = in.find("\r\n", chunk_pos);
+			if (eol == string::npos) return 0;
+			char* end;
+			unsigned long long size = strtoull(in.c_str() + chunk_pos, &end, 16);
+			if (end == in.c_str() + chunk_pos) return -1;
+			if (size == 0)
+			{
+				// Trailers end with an empty line.
+				size_t trailer_end = in.find("\r\n\r\n", eol);
+				if (trailer_end == string::npos) return 0;
+				// Bytes beyond the response would confuse the next user of the connection.
+				if (in.size() > trailer_end + 4) keep_alive = false;
+				return 1;
+			}
+			if (res.body.size() + size > MAX_RESPONSE) return -1;
+			chunk_pos = eol + 2;
+			chunk_left = size;
+		}
+	}
+
+	// Returns true when the whole response is here.
+	bool check_body(bool& bad)
+	{
+		bad = false;
+		switch (framing)
+		{
+		case Framing::None:
+			return true;
+		case Framing::Length:
+			return in.size() - body_begin >= content_length;
+		case Framing::Chunked:
+		{
+			int ret = decode_chunks();
+			bad = ret < 0;
+			return ret != 0;
+		}
+		case Framing::UntilClose:
+			return false;
+		}
+		return false;
+	}
+
+	bool on_response_done()
+	{
+		if (framing == Framing::None)
+		{
+			// Bytes beyond the header would confuse the next user of the connection.
+			if (in.size() > body_begin) keep_alive = false;
+		}
+		else if (framing == Framing::Length)
+		{
+			// Bytes beyond the body would confuse the next user of the connection.
+			if (in.size() - body_begin > content_length) keep_alive = false;
+			res.body.assign(in, body_begin, content_length);
+		}
+		else if (framing == Framing::UntilClose)
+		{
+			res.body.assign(in, body_begin, string::npos);
+		}
+		string().swap(in);
+		return finish(nullptr);
+	}
+
+	bool step()
+	{
+		if (stage == 0)
+		{
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) return finish("connect failed");
+			stage = 1;
+		}
+		if (stage == 1)
+		{
+			while (sent < out.size())
+			{
+				ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+				if (n < 0)
+				{
+					if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return false;
+					if (can_retry()) return retry();
+					return finish("send failed");
+				}
+				sent += n;
+			}
+			stage = 2;
+		}
+		if (stage != 2) return true;
+
+		char buff[16 * 1024];
+		while (true)
+		{
+			ssize_t n = recv(fd, buff, sizeof(buff), 0);
+			if (n > 0)
+			{
+				if (in.size() + n > MAX_RESPONSE) return finish("response too large");
+				in.append(buff, n);
+				if (body_begin == string::npos)
+				{
+					int ret = parse_header();
+					if (ret < 0) return finish("invalid response");
+					if (ret == 0) continue;
+				}
+				bool bad;
+				if (check_body(bad)) return bad ? finish("invalid response") : on_response_done();
+			}
+			else if (n == 0)
+			{
+				if (can_retry()) return retry();
+				if (body_begin != string::npos && framing == Framing::UntilClose) return on_response_done();
+				return finish("connection closed");
+			}
+			else
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return false;
+				if (can_retry()) return retry();
+				return finish("recv failed");
+			}
+		}
+	}
+};
+
+UpstreamCall::UpstreamCall() : _p(new _impl)
+{
+
+}
+
+UpstreamCall::~UpstreamCall()
+{
+	_p->close_fd();
+	delete _p;
+}
+
+int UpstreamCall::start(const UpstreamRequest& req)
+{
+	if (parse_url(req.url, _p->target) < 0)
+	{
+		_p->res.error = "invalid url";
+		return -1;
+	}
+	string method = req.method.empty() ? "GET" : req.method;
+	_p->head = method == "HEAD";
+	_p->idempotent = method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "TRACE" ||
+		method == "PUT" || method == "DELETE";
+
+	string& out = _p->out;
+	out.reserve(128 + req.body.size());
+	out.append(method).append(" ").append(_p->target.path).append(" HTTP/1.1\r\nHost: ").append(_p->target.host).append("\r\n");
+	bool has_length = false;
+	for (const auto& h : req.headers)
+	{
+		if (name_is(h.first, "content-length")) has_length = true;
+		out.append(h.first).append(": ").append(h.second).append("\r\n");
+	}
+	if (!has_length && (!req.body.empty() || method == "POST" || method == "PUT"))
+	{
+		out.append("Content-Length: ").append(to_string(req.body.size())).append("\r\n");
+	}
+	out.append("\r\n").append(req.body);
+
+	_p->fd = pool().take(_p->target.key);
+	if (_p->fd >= 0)
+	{
+		_p->reused = true;
+		_p->stage = 1;
+		return 0;
+	}
+	if (_p->connect_new() < 0)
+	{
+		_p->finish("connect failed");
+		return -1;
+	}
+	return 0;
+}
+
+bool UpstreamCall::step()
+{
+	return _p->step();
+}
+
+void UpstreamCall::fail(const char* error)
+{
+	if (_p->stage != 3) _p->finish(error);
+}
+
+bool UpstreamCall::done() const
+{
+	return _p->stage == 3;
+}
+
+int UpstreamCall::fd() const
+{
+	return _p->fd;
+}
+
+bool UpstreamCall::wants_write() const
+{
+	return _p->stage < 2;
+}
+
+UpstreamResponse& UpstreamCall::response()
+{
+	return _p->res;
+}
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+
+// HTTP/1.1 client used by Lua scripts to call backend services (helper.http).
+// Connections are kept alive and reused per upstream (ip:port), up to UPSTREAM_KEEPALIVE idle ones each.
+// Calls are driven by the readiness of their sockets, so many of them can be in flight on one thread.
+
+struct UpstreamRequest
+{
+	std::string method;
+	// http://host[:port][/path]. host is an IPv4 or IPv6 ([::1]) address, or localhost.
+	std::string url;
+	std::vector<std::pair<std::string, std::string>> headers;
+	std::string body;
+};
+
+struct UpstreamResponse
+{
+	int status = 0;
+	// Names are lower case.
+	std::vector<std::pair<std::string, std::string>> headers;
+	std::string body;
+	// Not empty if the call failed.
+	std::string error;
+};
+
+class UpstreamCall
+{
+public:
+	UpstreamCall();
+	/// NonMoveable,NonCopyable
+	UpstreamCall(const UpstreamCall&) = delete;
+	UpstreamCall& operator = (const UpstreamCall&) = delete;
+	// Closes the connection, unless it went back to the pool.
+	~UpstreamCall();
+
+	// Takes a pooled connection to the upstream, or starts connecting.
+	// Returns:
+	// 0 Call is started. Wait for the socket and call step().
+	// -1 Call failed. See response().error
+	int start(const UpstreamRequest& req);
+
+	// Call when the socket is ready (see wants_write). Returns true when the call is over.
+	bool step();
+
+	// Ends a call that is not over yet, e.g. on timeout.
+	void fail(const char* error);
+
+	bool done() const;
+	int fd() const;
+	// The socket is waited for writing (connecting, sending) or reading.
+	bool wants_write() const;
+
+	UpstreamResponse& response();
+private:
+	struct _impl;
+	_impl* _p;
+};
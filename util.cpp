@@ -1,8 +1,13 @@
 #include "util.h"
-#include "log.h"
+#include "logging.h"
 #include "config.h"
 #include "GSock/gsock_helper.h"
+#include "fastscan.h"
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <algorithm>
 using namespace std;
 
 #ifdef _WIN32
@@ -32,25 +37,31 @@ static inline bool urlCharNeedEncode(char c)
 	}
 }
 
-static inline int getHexValue(char c)
+// -1 for characters that are not hex digits.
+struct HexTable
 {
-	if (c >= '0'&&c <= '9')
-	{
-		return c - '0';
-	}
-	else if (c >= 'a'&&c <= 'f')
+	signed char v[256];
+	HexTable()
 	{
-		return c - 'a' + 10;
-	}
-	else if (c >= 'A'&&c <= 'F')
-	{
-		return c - 'A' + 10;
+		memset(v, -1, sizeof(v));
+		for (int i = 0; i < 10; i++) v['0' + i] = i;
+		for (int i = 0; i < 6; i++)
+		{
+			v['a' + i] = 10 + i;
+			v['A' + i] = 10 + i;
+		}
 	}
-	else
+};
+static const HexTable hex_table;
+
+static inline int getHexValue(char c)
+{
+	int ret = hex_table.v[(unsigned char)c];
+	if (ret < 0)
 	{
 		logw("[getHexValue]: Failed to get hex value from char: %c\n", c);
-		return -1;
 	}
+	return ret;
 }
 
 int urlencode(const string& url_before, string& out_url_encoded)
@@ -73,96 +84,164 @@ int urlencode(const string& url_before, string& out_url_encoded)
 	return 0;
 }
 
-int urldecode_real(const string& url_before, string& out_url_decoded)
+// Appends [s, s+len) to out. With plus_as_space, '+' becomes ' ' as in form data.
+static inline void append_plain(const char* s, size_t len, ArenaString& out, bool plus_as_space)
 {
-	string ans;
-	int len = url_before.size();
-	for (int i = 0; i < len; i++)
+	size_t begin = out.size();
+	out.append(s, len);
+	if (!plus_as_space) return;
+	for (size_t i = 0; i < len; i++)
+	{
+		size_t pos = scan_byte(s + i, len - i, '+');
+		if (pos == string::npos) break;
+		i += pos;
+		out[begin + i] = ' ';
+	}
+}
+
+// Appends the decoded form of [s, s+len) to out.
+static void urldecode_append(const char* s, size_t len, ArenaString& out, bool plus_as_space = false)
+{
+	out.reserve(out.size() + len);
+	size_t i = 0;
+	while (i < len)
 	{
-		if (url_before[i] == '%')
+		// Copy everything before the next escape at once.
+		size_t pos = scan_byte(s + i, len - i, '%');
+		if (pos == string::npos)
 		{
-			int a = getHexValue(url_before[i + 1]);
-			int b = getHexValue(url_before[i + 2]);
-			char c = a * 16 + b;
-			ans.push_back(c);
-			i += 2;
+			append_plain(s + i, len - i, out, plus_as_space);
+			break;
+		}
+		append_plain(s + i, pos, out, plus_as_space);
+		i += pos;
+
+		int a = i + 1 < len ? getHexValue(s[i + 1]) : -1;
+		int b = i + 2 < len ? getHexValue(s[i + 2]) : -1;
+		if (a < 0 || b < 0)
+		{
+			// Malformed escape. Keep it as it is.
+			out.push_back('%');
+			i++;
 		}
 		else
 		{
-			ans.push_back(url_before[i]);
+			out.push_back((char)(a * 16 + b));
+			i += 3;
 		}
 	}
-	out_url_decoded = ans;
+}
 
-	return 0;
+// FNV-1a
+static inline uint64_t hash_name(const char* name, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++)
+	{
+		h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+	}
+	return h;
 }
 
-int urldecode(const string& url_before, string& out_url_decoded, map<string, string>& out_param)
+static inline bool same_name(const ArenaString& a, const char* name, size_t len)
 {
-	size_t idx = url_before.find("?");
-	if (idx == string::npos)
+	return a.size() == len && memcmp(a.data(), name, len) == 0;
+}
+
+void ParamNames::clear()
+{
+	hashes.clear();
+	fill(slots.begin(), slots.end(), 0);
+}
+
+void ParamNames::grow()
+{
+	slots.assign(slots.empty() ? 16 : slots.size() * 2, 0);
+	size_t mask = slots.size() - 1;
+	for (size_t i = 0; i < hashes.size(); i++)
 	{
-		// No parameters. Fallback to urldecode.
-		return urldecode_real(url_before, out_url_decoded);
+		size_t k = hashes[i] & mask;
+		while (slots[k]) k = (k + 1) & mask;
+		slots[k] = (uint32_t)(i + 1);
 	}
-	else // ....?para=value&para2=value
+}
+
+bool ParamNames::add(const ParamList& list, const char* name, size_t len)
+{
+	if ((hashes.size() + 1) * 2 > slots.size()) grow();
+	uint64_t h = hash_name(name, len);
+	size_t mask = slots.size() - 1;
+	size_t k = h & mask;
+	while (slots[k])
 	{
-		// okay we have params, yeah?
-		out_param.clear();
-
-		string frontpart = url_before.substr(0, idx);
-		urldecode_real(frontpart, out_url_decoded);
-		int len = url_before.size();
-		int now = idx + 1;
-		// Things get weird...
-		while (true)
+		size_t i = slots[k] - 1;
+		if (hashes[i] == h && same_name(list[i].first, name, len)) return false;
+		k = (k + 1) & mask;
+	}
+	slots[k] = (uint32_t)(hashes.size() + 1);
+	hashes.push_back(h);
+	return true;
+}
+
+// name=value&name2=value2 appended to out_param, which is empty.
+static void parse_params(const char* s, size_t len, ParamList& out_param, bool plus_as_space)
+{
+	ArenaAllocator<char> alloc = out_param.get_allocator();
+	thread_local ParamNames names;
+	names.clear();
+	size_t now = 0;
+	while (now <= len)
+	{
+		size_t endpoint = scan_byte(s + now, len - now, '&');
+		endpoint = (endpoint == string::npos) ? len : now + endpoint;
+
+		// Parts without '=' are ignored. The first value of a name wins.
+		size_t midx = scan_byte(s + now, endpoint - now, '=');
+		if (midx != string::npos)
 		{
-			size_t nidx = url_before.find("&", now);
-			size_t endpoint;
-			if (nidx != string::npos)
+			if (out_param.size() >= PARAM_LIMIT)
 			{
-				// Still have next part
-				endpoint = nidx;
+				logw("More than %d parameters. The rest are ignored.\n", (int)PARAM_LIMIT);
+				return;
 			}
-			else
+			midx += now;
+			ArenaString name(alloc);
+			urldecode_append(s + now, midx - now, name, plus_as_space);
+			if (names.add(out_param, name.data(), name.size()))
 			{
-				// Oh we are at the end
-				endpoint = len;
+				ArenaString value(alloc);
+				urldecode_append(s + midx + 1, endpoint - midx - 1, value, plus_as_space);
+				out_param.emplace_back(std::move(name), std::move(value));
 			}
-
-			// separate it
-			string current = url_before.substr(now, endpoint - now);
-			size_t midx = current.find("=");
-			if (midx != string::npos)
-			{
-				// param=
-				if (midx == current.size() - 1)
-				{
-					string a = current.substr(0, midx);
-					string ta;
-					urldecode_real(a, ta);
-					out_param.insert(make_pair(ta, ""));
-				}
-				// param=value
-				else
-				{
-					string a = current.substr(0, midx);
-					string ta;
-					urldecode_real(a, ta);
-					string b = current.substr(midx + 1);
-					string tb;
-					urldecode_real(b, tb);
-					out_param.insert(make_pair(ta, tb));
-				}
-			}
-
-			// This is the end.
-			if (nidx == string::npos) break;
-			now = endpoint + 1;
 		}
 
+		now = endpoint + 1;
+	}
+}
+
+int urldecode(const char* url, size_t len, ArenaString& out_url_decoded, ParamList& out_param)
+{
+	out_url_decoded.clear();
+	size_t idx = scan_byte(url, len, '?');
+	if (idx == string::npos)
+	{
+		// No parameters.
+		urldecode_append(url, len, out_url_decoded);
 		return 0;
 	}
+
+	// ....?para=value&para2=value
+	out_param.clear();
+	urldecode_append(url, idx, out_url_decoded);
+	parse_params(url + idx + 1, len - idx - 1, out_param, false);
+	return 0;
+}
+
+int parse_urlencoded(const char* data, size_t len, ParamList& out_param)
+{
+	out_param.clear();
+	parse_params(data, len, out_param, true);
+	return 0;
 }
 
 int mymin(int a, int b)
@@ -170,58 +249,77 @@ int mymin(int a, int b)
 	return a < b ? a : b;
 }
 
-int GetFileContent(const string& request_path, string& out_content)
+// Builds SERVER_ROOT + request_path + suffix into buff without touching the heap.
+// Returns false if the result does not fit.
+static bool GetRealPath(const char* request_path, char* buff, size_t size, const char* suffix = "")
+{
+	int ret = snprintf(buff, size, "%s%s%s", SERVER_ROOT.c_str(), request_path, suffix);
+	return ret >= 0 && (size_t)ret < size;
+}
+
+static const size_t REAL_PATH_MAX = 4096;
+
+int GetFileContent(const char* request_path, string& out_content)
 {
-	string realpath = SERVER_ROOT + request_path;
-	FILE* fp = fopen(realpath.c_str(), "rb");
+	char realpath[REAL_PATH_MAX];
+	if (!GetRealPath(request_path, realpath, sizeof(realpath))) return -1;
+	FILE* fp = fopen(realpath, "rb");
 	if (fp == NULL) return -1;
-	char buff[1024];
+
 	string content;
-	while (true)
+	long size = -1;
+	if (fseek(fp, 0L, SEEK_END) == 0)
+	{
+		size = ftell(fp);
+		fseek(fp, 0L, SEEK_SET);
+	}
+	if (size > 0)
+	{
+		// Size is known. Read it in one go.
+		content.resize(size);
+		content.resize(fread(&content[0], 1, size, fp));
+	}
+	else
 	{
-		memset(buff, 0, 1024);
-		int ret = fread(buff, 1, 1024, fp);
-		if (ret <= 0)
+		char buff[1024];
+		while (true)
 		{
-			break;
+			int ret = fread(buff, 1, 1024, fp);
+			if (ret <= 0)
+			{
+				break;
+			}
+			content.append(buff, ret);
 		}
-		content.append(string(buff, ret));
 	}
 	fclose(fp);
-	out_content = content;
+	out_content = std::move(content);
 	return 0;
 }
 
-int GetFileContentEx(const string& request_path, int beginat, int length, string& out_content)
+int GetFileContentEx(const char* request_path, int beginat, int length, string& out_content)
 {
-	string realpath = SERVER_ROOT + request_path;
-	FILE* fp = fopen(realpath.c_str(), "rb");
+	char realpath[REAL_PATH_MAX];
+	if (!GetRealPath(request_path, realpath, sizeof(realpath))) return -1;
+	FILE* fp = fopen(realpath, "rb");
 	if (fp == NULL) return -1;
 	fseek(fp, beginat, SEEK_SET);
-	char buff[1024];
 	string content;
-	int done = 0;
-	int total = length;
-	while (done < total)
+	if (length > 0)
 	{
-		memset(buff, 0, 1024);
-		int ret = fread(buff, 1, mymin(1024, total - done), fp);
-		if (ret <= 0)
-		{
-			break;
-		}
-		content.append(string(buff, ret));
-		done += ret;
+		content.resize(length);
+		content.resize(fread(&content[0], 1, length, fp));
 	}
 	fclose(fp);
-	out_content = content;
+	out_content = std::move(content);
 	return 0;
 }
 
-int GetFileLength(const string& request_path, int& out_length)
+int GetFileLength(const char* request_path, int& out_length)
 {
-	string realpath = SERVER_ROOT + request_path;
-	FILE* fp = fopen(realpath.c_str(), "rb");
+	char realpath[REAL_PATH_MAX];
+	if (!GetRealPath(request_path, realpath, sizeof(realpath))) return -1;
+	FILE* fp = fopen(realpath, "rb");
 	if (fp == NULL) return -1;
 	fseek(fp, 0L, SEEK_END);
 	out_length = ftell(fp);
@@ -229,57 +327,15 @@ int GetFileLength(const string& request_path, int& out_length)
 	return 0;
 }
 
-#define ct(abbr,target) else if(endwith(path,abbr)) out_content_type=target
-
-int GetFileContentType(const string& path, string& out_content_type)
+int get_request_path_type(const char* path)
 {
-	if (endwith(path, ".html"))
-	{
-		out_content_type = "text/html";
-	}
-	ct(".bmp", "application/x-bmp");
-	ct(".doc", "application/msword");
-	ct(".ico", "image/x-icon");
-	ct(".java", "java/*");
-	ct(".class", "java/*");
-	ct(".jpeg", "image/jpeg");
-	ct(".jpg", "image/jpeg");
-	ct(".png", "image/png");
-	ct(".swf", "application/x-shockwave-flash");
-	ct(".xhtml", "text/html");
-	ct(".apk", "application/vnd.android.package-archive");
-	ct(".exe", "application/x-msdownload");
-	ct(".htm", "text/html");
-	ct(".js", "application/x-javascript");
-	ct(".mp3", "audio/mp3");
-	ct(".mp4", "video/mpeg4");
-	ct(".mpg", "video/mpg");
-	ct(".pdf", "application/pdf");
-	ct(".rmvb", "application/vnd.rn-realmedia-vbr");
-	ct(".torrent", "application/x-bittorrent");
-	ct(".txt", "text/plain");
-	ct(".css", "text/css");
-	else
-	{
-		/// Not Support Content Type
-		return -1;
-	}
-
-	/// Supported ContentType
-	return 0;
-}
-
-#undef ct
-
-int get_request_path_type(const string& path)
-{
-	string realpath = SERVER_ROOT + path;
-	if (access(realpath.c_str(), 0) < 0) // File not exist
+	char realpath[REAL_PATH_MAX];
+	if (!GetRealPath(path, realpath, sizeof(realpath))) return -1;
+	if (access(realpath, 0) < 0) // File not exist
 	{
 		// File not exist, maybe dynamic request?
 		// Only Lua extension is planned to support, which means *.php will be treated as a static file.
-		realpath = realpath + ".lua";
-		if (access(realpath.c_str(), 0) < 0)
+		if (!GetRealPath(path, realpath, sizeof(realpath), ".lua") || access(realpath, 0) < 0)
 		{
 			// Not a valid request.
 			return -1;
@@ -292,7 +348,8 @@ int get_request_path_type(const string& path)
 	}
 	else // File exists.
 	{
-		if (endwith(path,".lua")) // XXX.lua
+		size_t len = strlen(path);
+		if (len >= 4 && memcmp(path + len - 4, ".lua", 4) == 0) // XXX.lua
 		{
 			// Dynamic Request
 			return 1;
@@ -373,4 +430,56 @@ int parse_range_request(const string& range, int content_length, int& _out_begin
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+bool etag_matches(const char* if_none_match, const char* etag, size_t len)
+{
+	if (strcmp(if_none_match, "*") == 0) return true;
+	for (const char* p = strchr(if_none_match, '"'); p; p = strchr(p + 1, '"'))
+	{
+		if (strncmp(p, etag, len) == 0) return true;
+	}
+	return false;
+}
+
+bool accepts_coding(const char* accept_encoding, const char* coding)
+{
+	if (!accept_encoding) return false;
+	size_t coding_len = strlen(coding);
+	// -1: not listed
+	double q_coding = -1, q_any = -1;
+	const char* p = accept_encoding;
+	while (*p)
+	{
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+		const char* token = p;
+		while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+		size_t token_len = p - token;
+		// Parameters up to the next element. Only q is used.
+		double q = 1;
+		while (*p && *p != ',')
+		{
+			if (*p++ != ';') continue;
+			while (*p == ' ' || *p == '\t') p++;
+			if ((*p == 'q' || *p == 'Q') && p[1] == '=') q = strtod(p + 2, nullptr);
+		}
+
+		bool same = token_len == coding_len;
+		for (size_t i = 0; same && i < token_len; i++)
+		{
+			same = tolower((unsigned char)token[i]) == coding[i];
+		}
+		if (same) q_coding = q;
+		else if (token_len == 1 && *token == '*') q_any = q;
+	}
+	return q_coding >= 0 ? q_coding > 0 : q_any > 0;
+}
+
+long long seconds_to_us(double seconds)
+{
+	static const double max_seconds = 10.0 * 365 * 24 * 3600;
+	// Written so that NaN fails the first test.
+	if (!(seconds > 0)) return 0;
+	if (seconds > max_seconds) seconds = max_seconds;
+	return (long long)(seconds * 1000000);
+}
@@ -1,29 +1,66 @@
 #pragma once
 #include "GSock/gsock.h"
 #include "response.h"
+#include "arena.h"
 #include <string>
-#include <map>
+#include <vector>
+#include <cstdint>
 
 bool endwith(const std::string& str, const std::string& target);
 
 int urlencode(const std::string& url_before, std::string& out_url_encoded);
 
-int urldecode(const std::string& url_before, std::string& out_url_decoded, std::map<std::string, std::string>& out_param);
+// Decodes [url, url+len). Output strings are allocated with the allocator they already have.
+int urldecode(const char* url, size_t len, ArenaString& out_url_decoded, ParamList& out_param);
 
-int mymin(int a, int b);
+// Decodes an application/x-www-form-urlencoded body into out_param. '+' is decoded as space.
+int parse_urlencoded(const char* data, size_t len, ParamList& out_param);
+
+// Fields of a query string or form past this many are dropped.
+const size_t PARAM_LIMIT = 1000;
+
+// Names already in a ParamList, looked up by hash, so keeping the first value of each name costs one lookup per field.
+// The tables are kept across clear(), so a reused one does not allocate.
+class ParamNames
+{
+public:
+	void clear();
+	// Returns false if name is in list already. Otherwise it is taken as the name of the next entry of list.
+	bool add(const ParamList& list, const char* name, size_t len);
+private:
+	void grow();
+
+	// hashes[i] is the hash of the name of list[i].
+	std::vector<uint64_t> hashes;
+	// Open addressing. Index in list + 1, 0 if empty. Its size is a power of 2, at least twice the number of names.
+	std::vector<uint32_t> slots;
+};
 
-int GetFileContent(const std::string& request_path, std::string& out_content);
+int mymin(int a, int b);
 
-int GetFileContentEx(const std::string& request_path, int beginat, int length, std::string& out_content);
+// request_path is relative to SERVER_ROOT.
+int GetFileContent(const char* request_path, std::string& out_content);
 
-int GetFileLength(const std::string& request_path, int& out_length);
+int GetFileContentEx(const char* request_path, int beginat, int length, std::string& out_content);
 
-int GetFileContentType(const std::string& path, std::string& out_content_type);
+int GetFileLength(const char* request_path, int& out_length);
 
 // -1: Invalid (file does not exist on server)
 //  0: Static
 //  1: Dynamic
-int get_request_path_type(const std::string& request_path);
+int get_request_path_type(const char* request_path);
 
 int parse_range_request(const std::string& range, int content_length, 
 	int& _out_beginat, int& _out_length);
+
+// if_none_match is the value of If-None-Match: a list of quoted ETags, or "*".
+// etag is quoted, as it is sent.
+bool etag_matches(const char* if_none_match, const char* etag, size_t len);
+
+// accept_encoding is the value of Accept-Encoding (may be nullptr). coding is lower case, like "gzip".
+// True if coding, or "*" when coding is not listed, has a q-value above 0. (RFC 9110 12.5.3)
+bool accepts_coding(const char* accept_encoding, const char* coding);
+
+// Seconds given by scripts (timeouts, TTLs) in microseconds, clamped to [0, 10 years], so that adding it to a
+// steady_clock time point cannot overflow. Negative values and NaN are 0, math.huge is 10 years.
+long long seconds_to_us(double seconds);
@@ -1,10 +1,21 @@
 #include "vmop.h"
-#include "log.h"
+#include "logging.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
 using namespace std;
 
+// Same as the one of luaL_newstate(). Lua aborts the process when this returns.
+static int panic(lua_State* L)
+{
+	loge("LuaVM Panic: %s\n", lua_tostring(L, -1));
+	return 0;
+}
+
 VM::VM()
 {
-	_luavm = luaL_newstate();
+	_luavm = lua_newstate(alloc, this);
+	lua_atpanic(_luavm, panic);
 	luaL_openlibs(_luavm);
 	runCode("response={}");
 }
@@ -12,9 +23,113 @@ VM::VM()
 
 VM::~VM()
 {
+	// Small objects are released with the arena.
+	_closing = true;
 	lua_close(_luavm);
 }
 
+size_t VM::small_class(size_t size)
+{
+	return size <= SMALL_STEP * SMALL_CLASSES ? (size - 1) / SMALL_STEP : SMALL_CLASSES;
+}
+
+void* VM::allocate_small(size_t cls)
+{
+	void* p = _small_free[cls];
+	if (p)
+	{
+		_small_free[cls] = *(void**)p;
+		return p;
+	}
+	try
+	{
+		return _arena.get()->allocate((cls + 1) * SMALL_STEP);
+	}
+	catch (const bad_alloc&)
+	{
+		return nullptr;
+	}
+}
+
+void VM::release(void* ptr, size_t cls)
+{
+	if (cls < SMALL_CLASSES)
+	{
+		// lua_close() frees every object. Their slots go away with the arena anyway.
+		if (!_closing)
+		{
+			*(void**)ptr = _small_free[cls];
+			_small_free[cls] = ptr;
+		}
+	}
+	else
+	{
+		free(ptr);
+	}
+}
+
+void* VM::alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	VM* vm = (VM*)ud;
+	// When ptr is NULL, osize is the type of the new object, not a size.
+	size_t old_size = ptr ? osize : 0;
+	size_t old_cls = ptr ? small_class(old_size) : SMALL_CLASSES;
+	if (nsize == 0)
+	{
+		vm->_used -= old_size;
+		vm->release(ptr, old_cls);
+		return nullptr;
+	}
+	// Lua expects shrinking to succeed, so only growth is checked.
+	if (vm->_limit && nsize > old_size && vm->_used - old_size + nsize > vm->_limit)
+	{
+		vm->_exceeded = true;
+		return nullptr;
+	}
+
+	size_t new_cls = small_class(nsize);
+	void* p;
+	if (ptr && new_cls == old_cls)
+	{
+		// A small object still fits in its slot.
+		p = new_cls < SMALL_CLASSES ? ptr : realloc(ptr, nsize);
+	}
+	else
+	{
+		p = new_cls < SMALL_CLASSES ? vm->allocate_small(new_cls) : malloc(nsize);
+		if (p && ptr)
+		{
+			memcpy(p, ptr, old_size < nsize ? old_size : nsize);
+			vm->release(ptr, old_cls);
+		}
+		else if (!p && nsize < old_size && old_cls < SMALL_CLASSES)
+		{
+			// Shrinking must not fail. A slot larger than its class is fine.
+			p = ptr;
+		}
+	}
+	if (p)
+	{
+		vm->_used = vm->_used - old_size + nsize;
+	}
+	return p;
+}
+
+void VM::set_memory_limit(size_t bytes)
+{
+	_limit = bytes;
+}
+
+size_t VM::memory_used() const
+{
+	return _used;
+}
+
+bool VM::memory_exceeded() const
+{
+	return _exceeded;
+}
+
 lua_State* VM::get()
 {
 	return _luavm;
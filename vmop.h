@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <functional>
+#include "arena.h"
 #include "LuaSrc/include/lua.hpp"
 
 class VM
@@ -16,6 +17,14 @@ public:
 
 	int runCode(const std::string& LuaSource);
 
+	// Bytes the state may hold. An allocation beyond it fails, and Lua raises a memory error.
+	// Only set it while Lua code runs in protected mode: outside of it, a memory error aborts the process.
+	// 0 No limit
+	void set_memory_limit(size_t bytes);
+	size_t memory_used() const;
+	// An allocation has been refused because of the limit.
+	bool memory_exceeded() const;
+
 	// Lua C API Wrapper
 	int getglobal(const char* name); // Lua -> Stack
 	void pushnil(); // C -> Stack
@@ -24,5 +33,23 @@ public:
 	// This method should be removed in future.
 	lua_State* get();
 private:
+	// Size classes of small objects, which come from an arena leased from the thread that creates the VM.
+	// Freed objects are kept in a list per class for the next allocation of that class.
+	// Everything goes back in one piece when the VM is destroyed.
+	static const size_t SMALL_STEP = 16;
+	static const size_t SMALL_CLASSES = 16;
+
+	static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+	// SMALL_CLASSES if size is too large for a class.
+	static size_t small_class(size_t size);
+	void* allocate_small(size_t cls);
+	void release(void* ptr, size_t cls);
+
+	ArenaLease _arena;
+	void* _small_free[SMALL_CLASSES] = {};
+	bool _closing = false;
 	lua_State * _luavm;
+	size_t _used = 0;
+	size_t _limit = 0;
+	bool _exceeded = false;
 };
@@ -0,0 +1,109 @@
+#include "workpool.h"
+#include "logging.h"
+using namespace std;
+
+WorkStealingPool::WorkStealingPool(int thread_count, function<void(int)> thread_init) :
+	_thread_init(std::move(thread_init)), _next(0), _pending(0), _sleeping(0), _stop(false)
+{
+	if (thread_count <= 0)
+	{
+		thread_count = (int)thread::hardware_concurrency();
+		if (thread_count <= 0) thread_count = 10;
+	}
+	for (int i = 0; i < thread_count; i++)
+	{
+		_workers.emplace_back(new Worker);
+	}
+	for (int i = 0; i < thread_count; i++)
+	{
+		_threads.emplace_back(&WorkStealingPool::run, this, i);
+	}
+	logi("Thread pool started with %d workers.\n", thread_count);
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		lock_guard<mutex> lg(_idle_lock);
+		_stop = true;
+	}
+	_idle_cond.notify_all();
+	for (auto& t : _threads) t.join();
+}
+
+int WorkStealingPool::size() const
+{
+	return (int)_workers.size();
+}
+
+int WorkStealingPool::start(function<void()> job)
+{
+	if (_stop) return -1;
+
+	// Counted before it is pushed, so _pending never goes below the real number of jobs.
+	_pending.fetch_add(1);
+	Worker& w = *_workers[_next.fetch_add(1, memory_order_relaxed) % _workers.size()];
+	{
+		lock_guard<mutex> lg(w.lock);
+		w.jobs.push_back(std::move(job));
+	}
+
+	// A worker about to sleep has already counted itself in _sleeping, and checks _pending
+	// again under _idle_lock, so no wakeup is lost when nobody seems to be sleeping here.
+	if (_sleeping.load() > 0)
+	{
+		{
+			lock_guard<mutex> lg(_idle_lock);
+		}
+		_idle_cond.notify_one();
+	}
+	return 0;
+}
+
+// Own jobs are taken in FIFO order. Other workers are searched starting from the next one,
+// and a stolen job is taken from the back, away from where the owner works.
+bool WorkStealingPool::take(int idx, function<void()>& out_job)
+{
+	size_t n = _workers.size();
+	for (size_t i = 0; i < n; i++)
+	{
+		Worker& w = *_workers[(idx + i) % n];
+		lock_guard<mutex> lg(w.lock);
+		if (w.jobs.empty()) continue;
+		if (i == 0)
+		{
+			out_job = std::move(w.jobs.front());
+			w.jobs.pop_front();
+		}
+		else
+		{
+			out_job = std::move(w.jobs.back());
+			w.jobs.pop_back();
+		}
+		_pending.fetch_sub(1);
+		return true;
+	}
+	return false;
+}
+
+void WorkStealingPool::run(int idx)
+{
+	if (_thread_init) _thread_init(idx);
+
+	function<void()> job;
+	while (true)
+	{
+		if (take(idx, job))
+		{
+			job();
+			job = nullptr;
+			continue;
+		}
+
+		unique_lock<mutex> ulk(_idle_lock);
+		_sleeping.fetch_add(1);
+		_idle_cond.wait(ulk, [this]() { return _stop || _pending.load() > 0; });
+		_sleeping.fetch_sub(1);
+		if (_stop && _pending.load() == 0) return;
+	}
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+// Thread pool used by the normal deploy mode.
+// Every worker owns a deque of jobs. Jobs are handed out round-robin, and a worker
+// that runs out of jobs steals from the others before going to sleep.
+class WorkStealingPool
+{
+public:
+	// thread_count <= 0 uses the number of hardware threads.
+	// thread_init (if set) runs first on every worker with the worker's index.
+	explicit WorkStealingPool(int thread_count, std::function<void(int)> thread_init = nullptr);
+	/// NonMoveable,NonCopyable
+	WorkStealingPool(const WorkStealingPool&) = delete;
+	WorkStealingPool& operator = (const WorkStealingPool&) = delete;
+	// Runs the remaining jobs, then joins all workers.
+	~WorkStealingPool();
+
+	// Returns:
+	// 0 Job is queued.
+	// -1 Pool is stopping.
+	int start(std::function<void()> job);
+
+	int size() const;
+private:
+	struct Worker
+	{
+		std::mutex lock;
+		std::deque<std::function<void()>> jobs;
+	};
+
+	void run(int idx);
+	bool take(int idx, std::function<void()>& out_job);
+
+	std::function<void(int)> _thread_init;
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::vector<std::thread> _threads;
+	std::atomic<unsigned> _next;
+	std::atomic<size_t> _pending;
+	std::atomic<int> _sleeping;
+	std::atomic<bool> _stop;
+	std::mutex _idle_lock;
+	std::condition_variable _idle_cond;
+};
+
+// Keeps the storage of released objects for later use, so objects that are created
+// and destroyed all the time (like accepted sockets) do not go through malloc.
+// Thread-safe. An object can be released on another thread than the one acquired it.
+template<typename T>
+class ObjectPool
+{
+public:
+	explicit ObjectPool(size_t limit) : _limit(limit) {}
+	/// NonMoveable,NonCopyable
+	ObjectPool(const ObjectPool&) = delete;
+	ObjectPool& operator = (const ObjectPool&) = delete;
+	~ObjectPool()
+	{
+		for (auto p : _free) ::operator delete(p);
+	}
+
+	// Returns a default-constructed object.
+	T* acquire()
+	{
+		void* p = nullptr;
+		{
+			std::lock_guard<std::mutex> lg(_lock);
+			if (!_free.empty())
+			{
+				p = _free.back();
+				_free.pop_back();
+			}
+		}
+		if (!p) p = ::operator new(sizeof(T));
+		try
+		{
+			return new (p) T;
+		}
+		catch (...)
+		{
+			::operator delete(p);
+			throw;
+		}
+	}
+
+	// Destroys the object. Its storage is kept if the pool is not full.
+	void release(T* obj)
+	{
+		obj->~T();
+		{
+			std::lock_guard<std::mutex> lg(_lock);
+			if (_free.size() < _limit)
+			{
+				_free.push_back(obj);
+				return;
+			}
+		}
+		::operator delete(obj);
+	}
+private:
+	std::mutex _lock;
+	std::vector<void*> _free;
+	size_t _limit;
+};